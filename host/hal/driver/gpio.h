@@ -0,0 +1,217 @@
+/*
+ * gpio.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_DRIVER_GPIO_H_
+#define HOST_HAL_DRIVER_GPIO_H_
+
+#include "host_periph.h"
+#include "esp_err.h"
+#include "esp_attr.h"
+
+// Level interrupts of the input pins (the button), the handler runs from
+// the scheduler like an ISR as long as the level matches and the interrupt
+// is enabled, so the handler has to disable it (see button.h).
+
+typedef enum {
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_0 = 0, GPIO_NUM_1, GPIO_NUM_2, GPIO_NUM_3, GPIO_NUM_4, GPIO_NUM_5, GPIO_NUM_6, GPIO_NUM_7,
+    GPIO_NUM_8, GPIO_NUM_9, GPIO_NUM_10, GPIO_NUM_11, GPIO_NUM_12, GPIO_NUM_13, GPIO_NUM_14, GPIO_NUM_15,
+    GPIO_NUM_16, GPIO_NUM_17, GPIO_NUM_18, GPIO_NUM_19, GPIO_NUM_20, GPIO_NUM_21,
+    GPIO_NUM_MAX,
+} gpio_num_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE = 0,
+    GPIO_INTR_POSEDGE = 1,
+    GPIO_INTR_NEGEDGE = 2,
+    GPIO_INTR_ANYEDGE = 3,
+    GPIO_INTR_LOW_LEVEL = 4,
+    GPIO_INTR_HIGH_LEVEL = 5,
+    GPIO_INTR_MAX,
+} gpio_int_type_t;
+
+typedef enum {
+    GPIO_MODE_DISABLE = 0,
+    GPIO_MODE_INPUT = 1,
+    GPIO_MODE_OUTPUT = 2,
+    GPIO_MODE_OUTPUT_OD = 6,
+    GPIO_MODE_INPUT_OUTPUT_OD = 7,
+    GPIO_MODE_INPUT_OUTPUT = 3,
+} gpio_mode_t;
+
+typedef enum {
+    GPIO_PULLUP_DISABLE = 0,
+    GPIO_PULLUP_ENABLE = 1,
+} gpio_pullup_t;
+
+typedef enum {
+    GPIO_PULLDOWN_DISABLE = 0,
+    GPIO_PULLDOWN_ENABLE = 1,
+} gpio_pulldown_t;
+
+typedef struct {
+    uint64_t pin_bit_mask;
+    gpio_mode_t mode;
+    gpio_pullup_t pull_up_en;
+    gpio_pulldown_t pull_down_en;
+    gpio_int_type_t intr_type;
+} gpio_config_t;
+
+typedef void (*gpio_isr_t)(void* arg);
+
+typedef struct {
+    gpio_int_type_t intr_type;
+    bool intr_is_enabled;
+    gpio_isr_t isr;
+    void* isr_arg;
+    host_item_t item;       // runs the handler or waits for the next edge
+} host_gpio_pin_t;
+
+host_gpio_pin_t g_host_gpio_pins[GPIO_NUM_MAX];
+bool g_host_gpio_isr_service = false;
+
+
+static bool host_gpio_intr_is_due(gpio_num_t pin)
+{
+    host_gpio_pin_t* gpio = &g_host_gpio_pins[pin];
+    if (!gpio->intr_is_enabled || gpio->isr == NULL)
+        return false;
+
+    bool level = host_gpio_level(pin);
+    return (gpio->intr_type == GPIO_INTR_HIGH_LEVEL && level) || (gpio->intr_type == GPIO_INTR_LOW_LEVEL && !level);
+}
+
+
+// runs the handler if the interrupt is due, otherwise waits for the next edge
+static void host_gpio_check(gpio_num_t pin)
+{
+    host_gpio_pin_t* gpio = &g_host_gpio_pins[pin];
+    if (host_gpio_intr_is_due(pin))
+    {
+        host_item_arm(&gpio->item, host_now_us());
+        return;
+    }
+
+    int64_t next_edge = pin == host_world()->button_pin ? host_button_next_edge(host_now_us()) : INT64_MAX;
+    if (gpio->intr_is_enabled && next_edge != INT64_MAX)
+        host_item_arm(&gpio->item, next_edge);
+    else
+        host_item_disarm(&gpio->item);
+}
+
+
+static void host_gpio_on_item(host_item_t* item)
+{
+    host_gpio_pin_t* gpio = HOST_CONTAINER_OF(item, host_gpio_pin_t, item);
+    gpio_num_t pin = (gpio_num_t)(gpio - g_host_gpio_pins);
+
+    if (host_gpio_intr_is_due(pin))
+        gpio->isr(gpio->isr_arg);
+    host_gpio_check(pin);
+}
+
+
+esp_err_t gpio_config(const gpio_config_t* config)
+{
+    for (int pin = 0; pin < GPIO_NUM_MAX; pin++)
+    {
+        if (!(config->pin_bit_mask & (1ULL << pin)))
+            continue;
+        g_host_gpio_pins[pin].intr_type = config->intr_type;
+        g_host_gpio_pins[pin].item.fn = host_gpio_on_item;
+        host_gpio_check((gpio_num_t)pin);
+    }
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    g_host_gpio_pins[pin].intr_type = intr_type;
+    g_host_gpio_pins[pin].item.fn = host_gpio_on_item;
+    host_gpio_check(pin);
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_intr_enable(gpio_num_t pin)
+{
+    g_host_gpio_pins[pin].intr_is_enabled = true;
+    g_host_gpio_pins[pin].item.fn = host_gpio_on_item;
+    host_gpio_check(pin);
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_intr_disable(gpio_num_t pin)
+{
+    g_host_gpio_pins[pin].intr_is_enabled = false;
+    host_item_disarm(&g_host_gpio_pins[pin].item);
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    if (g_host_gpio_isr_service)
+        return ESP_ERR_INVALID_STATE;
+    g_host_gpio_isr_service = true;
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_isr_handler_add(gpio_num_t pin, gpio_isr_t isr_handler, void* args)
+{
+    if (!g_host_gpio_isr_service)
+        return ESP_ERR_INVALID_STATE;
+    g_host_gpio_pins[pin].isr = isr_handler;
+    g_host_gpio_pins[pin].isr_arg = args;
+    g_host_gpio_pins[pin].item.fn = host_gpio_on_item;
+    host_gpio_check(pin);
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t pin)
+{
+    g_host_gpio_pins[pin].isr = NULL;
+    host_item_disarm(&g_host_gpio_pins[pin].item);
+    return ESP_OK;
+}
+
+
+int gpio_get_level(gpio_num_t pin)
+{
+    return host_gpio_level(pin);
+}
+
+
+// sets the level interrupt that also wakes from light sleep
+esp_err_t gpio_wakeup_enable(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    if (intr_type != GPIO_INTR_LOW_LEVEL && intr_type != GPIO_INTR_HIGH_LEVEL)
+        return ESP_ERR_INVALID_ARG;
+    return gpio_set_intr_type(pin, intr_type);
+}
+
+
+esp_err_t gpio_deep_sleep_wakeup_enable(gpio_num_t pin, gpio_int_type_t intr_type)
+{
+    if (pin > GPIO_NUM_5)
+        return ESP_ERR_INVALID_ARG;
+    if (intr_type != GPIO_INTR_LOW_LEVEL && intr_type != GPIO_INTR_HIGH_LEVEL)
+        return ESP_ERR_INVALID_ARG;
+    return ESP_OK;
+}
+
+
+esp_err_t gpio_pullup_en(gpio_num_t pin)    { return ESP_OK; }
+esp_err_t gpio_pullup_dis(gpio_num_t pin)   { return ESP_OK; }
+esp_err_t gpio_pulldown_en(gpio_num_t pin)  { return ESP_OK; }
+esp_err_t gpio_pulldown_dis(gpio_num_t pin) { return ESP_OK; }
+
+#endif /* HOST_HAL_DRIVER_GPIO_H_ */
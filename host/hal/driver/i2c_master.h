@@ -0,0 +1,150 @@
+/*
+ * i2c_master.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_DRIVER_I2C_MASTER_H_
+#define HOST_HAL_DRIVER_I2C_MASTER_H_
+
+#include "host_periph.h"
+#include "esp_err.h"
+
+// Transactions go to the sensor model (see host_periph.h), they take the
+// time of the bits on the bus plus the driver overhead. A device that
+// doesn't acknowledge fails the transaction like the driver does on nack.
+
+#define HOST_I2C_OVERHEAD_US    30
+
+typedef int i2c_port_t;
+
+#define I2C_NUM_0   0
+
+typedef enum {
+    I2C_CLK_SRC_DEFAULT = 0,
+    I2C_CLK_SRC_XTAL,
+    I2C_CLK_SRC_RC_FAST,
+} i2c_clock_source_t;
+
+typedef enum {
+    I2C_ADDR_BIT_LEN_7 = 0,
+    I2C_ADDR_BIT_LEN_10,
+} i2c_addr_bit_len_t;
+
+typedef struct {
+    i2c_port_t i2c_port;
+    int sda_io_num;
+    int scl_io_num;
+    i2c_clock_source_t clk_source;
+    uint8_t glitch_ignore_cnt;
+    int intr_priority;
+    size_t trans_queue_depth;
+    struct {
+        uint32_t enable_internal_pullup: 1;
+    } flags;
+} i2c_master_bus_config_t;
+
+typedef struct {
+    i2c_addr_bit_len_t dev_addr_length;
+    uint16_t device_address;
+    uint32_t scl_speed_hz;
+    uint32_t scl_wait_us;
+} i2c_device_config_t;
+
+typedef struct i2c_master_bus {
+    i2c_master_bus_config_t config;
+} *i2c_master_bus_handle_t;
+
+typedef struct i2c_master_dev {
+    i2c_master_bus_handle_t bus;
+    i2c_device_config_t config;
+} *i2c_master_dev_handle_t;
+
+
+esp_err_t i2c_new_master_bus(const i2c_master_bus_config_t* bus_config, i2c_master_bus_handle_t* ret_bus_handle)
+{
+    i2c_master_bus_handle_t bus = calloc(1, sizeof(*bus));
+    bus->config = *bus_config;
+    *ret_bus_handle = bus;
+    return ESP_OK;
+}
+
+
+esp_err_t i2c_master_bus_add_device(i2c_master_bus_handle_t bus_handle, const i2c_device_config_t* dev_config,
+                                    i2c_master_dev_handle_t* ret_handle)
+{
+    if (bus_handle == NULL || dev_config->scl_speed_hz == 0)
+        return ESP_ERR_INVALID_ARG;
+
+    i2c_master_dev_handle_t dev = calloc(1, sizeof(*dev));
+    dev->bus = bus_handle;
+    dev->config = *dev_config;
+    *ret_handle = dev;
+    return ESP_OK;
+}
+
+
+static void host_i2c_spend(i2c_master_dev_handle_t dev, size_t byte_cnt)
+{
+    uint64_t bits = 9 * byte_cnt + 2;
+    host_advance_us(HOST_I2C_OVERHEAD_US + bits * 1000000 / dev->config.scl_speed_hz);
+}
+
+
+// the device answers if it is the sensor and the bus is on its pins
+static bool host_i2c_select(i2c_master_dev_handle_t dev, bool is_read)
+{
+    host_world_t* world = host_world();
+    if (dev->bus->config.sda_io_num != world->i2c_sda_pin || dev->bus->config.scl_io_num != world->i2c_scl_pin)
+        return false;
+    if (dev->config.device_address != HOST_MAX30205_ADDR)
+        return false;
+
+    world->stats.i2c_transactions++;
+    return host_max30205_select(is_read);
+}
+
+
+esp_err_t i2c_master_transmit(i2c_master_dev_handle_t i2c_dev, const uint8_t* write_buffer, size_t write_size,
+                              int xfer_timeout_ms)
+{
+    host_i2c_spend(i2c_dev, 1 + write_size);
+    if (!host_i2c_select(i2c_dev, false))
+        return ESP_ERR_INVALID_STATE;
+
+    for (size_t i = 0; i < write_size; i++)
+        host_max30205_write(write_buffer[i]);
+    return ESP_OK;
+}
+
+
+esp_err_t i2c_master_transmit_receive(i2c_master_dev_handle_t i2c_dev, const uint8_t* write_buffer, size_t write_size,
+                                      uint8_t* read_buffer, size_t read_size, int xfer_timeout_ms)
+{
+    host_i2c_spend(i2c_dev, 2 + write_size + read_size);
+    if (!host_i2c_select(i2c_dev, false))
+        return ESP_ERR_INVALID_STATE;
+
+    for (size_t i = 0; i < write_size; i++)
+        host_max30205_write(write_buffer[i]);
+    host_max30205_select(true);
+    for (size_t i = 0; i < read_size; i++)
+        read_buffer[i] = host_max30205_read();
+    return ESP_OK;
+}
+
+
+esp_err_t i2c_master_receive(i2c_master_dev_handle_t i2c_dev, uint8_t* read_buffer, size_t read_size,
+                             int xfer_timeout_ms)
+{
+    host_i2c_spend(i2c_dev, 1 + read_size);
+    if (!host_i2c_select(i2c_dev, true))
+        return ESP_ERR_INVALID_STATE;
+
+    for (size_t i = 0; i < read_size; i++)
+        read_buffer[i] = host_max30205_read();
+    return ESP_OK;
+}
+
+#endif /* HOST_HAL_DRIVER_I2C_MASTER_H_ */
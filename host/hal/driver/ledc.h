@@ -0,0 +1,176 @@
+/*
+ * ledc.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_DRIVER_LEDC_H_
+#define HOST_HAL_DRIVER_LEDC_H_
+
+#include "host_sim.h"
+#include "esp_err.h"
+
+// The duty of the channel is kept in the world (see host_led_duty), fades
+// reach their duty at once. Scenarios can make ledc_stop fail to check the
+// error paths (see host_ledc_fail_stop).
+
+typedef enum {
+    LEDC_LOW_SPEED_MODE,
+    LEDC_SPEED_MODE_MAX,
+} ledc_mode_t;
+
+typedef enum {
+    LEDC_TIMER_0, LEDC_TIMER_1, LEDC_TIMER_2, LEDC_TIMER_3,
+    LEDC_TIMER_MAX,
+} ledc_timer_t;
+
+typedef enum {
+    LEDC_CHANNEL_0, LEDC_CHANNEL_1, LEDC_CHANNEL_2, LEDC_CHANNEL_3, LEDC_CHANNEL_4, LEDC_CHANNEL_5,
+    LEDC_CHANNEL_MAX,
+} ledc_channel_t;
+
+typedef enum {
+    LEDC_TIMER_1_BIT = 1, LEDC_TIMER_2_BIT, LEDC_TIMER_3_BIT, LEDC_TIMER_4_BIT, LEDC_TIMER_5_BIT,
+    LEDC_TIMER_6_BIT, LEDC_TIMER_7_BIT, LEDC_TIMER_8_BIT, LEDC_TIMER_9_BIT, LEDC_TIMER_10_BIT,
+    LEDC_TIMER_11_BIT, LEDC_TIMER_12_BIT, LEDC_TIMER_13_BIT, LEDC_TIMER_14_BIT,
+    LEDC_TIMER_BIT_MAX,
+} ledc_timer_bit_t;
+
+typedef enum {
+    LEDC_AUTO_CLK = 0,
+    LEDC_USE_APB_CLK,
+    LEDC_USE_RC_FAST_CLK,
+    LEDC_USE_XTAL_CLK,
+} ledc_clk_cfg_t;
+
+typedef enum {
+    LEDC_FADE_NO_WAIT = 0,
+    LEDC_FADE_WAIT_DONE,
+    LEDC_FADE_MAX,
+} ledc_fade_mode_t;
+
+typedef enum {
+    LEDC_INTR_DISABLE = 0,
+    LEDC_INTR_FADE_END,
+} ledc_intr_type_t;
+
+typedef struct {
+    ledc_mode_t speed_mode;
+    ledc_timer_bit_t duty_resolution;
+    ledc_timer_t timer_num;
+    uint32_t freq_hz;
+    ledc_clk_cfg_t clk_cfg;
+    bool deconfigure;
+} ledc_timer_config_t;
+
+typedef struct {
+    int gpio_num;
+    ledc_mode_t speed_mode;
+    ledc_channel_t channel;
+    ledc_intr_type_t intr_type;
+    ledc_timer_t timer_sel;
+    uint32_t duty;
+    int hpoint;
+    struct {
+        unsigned int output_invert: 1;
+    } flags;
+} ledc_channel_config_t;
+
+bool g_host_ledc_fade_is_installed = false;
+bool g_host_ledc_is_configured = false;
+ledc_clk_cfg_t g_host_ledc_clk = LEDC_AUTO_CLK;
+esp_err_t g_host_ledc_stop_err = ESP_OK;
+
+
+// makes the following ledc_stop calls fail with the error (ESP_OK - succeed)
+void host_ledc_fail_stop(esp_err_t err)
+{
+    g_host_ledc_stop_err = err;
+}
+
+
+static void host_ledc_set_duty(uint32_t duty)
+{
+    host_world_t* world = host_world();
+    if (world->led_duty != duty)
+        world->led_changes++;
+    world->led_duty = duty;
+}
+
+
+uint32_t host_led_duty()
+{
+    return host_world()->led_duty;
+}
+
+
+esp_err_t ledc_timer_config(const ledc_timer_config_t* timer_conf)
+{
+    if (timer_conf->freq_hz == 0 || timer_conf->duty_resolution >= LEDC_TIMER_BIT_MAX)
+        return ESP_ERR_INVALID_ARG;
+    g_host_ledc_clk = timer_conf->clk_cfg;
+    return ESP_OK;
+}
+
+
+esp_err_t ledc_channel_config(const ledc_channel_config_t* ledc_conf)
+{
+    g_host_ledc_is_configured = true;
+    host_ledc_set_duty(ledc_conf->duty);
+    return ESP_OK;
+}
+
+
+esp_err_t ledc_fade_func_install(int intr_alloc_flags)
+{
+    if (g_host_ledc_fade_is_installed)
+        return ESP_ERR_INVALID_STATE;
+    g_host_ledc_fade_is_installed = true;
+    return ESP_OK;
+}
+
+
+void ledc_fade_func_uninstall()
+{
+    g_host_ledc_fade_is_installed = false;
+}
+
+
+esp_err_t ledc_set_duty_and_update(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t duty, uint32_t hpoint)
+{
+    if (!g_host_ledc_is_configured)
+        return ESP_ERR_INVALID_STATE;
+    host_ledc_set_duty(duty);
+    return ESP_OK;
+}
+
+
+esp_err_t ledc_set_fade_time_and_start(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t target_duty,
+                                       uint32_t max_fade_time_ms, ledc_fade_mode_t fade_mode)
+{
+    if (!g_host_ledc_is_configured || !g_host_ledc_fade_is_installed)
+        return ESP_ERR_INVALID_STATE;
+    host_ledc_set_duty(target_duty);
+    return ESP_OK;
+}
+
+
+esp_err_t ledc_fade_stop(ledc_mode_t speed_mode, ledc_channel_t channel)
+{
+    if (!g_host_ledc_fade_is_installed)
+        return ESP_ERR_INVALID_STATE;
+    return ESP_OK;
+}
+
+
+esp_err_t ledc_stop(ledc_mode_t speed_mode, ledc_channel_t channel, uint32_t idle_level)
+{
+    if (g_host_ledc_stop_err != ESP_OK)
+        return g_host_ledc_stop_err;
+    g_host_ledc_is_configured = false;
+    host_ledc_set_duty(0);
+    return ESP_OK;
+}
+
+#endif /* HOST_HAL_DRIVER_LEDC_H_ */
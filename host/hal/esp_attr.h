@@ -0,0 +1,17 @@
+/*
+ * esp_attr.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_ATTR_H_
+#define HOST_HAL_ESP_ATTR_H_
+
+// RTC data is kept in its own section, the wake processes save and restore
+// it across the deep sleep (see host_sim.h). code attributes are empty
+#define RTC_DATA_ATTR   __attribute__((section("rtc_data")))
+#define RTC_IRAM_ATTR
+#define IRAM_ATTR
+
+#endif /* HOST_HAL_ESP_ATTR_H_ */
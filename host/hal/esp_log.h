@@ -0,0 +1,21 @@
+/*
+ * esp_log.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_LOG_H_
+#define HOST_HAL_ESP_LOG_H_
+
+#include "host_sim.h"
+
+// logs are printed with the world time if HOST_LOG is set (1 - warnings
+// and errors, 2 - everything)
+#define ESP_LOGE(tag, fmt, ...) host_log('E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log('W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log('I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do {} while (0)
+#define ESP_LOGV(tag, fmt, ...) do {} while (0)
+
+#endif /* HOST_HAL_ESP_LOG_H_ */
@@ -0,0 +1,13 @@
+/*
+ * esp_nimble_hci.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_NIMBLE_HCI_H_
+#define HOST_HAL_ESP_NIMBLE_HCI_H_
+
+// the controller is a part of host_ble.h
+
+#endif /* HOST_HAL_ESP_NIMBLE_HCI_H_ */
@@ -0,0 +1,136 @@
+/*
+ * esp_partition.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_PARTITION_H_
+#define HOST_HAL_ESP_PARTITION_H_
+
+#include "host_sim.h"
+#include "esp_err.h"
+
+// The "samples" partition is NOR flash in the world: erase sets the sectors
+// to 0xFF, write can only clear bits. The scenarios can cut the power on
+// the n-th write or erase (see host_flash_cut_power_at): half of the data
+// is written (half of the sector is erased) and the wake ends like the
+// device lost power, the next wake has to be host_power_on.
+
+#define HOST_FLASH_SECTOR_SIZE  4096
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+    ESP_PARTITION_TYPE_ANY = 0xff,
+} esp_partition_type_t;
+
+typedef int esp_partition_subtype_t;
+
+typedef struct {
+    void* flash_chip;
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    uint32_t erase_size;
+    char label[17];
+    bool encrypted;
+    bool readonly;
+} esp_partition_t;
+
+const esp_partition_t g_host_samples_partition = {
+    .type = ESP_PARTITION_TYPE_DATA,
+    .subtype = 0x40,
+    .address = 0x190000,
+    .size = HOST_FLASH_SIZE,
+    .erase_size = HOST_FLASH_SECTOR_SIZE,
+    .label = "samples",
+};
+
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char* label)
+{
+    if (type != g_host_samples_partition.type || subtype != g_host_samples_partition.subtype)
+        return NULL;
+    if (label != NULL && strcmp(label, g_host_samples_partition.label) != 0)
+        return NULL;
+    return &g_host_samples_partition;
+}
+
+
+// cuts the power on the n-th write or erase from now (0 - never)
+void host_flash_cut_power_at(int32_t op_cnt)
+{
+    host_world()->flash_power_cut_in = op_cnt;
+    host_world()->flash_power_is_cut = false;
+}
+
+
+static bool host_flash_power_is_cut()
+{
+    host_world_t* world = host_world();
+    return world->flash_power_cut_in > 0 && --world->flash_power_cut_in == 0;
+}
+
+
+static void host_flash_power_loss()
+{
+    host_world()->flash_power_is_cut = true;
+    host_end_wake(HOST_END_POWER_LOSS, "power loss during flash operation");
+}
+
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size)
+{
+    if (partition == NULL || dst == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (src_offset + size > partition->size)
+        return ESP_ERR_INVALID_SIZE;
+
+    memcpy(dst, host_world()->flash + src_offset, size);
+    return ESP_OK;
+}
+
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size)
+{
+    if (partition == NULL || src == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (dst_offset + size > partition->size)
+        return ESP_ERR_INVALID_SIZE;
+
+    host_world_t* world = host_world();
+    bool is_cut = host_flash_power_is_cut();
+    size_t len = is_cut ? size / 2 : size;
+    for (size_t i = 0; i < len; i++)
+        world->flash[dst_offset + i] &= ((const uint8_t*)src)[i];
+    world->stats.flash_writes++;
+
+    if (is_cut)
+        host_flash_power_loss();
+    return ESP_OK;
+}
+
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size)
+{
+    if (partition == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (offset + size > partition->size)
+        return ESP_ERR_INVALID_SIZE;
+    if (offset % HOST_FLASH_SECTOR_SIZE != 0 || size % HOST_FLASH_SECTOR_SIZE != 0)
+        return ESP_ERR_INVALID_SIZE;
+
+    host_world_t* world = host_world();
+    bool is_cut = host_flash_power_is_cut();
+    memset(world->flash + offset, 0xFF, is_cut ? size / 2 : size);
+    world->stats.flash_erases++;
+
+    if (is_cut)
+        host_flash_power_loss();
+    return ESP_OK;
+}
+
+#endif /* HOST_HAL_ESP_PARTITION_H_ */
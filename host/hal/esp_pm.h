@@ -0,0 +1,123 @@
+/*
+ * esp_pm.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_PM_H_
+#define HOST_HAL_ESP_PM_H_
+
+#include "host_sim.h"
+#include "esp_err.h"
+
+// Locks are counted only, frequency scaling and light sleep are not
+// modeled (the light sleep callbacks are kept, but never called). The
+// locks still held at the deep sleep are reported in the sleep (see
+// host_sleep_t).
+
+typedef enum {
+    ESP_PM_CPU_FREQ_MAX,
+    ESP_PM_APB_FREQ_MAX,
+    ESP_PM_NO_LIGHT_SLEEP,
+} esp_pm_lock_type_t;
+
+typedef struct {
+    int max_freq_mhz;
+    int min_freq_mhz;
+    bool light_sleep_enable;
+} esp_pm_config_t;
+
+typedef struct esp_pm_lock {
+    esp_pm_lock_type_t type;
+    const char* name;
+    uint32_t count;
+    struct esp_pm_lock* next;
+} *esp_pm_lock_handle_t;
+
+typedef esp_err_t (*esp_pm_light_sleep_cb_t)(int64_t sleep_time_us, void* arg);
+
+typedef struct {
+    esp_pm_light_sleep_cb_t enter_cb;
+    esp_pm_light_sleep_cb_t exit_cb;
+    void* enter_cb_user_arg;
+    void* exit_cb_user_arg;
+    uint32_t enter_cb_prior;
+    uint32_t exit_cb_prior;
+} esp_pm_sleep_cbs_register_config_t;
+
+esp_pm_lock_handle_t g_host_pm_locks = NULL;
+bool g_host_pm_is_configured = false;
+esp_pm_sleep_cbs_register_config_t g_host_pm_sleep_cbs;
+
+
+static void host_pm_on_sleep()
+{
+    uint32_t held = 0;
+    for (esp_pm_lock_handle_t lock = g_host_pm_locks; lock != NULL; lock = lock->next)
+        held += lock->count;
+    host_world()->sleep.pm_locks_held = held;
+}
+
+
+esp_err_t esp_pm_configure(const void* config)
+{
+    const esp_pm_config_t* pm_config = config;
+    if (pm_config == NULL || pm_config->min_freq_mhz > pm_config->max_freq_mhz)
+        return ESP_ERR_INVALID_ARG;
+    g_host_pm_is_configured = true;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char* name, esp_pm_lock_handle_t* out_handle)
+{
+    esp_pm_lock_handle_t lock = calloc(1, sizeof(*lock));
+    lock->type = lock_type;
+    lock->name = name;
+    if (g_host_pm_locks == NULL)
+        host_at_sleep(host_pm_on_sleep);
+    lock->next = g_host_pm_locks;
+    g_host_pm_locks = lock;
+    *out_handle = lock;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+{
+    if (handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+    handle->count++;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+{
+    if (handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (handle->count == 0)
+        return ESP_ERR_INVALID_STATE;
+    handle->count--;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_pm_light_sleep_register_cbs(esp_pm_sleep_cbs_register_config_t* cbs_conf)
+{
+    if (cbs_conf == NULL || (cbs_conf->enter_cb == NULL && cbs_conf->exit_cb == NULL))
+        return ESP_ERR_INVALID_ARG;
+    g_host_pm_sleep_cbs = *cbs_conf;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_pm_dump_locks(FILE* stream)
+{
+    for (esp_pm_lock_handle_t lock = g_host_pm_locks; lock != NULL; lock = lock->next)
+        fprintf(stream, "%-10s %u\n", lock->name, lock->count);
+    return ESP_OK;
+}
+
+#endif /* HOST_HAL_ESP_PM_H_ */
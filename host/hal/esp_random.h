@@ -0,0 +1,27 @@
+/*
+ * esp_random.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_RANDOM_H_
+#define HOST_HAL_ESP_RANDOM_H_
+
+#include "host_sim.h"
+
+// the random numbers repeat from run to run, so do the scenarios
+
+uint32_t esp_random()
+{
+    return (uint32_t)(host_random() >> 32);
+}
+
+
+void esp_fill_random(void* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        ((uint8_t*)buf)[i] = (uint8_t)(host_random() >> 56);
+}
+
+#endif /* HOST_HAL_ESP_RANDOM_H_ */
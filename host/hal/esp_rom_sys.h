@@ -0,0 +1,21 @@
+/*
+ * esp_rom_sys.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_ROM_SYS_H_
+#define HOST_HAL_ESP_ROM_SYS_H_
+
+#include "host_sim.h"
+
+// busy wait of ROM, the time goes on without the scheduler
+static inline void esp_rom_delay_us(uint32_t us)
+{
+    host_advance_us(us);
+}
+
+#define esp_rom_printf printf
+
+#endif /* HOST_HAL_ESP_ROM_SYS_H_ */
@@ -0,0 +1,127 @@
+/*
+ * esp_sleep.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_SLEEP_H_
+#define HOST_HAL_ESP_SLEEP_H_
+
+#include "host_sim.h"
+#include "esp_err.h"
+
+// Deep sleep ends the wake process (see host_sim.h), the wakeup sources
+// set before it choose the next wake. Only RTC gpios (0-5) wake ESP32-C3
+// from deep sleep.
+
+typedef enum {
+    ESP_SLEEP_WAKEUP_UNDEFINED,
+    ESP_SLEEP_WAKEUP_ALL,
+    ESP_SLEEP_WAKEUP_EXT0,
+    ESP_SLEEP_WAKEUP_EXT1,
+    ESP_SLEEP_WAKEUP_TIMER,
+    ESP_SLEEP_WAKEUP_TOUCHPAD,
+    ESP_SLEEP_WAKEUP_ULP,
+    ESP_SLEEP_WAKEUP_GPIO,
+    ESP_SLEEP_WAKEUP_UART,
+    ESP_SLEEP_WAKEUP_WIFI,
+    ESP_SLEEP_WAKEUP_COCPU,
+    ESP_SLEEP_WAKEUP_COCPU_TRAP_TRIG,
+    ESP_SLEEP_WAKEUP_BT,
+} esp_sleep_wakeup_cause_t;
+
+typedef enum {
+    ESP_GPIO_WAKEUP_GPIO_LOW = 0,
+    ESP_GPIO_WAKEUP_GPIO_HIGH = 1,
+} esp_deepsleep_gpio_wake_up_mode_t;
+
+typedef enum {
+    ESP_PD_DOMAIN_RTC_PERIPH,
+    ESP_PD_DOMAIN_XTAL,
+    ESP_PD_DOMAIN_RC_FAST,
+    ESP_PD_DOMAIN_VDDSDIO,
+    ESP_PD_DOMAIN_MAX,
+} esp_sleep_pd_domain_t;
+
+typedef enum {
+    ESP_PD_OPTION_OFF,
+    ESP_PD_OPTION_ON,
+    ESP_PD_OPTION_AUTO,
+} esp_sleep_pd_option_t;
+
+#define HOST_DEEP_SLEEP_GPIO_MASK   0x3F    // gpio 0-5
+
+bool g_host_sleep_timer_armed = false;
+uint64_t g_host_sleep_timer_us = 0;
+uint64_t g_host_sleep_gpio_mask = 0;
+esp_sleep_pd_option_t g_host_sleep_pd[ESP_PD_DOMAIN_MAX];
+
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+    return (esp_sleep_wakeup_cause_t)host_world()->wake_cause;
+}
+
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+    g_host_sleep_timer_armed = true;
+    g_host_sleep_timer_us = time_in_us;
+    return ESP_OK;
+}
+
+
+esp_err_t esp_deep_sleep_enable_gpio_wakeup(uint64_t gpio_pin_mask, esp_deepsleep_gpio_wake_up_mode_t mode)
+{
+    if (gpio_pin_mask & ~(uint64_t)HOST_DEEP_SLEEP_GPIO_MASK)
+        return ESP_ERR_INVALID_ARG;
+    if (mode == ESP_GPIO_WAKEUP_GPIO_HIGH)
+        g_host_sleep_gpio_mask |= gpio_pin_mask;
+    else
+        g_host_sleep_gpio_mask &= ~gpio_pin_mask;   // low level wakeup is not modeled
+    return ESP_OK;
+}
+
+
+// gpio wakeup from light sleep, light sleep is not modeled
+esp_err_t esp_sleep_enable_gpio_wakeup()
+{
+    return ESP_OK;
+}
+
+
+esp_err_t esp_sleep_pd_config(esp_sleep_pd_domain_t domain, esp_sleep_pd_option_t option)
+{
+    if (domain >= ESP_PD_DOMAIN_MAX)
+        return ESP_ERR_INVALID_ARG;
+    g_host_sleep_pd[domain] = option;
+    return ESP_OK;
+}
+
+
+// returns the power down option of the domain, for the scenarios
+esp_sleep_pd_option_t host_sleep_pd_option(esp_sleep_pd_domain_t domain)
+{
+    return g_host_sleep_pd[domain];
+}
+
+
+void esp_deep_sleep_start()
+{
+    host_world_t* world = host_world();
+    world->sleep.timer_armed = g_host_sleep_timer_armed;
+    world->sleep.timer_us = g_host_sleep_timer_us;
+    world->sleep.gpio_mask = g_host_sleep_gpio_mask;
+    world->sleep.rc_fast_is_on = g_host_sleep_pd[ESP_PD_DOMAIN_RC_FAST] == ESP_PD_OPTION_ON;
+    host_end_wake(HOST_END_DEEP_SLEEP, NULL);
+}
+
+
+void esp_deep_sleep(uint64_t time_in_us)
+{
+    esp_sleep_enable_timer_wakeup(time_in_us);
+    esp_deep_sleep_start();
+}
+
+#endif /* HOST_HAL_ESP_SLEEP_H_ */
@@ -0,0 +1,178 @@
+/*
+ * esp_timer.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_TIMER_H_
+#define HOST_HAL_ESP_TIMER_H_
+
+#include "host_sim.h"
+#include "esp_err.h"
+
+// Callbacks run in the "esp_timer" task, like with ESP_TIMER_TASK dispatch.
+// The time counts from the boot, the deep sleep resets it.
+
+typedef void (*esp_timer_cb_t)(void* arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+    ESP_TIMER_ISR,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void* arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char* name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+struct esp_timer {
+    esp_timer_create_args_t args;
+    uint64_t period_us;         // 0 - one-shot
+    host_item_t item;
+    bool is_pending;            // expired, the callback is not run yet
+    struct esp_timer* next_pending;
+};
+
+typedef struct esp_timer* esp_timer_handle_t;
+
+struct esp_timer* g_host_timer_pending = NULL;
+host_task_t* g_host_timer_task = NULL;
+
+
+int64_t esp_timer_get_time()
+{
+    return host_now_us() - host_world()->boot_us;
+}
+
+
+static void host_esp_timer_unpend(esp_timer_handle_t timer)
+{
+    for (struct esp_timer** it = &g_host_timer_pending; *it != NULL; it = &(*it)->next_pending)
+    {
+        if (*it == timer)
+        {
+            *it = timer->next_pending;
+            break;
+        }
+    }
+    timer->is_pending = false;
+    timer->next_pending = NULL;
+}
+
+
+static void host_esp_timer_on_expire(host_item_t* item)
+{
+    esp_timer_handle_t timer = HOST_CONTAINER_OF(item, struct esp_timer, item);
+    if (timer->period_us > 0)
+        host_item_arm(&timer->item, timer->item.due_us + timer->period_us);
+
+    if (!timer->is_pending)
+    {
+        struct esp_timer** it = &g_host_timer_pending;
+        while (*it != NULL)
+            it = &(*it)->next_pending;
+        *it = timer;
+        timer->is_pending = true;
+    }
+    host_task_unblock(g_host_timer_task);
+}
+
+
+static void host_esp_timer_task(void* arg)
+{
+    while (true)
+    {
+        while (g_host_timer_pending != NULL)
+        {
+            esp_timer_handle_t timer = g_host_timer_pending;
+            host_esp_timer_unpend(timer);
+            timer->args.callback(timer->args.arg);
+        }
+        host_task_block(&g_host_timer_pending, -1);
+    }
+}
+
+
+// starts the esp_timer task of the boot
+void host_esp_timer_start()
+{
+    g_host_timer_task = host_task_create("esp_timer", host_esp_timer_task, NULL, 22);
+}
+
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle)
+{
+    if (create_args == NULL || create_args->callback == NULL || out_handle == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    esp_timer_handle_t timer = calloc(1, sizeof(struct esp_timer));
+    timer->args = *create_args;
+    timer->item.fn = host_esp_timer_on_expire;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+    return timer != NULL && timer->item.is_armed;
+}
+
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (timer == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (timer->item.is_armed)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->period_us = 0;
+    host_item_arm(&timer->item, host_now_us() + (int64_t)timeout_us);
+    return ESP_OK;
+}
+
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+    if (timer == NULL || period_us == 0)
+        return ESP_ERR_INVALID_ARG;
+    if (timer->item.is_armed)
+        return ESP_ERR_INVALID_STATE;
+
+    timer->period_us = period_us;
+    host_item_arm(&timer->item, host_now_us() + (int64_t)period_us);
+    return ESP_OK;
+}
+
+
+// the callback of expired timer doesn't run after stop (it waits in the
+// list of the esp_timer task until then)
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (timer == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    bool was_active = timer->item.is_armed || timer->is_pending;
+    host_item_disarm(&timer->item);
+    host_esp_timer_unpend(timer);
+    return was_active ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (timer == NULL)
+        return ESP_ERR_INVALID_ARG;
+    if (timer->item.is_armed)
+        return ESP_ERR_INVALID_STATE;
+
+    host_esp_timer_unpend(timer);
+    free(timer);
+    return ESP_OK;
+}
+
+#endif /* HOST_HAL_ESP_TIMER_H_ */
@@ -0,0 +1,54 @@
+/*
+ * esp_wake_stub.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_ESP_WAKE_STUB_H_
+#define HOST_HAL_ESP_WAKE_STUB_H_
+
+#include "host_sim.h"
+#include "esp_sleep.h"
+#include "soc/rtc.h"
+
+// The stub runs before the boot in the same wake process, sleeping from it
+// keeps the gpio wakeup of the last deep sleep
+
+typedef void (*esp_deep_sleep_wake_stub_fn_t)(void);
+
+uint64_t g_host_stub_sleep_us = 0;
+
+
+void esp_default_wake_deep_sleep(void)
+{
+}
+
+
+uint32_t esp_wake_stub_get_wakeup_cause()
+{
+    switch (host_world()->wake_cause)
+    {
+        case ESP_SLEEP_WAKEUP_TIMER:    return RTC_TIMER_TRIG_EN;
+        case ESP_SLEEP_WAKEUP_GPIO:     return RTC_GPIO_TRIG_EN;
+        default:                        return 0;
+    }
+}
+
+
+void esp_wake_stub_set_wakeup_time(uint64_t time_in_us)
+{
+    g_host_stub_sleep_us = time_in_us;
+}
+
+
+void esp_wake_stub_sleep(esp_deep_sleep_wake_stub_fn_t new_stub)
+{
+    host_world_t* world = host_world();
+    world->stats.stub_wakes++;
+    world->sleep.timer_armed = true;
+    world->sleep.timer_us = g_host_stub_sleep_us;
+    host_end_wake(HOST_END_STUB_SLEEP, NULL);
+}
+
+#endif /* HOST_HAL_ESP_WAKE_STUB_H_ */
@@ -0,0 +1,42 @@
+/*
+ * FreeRTOS.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_FREERTOS_FREERTOS_H_
+#define HOST_HAL_FREERTOS_FREERTOS_H_
+
+#include "host_sim.h"
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE             0
+#define pdTRUE              1
+#define pdPASS              pdTRUE
+#define pdFAIL              pdFALSE
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define configTICK_RATE_HZ  CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS  ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(((TickType_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define configMAX_PRIORITIES 25
+#define tskIDLE_PRIORITY    ((UBaseType_t)0U)
+
+
+// timeout of blocking call in us (-1 - forever), a tick timeout ends on
+// the tick interrupt, so it may be shorter by up to one tick
+static inline int64_t host_ticks_to_timeout_us(TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+        return -1;
+
+    int64_t since_boot = host_now_us() - host_world()->boot_us;
+    int64_t wake_at = (since_boot / HOST_TICK_US + ticks) * HOST_TICK_US;
+    return wake_at - since_boot;
+}
+
+#endif /* HOST_HAL_FREERTOS_FREERTOS_H_ */
@@ -0,0 +1,74 @@
+/*
+ * semphr.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_FREERTOS_SEMPHR_H_
+#define HOST_HAL_FREERTOS_SEMPHR_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// mutex only, taking it out of a task (timer callback on the scheduler)
+// while it is held is a deadlock and fails the wake
+
+typedef struct {
+    host_task_t* holder;
+    uint32_t depth;
+    bool is_mutex;
+} StaticSemaphore_t;
+
+typedef StaticSemaphore_t* SemaphoreHandle_t;
+
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* buffer)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->is_mutex = true;
+    return buffer;
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    return xSemaphoreCreateMutexStatic(calloc(1, sizeof(StaticSemaphore_t)));
+}
+
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    host_task_t* task = host_task_current();
+    int64_t deadline_us = ticks == portMAX_DELAY ? -1 : host_now_us() + host_ticks_to_timeout_us(ticks);
+
+    while (sem->depth > 0)
+    {
+        if (sem->holder == task && task == NULL)
+            host_fail("mutex is taken twice out of a task");
+        if (ticks == 0 || (deadline_us >= 0 && host_now_us() >= deadline_us))
+            return pdFALSE;
+        if (task == NULL)
+            host_fail("mutex is held, it can't be waited for out of a task");
+        if (!host_task_block(sem, deadline_us < 0 ? -1 : deadline_us - host_now_us()))
+            return pdFALSE;
+    }
+
+    sem->holder = task;
+    sem->depth = 1;
+    return pdTRUE;
+}
+
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    if (sem->depth == 0)
+        return pdFALSE;
+
+    sem->depth = 0;
+    sem->holder = NULL;
+    host_task_unblock_waiters(sem);
+    return pdTRUE;
+}
+
+#endif /* HOST_HAL_FREERTOS_SEMPHR_H_ */
@@ -0,0 +1,82 @@
+/*
+ * task.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_FREERTOS_TASK_H_
+#define HOST_HAL_FREERTOS_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+// tasks are cooperative, see host_sim.h
+
+typedef void (*TaskFunction_t)(void*);
+typedef host_task_t* TaskHandle_t;
+
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* params,
+                       UBaseType_t priority, TaskHandle_t* created_task)
+{
+    TaskHandle_t task = host_task_create(name, fn, params, priority);
+    if (created_task != NULL)
+        *created_task = task;
+    return pdPASS;
+}
+
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == host_task_current())
+    {
+        host_task_exit();
+        return;
+    }
+    task->is_done = true;
+    task->is_ready = false;
+    host_item_disarm(&task->timeout_item);
+}
+
+
+void vTaskDelay(TickType_t ticks)
+{
+    if (ticks == 0)
+        return;
+    host_task_block(&g_host_current, host_ticks_to_timeout_us(ticks));
+}
+
+
+TickType_t xTaskGetTickCount()
+{
+    return (TickType_t)((host_now_us() - host_world()->boot_us) / HOST_TICK_US);
+}
+
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+    host_task_t* task = host_task_current();
+    if (task == NULL)
+        host_fail("ulTaskNotifyTake out of a task");
+
+    if (task->notify_value == 0 && ticks != 0)
+        host_task_block(&task->notify_value, host_ticks_to_timeout_us(ticks));
+
+    uint32_t value = task->notify_value;
+    if (value != 0)
+        task->notify_value = clear_on_exit ? 0 : value - 1;
+    return value;
+}
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    task->notify_value++;
+    if (task->wait_obj == &task->notify_value)
+        host_task_unblock(task);
+    return pdPASS;
+}
+
+#define vTaskNotifyGiveFromISR(task, woken) xTaskNotifyGive(task)
+
+#endif /* HOST_HAL_FREERTOS_TASK_H_ */
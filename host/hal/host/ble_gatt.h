@@ -0,0 +1,13 @@
+/*
+ * ble_gatt.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_HOST_BLE_GATT_H_
+#define HOST_HAL_HOST_BLE_GATT_H_
+
+#include "host_ble.h"
+
+#endif /* HOST_HAL_HOST_BLE_GATT_H_ */
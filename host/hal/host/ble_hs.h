@@ -0,0 +1,13 @@
+/*
+ * ble_hs.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_HOST_BLE_HS_H_
+#define HOST_HAL_HOST_BLE_HS_H_
+
+#include "host_ble.h"
+
+#endif /* HOST_HAL_HOST_BLE_HS_H_ */
@@ -0,0 +1,13 @@
+/*
+ * ble_sm.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_HOST_BLE_SM_H_
+#define HOST_HAL_HOST_BLE_SM_H_
+
+#include "host_ble.h"
+
+#endif /* HOST_HAL_HOST_BLE_SM_H_ */
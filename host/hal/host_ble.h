@@ -0,0 +1,1923 @@
+/*
+ * host_ble.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_HOST_BLE_H_
+#define HOST_HAL_HOST_BLE_H_
+
+
+#include "host_sim.h"
+#include "esp_err.h"
+#include "nimble/nimble_npl.h"
+#include "sdkconfig.h"
+
+// NimBLE host and controller of the device and the peers in range.
+//
+// The device side is the part of the NimBLE api the firmware uses, with
+// the behaviour it relies on: GAP events and GATT access callbacks run
+// in the host task (they are posted to the default event queue), except
+// BLE_GAP_EVENT_NOTIFY_TX of a notification, which NimBLE reports from
+// ble_gatts_notify_custom itself. Notifications hold their mbuf (the msys
+// pool has HOST_MSYS_BLOCK_CNT blocks) until they are sent in a connection
+// event. The legacy advertising api exists only without extended
+// advertising (CONFIG_BT_NIMBLE_EXT_ADV), like in NimBLE.
+//
+// The peers (gateways, phones, see sim_gateway.h) live in the world. They
+// see the advertising of the device on every adv event while they are in
+// range and react from their hooks: a scan request or a connection while
+// the adv is seen, GATT procedures and encryption while connected. The
+// filter policy of the adv is checked against the filter accept list
+// (ble_gap_wl_set). Hooks of the peers run in the host task too, their
+// procedures take a connection interval or a few.
+//
+// Advertising and connection time is added to the stats of the world.
+
+#define HOST_MSYS_BLOCK_CNT     12      // CONFIG_BT_NIMBLE_MSYS_1_BLOCK_COUNT
+#define HOST_MSYS_BLOCK_SIZE    256     // CONFIG_BT_NIMBLE_MSYS_1_BLOCK_SIZE
+#define HOST_BLE_MAX_PEERS      12      // a full white list and a few more
+#define HOST_BLE_MAX_CONNS      CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define HOST_BLE_MAX_ATTRS      48
+#define HOST_BLE_MAX_SVCS       8
+#define HOST_BLE_MAX_POSTS      64
+#define HOST_BLE_MAX_OPS        16
+#define HOST_BLE_TXQ_SIZE       16
+#define HOST_BLE_WL_SIZE        12
+#define HOST_BLE_EXT_DATA_MAX   1650
+#define HOST_BLE_LEGACY_DATA_MAX 31
+
+#define HOST_BLE_INIT_US        20000   // controller init in nimble_port_init
+#define HOST_BLE_SYNC_US        15000   // from the host task start to the sync
+#define HOST_BLE_CONN_ITVL_US   30000   // connection interval chosen by the peer
+#define HOST_BLE_LL_PKTS_PER_EVENT 4    // LL packets the device sends per connection event
+#define HOST_BLE_ENCRYPT_EVENTS 4       // connection events of the pairing (Just Works)
+#define HOST_BLE_PEER_MTU       247
+
+
+// ---------------------------------------------------------------- error codes
+
+#define BLE_HS_EAGAIN           1
+#define BLE_HS_EALREADY         2
+#define BLE_HS_EINVAL           3
+#define BLE_HS_EMSGSIZE         4
+#define BLE_HS_ENOENT           5
+#define BLE_HS_ENOMEM           6
+#define BLE_HS_ENOTCONN         7
+#define BLE_HS_ENOTSUP          8
+#define BLE_HS_EAPP             9
+#define BLE_HS_EBADDATA         10
+#define BLE_HS_EOS              11
+#define BLE_HS_ECONTROLLER      12
+#define BLE_HS_ETIMEOUT         13
+#define BLE_HS_EDONE            14
+#define BLE_HS_EBUSY            15
+#define BLE_HS_EREJECT          16
+#define BLE_HS_EUNKNOWN         17
+#define BLE_HS_EROLE            18
+#define BLE_HS_ETIMEOUT_HCI     19
+#define BLE_HS_ENOMEM_EVT       20
+#define BLE_HS_ENOADDR          21
+#define BLE_HS_ENOTSYNCED       22
+#define BLE_HS_EAUTHEN          23
+#define BLE_HS_EAUTHOR          24
+#define BLE_HS_EENCRYPT         25
+#define BLE_HS_EENCRYPT_KEY_SZ  26
+#define BLE_HS_ESTORE_CAP       27
+#define BLE_HS_ESTORE_FAIL      28
+#define BLE_HS_EPREEMPTED       29
+#define BLE_HS_EDISABLED        30
+#define BLE_HS_ESTALLED         31
+
+#define BLE_HS_ERR_ATT_BASE     0x100
+#define BLE_HS_ERR_HCI_BASE     0x200
+#define BLE_HS_ERR_SM_US_BASE   0x300
+#define BLE_HS_ERR_SM_PEER_BASE 0x400
+
+#define BLE_HS_FOREVER          INT32_MAX
+#define BLE_HS_CONN_HANDLE_NONE 0xFFFF
+
+#define BLE_ERR_CONN_SPVN_TMO       0x08
+#define BLE_ERR_REM_USER_CONN_TERM  0x13
+#define BLE_ERR_CONN_TERM_LOCAL     0x16
+
+#define BLE_ATT_ERR_INVALID_HANDLE          0x01
+#define BLE_ATT_ERR_READ_NOT_PERMITTED      0x02
+#define BLE_ATT_ERR_WRITE_NOT_PERMITTED     0x03
+#define BLE_ATT_ERR_INVALID_PDU             0x04
+#define BLE_ATT_ERR_INSUFFICIENT_AUTHEN     0x05
+#define BLE_ATT_ERR_REQ_NOT_SUPPORTED       0x06
+#define BLE_ATT_ERR_INVALID_OFFSET          0x07
+#define BLE_ATT_ERR_INSUFFICIENT_AUTHOR     0x08
+#define BLE_ATT_ERR_ATTR_NOT_FOUND          0x0A
+#define BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN  0x0D
+#define BLE_ATT_ERR_UNLIKELY                0x0E
+#define BLE_ATT_ERR_INSUFFICIENT_ENC        0x0F
+#define BLE_ATT_ERR_INSUFFICIENT_RES        0x11
+#define BLE_ATT_ERR_VALUE_NOT_ALLOWED       0x13
+
+#define BLE_ATT_F_READ          0x01
+#define BLE_ATT_F_WRITE         0x02
+#define BLE_ATT_F_READ_ENC      0x04
+#define BLE_ATT_F_WRITE_ENC     0x20
+
+#define BLE_ATT_MTU_DFLT        23
+#define BLE_ATT_MTU_MAX         527
+
+
+// ---------------------------------------------------------------- addrs and uuids
+
+#define BLE_ADDR_PUBLIC         0x00
+#define BLE_ADDR_RANDOM         0x01
+#define BLE_OWN_ADDR_PUBLIC     0x00
+
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+#define BLE_UUID_TYPE_16        16
+#define BLE_UUID_TYPE_32        32
+#define BLE_UUID_TYPE_128       128
+
+typedef struct {
+    uint8_t type;
+} ble_uuid_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint16_t value;
+} ble_uuid16_t;
+
+typedef struct {
+    ble_uuid_t u;
+    uint8_t value[16];
+} ble_uuid128_t;
+
+typedef union {
+    ble_uuid_t u;
+    ble_uuid16_t u16;
+    ble_uuid128_t u128;
+} ble_uuid_any_t;
+
+#define BLE_UUID16_INIT(uuid16) {.u = {.type = BLE_UUID_TYPE_16}, .value = (uuid16)}
+#define BLE_UUID128_INIT(uuid128...) {.u = {.type = BLE_UUID_TYPE_128}, .value = {uuid128}}
+#define BLE_UUID16_DECLARE(uuid16) ((const ble_uuid_t*)(&(ble_uuid16_t)BLE_UUID16_INIT(uuid16)))
+
+
+int ble_uuid_cmp(const ble_uuid_t* uuid1, const ble_uuid_t* uuid2)
+{
+    if (uuid1->type != uuid2->type)
+        return uuid1->type - uuid2->type;
+    if (uuid1->type == BLE_UUID_TYPE_16)
+        return (int)((const ble_uuid16_t*)uuid1)->value - (int)((const ble_uuid16_t*)uuid2)->value;
+    return memcmp(((const ble_uuid128_t*)uuid1)->value, ((const ble_uuid128_t*)uuid2)->value, 16);
+}
+
+
+uint16_t ble_uuid_u16(const ble_uuid_t* uuid)
+{
+    return uuid->type == BLE_UUID_TYPE_16 ? ((const ble_uuid16_t*)uuid)->value : 0;
+}
+
+
+static void host_ble_copy_uuid(ble_uuid_any_t* dest, const ble_uuid_t* uuid)
+{
+    memset(dest, 0, sizeof(*dest));
+    if (uuid->type == BLE_UUID_TYPE_16)
+        dest->u16 = *(const ble_uuid16_t*)uuid;
+    else
+        dest->u128 = *(const ble_uuid128_t*)uuid;
+}
+
+
+// ---------------------------------------------------------------- mbufs
+
+// one block per packet, the values of this firmware fit into a block
+struct os_mbuf {
+    uint8_t* om_data;
+    uint16_t om_len;
+    bool is_used;
+    uint8_t buf[HOST_MSYS_BLOCK_SIZE];
+};
+
+struct os_mbuf g_host_msys[HOST_MSYS_BLOCK_CNT];
+
+#define OS_MBUF_PKTLEN(om)  ((om)->om_len)
+
+
+static struct os_mbuf* host_mbuf_get()
+{
+    for (int i = 0; i < HOST_MSYS_BLOCK_CNT; i++)
+    {
+        if (!g_host_msys[i].is_used)
+        {
+            g_host_msys[i].is_used = true;
+            g_host_msys[i].om_data = g_host_msys[i].buf;
+            g_host_msys[i].om_len = 0;
+            return &g_host_msys[i];
+        }
+    }
+    return NULL;
+}
+
+
+int os_mbuf_free_chain(struct os_mbuf* om)
+{
+    if (om != NULL)
+        om->is_used = false;
+    return 0;
+}
+
+
+int os_msys_num_free()
+{
+    int cnt = 0;
+    for (int i = 0; i < HOST_MSYS_BLOCK_CNT; i++)
+        cnt += !g_host_msys[i].is_used;
+    return cnt;
+}
+
+
+int os_msys_count()
+{
+    return HOST_MSYS_BLOCK_CNT;
+}
+
+
+int os_mbuf_append(struct os_mbuf* om, const void* data, uint16_t len)
+{
+    if (om->om_len + len > HOST_MSYS_BLOCK_SIZE)
+        return 1;   // OS_ENOMEM
+    memcpy(om->om_data + om->om_len, data, len);
+    om->om_len += len;
+    return 0;
+}
+
+
+struct os_mbuf* ble_hs_mbuf_from_flat(const void* buf, uint16_t len)
+{
+    if (len > HOST_MSYS_BLOCK_SIZE)
+        return NULL;
+    struct os_mbuf* om = host_mbuf_get();
+    if (om != NULL)
+        os_mbuf_append(om, buf, len);
+    return om;
+}
+
+
+int ble_hs_mbuf_to_flat(const struct os_mbuf* om, void* flat, uint16_t max_len, uint16_t* out_copy_len)
+{
+    uint16_t len = om->om_len < max_len ? om->om_len : max_len;
+    memcpy(flat, om->om_data, len);
+    if (out_copy_len != NULL)
+        *out_copy_len = len;
+    return om->om_len > max_len ? BLE_HS_EMSGSIZE : 0;
+}
+
+
+// ---------------------------------------------------------------- GAP
+
+#define BLE_GAP_EVENT_CONNECT           0
+#define BLE_GAP_EVENT_DISCONNECT        1
+#define BLE_GAP_EVENT_CONN_UPDATE       3
+#define BLE_GAP_EVENT_ADV_COMPLETE      9
+#define BLE_GAP_EVENT_ENC_CHANGE        10
+#define BLE_GAP_EVENT_NOTIFY_TX         13
+#define BLE_GAP_EVENT_SUBSCRIBE         14
+#define BLE_GAP_EVENT_MTU               15
+#define BLE_GAP_EVENT_SCAN_REQ_RCVD     22
+
+#define BLE_GAP_CONN_MODE_NON           0
+#define BLE_GAP_CONN_MODE_DIR           1
+#define BLE_GAP_CONN_MODE_UND           2
+#define BLE_GAP_DISC_MODE_NON           0
+#define BLE_GAP_DISC_MODE_LTD           1
+#define BLE_GAP_DISC_MODE_GEN           2
+#define BLE_GAP_ADV_DFLT_CHANNEL_MAP    0
+#define BLE_GAP_ROLE_SLAVE              1
+
+#define BLE_GAP_SUBSCRIBE_REASON_WRITE  1
+#define BLE_GAP_SUBSCRIBE_REASON_TERM   2
+
+#define BLE_HCI_ADV_FILT_NONE           0
+#define BLE_HCI_ADV_FILT_SCAN           1
+#define BLE_HCI_ADV_FILT_CONN           2
+#define BLE_HCI_ADV_FILT_BOTH           3
+#define BLE_HCI_LE_PHY_1M               1
+#define BLE_HCI_LE_PHY_2M               2
+#define BLE_HCI_LE_PHY_CODED            3
+
+struct ble_gap_sec_state {
+    unsigned encrypted:1;
+    unsigned authenticated:1;
+    unsigned bonded:1;
+    unsigned key_size:5;
+};
+
+struct ble_gap_conn_desc {
+    struct ble_gap_sec_state sec_state;
+    ble_addr_t our_id_addr;
+    ble_addr_t peer_id_addr;
+    ble_addr_t our_ota_addr;
+    ble_addr_t peer_ota_addr;
+    uint16_t conn_handle;
+    uint16_t conn_itvl;
+    uint16_t conn_latency;
+    uint16_t supervision_timeout;
+    uint8_t role;
+    uint8_t master_clock_accuracy;
+};
+
+struct ble_gap_event {
+    uint8_t type;
+    union {
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } connect;
+        struct {
+            int reason;
+            struct ble_gap_conn_desc conn;
+        } disconnect;
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } conn_update;
+        struct {
+            int reason;
+            uint8_t instance;
+            uint16_t conn_handle;
+            uint8_t num_ext_adv_events;
+        } adv_complete;
+        struct {
+            int status;
+            uint16_t conn_handle;
+        } enc_change;
+        struct {
+            int status;
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t indication:1;
+        } notify_tx;
+        struct {
+            uint16_t conn_handle;
+            uint16_t attr_handle;
+            uint8_t reason;
+            uint8_t prev_notify:1;
+            uint8_t cur_notify:1;
+            uint8_t prev_indicate:1;
+            uint8_t cur_indicate:1;
+        } subscribe;
+        struct {
+            uint16_t conn_handle;
+            uint16_t channel_id;
+            uint16_t value;
+        } mtu;
+        struct {
+            uint8_t instance;
+            ble_addr_t scan_addr;
+        } scan_req_rcvd;
+    };
+};
+
+typedef int ble_gap_event_fn(struct ble_gap_event* event, void* arg);
+
+struct ble_gap_adv_params {
+    uint8_t conn_mode;
+    uint8_t disc_mode;
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint8_t channel_map;
+    uint8_t filter_policy;
+    uint8_t high_duty_cycle:1;
+};
+
+struct ble_gap_ext_adv_params {
+    unsigned int connectable:1;
+    unsigned int scannable:1;
+    unsigned int directed:1;
+    unsigned int high_duty_directed:1;
+    unsigned int legacy_pdu:1;
+    unsigned int anonymous:1;
+    unsigned int include_tx_power:1;
+    unsigned int scan_req_notif:1;
+    uint32_t itvl_min;
+    uint32_t itvl_max;
+    uint8_t channel_map;
+    uint8_t own_addr_type;
+    ble_addr_t peer;
+    uint8_t filter_policy;
+    uint8_t primary_phy;
+    uint8_t secondary_phy;
+    int8_t tx_power;
+    uint8_t sid;
+};
+
+struct ble_gap_upd_params {
+    uint16_t itvl_min;
+    uint16_t itvl_max;
+    uint16_t latency;
+    uint16_t supervision_timeout;
+    uint16_t min_ce_len;
+    uint16_t max_ce_len;
+};
+
+
+// ---------------------------------------------------------------- GATT
+
+#define BLE_GATT_SVC_TYPE_END       0
+#define BLE_GATT_SVC_TYPE_PRIMARY   1
+#define BLE_GATT_SVC_TYPE_SECONDARY 2
+
+#define BLE_GATT_CHR_F_BROADCAST    0x0001
+#define BLE_GATT_CHR_F_READ         0x0002
+#define BLE_GATT_CHR_F_WRITE_NO_RSP 0x0004
+#define BLE_GATT_CHR_F_WRITE        0x0008
+#define BLE_GATT_CHR_F_NOTIFY       0x0010
+#define BLE_GATT_CHR_F_INDICATE     0x0020
+#define BLE_GATT_CHR_F_READ_ENC     0x0200
+#define BLE_GATT_CHR_F_READ_AUTHEN  0x0400
+#define BLE_GATT_CHR_F_READ_AUTHOR  0x0800
+#define BLE_GATT_CHR_F_WRITE_ENC    0x1000
+#define BLE_GATT_CHR_F_WRITE_AUTHEN 0x2000
+#define BLE_GATT_CHR_F_WRITE_AUTHOR 0x4000
+
+#define BLE_GATT_ACCESS_OP_READ_CHR     0
+#define BLE_GATT_ACCESS_OP_WRITE_CHR    1
+#define BLE_GATT_ACCESS_OP_READ_DSC     2
+#define BLE_GATT_ACCESS_OP_WRITE_DSC    3
+
+typedef uint16_t ble_gatt_chr_flags;
+
+struct ble_gatt_access_ctxt;
+typedef int ble_gatt_access_fn(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg);
+
+struct ble_gatt_dsc_def {
+    const ble_uuid_t* uuid;
+    uint8_t att_flags;
+    uint8_t min_key_size;
+    ble_gatt_access_fn* access_cb;
+    void* arg;
+};
+
+struct ble_gatt_chr_def {
+    const ble_uuid_t* uuid;
+    ble_gatt_access_fn* access_cb;
+    void* arg;
+    struct ble_gatt_dsc_def* descriptors;
+    ble_gatt_chr_flags flags;
+    uint8_t min_key_size;
+    uint16_t* val_handle;
+};
+
+struct ble_gatt_svc_def {
+    uint8_t type;
+    const ble_uuid_t* uuid;
+    const struct ble_gatt_svc_def** includes;
+    const struct ble_gatt_chr_def* characteristics;
+};
+
+struct ble_gatt_access_ctxt {
+    uint8_t op;
+    struct os_mbuf* om;
+    union {
+        const struct ble_gatt_chr_def* chr;
+        const struct ble_gatt_dsc_def* dsc;
+    };
+};
+
+struct ble_gatt_error {
+    uint16_t status;
+    uint16_t att_handle;
+};
+
+struct ble_gatt_attr {
+    uint16_t handle;
+    uint16_t offset;
+    struct os_mbuf* om;
+};
+
+typedef int ble_gatt_attr_fn(uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr,
+                             void* arg);
+typedef int ble_gatt_mtu_fn(uint16_t conn_handle, const struct ble_gatt_error* error, uint16_t mtu, void* arg);
+
+
+// ---------------------------------------------------------------- host config
+
+#define BLE_SM_IO_CAP_DISP_ONLY     0x00
+#define BLE_SM_IO_CAP_DISP_YES_NO   0x01
+#define BLE_SM_IO_CAP_KEYBOARD_ONLY 0x02
+#define BLE_SM_IO_CAP_NO_IO         0x03
+#define BLE_SM_IO_CAP_KEYBOARD_DISP 0x04
+
+typedef void ble_hs_sync_fn(void);
+typedef void ble_hs_reset_fn(int reason);
+
+struct ble_hs_cfg {
+    ble_hs_reset_fn* reset_cb;
+    ble_hs_sync_fn* sync_cb;
+    uint8_t sm_io_cap;
+    unsigned sm_oob_data_flag:1;
+    unsigned sm_bonding:1;
+    unsigned sm_mitm:1;
+    unsigned sm_sc:1;
+    unsigned sm_keypress:1;
+    uint8_t sm_our_key_dist;
+    uint8_t sm_their_key_dist;
+};
+
+struct ble_hs_cfg ble_hs_cfg;
+
+
+// ---------------------------------------------------------------- peers
+
+typedef struct host_ble_peer host_ble_peer_t;
+
+// advertising of the device as a peer sees it on one adv event
+typedef struct {
+    const uint8_t* data;
+    uint16_t data_len;
+    bool is_ext_pdu;
+    bool is_connectable;
+    bool is_scannable;
+} host_ble_adv_view_t;
+
+// end of a procedure of the peer: status is 0 or ATT error (BLE_HS_* if
+// the link is lost), data is the read value
+typedef void host_ble_peer_cb_t(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len);
+
+struct host_ble_peer {
+    ble_addr_t addr;
+    bool is_in_range;
+    uint16_t mtu;
+    int64_t conn_itvl_us;
+    void* ctx;      // model of the peer (shared memory)
+
+    void (*on_adv)(host_ble_peer_t* peer, const host_ble_adv_view_t* adv);
+    void (*on_connect)(host_ble_peer_t* peer);
+    void (*on_disconnect)(host_ble_peer_t* peer, int reason);
+    void (*on_notify)(host_ble_peer_t* peer, uint16_t attr_handle, const uint8_t* data, uint16_t len,
+                      bool is_indication);
+    // GATT server of the peer: returns 0 and the value or ATT error
+    int (*on_read)(host_ble_peer_t* peer, uint16_t uuid16, uint8_t* dest, uint16_t* len);
+};
+
+// part of the world: the device addr and the peers
+typedef struct {
+    ble_addr_t device_addr;
+    uint8_t peer_cnt;
+    host_ble_peer_t peers[HOST_BLE_MAX_PEERS];
+} host_ble_world_t;
+
+host_ble_world_t* g_host_ble_world = NULL;
+
+
+host_ble_world_t* host_ble_world()
+{
+    static host_ble_world_t empty_world;    // the wake of a world without peers
+
+    if (g_host_ble_world == NULL)
+    {
+        g_host_ble_world = g_host_is_device ? &empty_world : host_shared_alloc(sizeof(host_ble_world_t));
+        g_host_ble_world->device_addr = (ble_addr_t){.type = BLE_ADDR_PUBLIC,
+                                                     .val = {0x36, 0x12, 0xA4, 0x79, 0xCF, 0x58}};
+    }
+    return g_host_ble_world;
+}
+
+
+// adds a peer in range, its hooks are set by the caller
+host_ble_peer_t* host_ble_add_peer(const uint8_t addr[6])
+{
+    host_ble_world_t* ble_world = host_ble_world();
+    if (ble_world->peer_cnt == HOST_BLE_MAX_PEERS)
+        host_fail("too many peers");
+
+    host_ble_peer_t* peer = &ble_world->peers[ble_world->peer_cnt++];
+    memset(peer, 0, sizeof(*peer));
+    peer->addr.type = BLE_ADDR_PUBLIC;
+    memcpy(peer->addr.val, addr, 6);
+    peer->is_in_range = true;
+    peer->mtu = HOST_BLE_PEER_MTU;
+    peer->conn_itvl_us = HOST_BLE_CONN_ITVL_US;
+    return peer;
+}
+
+
+// ---------------------------------------------------------------- state of the wake
+
+typedef struct {
+    struct ble_npl_event ev;
+    host_item_t item;
+    void (*fn)(void* arg);
+    void* arg;
+    bool in_use;
+} host_ble_post_t;
+
+typedef struct {
+    const struct ble_gatt_chr_def* chr;
+    const struct ble_gatt_dsc_def* dsc;    // NULL - value of the characteristic
+    uint16_t handle;
+    uint16_t cccd_handle;                  // 0 - no notifications and indications
+} host_ble_attr_t;
+
+typedef struct {
+    struct os_mbuf* om;
+    uint16_t attr_handle;
+    bool is_indication;
+} host_ble_tx_t;
+
+typedef struct {
+    bool in_use;
+    uint16_t handle;
+    host_ble_peer_t* peer;
+    ble_gap_event_fn* cb;
+    void* cb_arg;
+    bool is_encrypted;
+    bool is_terminating;
+    bool has_dle;
+    uint16_t mtu;
+    int64_t itvl_us;
+    int64_t start_us;
+    uint8_t subs[HOST_BLE_MAX_ATTRS];      // bit 0 - notify, bit 1 - indicate
+    host_ble_tx_t txq[HOST_BLE_TXQ_SIZE];
+    uint8_t txq_len;
+    bool ind_in_flight;
+    host_item_t event_item;
+} host_ble_conn_t;
+
+typedef enum {
+    HOST_BLE_OP_PEER_READ,
+    HOST_BLE_OP_PEER_WRITE,
+    HOST_BLE_OP_PEER_SUBSCRIBE,
+    HOST_BLE_OP_PEER_ENCRYPT,
+    HOST_BLE_OP_PEER_DISCONNECT,
+    HOST_BLE_OP_READ_BY_UUID,   // device reads the peer
+    HOST_BLE_OP_EXCHANGE_MTU,
+    HOST_BLE_OP_TERMINATE,
+    HOST_BLE_OP_IND_CONFIRM,
+    HOST_BLE_OP_UPDATE_PARAMS,
+} host_ble_op_type_t;
+
+typedef struct {
+    bool in_use;
+    host_ble_op_type_t type;
+    uint16_t conn_handle;
+    ble_uuid_any_t uuid;
+    uint8_t data[HOST_MSYS_BLOCK_SIZE];
+    uint16_t len;
+    bool notify;
+    bool indicate;
+    int value;
+    host_ble_peer_cb_t* peer_cb;
+    ble_gatt_attr_fn* attr_cb;
+    ble_gatt_mtu_fn* mtu_cb;
+    void* cb_arg;
+} host_ble_op_t;
+
+typedef struct {
+    bool is_active;
+    bool is_configured;
+    bool is_legacy_pdu;
+    bool is_connectable;
+    bool is_scannable;
+    bool scan_req_notif;
+    uint8_t filter_policy;
+    int64_t itvl_us;
+    uint8_t data[HOST_BLE_EXT_DATA_MAX];
+    uint16_t data_len;
+    uint8_t rsp[HOST_BLE_LEGACY_DATA_MAX];
+    uint16_t rsp_len;
+    ble_gap_event_fn* cb;
+    void* cb_arg;
+    int64_t start_us;
+    host_item_t end_item;
+    host_item_t event_item;
+} host_ble_adv_t;
+
+typedef struct {
+    bool is_inited;
+    bool is_synced;
+    bool is_stopped;
+    struct ble_npl_eventq dflt_evq;
+    host_ble_post_t posts[HOST_BLE_MAX_POSTS];
+    host_ble_op_t ops[HOST_BLE_MAX_OPS];
+    host_ble_adv_t adv;
+    ble_addr_t wl[HOST_BLE_WL_SIZE];
+    uint8_t wl_cnt;
+    host_ble_conn_t conns[HOST_BLE_MAX_CONNS];
+    uint16_t next_conn_handle;
+    host_ble_attr_t attrs[HOST_BLE_MAX_ATTRS];
+    uint8_t attr_cnt;
+    uint16_t next_handle;
+    uint16_t preferred_mtu;
+} host_ble_t;
+
+host_ble_t g_host_ble;
+bool g_host_ble_hook_is_set = false;
+
+
+// ---------------------------------------------------------------- posting
+
+static void host_ble_post_run(struct ble_npl_event* ev)
+{
+    host_ble_post_t* post = HOST_CONTAINER_OF(ev, host_ble_post_t, ev);
+    void (*fn)(void*) = post->fn;
+    void* arg = post->arg;
+    post->in_use = false;
+    fn(arg);
+}
+
+
+static void host_ble_post_due(host_item_t* item)
+{
+    host_ble_post_t* post = HOST_CONTAINER_OF(item, host_ble_post_t, item);
+    ble_npl_eventq_put(&g_host_ble.dflt_evq, &post->ev);
+}
+
+
+// runs the function in the host task after the delay
+static void host_ble_post(int64_t delay_us, void (*fn)(void* arg), void* arg)
+{
+    for (int i = 0; i < HOST_BLE_MAX_POSTS; i++)
+    {
+        host_ble_post_t* post = &g_host_ble.posts[i];
+        if (post->in_use)
+            continue;
+
+        post->in_use = true;
+        post->fn = fn;
+        post->arg = arg;
+        ble_npl_event_init(&post->ev, host_ble_post_run, post);
+        post->item.fn = host_ble_post_due;
+        host_item_arm(&post->item, host_now_us() + delay_us);
+        return;
+    }
+    host_fail("too many posted BLE events");
+}
+
+
+static host_ble_op_t* host_ble_op_new(host_ble_op_type_t type, uint16_t conn_handle)
+{
+    for (int i = 0; i < HOST_BLE_MAX_OPS; i++)
+    {
+        host_ble_op_t* op = &g_host_ble.ops[i];
+        if (op->in_use)
+            continue;
+
+        memset(op, 0, sizeof(*op));
+        op->in_use = true;
+        op->type = type;
+        op->conn_handle = conn_handle;
+        return op;
+    }
+    host_fail("too many BLE procedures");
+    return NULL;
+}
+
+
+static void host_ble_gap_call(ble_gap_event_fn* cb, void* arg, struct ble_gap_event* event)
+{
+    if (cb != NULL)
+        cb(event, arg);
+}
+
+
+// ---------------------------------------------------------------- connections
+
+static host_ble_conn_t* host_ble_conn_find(uint16_t handle)
+{
+    for (int i = 0; i < HOST_BLE_MAX_CONNS; i++)
+        if (g_host_ble.conns[i].in_use && g_host_ble.conns[i].handle == handle)
+            return &g_host_ble.conns[i];
+    return NULL;
+}
+
+
+static host_ble_conn_t* host_ble_peer_conn(const host_ble_peer_t* peer)
+{
+    for (int i = 0; i < HOST_BLE_MAX_CONNS; i++)
+        if (g_host_ble.conns[i].in_use && g_host_ble.conns[i].peer == peer)
+            return &g_host_ble.conns[i];
+    return NULL;
+}
+
+
+static bool host_ble_wl_contains(const ble_addr_t* addr)
+{
+    for (uint8_t i = 0; i < g_host_ble.wl_cnt; i++)
+        if (g_host_ble.wl[i].type == addr->type && memcmp(g_host_ble.wl[i].val, addr->val, 6) == 0)
+            return true;
+    return false;
+}
+
+
+static void host_ble_fill_desc(const host_ble_conn_t* conn, struct ble_gap_conn_desc* desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->sec_state.encrypted = conn->is_encrypted;
+    desc->sec_state.key_size = conn->is_encrypted ? 16 : 0;
+    desc->our_id_addr = host_ble_world()->device_addr;
+    desc->our_ota_addr = desc->our_id_addr;
+    desc->peer_id_addr = conn->peer->addr;
+    desc->peer_ota_addr = conn->peer->addr;
+    desc->conn_handle = conn->handle;
+    desc->conn_itvl = conn->itvl_us / 1250;
+    desc->supervision_timeout = 400;
+    desc->role = BLE_GAP_ROLE_SLAVE;
+}
+
+
+// closes the connection: subscriptions end, then the peer and the device
+// get the disconnect (the peer first, the device may go to sleep on it)
+static void host_ble_conn_drop(host_ble_conn_t* conn, int device_reason, int peer_reason)
+{
+    host_world_t* world = host_world();
+    world->stats.conn_us += host_now_us() - conn->start_us;
+    host_item_disarm(&conn->event_item);
+    for (uint8_t i = 0; i < conn->txq_len; i++)
+        os_mbuf_free_chain(conn->txq[i].om);
+    conn->txq_len = 0;
+
+    for (uint8_t i = 0; i < g_host_ble.attr_cnt; i++)
+    {
+        if (conn->subs[i] == 0)
+            continue;
+
+        struct ble_gap_event event = {.type = BLE_GAP_EVENT_SUBSCRIBE};
+        event.subscribe.conn_handle = conn->handle;
+        event.subscribe.attr_handle = g_host_ble.attrs[i].handle;
+        event.subscribe.reason = BLE_GAP_SUBSCRIBE_REASON_TERM;
+        event.subscribe.prev_notify = conn->subs[i] & 1;
+        event.subscribe.prev_indicate = (conn->subs[i] >> 1) & 1;
+        conn->subs[i] = 0;
+        host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+    }
+
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_DISCONNECT};
+    event.disconnect.reason = device_reason;
+    host_ble_fill_desc(conn, &event.disconnect.conn);
+    conn->in_use = false;
+    if (conn->peer->on_disconnect != NULL)
+        conn->peer->on_disconnect(conn->peer, peer_reason);
+    host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+}
+
+
+static void host_ble_conn_event(void* arg);
+
+static void host_ble_conn_event_due(host_item_t* item)
+{
+    host_ble_conn_t* conn = HOST_CONTAINER_OF(item, host_ble_conn_t, event_item);
+    host_ble_post(0, host_ble_conn_event, conn);
+}
+
+
+// arms the next connection event if there is something to send
+static void host_ble_conn_schedule(host_ble_conn_t* conn)
+{
+    if (conn->txq_len == 0 || conn->event_item.is_armed)
+        return;
+
+    int64_t since_start = host_now_us() - conn->start_us;
+    int64_t next = (since_start / conn->itvl_us + 1) * conn->itvl_us;
+    conn->event_item.fn = host_ble_conn_event_due;
+    host_item_arm(&conn->event_item, conn->start_us + next);
+}
+
+
+static void host_ble_ind_confirm(void* arg);
+
+// sends the queued notifications that fit into the connection event,
+// their mbufs are freed once they are sent
+static void host_ble_conn_event(void* arg)
+{
+    host_ble_conn_t* conn = arg;
+    if (!conn->in_use)
+        return;
+
+    uint16_t ll_payload = conn->has_dle ? 251 : 27;
+    int16_t pkts_left = HOST_BLE_LL_PKTS_PER_EVENT;
+    while (conn->txq_len > 0 && pkts_left > 0)
+    {
+        host_ble_tx_t tx = conn->txq[0];
+        uint16_t pdu_len = tx.om->om_len + 3 + 4;   // ATT and L2CAP headers
+        int16_t pkts = (pdu_len + ll_payload - 1) / ll_payload;
+        if (pkts > pkts_left && pkts_left < HOST_BLE_LL_PKTS_PER_EVENT)
+            break;  // goes in the next event
+        pkts_left -= pkts;
+
+        memmove(conn->txq, conn->txq + 1, (conn->txq_len - 1) * sizeof(host_ble_tx_t));
+        conn->txq_len--;
+
+        uint8_t data[HOST_MSYS_BLOCK_SIZE];
+        uint16_t len = tx.om->om_len;
+        memcpy(data, tx.om->om_data, len);
+        os_mbuf_free_chain(tx.om);
+
+        if (conn->peer->on_notify != NULL)
+            conn->peer->on_notify(conn->peer, tx.attr_handle, data, len, tx.is_indication);
+        if (tx.is_indication)
+        {
+            host_ble_op_t* op = host_ble_op_new(HOST_BLE_OP_IND_CONFIRM, conn->handle);
+            op->value = tx.attr_handle;
+            host_ble_post(conn->itvl_us, host_ble_ind_confirm, op);
+        }
+        if (!conn->in_use)
+            return;
+    }
+    host_ble_conn_schedule(conn);
+}
+
+
+static void host_ble_ind_confirm(void* arg)
+{
+    host_ble_op_t* op = arg;
+    op->in_use = false;
+    host_ble_conn_t* conn = host_ble_conn_find(op->conn_handle);
+    if (conn == NULL)
+        return;
+
+    conn->ind_in_flight = false;
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_NOTIFY_TX};
+    event.notify_tx.status = BLE_HS_EDONE;
+    event.notify_tx.conn_handle = conn->handle;
+    event.notify_tx.attr_handle = op->value;
+    event.notify_tx.indication = 1;
+    host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+}
+
+
+// ---------------------------------------------------------------- advertising
+
+static void host_ble_adv_close()
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (!adv->is_active)
+        return;
+
+    adv->is_active = false;
+    host_item_disarm(&adv->end_item);
+    host_item_disarm(&adv->event_item);
+    host_world()->stats.adv_us += host_now_us() - adv->start_us;
+}
+
+
+static void host_ble_adv_expired(void* arg)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (!adv->is_active)
+        return;
+
+    host_ble_adv_close();
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_ADV_COMPLETE};
+    event.adv_complete.reason = BLE_HS_ETIMEOUT;
+    event.adv_complete.conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    host_ble_gap_call(adv->cb, adv->cb_arg, &event);
+}
+
+
+static void host_ble_adv_end_due(host_item_t* item)
+{
+    host_ble_post(0, host_ble_adv_expired, NULL);
+}
+
+
+// the peers in range see the adv event
+static void host_ble_adv_observe(void* arg)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    host_ble_world_t* ble_world = host_ble_world();
+
+    for (uint8_t i = 0; i < ble_world->peer_cnt && adv->is_active; i++)
+    {
+        host_ble_peer_t* peer = &ble_world->peers[i];
+        if (!peer->is_in_range || peer->on_adv == NULL)
+            continue;
+
+        host_ble_adv_view_t view = {.data = adv->data, .data_len = adv->data_len, .is_ext_pdu = !adv->is_legacy_pdu,
+                                    .is_connectable = adv->is_connectable, .is_scannable = adv->is_scannable};
+        peer->on_adv(peer, &view);
+    }
+}
+
+
+static void host_ble_adv_event_due(host_item_t* item)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    host_ble_post(0, host_ble_adv_observe, NULL);
+    host_item_arm(&adv->event_item, host_now_us() + adv->itvl_us);
+}
+
+
+static int host_ble_adv_start(int32_t duration_ms, ble_gap_event_fn* cb, void* cb_arg)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (!g_host_ble.is_synced)
+        return BLE_HS_ENOTSYNCED;
+    if (adv->is_active)
+        return BLE_HS_EALREADY;
+
+    adv->is_active = true;
+    adv->cb = cb;
+    adv->cb_arg = cb_arg;
+    adv->start_us = host_now_us();
+    host_world()->stats.adv_starts++;
+
+    adv->event_item.fn = host_ble_adv_event_due;
+    host_item_arm(&adv->event_item, host_now_us() + 1000);
+    adv->end_item.fn = host_ble_adv_end_due;
+    if (duration_ms != BLE_HS_FOREVER && duration_ms > 0)
+        host_item_arm(&adv->end_item, host_now_us() + (int64_t)duration_ms * 1000);
+    return 0;
+}
+
+
+static int host_ble_adv_stop()
+{
+    if (!g_host_ble.adv.is_active)
+        return BLE_HS_EALREADY;
+    host_ble_adv_close();
+    return 0;
+}
+
+
+// ---------------------------------------------------------------- actions of the peers
+
+static void host_ble_scan_req_rcvd(void* arg)
+{
+    host_ble_peer_t* peer = arg;
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (!adv->is_active)
+        return;
+
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_SCAN_REQ_RCVD};
+    event.scan_req_rcvd.scan_addr = peer->addr;
+    host_ble_gap_call(adv->cb, adv->cb_arg, &event);
+}
+
+
+// sends the scan request on the seen adv event (in on_adv), returns 0 and
+// the scan response if the device answered
+int host_ble_peer_scan_req(host_ble_peer_t* peer, uint8_t* rsp, uint16_t* rsp_len)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (!adv->is_active || !adv->is_scannable)
+        return BLE_HS_ENOTSUP;
+    if ((adv->filter_policy & BLE_HCI_ADV_FILT_SCAN) && !host_ble_wl_contains(&peer->addr))
+        return BLE_HS_EREJECT;
+
+    if (rsp != NULL)
+        memcpy(rsp, adv->rsp, adv->rsp_len);
+    if (rsp_len != NULL)
+        *rsp_len = adv->rsp_len;
+    if (adv->scan_req_notif)
+        host_ble_post(150, host_ble_scan_req_rcvd, peer);
+    return 0;
+}
+
+
+static void host_ble_conn_established(void* arg)
+{
+    host_ble_conn_t* conn = arg;
+    if (!conn->in_use)
+        return;
+
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_CONNECT};
+    event.connect.status = 0;
+    event.connect.conn_handle = conn->handle;
+    host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+
+#if CONFIG_BT_NIMBLE_EXT_ADV
+    // the adv set ends with the connection
+    struct ble_gap_event adv_event = {.type = BLE_GAP_EVENT_ADV_COMPLETE};
+    adv_event.adv_complete.reason = 0;
+    adv_event.adv_complete.conn_handle = conn->handle;
+    host_ble_gap_call(conn->cb, conn->cb_arg, &adv_event);
+#endif
+
+    if (conn->in_use && conn->peer->on_connect != NULL)
+        conn->peer->on_connect(conn->peer);
+}
+
+
+// connects on the seen adv event (in on_adv), returns 0 if the connection
+// is established (the peer gets on_connect after the device)
+int host_ble_peer_connect(host_ble_peer_t* peer)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (!adv->is_active || !adv->is_connectable)
+        return BLE_HS_ENOTSUP;
+    if ((adv->filter_policy & BLE_HCI_ADV_FILT_CONN) && !host_ble_wl_contains(&peer->addr))
+        return BLE_HS_EREJECT;
+    if (host_ble_peer_conn(peer) != NULL)
+        return BLE_HS_EALREADY;
+
+    host_ble_conn_t* conn = NULL;
+    for (int i = 0; i < HOST_BLE_MAX_CONNS && conn == NULL; i++)
+        if (!g_host_ble.conns[i].in_use)
+            conn = &g_host_ble.conns[i];
+    if (conn == NULL)
+        return BLE_HS_ENOMEM;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->in_use = true;
+    conn->handle = g_host_ble.next_conn_handle++;
+    conn->peer = peer;
+    conn->cb = adv->cb;
+    conn->cb_arg = adv->cb_arg;
+    conn->mtu = BLE_ATT_MTU_DFLT;
+    conn->itvl_us = peer->conn_itvl_us;
+    conn->start_us = host_now_us() + 1250;
+    host_world()->stats.conns++;
+
+    host_ble_adv_close();
+    host_ble_post(1250, host_ble_conn_established, conn);
+    return 0;
+}
+
+
+bool host_ble_peer_is_connected(const host_ble_peer_t* peer)
+{
+    return host_ble_peer_conn(peer) != NULL;
+}
+
+
+static const host_ble_attr_t* host_ble_attr_by_uuid(const ble_uuid_t* uuid, uint8_t* idx)
+{
+    for (uint8_t i = 0; i < g_host_ble.attr_cnt; i++)
+    {
+        const host_ble_attr_t* attr = &g_host_ble.attrs[i];
+        const ble_uuid_t* attr_uuid = attr->dsc != NULL ? attr->dsc->uuid : attr->chr->uuid;
+        if (ble_uuid_cmp(attr_uuid, uuid) == 0)
+        {
+            if (idx != NULL)
+                *idx = i;
+            return attr;
+        }
+    }
+    return NULL;
+}
+
+
+// checks the permissions of the attr like the ATT server does
+static int host_ble_check_access(const host_ble_conn_t* conn, const host_ble_attr_t* attr, bool is_write)
+{
+    if (attr->dsc != NULL)
+    {
+        uint8_t flags = attr->dsc->att_flags;
+        if (!(flags & (is_write ? BLE_ATT_F_WRITE : BLE_ATT_F_READ)))
+            return is_write ? BLE_ATT_ERR_WRITE_NOT_PERMITTED : BLE_ATT_ERR_READ_NOT_PERMITTED;
+        if ((flags & (is_write ? BLE_ATT_F_WRITE_ENC : BLE_ATT_F_READ_ENC)) && !conn->is_encrypted)
+            return BLE_ATT_ERR_INSUFFICIENT_ENC;
+        return 0;
+    }
+
+    ble_gatt_chr_flags flags = attr->chr->flags;
+    if (!(flags & (is_write ? BLE_GATT_CHR_F_WRITE : BLE_GATT_CHR_F_READ)))
+        return is_write ? BLE_ATT_ERR_WRITE_NOT_PERMITTED : BLE_ATT_ERR_READ_NOT_PERMITTED;
+    if ((flags & (is_write ? BLE_GATT_CHR_F_WRITE_ENC : BLE_GATT_CHR_F_READ_ENC)) && !conn->is_encrypted)
+        return BLE_ATT_ERR_INSUFFICIENT_ENC;
+    if ((flags & (is_write ? BLE_GATT_CHR_F_WRITE_AUTHEN : BLE_GATT_CHR_F_READ_AUTHEN)))
+        return BLE_ATT_ERR_INSUFFICIENT_AUTHEN;     // Just Works is not authenticated
+    return 0;
+}
+
+
+// read or write of the attr by the peer, the access callback of the device
+// runs with the mbuf of the request
+static int host_ble_access(host_ble_conn_t* conn, const host_ble_attr_t* attr, bool is_write,
+                           const uint8_t* data, uint16_t len, uint8_t* dest, uint16_t* dest_len)
+{
+    int rc = host_ble_check_access(conn, attr, is_write);
+    if (rc != 0)
+        return rc;
+
+    struct os_mbuf* om = host_mbuf_get();
+    if (om == NULL)
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    if (is_write)
+        os_mbuf_append(om, data, len);
+
+    struct ble_gatt_access_ctxt ctxt = {.om = om};
+    ble_gatt_access_fn* access_cb;
+    void* arg;
+    if (attr->dsc != NULL)
+    {
+        ctxt.op = is_write ? BLE_GATT_ACCESS_OP_WRITE_DSC : BLE_GATT_ACCESS_OP_READ_DSC;
+        ctxt.dsc = attr->dsc;
+        access_cb = attr->dsc->access_cb;
+        arg = attr->dsc->arg;
+    }
+    else
+    {
+        ctxt.op = is_write ? BLE_GATT_ACCESS_OP_WRITE_CHR : BLE_GATT_ACCESS_OP_READ_CHR;
+        ctxt.chr = attr->chr;
+        access_cb = attr->chr->access_cb;
+        arg = attr->chr->arg;
+    }
+
+    rc = access_cb(conn->handle, attr->handle, &ctxt, arg);
+    if (rc == 0 && !is_write)
+    {
+        // the response is cut to the MTU (long reads are not used)
+        uint16_t max_len = conn->mtu - 1;
+        *dest_len = om->om_len < max_len ? om->om_len : max_len;
+        memcpy(dest, om->om_data, *dest_len);
+    }
+    os_mbuf_free_chain(om);
+    return rc;
+}
+
+
+static void host_ble_peer_op_run(void* arg)
+{
+    host_ble_op_t* op = arg;
+    op->in_use = false;
+    host_ble_conn_t* conn = host_ble_conn_find(op->conn_handle);
+    host_ble_peer_t* peer = conn != NULL ? conn->peer : NULL;
+    if (conn == NULL || conn->is_terminating)
+    {
+        if (op->peer_cb != NULL && peer != NULL)
+            op->peer_cb(peer, BLE_HS_ENOTCONN, NULL, 0);
+        return;
+    }
+
+    uint8_t value[HOST_MSYS_BLOCK_SIZE];
+    uint16_t value_len = 0;
+    uint8_t idx = 0;
+    const host_ble_attr_t* attr = op->type == HOST_BLE_OP_PEER_ENCRYPT || op->type == HOST_BLE_OP_PEER_DISCONNECT ?
+                                  NULL : host_ble_attr_by_uuid(&op->uuid.u, &idx);
+    int rc = 0;
+
+    switch (op->type)
+    {
+        case HOST_BLE_OP_PEER_READ:
+            rc = attr == NULL ? BLE_ATT_ERR_ATTR_NOT_FOUND :
+                 host_ble_access(conn, attr, false, NULL, 0, value, &value_len);
+            break;
+        case HOST_BLE_OP_PEER_WRITE:
+            rc = attr == NULL ? BLE_ATT_ERR_ATTR_NOT_FOUND :
+                 host_ble_access(conn, attr, true, op->data, op->len, NULL, NULL);
+            break;
+        case HOST_BLE_OP_PEER_SUBSCRIBE:
+        {
+            if (attr == NULL || attr->cccd_handle == 0)
+            {
+                rc = BLE_ATT_ERR_ATTR_NOT_FOUND;
+                break;
+            }
+            if ((op->notify && !(attr->chr->flags & BLE_GATT_CHR_F_NOTIFY)) ||
+                (op->indicate && !(attr->chr->flags & BLE_GATT_CHR_F_INDICATE)))
+            {
+                rc = BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+                break;
+            }
+
+            struct ble_gap_event event = {.type = BLE_GAP_EVENT_SUBSCRIBE};
+            event.subscribe.conn_handle = conn->handle;
+            event.subscribe.attr_handle = attr->handle;
+            event.subscribe.reason = BLE_GAP_SUBSCRIBE_REASON_WRITE;
+            event.subscribe.prev_notify = conn->subs[idx] & 1;
+            event.subscribe.prev_indicate = (conn->subs[idx] >> 1) & 1;
+            event.subscribe.cur_notify = op->notify;
+            event.subscribe.cur_indicate = op->indicate;
+            conn->subs[idx] = op->notify | (op->indicate << 1);
+            host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+            break;
+        }
+        case HOST_BLE_OP_PEER_ENCRYPT:
+        {
+            conn->is_encrypted = true;
+            struct ble_gap_event event = {.type = BLE_GAP_EVENT_ENC_CHANGE};
+            event.enc_change.status = 0;
+            event.enc_change.conn_handle = conn->handle;
+            host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+            break;
+        }
+        case HOST_BLE_OP_PEER_DISCONNECT:
+            host_ble_conn_drop(conn, BLE_HS_ERR_HCI_BASE + BLE_ERR_REM_USER_CONN_TERM, BLE_ERR_CONN_TERM_LOCAL);
+            return;
+        default:
+            break;
+    }
+
+    if (op->peer_cb != NULL && host_ble_conn_find(op->conn_handle) != NULL)
+        op->peer_cb(peer, rc, value_len > 0 ? value : NULL, value_len);
+}
+
+
+static void host_ble_peer_op_post(host_ble_peer_t* peer, host_ble_op_type_t type, const ble_uuid_t* uuid,
+                                  host_ble_peer_cb_t* cb, int64_t events, host_ble_op_t** dest_op)
+{
+    host_ble_conn_t* conn = host_ble_peer_conn(peer);
+    host_ble_op_t* op = host_ble_op_new(type, conn != NULL ? conn->handle : BLE_HS_CONN_HANDLE_NONE);
+    if (uuid != NULL)
+        host_ble_copy_uuid(&op->uuid, uuid);
+    op->peer_cb = cb;
+    if (dest_op != NULL)
+        *dest_op = op;
+    host_ble_post(events * (conn != NULL ? conn->itvl_us : HOST_BLE_CONN_ITVL_US), host_ble_peer_op_run, op);
+}
+
+
+// reads the characteristic (or descriptor) of the device by uuid
+void host_ble_peer_read(host_ble_peer_t* peer, const ble_uuid_t* uuid, host_ble_peer_cb_t* cb)
+{
+    host_ble_peer_op_post(peer, HOST_BLE_OP_PEER_READ, uuid, cb, 2, NULL);
+}
+
+
+// writes the characteristic of the device by uuid (write request)
+void host_ble_peer_write(host_ble_peer_t* peer, const ble_uuid_t* uuid, const uint8_t* data, uint16_t len,
+                         host_ble_peer_cb_t* cb)
+{
+    host_ble_op_t* op = NULL;
+    host_ble_peer_op_post(peer, HOST_BLE_OP_PEER_WRITE, uuid, cb, 2, &op);
+    op->len = len < sizeof(op->data) ? len : sizeof(op->data);
+    memcpy(op->data, data, op->len);
+}
+
+
+// writes the client configuration of the characteristic by uuid
+void host_ble_peer_subscribe(host_ble_peer_t* peer, const ble_uuid_t* uuid, bool notify, bool indicate,
+                             host_ble_peer_cb_t* cb)
+{
+    host_ble_op_t* op = NULL;
+    host_ble_peer_op_post(peer, HOST_BLE_OP_PEER_SUBSCRIBE, uuid, cb, 2, &op);
+    op->notify = notify;
+    op->indicate = indicate;
+}
+
+
+// pairs with the device (Just Works, no bonding), the link is encrypted
+void host_ble_peer_encrypt(host_ble_peer_t* peer, host_ble_peer_cb_t* cb)
+{
+    host_ble_peer_op_post(peer, HOST_BLE_OP_PEER_ENCRYPT, NULL, cb, HOST_BLE_ENCRYPT_EVENTS, NULL);
+}
+
+
+void host_ble_peer_disconnect(host_ble_peer_t* peer)
+{
+    host_ble_peer_op_post(peer, HOST_BLE_OP_PEER_DISCONNECT, NULL, NULL, 1, NULL);
+}
+
+
+// ---------------------------------------------------------------- sleep
+
+// the radio is off in deep sleep, the peers lose the connection
+static void host_ble_on_sleep()
+{
+    host_ble_adv_close();
+    for (int i = 0; i < HOST_BLE_MAX_CONNS; i++)
+    {
+        host_ble_conn_t* conn = &g_host_ble.conns[i];
+        if (!conn->in_use)
+            continue;
+
+        conn->in_use = false;
+        host_world()->stats.conn_us += host_now_us() - conn->start_us;
+        if (conn->peer->on_disconnect != NULL)
+            conn->peer->on_disconnect(conn->peer, BLE_ERR_CONN_SPVN_TMO);
+    }
+}
+
+
+// ---------------------------------------------------------------- port
+
+static void host_ble_sync(void* arg)
+{
+    g_host_ble.is_synced = true;
+    if (ble_hs_cfg.sync_cb != NULL)
+        ble_hs_cfg.sync_cb();
+}
+
+
+esp_err_t nimble_port_init(void)
+{
+    if (g_host_ble.is_inited)
+        return ESP_FAIL;
+
+    memset(&g_host_ble, 0, sizeof(g_host_ble));
+    memset(g_host_msys, 0, sizeof(g_host_msys));
+    g_host_ble.is_inited = true;
+    g_host_ble.next_conn_handle = 1;
+    g_host_ble.next_handle = 1;
+    g_host_ble.preferred_mtu = BLE_ATT_MTU_DFLT;
+    ble_npl_eventq_init(&g_host_ble.dflt_evq);
+    if (!g_host_ble_hook_is_set)
+    {
+        host_at_sleep(host_ble_on_sleep);
+        g_host_ble_hook_is_set = true;
+    }
+
+    host_advance_us(HOST_BLE_INIT_US);  // controller init and enable
+    return ESP_OK;
+}
+
+
+struct ble_npl_eventq* nimble_port_get_dflt_eventq(void)
+{
+    return &g_host_ble.dflt_evq;
+}
+
+
+// runs the events of the default queue until the port is stopped
+void nimble_port_run(void)
+{
+    while (!g_host_ble.is_stopped)
+    {
+        struct ble_npl_event* ev = ble_npl_eventq_get(&g_host_ble.dflt_evq, BLE_NPL_TIME_FOREVER);
+        if (ev != NULL)
+            ble_npl_event_run(ev);
+    }
+}
+
+
+static void host_ble_stop(void* arg)
+{
+    g_host_ble.is_stopped = true;
+}
+
+
+int nimble_port_stop(void)
+{
+    host_ble_post(0, host_ble_stop, NULL);
+    return 0;
+}
+
+
+// the host task starts, the host is synced with the controller a bit later
+void nimble_port_freertos_init(void (*host_task_fn)(void*))
+{
+    host_task_create("nimble_host", host_task_fn, NULL, 21);
+    host_ble_post(HOST_BLE_SYNC_US, host_ble_sync, NULL);
+}
+
+
+void nimble_port_freertos_deinit(void)
+{
+    host_task_exit();
+}
+
+
+// ---------------------------------------------------------------- host api
+
+int ble_hs_id_infer_auto(int privacy, uint8_t* out_addr_type)
+{
+    if (!g_host_ble.is_synced)
+        return BLE_HS_ENOTSYNCED;
+    *out_addr_type = BLE_OWN_ADDR_PUBLIC;
+    return 0;
+}
+
+
+int ble_gap_wl_set(const ble_addr_t* addrs, uint8_t white_list_count)
+{
+    if (g_host_ble.adv.is_active)
+        return BLE_HS_EBUSY;    // the controller rejects it while advertising
+    if (white_list_count > HOST_BLE_WL_SIZE)
+        return BLE_HS_ENOMEM;
+
+    memcpy(g_host_ble.wl, addrs, white_list_count * sizeof(ble_addr_t));
+    g_host_ble.wl_cnt = white_list_count;
+    return 0;
+}
+
+
+int ble_gap_conn_find(uint16_t handle, struct ble_gap_conn_desc* out_desc)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(handle);
+    if (conn == NULL)
+        return BLE_HS_ENOTCONN;
+    if (out_desc != NULL)
+        host_ble_fill_desc(conn, out_desc);
+    return 0;
+}
+
+
+static void host_ble_terminate(void* arg)
+{
+    host_ble_op_t* op = arg;
+    op->in_use = false;
+    host_ble_conn_t* conn = host_ble_conn_find(op->conn_handle);
+    if (conn != NULL)
+        host_ble_conn_drop(conn, BLE_HS_ERR_HCI_BASE + BLE_ERR_CONN_TERM_LOCAL, op->value);
+}
+
+
+int ble_gap_terminate(uint16_t conn_handle, uint8_t hci_reason)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    if (conn == NULL)
+        return BLE_HS_ENOTCONN;
+    if (conn->is_terminating)
+        return BLE_HS_EALREADY;
+
+    conn->is_terminating = true;
+    host_ble_op_t* op = host_ble_op_new(HOST_BLE_OP_TERMINATE, conn_handle);
+    op->value = hci_reason;
+    host_ble_post(conn->itvl_us, host_ble_terminate, op);
+    return 0;
+}
+
+
+static void host_ble_update_params(void* arg)
+{
+    host_ble_op_t* op = arg;
+    op->in_use = false;
+    host_ble_conn_t* conn = host_ble_conn_find(op->conn_handle);
+    if (conn == NULL)
+        return;
+
+    // the new interval counts from the instant
+    conn->itvl_us = op->value;
+    conn->start_us = host_now_us();
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_CONN_UPDATE};
+    event.conn_update.status = 0;
+    event.conn_update.conn_handle = conn->handle;
+    host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+}
+
+
+int ble_gap_update_params(uint16_t conn_handle, const struct ble_gap_upd_params* params)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    if (conn == NULL)
+        return BLE_HS_ENOTCONN;
+    if (params->itvl_min < 6 || params->itvl_max < params->itvl_min)
+        return BLE_HS_EINVAL;
+
+    host_ble_op_t* op = host_ble_op_new(HOST_BLE_OP_UPDATE_PARAMS, conn_handle);
+    op->value = params->itvl_max * 1250;
+    host_ble_post(6 * conn->itvl_us, host_ble_update_params, op);
+    return 0;
+}
+
+
+int ble_gap_set_data_len(uint16_t conn_handle, uint16_t tx_octets, uint16_t tx_time)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    if (conn == NULL)
+        return BLE_HS_ENOTCONN;
+    conn->has_dle = tx_octets > 27;
+    return 0;
+}
+
+
+#if !CONFIG_BT_NIMBLE_EXT_ADV
+
+int ble_gap_adv_set_data(const uint8_t* data, int data_len)
+{
+    if (data_len > HOST_BLE_LEGACY_DATA_MAX)
+        return BLE_HS_EMSGSIZE;
+    memcpy(g_host_ble.adv.data, data, data_len);
+    g_host_ble.adv.data_len = data_len;
+    return 0;
+}
+
+
+int ble_gap_adv_rsp_set_data(const uint8_t* data, int data_len)
+{
+    if (data_len > HOST_BLE_LEGACY_DATA_MAX)
+        return BLE_HS_EMSGSIZE;
+    memcpy(g_host_ble.adv.rsp, data, data_len);
+    g_host_ble.adv.rsp_len = data_len;
+    return 0;
+}
+
+
+int ble_gap_adv_start(uint8_t own_addr_type, const ble_addr_t* direct_addr, int32_t duration_ms,
+                      const struct ble_gap_adv_params* adv_params, ble_gap_event_fn* cb, void* cb_arg)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (adv->is_active)
+        return BLE_HS_EALREADY;
+
+    // ADV_IND is connectable and scannable, ADV_SCAN_IND is discoverable
+    adv->is_legacy_pdu = true;
+    adv->is_connectable = adv_params->conn_mode != BLE_GAP_CONN_MODE_NON;
+    adv->is_scannable = adv->is_connectable || adv_params->disc_mode != BLE_GAP_DISC_MODE_NON;
+    adv->scan_req_notif = false;
+    adv->filter_policy = adv_params->filter_policy;
+    adv->itvl_us = (adv_params->itvl_max ? adv_params->itvl_max : 0x800) * 625;
+    return host_ble_adv_start(duration_ms, cb, cb_arg);
+}
+
+
+int ble_gap_adv_stop(void)
+{
+    return host_ble_adv_stop();
+}
+
+
+int ble_gap_adv_active(void)
+{
+    return g_host_ble.adv.is_active;
+}
+
+#else
+
+int ble_gap_ext_adv_configure(uint8_t instance, const struct ble_gap_ext_adv_params* params,
+                              int8_t* selected_tx_power, ble_gap_event_fn* cb, void* cb_arg)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (instance != 0)
+        return BLE_HS_EINVAL;
+    if (adv->is_active)
+        return BLE_HS_EBUSY;
+
+    // legacy connectable pdu is scannable, extended one can't be both
+    if (params->legacy_pdu ? (params->connectable && !params->scannable)
+                           : (params->connectable && params->scannable))
+        return BLE_HS_EINVAL;
+
+    adv->is_configured = true;
+    adv->is_legacy_pdu = params->legacy_pdu;
+    adv->is_connectable = params->connectable;
+    adv->is_scannable = params->scannable;
+    adv->scan_req_notif = params->scan_req_notif;
+    adv->filter_policy = params->filter_policy;
+    adv->itvl_us = (params->itvl_max ? params->itvl_max : 0x800) * 625;
+    adv->cb = cb;
+    adv->cb_arg = cb_arg;
+    adv->data_len = 0;
+    adv->rsp_len = 0;
+    if (selected_tx_power != NULL)
+        *selected_tx_power = 9;
+    return 0;
+}
+
+
+int ble_gap_ext_adv_set_data(uint8_t instance, struct os_mbuf* data)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    uint16_t len = data->om_len;
+    int rc = 0;
+    if (instance != 0 || !adv->is_configured)
+        rc = BLE_HS_EINVAL;
+    else if (adv->is_legacy_pdu ? len > HOST_BLE_LEGACY_DATA_MAX : (adv->is_scannable && len > 0))
+        rc = BLE_HS_EINVAL;
+    else
+    {
+        memcpy(adv->data, data->om_data, len);
+        adv->data_len = len;
+    }
+    os_mbuf_free_chain(data);
+    return rc;
+}
+
+
+int ble_gap_ext_adv_rsp_set_data(uint8_t instance, struct os_mbuf* data)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    uint16_t len = data->om_len;
+    int rc = 0;
+    if (instance != 0 || !adv->is_configured || !adv->is_scannable || len > HOST_BLE_LEGACY_DATA_MAX)
+        rc = BLE_HS_EINVAL;
+    else
+    {
+        memcpy(adv->rsp, data->om_data, len);
+        adv->rsp_len = len;
+    }
+    os_mbuf_free_chain(data);
+    return rc;
+}
+
+
+int ble_gap_ext_adv_start(uint8_t instance, int duration, int max_events)
+{
+    host_ble_adv_t* adv = &g_host_ble.adv;
+    if (instance != 0 || !adv->is_configured)
+        return BLE_HS_EINVAL;
+    return host_ble_adv_start(duration == 0 ? BLE_HS_FOREVER : duration * 10, adv->cb, adv->cb_arg);
+}
+
+
+int ble_gap_ext_adv_stop(uint8_t instance)
+{
+    if (instance != 0)
+        return BLE_HS_EINVAL;
+    return host_ble_adv_stop();
+}
+
+
+bool ble_gap_ext_adv_active(uint8_t instance)
+{
+    return instance == 0 && g_host_ble.adv.is_active;
+}
+
+#endif
+
+
+// ---------------------------------------------------------------- GATT server
+
+int ble_gatts_count_cfg(const struct ble_gatt_svc_def* defs)
+{
+    return 0;
+}
+
+
+// adds the services, handles are given in the order of the definitions
+int ble_gatts_add_svcs(const struct ble_gatt_svc_def* svcs)
+{
+    if (g_host_ble.is_synced)
+        return BLE_HS_EBUSY;    // the host has started
+
+    for (const struct ble_gatt_svc_def* svc = svcs; svc->type != BLE_GATT_SVC_TYPE_END; svc++)
+    {
+        g_host_ble.next_handle++;   // service declaration
+        for (const struct ble_gatt_chr_def* chr = svc->characteristics; chr != NULL && chr->uuid != NULL; chr++)
+        {
+            if (g_host_ble.attr_cnt == HOST_BLE_MAX_ATTRS)
+                return BLE_HS_ENOMEM;
+
+            host_ble_attr_t* attr = &g_host_ble.attrs[g_host_ble.attr_cnt++];
+            g_host_ble.next_handle++;   // characteristic declaration
+            attr->chr = chr;
+            attr->dsc = NULL;
+            attr->handle = g_host_ble.next_handle++;
+            if (chr->val_handle != NULL)
+                *chr->val_handle = attr->handle;
+            if (chr->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE))
+                attr->cccd_handle = g_host_ble.next_handle++;
+
+            for (const struct ble_gatt_dsc_def* dsc = chr->descriptors; dsc != NULL && dsc->uuid != NULL; dsc++)
+            {
+                if (g_host_ble.attr_cnt == HOST_BLE_MAX_ATTRS)
+                    return BLE_HS_ENOMEM;
+
+                host_ble_attr_t* dsc_attr = &g_host_ble.attrs[g_host_ble.attr_cnt++];
+                dsc_attr->chr = chr;
+                dsc_attr->dsc = dsc;
+                dsc_attr->handle = g_host_ble.next_handle++;
+            }
+        }
+    }
+    return 0;
+}
+
+
+static int host_ble_notify(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf* om, bool is_indication)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    int rc = 0;
+    if (om == NULL)
+        rc = BLE_HS_EINVAL;
+    else if (conn == NULL)
+        rc = BLE_HS_ENOTCONN;
+    else if (is_indication && conn->ind_in_flight)
+        rc = BLE_HS_EALREADY;
+    else if (conn->txq_len == HOST_BLE_TXQ_SIZE || om->om_len > conn->mtu - 3)
+        rc = BLE_HS_ENOMEM;
+
+    if (rc != 0)
+    {
+        os_mbuf_free_chain(om);
+        return rc;
+    }
+
+    conn->txq[conn->txq_len++] = (host_ble_tx_t){.om = om, .attr_handle = chr_val_handle,
+                                                 .is_indication = is_indication};
+    conn->ind_in_flight |= is_indication;
+    host_ble_conn_schedule(conn);
+
+    // NimBLE reports the transmission from the call itself
+    struct ble_gap_event event = {.type = BLE_GAP_EVENT_NOTIFY_TX};
+    event.notify_tx.status = 0;
+    event.notify_tx.conn_handle = conn_handle;
+    event.notify_tx.attr_handle = chr_val_handle;
+    event.notify_tx.indication = is_indication;
+    host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+    return 0;
+}
+
+
+int ble_gatts_notify_custom(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf* om)
+{
+    return host_ble_notify(conn_handle, chr_val_handle, om, false);
+}
+
+
+int ble_gatts_indicate_custom(uint16_t conn_handle, uint16_t chr_val_handle, struct os_mbuf* om)
+{
+    return host_ble_notify(conn_handle, chr_val_handle, om, true);
+}
+
+
+int ble_att_set_preferred_mtu(uint16_t mtu)
+{
+    if (mtu < BLE_ATT_MTU_DFLT || mtu > BLE_ATT_MTU_MAX)
+        return BLE_HS_EINVAL;
+    g_host_ble.preferred_mtu = mtu;
+    return 0;
+}
+
+
+uint16_t ble_att_mtu(uint16_t conn_handle)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    return conn != NULL ? conn->mtu : 0;
+}
+
+
+// ---------------------------------------------------------------- GATT client
+
+static void host_ble_exchange_mtu(void* arg)
+{
+    host_ble_op_t* op = arg;
+    op->in_use = false;
+    host_ble_conn_t* conn = host_ble_conn_find(op->conn_handle);
+    struct ble_gatt_error error = {.status = conn != NULL ? 0 : BLE_HS_ENOTCONN};
+    if (conn != NULL)
+    {
+        conn->mtu = g_host_ble.preferred_mtu < conn->peer->mtu ? g_host_ble.preferred_mtu : conn->peer->mtu;
+        struct ble_gap_event event = {.type = BLE_GAP_EVENT_MTU};
+        event.mtu.conn_handle = conn->handle;
+        event.mtu.channel_id = 4;
+        event.mtu.value = conn->mtu;
+        host_ble_gap_call(conn->cb, conn->cb_arg, &event);
+    }
+    if (op->mtu_cb != NULL)
+        op->mtu_cb(op->conn_handle, &error, conn != NULL ? conn->mtu : 0, op->cb_arg);
+}
+
+
+int ble_gattc_exchange_mtu(uint16_t conn_handle, ble_gatt_mtu_fn* cb, void* cb_arg)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    if (conn == NULL)
+        return BLE_HS_ENOTCONN;
+
+    host_ble_op_t* op = host_ble_op_new(HOST_BLE_OP_EXCHANGE_MTU, conn_handle);
+    op->mtu_cb = cb;
+    op->cb_arg = cb_arg;
+    host_ble_post(2 * conn->itvl_us, host_ble_exchange_mtu, op);
+    return 0;
+}
+
+
+// the peer answers the read, the callback gets every attr and then EDONE
+static void host_ble_read_by_uuid(void* arg)
+{
+    host_ble_op_t* op = arg;
+    op->in_use = false;
+    host_ble_conn_t* conn = host_ble_conn_find(op->conn_handle);
+    if (conn == NULL)
+    {
+        struct ble_gatt_error error = {.status = BLE_HS_ENOTCONN};
+        op->attr_cb(op->conn_handle, &error, NULL, op->cb_arg);
+        return;
+    }
+
+    uint8_t value[HOST_MSYS_BLOCK_SIZE];
+    uint16_t len = 0;
+    host_ble_peer_t* peer = conn->peer;
+    int rc = peer->on_read != NULL && op->uuid.u.type == BLE_UUID_TYPE_16 ?
+             peer->on_read(peer, op->uuid.u16.value, value, &len) : BLE_ATT_ERR_ATTR_NOT_FOUND;
+    if (rc != 0)
+    {
+        struct ble_gatt_error error = {.status = BLE_HS_ERR_ATT_BASE + rc};
+        op->attr_cb(op->conn_handle, &error, NULL, op->cb_arg);
+        return;
+    }
+
+    struct os_mbuf* om = ble_hs_mbuf_from_flat(value, len);
+    if (om == NULL)
+    {
+        struct ble_gatt_error error = {.status = BLE_HS_ENOMEM};
+        op->attr_cb(op->conn_handle, &error, NULL, op->cb_arg);
+        return;
+    }
+
+    struct ble_gatt_error error = {.status = 0};
+    struct ble_gatt_attr attr = {.handle = 0x20, .offset = 0, .om = om};
+    op->attr_cb(op->conn_handle, &error, &attr, op->cb_arg);
+    os_mbuf_free_chain(om);
+
+    struct ble_gatt_error done = {.status = BLE_HS_EDONE};
+    op->attr_cb(op->conn_handle, &done, NULL, op->cb_arg);
+}
+
+
+int ble_gattc_read_by_uuid(uint16_t conn_handle, uint16_t start_handle, uint16_t end_handle, const ble_uuid_t* uuid,
+                           ble_gatt_attr_fn* cb, void* cb_arg)
+{
+    host_ble_conn_t* conn = host_ble_conn_find(conn_handle);
+    if (conn == NULL)
+        return BLE_HS_ENOTCONN;
+    if (cb == NULL)
+        return BLE_HS_EINVAL;
+
+    host_ble_op_t* op = host_ble_op_new(HOST_BLE_OP_READ_BY_UUID, conn_handle);
+    host_ble_copy_uuid(&op->uuid, uuid);
+    op->attr_cb = cb;
+    op->cb_arg = cb_arg;
+    host_ble_post(2 * conn->itvl_us, host_ble_read_by_uuid, op);
+    return 0;
+}
+
+
+#endif /* HOST_HAL_HOST_BLE_H_ */
@@ -0,0 +1,343 @@
+/*
+ * host_periph.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_HOST_PERIPH_H_
+#define HOST_HAL_HOST_PERIPH_H_
+
+
+#include "host_sim.h"
+
+// Peripherals of the board: the gpio registers and the MAX30205 on I2C.
+//
+// The gpio registers are enough for the wake stub, it bit-bangs I2C with
+// open-drain lines (see wake_stub.h): enabling the output pulls the line
+// down, releasing it lets the pull-up (or the sensor) set the level. The
+// sensor follows the lines bit by bit like an I2C slave, so the stub
+// talks to the same registers as the I2C driver does.
+//
+// The sensor converts in 44 ms (50 ms max), the temperature of the body
+// comes from the world (see host_set_temperature). Reading the register
+// before the conversion is over returns the old value and is counted.
+
+#define HOST_GPIO_BASE              0x60004000
+#define HOST_GPIO_OUT_REG           (HOST_GPIO_BASE + 0x0004)
+#define HOST_GPIO_OUT_W1TS_REG      (HOST_GPIO_BASE + 0x0008)
+#define HOST_GPIO_OUT_W1TC_REG      (HOST_GPIO_BASE + 0x000C)
+#define HOST_GPIO_ENABLE_REG        (HOST_GPIO_BASE + 0x0020)
+#define HOST_GPIO_ENABLE_W1TS_REG   (HOST_GPIO_BASE + 0x0024)
+#define HOST_GPIO_ENABLE_W1TC_REG   (HOST_GPIO_BASE + 0x0028)
+#define HOST_GPIO_IN_REG            (HOST_GPIO_BASE + 0x003C)
+
+#define HOST_MAX30205_ADDR          0x48
+#define HOST_MAX30205_TEMP_REG      0x00
+#define HOST_MAX30205_CNFG_REG      0x01
+#define HOST_MAX30205_SHUTDOWN      0x01
+#define HOST_MAX30205_ONE_SHOT      0x80
+#define HOST_MAX30205_CONV_US       44000
+
+typedef enum {
+    HOST_I2C_IDLE,      // waits for the start condition
+    HOST_I2C_RX,        // receives a byte from the master
+    HOST_I2C_ACK,       // acknowledges the received byte
+    HOST_I2C_TX,        // sends a byte to the master
+    HOST_I2C_MACK,      // waits for the master's acknowledgement
+} host_i2c_state_t;
+
+// lines of the wake process (the gpio matrix is reset in deep sleep)
+uint32_t g_host_gpio_out = 0;
+uint32_t g_host_gpio_enable = 0;
+bool g_host_sda_is_held = false;    // the sensor pulls SDA down
+bool g_host_scl_prev = true;
+bool g_host_sda_prev = true;
+
+host_i2c_state_t g_host_i2c_state = HOST_I2C_IDLE;
+uint8_t g_host_i2c_bits = 0;
+uint8_t g_host_i2c_byte = 0;
+bool g_host_i2c_is_addr = false;
+bool g_host_i2c_is_read = false;
+uint8_t g_host_max30205_idx = 0;    // byte of the transfer
+
+
+// sets the temperature of the body (constant)
+void host_set_temperature(double temp_c)
+{
+    host_world()->temp_q8_8 = (int16_t)(temp_c * 256);
+    host_world()->temp_fn = NULL;
+}
+
+
+// sets the temperature of the body as a function of the world time
+void host_set_temperature_fn(int16_t (*temp_fn)(int64_t time_us))
+{
+    host_world()->temp_fn = temp_fn;
+}
+
+
+int16_t host_body_temp_q8_8(int64_t time_us)
+{
+    host_world_t* world = host_world();
+    return world->temp_fn != NULL ? world->temp_fn(time_us) : world->temp_q8_8;
+}
+
+
+// ---------------------------------------------------------------- MAX30205
+
+static void host_max30205_update()
+{
+    host_max30205_t* sensor = &host_world()->max30205;
+    int64_t now = host_now_us();
+
+    if (sensor->conv_done_us != 0 && now >= sensor->conv_done_us)
+    {
+        sensor->temp = (uint16_t)host_body_temp_q8_8(sensor->conv_done_us);
+        sensor->conv_done_us = 0;
+    }
+    else if (!(sensor->config & HOST_MAX30205_SHUTDOWN))
+    {
+        // continuous conversion, the register has the last finished one
+        sensor->temp = (uint16_t)host_body_temp_q8_8(now - now % HOST_MAX30205_CONV_US);
+    }
+}
+
+
+bool host_max30205_select(bool is_read)
+{
+    g_host_max30205_idx = 0;
+    return !host_world()->max30205.is_absent;
+}
+
+
+void host_max30205_write(uint8_t byte)
+{
+    host_world_t* world = host_world();
+    host_max30205_t* sensor = &world->max30205;
+
+    if (g_host_max30205_idx++ == 0)
+    {
+        sensor->pointer = byte;
+        return;
+    }
+    if (sensor->pointer != HOST_MAX30205_CNFG_REG || g_host_max30205_idx != 2)
+        return;
+
+    host_max30205_update();
+    sensor->config = byte & ~HOST_MAX30205_ONE_SHOT;    // one-shot bit clears itself
+    if ((byte & HOST_MAX30205_ONE_SHOT) && (byte & HOST_MAX30205_SHUTDOWN) && sensor->conv_done_us == 0)
+    {
+        sensor->conv_done_us = host_now_us() + HOST_MAX30205_CONV_US;
+        world->stats.sensor_conversions++;
+    }
+}
+
+
+uint8_t host_max30205_read()
+{
+    host_world_t* world = host_world();
+    host_max30205_t* sensor = &world->max30205;
+    uint8_t idx = g_host_max30205_idx++;
+
+    if (sensor->pointer == HOST_MAX30205_CNFG_REG)
+        return sensor->config;
+    if (sensor->pointer != HOST_MAX30205_TEMP_REG)
+        return 0;
+
+    if (idx == 0)
+    {
+        host_max30205_update();
+        if (sensor->conv_done_us != 0)
+            world->stats.sensor_early_reads++;
+    }
+    return idx % 2 == 0 ? sensor->temp >> 8 : sensor->temp & 0xFF;
+}
+
+
+// ---------------------------------------------------------------- I2C slave
+
+static void host_i2c_on_byte()
+{
+    if (g_host_i2c_is_addr)
+    {
+        g_host_i2c_is_addr = false;
+        g_host_i2c_is_read = g_host_i2c_byte & 1;
+        if ((g_host_i2c_byte >> 1) != HOST_MAX30205_ADDR || !host_max30205_select(g_host_i2c_is_read))
+        {
+            g_host_i2c_state = HOST_I2C_IDLE;   // not addressed, wait for the next start
+            return;
+        }
+        host_world()->stats.i2c_transactions++;
+    }
+    else
+    {
+        host_max30205_write(g_host_i2c_byte);
+    }
+
+    g_host_i2c_state = HOST_I2C_ACK;
+    g_host_sda_is_held = true;
+}
+
+
+static void host_i2c_send_bit()
+{
+    g_host_sda_is_held = !((g_host_i2c_byte >> (7 - g_host_i2c_bits)) & 1);
+}
+
+
+// the sensor follows the bus after every change of the master lines
+static void host_i2c_update(bool scl, bool sda_master)
+{
+    bool sda = sda_master && !g_host_sda_is_held;
+
+    if (scl && g_host_scl_prev && sda != g_host_sda_prev)
+    {
+        // data changes while the clock is high only at start and stop
+        g_host_sda_is_held = false;
+        if (!sda)
+        {
+            g_host_i2c_state = HOST_I2C_RX;
+            g_host_i2c_is_addr = true;
+            g_host_i2c_bits = 0;
+            g_host_i2c_byte = 0;
+        }
+        else
+        {
+            g_host_i2c_state = HOST_I2C_IDLE;
+        }
+    }
+    else if (scl && !g_host_scl_prev)
+    {
+        // rising clock: the receiver samples the data
+        if (g_host_i2c_state == HOST_I2C_RX)
+        {
+            g_host_i2c_byte = (g_host_i2c_byte << 1) | sda;
+            g_host_i2c_bits++;
+        }
+        else if (g_host_i2c_state == HOST_I2C_MACK)
+        {
+            g_host_i2c_is_read = !sda;  // the master acks to get the next byte
+        }
+    }
+    else if (!scl && g_host_scl_prev)
+    {
+        // falling clock: the transmitter sets the next bit
+        switch (g_host_i2c_state)
+        {
+            case HOST_I2C_RX:
+                if (g_host_i2c_bits == 8)
+                    host_i2c_on_byte();
+                break;
+            case HOST_I2C_ACK:
+                g_host_sda_is_held = false;
+                g_host_i2c_bits = 0;
+                if (g_host_i2c_is_read)
+                {
+                    g_host_i2c_state = HOST_I2C_TX;
+                    g_host_i2c_byte = host_max30205_read();
+                    host_i2c_send_bit();
+                }
+                else
+                {
+                    g_host_i2c_state = HOST_I2C_RX;
+                    g_host_i2c_byte = 0;
+                }
+                break;
+            case HOST_I2C_TX:
+                if (++g_host_i2c_bits < 8)
+                {
+                    host_i2c_send_bit();
+                }
+                else
+                {
+                    g_host_sda_is_held = false;
+                    g_host_i2c_state = HOST_I2C_MACK;
+                }
+                break;
+            case HOST_I2C_MACK:
+                if (g_host_i2c_is_read)
+                {
+                    g_host_i2c_state = HOST_I2C_TX;
+                    g_host_i2c_bits = 0;
+                    g_host_i2c_byte = host_max30205_read();
+                    host_i2c_send_bit();
+                }
+                else
+                {
+                    g_host_i2c_state = HOST_I2C_IDLE;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    g_host_scl_prev = scl;
+    g_host_sda_prev = sda_master && !g_host_sda_is_held;
+}
+
+
+// ---------------------------------------------------------------- gpio registers
+
+// level of the pin: driven output, the sensor on SDA, the button or the pull-up
+bool host_gpio_level(uint8_t pin)
+{
+    host_world_t* world = host_world();
+    if ((g_host_gpio_enable >> pin) & 1)
+        return (g_host_gpio_out >> pin) & 1;
+    if (pin == world->i2c_sda_pin)
+        return !g_host_sda_is_held;
+    if (pin == world->i2c_scl_pin)
+        return true;
+    if (pin == world->button_pin)
+        return host_button_level(host_now_us());
+    return false;
+}
+
+
+static void host_gpio_lines_changed()
+{
+    host_world_t* world = host_world();
+    bool scl = !((g_host_gpio_enable >> world->i2c_scl_pin) & 1) || ((g_host_gpio_out >> world->i2c_scl_pin) & 1);
+    bool sda = !((g_host_gpio_enable >> world->i2c_sda_pin) & 1) || ((g_host_gpio_out >> world->i2c_sda_pin) & 1);
+    host_i2c_update(scl, sda);
+}
+
+
+void host_reg_write(uint32_t addr, uint32_t value)
+{
+    switch (addr)
+    {
+        case HOST_GPIO_OUT_REG:         g_host_gpio_out = value; break;
+        case HOST_GPIO_OUT_W1TS_REG:    g_host_gpio_out |= value; break;
+        case HOST_GPIO_OUT_W1TC_REG:    g_host_gpio_out &= ~value; break;
+        case HOST_GPIO_ENABLE_REG:      g_host_gpio_enable = value; break;
+        case HOST_GPIO_ENABLE_W1TS_REG: g_host_gpio_enable |= value; break;
+        case HOST_GPIO_ENABLE_W1TC_REG: g_host_gpio_enable &= ~value; break;
+        default: return;    // the gpio matrix and io mux are not modeled
+    }
+    host_gpio_lines_changed();
+}
+
+
+uint32_t host_reg_read(uint32_t addr)
+{
+    switch (addr)
+    {
+        case HOST_GPIO_OUT_REG:     return g_host_gpio_out;
+        case HOST_GPIO_ENABLE_REG:  return g_host_gpio_enable;
+        case HOST_GPIO_IN_REG:
+        {
+            uint32_t value = 0;
+            for (uint8_t pin = 0; pin < 22; pin++)
+                value |= (uint32_t)host_gpio_level(pin) << pin;
+            return value;
+        }
+        default:
+            return 0;
+    }
+}
+
+
+#endif /* HOST_HAL_HOST_PERIPH_H_ */
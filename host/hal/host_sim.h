@@ -0,0 +1,891 @@
+/*
+ * host_sim.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_HOST_SIM_H_
+#define HOST_HAL_HOST_SIM_H_
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// The host target runs the firmware on Linux: main.c is compiled as is
+// against the stand-ins of ESP-IDF, FreeRTOS and NimBLE headers in this
+// directory, and the scenarios (see scenarios.c) script the world around
+// the device - the button, the temperature, the gateways in range.
+//
+// Time is simulated, nothing waits for real time. The device runs until
+// it goes to deep sleep, then the world jumps to the next wakeup. Every
+// wake runs in a forked process that starts from the saved RTC memory
+// image, so the RTC_DATA_ATTR variables are the only ones that survive
+// the deep sleep, like on the chip. Everything the device can't lose
+// (NVS, the flash partition, the sensor) and everything the scenarios
+// check lives in the world, which is shared with the forked processes.
+//
+// Tasks are cooperative (ucontext), a task runs until it blocks. Timers
+// and other timed items run in order of their time, the clock jumps to
+// the next item when no task is ready. A wake that has no ready task and
+// nothing scheduled hangs, it is reported instead of the sleep.
+//
+// The durations below only order the events, they are rough figures of
+// ESP32-C3 and are not meant as a power model.
+
+#define HOST_ARENA_SIZE         (4 * 1024 * 1024)   // shared memory of the world and the models
+#define HOST_RTC_MEM_SIZE       (8 * 1024)          // RTC memory of ESP32-C3
+#define HOST_NVS_MAX_NAMESPACES 8
+#define HOST_NVS_MAX_ENTRIES    32
+#define HOST_NVS_MAX_VALUE_LEN  508
+#define HOST_FLASH_SIZE         (64 * 1024)         // "samples" partition (see partitions.csv)
+#define HOST_MAX_BUTTON_EDGES   64
+#define HOST_MAX_TASKS          8
+#define HOST_TASK_STACK_SIZE    (256 * 1024)
+#define HOST_MAX_DEFERRED       256
+#define HOST_MAX_SLEEP_HOOKS    8
+
+#define HOST_STUB_START_US      400                 // from the wakeup until the wake stub runs (default)
+#define HOST_BOOT_US            30000               // bootloader and startup until app_main
+#define HOST_MAX_AWAKE_US       (600LL * 1000000)   // longer wake is reported as a timeout
+#define HOST_TICK_US            10000               // FreeRTOS tick (CONFIG_FREERTOS_HZ = 100)
+
+#define HOST_CONTAINER_OF(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+
+typedef enum {
+    HOST_END_NONE = 0,      // the device is not powered yet
+    HOST_END_DEEP_SLEEP,    // esp_deep_sleep_start
+    HOST_END_STUB_SLEEP,    // esp_wake_stub_sleep
+    HOST_END_HANG,          // no task is ready and nothing is scheduled
+    HOST_END_TIMEOUT,       // awake for longer than HOST_MAX_AWAKE_US
+    HOST_END_CRASH,         // the wake process failed
+    HOST_END_POWER_LOSS,    // the power was cut (see esp_partition.h)
+} host_end_t;
+
+// how the last wake ended, the next wakeup is chosen from it
+typedef struct {
+    host_end_t end;
+    int64_t time_us;            // world time of the sleep
+    bool timer_armed;           // timer wakeup is enabled
+    uint64_t timer_us;          // sleep time of the timer wakeup (RTC time)
+    uint64_t gpio_mask;         // pins of the gpio wakeup (high level)
+    uint32_t pm_locks_held;     // power management locks that are not released
+    bool rc_fast_is_on;         // RC_FAST is kept powered in the sleep
+    char reason[160];           // what went wrong (hang, timeout, crash)
+} host_sleep_t;
+
+typedef struct {
+    uint32_t power_ons;
+    uint32_t stub_wakes;        // timer wakes handled by the wake stub alone
+    uint32_t boots;             // wakes that ran app_main
+    uint32_t timer_wakes;
+    uint32_t gpio_wakes;
+    int64_t stub_us;            // time in the wake stub
+    int64_t awake_us;           // time awake after the boot
+    int64_t adv_us;             // time advertising
+    int64_t conn_us;            // time connected
+    uint32_t adv_starts;
+    uint32_t conns;
+    uint32_t i2c_transactions;
+    uint32_t sensor_conversions;
+    uint32_t sensor_early_reads; // reads of the temperature before the conversion is done
+    uint32_t nvs_commits;
+    uint32_t flash_writes;
+    uint32_t flash_erases;
+} host_stats_t;
+
+typedef struct {
+    int64_t time_us;
+    bool level;
+} host_edge_t;
+
+typedef struct {
+    bool in_use;
+    uint8_t ns;
+    uint8_t type;
+    char key[16];
+    uint16_t len;
+    uint8_t value[HOST_NVS_MAX_VALUE_LEN];
+} host_nvs_entry_t;
+
+// MAX30205 registers, the sensor is powered while the device sleeps
+typedef struct {
+    bool is_absent;             // the sensor doesn't acknowledge its address
+    uint8_t pointer;            // register pointer
+    uint8_t config;             // configuration register
+    uint16_t temp;              // temperature register
+    int64_t conv_done_us;       // one-shot conversion is done at (0 - no conversion)
+} host_max30205_t;
+
+typedef struct {
+    int64_t now_us;             // world time
+    int64_t boot_us;            // world time when esp_timer started counting
+    int64_t wake_us;            // world time of the last wakeup
+    int64_t power_on_us;        // world time when RTC started counting
+    int32_t rtc_drift_ppm;      // RTC clock error (positive - RTC is fast)
+    int64_t stub_start_us;      // from the wakeup until the wake stub runs
+    uint64_t random_state;
+    int log_level;              // 0 - quiet, 1 - warnings, 2 - info
+
+    int wake_cause;             // esp_sleep_wakeup_cause_t of the current wake
+    host_sleep_t sleep;
+    host_stats_t stats;
+
+    bool rtc_is_valid;          // the RTC memory image is kept (no power loss)
+    uint32_t rtc_len;
+    uint8_t rtc_image[HOST_RTC_MEM_SIZE];
+
+    uint8_t button_pin;
+    uint8_t i2c_sda_pin;
+    uint8_t i2c_scl_pin;
+    uint8_t button_edge_cnt;
+    host_edge_t button_edges[HOST_MAX_BUTTON_EDGES];
+
+    char nvs_namespaces[HOST_NVS_MAX_NAMESPACES][16];
+    host_nvs_entry_t nvs[HOST_NVS_MAX_ENTRIES];
+
+    uint8_t flash[HOST_FLASH_SIZE];
+    int32_t flash_power_cut_in;     // the power is cut on this write or erase (0 - never)
+    bool flash_power_is_cut;
+
+    host_max30205_t max30205;
+    int16_t temp_q8_8;              // temperature of the body (1/256 C)
+    int16_t (*temp_fn)(int64_t time_us);
+
+    uint32_t led_duty;
+    uint32_t led_changes;
+
+    size_t arena_used;
+} host_world_t;
+
+typedef struct host_item {
+    int64_t due_us;
+    uint64_t seq;
+    bool is_armed;
+    void (*fn)(struct host_item* item);
+    struct host_item* next;
+} host_item_t;
+
+typedef struct host_task {
+    const char* name;
+    void (*fn)(void*);
+    void* arg;
+    int prio;
+    bool is_ready;
+    bool is_done;
+    bool is_timed_out;
+    const void* wait_obj;       // object the blocked task waits for
+    host_item_t timeout_item;
+    uint32_t notify_value;      // FreeRTOS task notification
+    ucontext_t ctx;
+    void* stack;
+} host_task_t;
+
+typedef struct {
+    host_item_t item;
+    void (*fn)(void* arg);
+    void* arg;
+    bool in_use;
+} host_deferred_t;
+
+
+// the firmware entry points, the unit tests are linked without them
+void app_main(void) __attribute__((weak));
+void esp_wake_deep_sleep(void) __attribute__((weak));
+void host_esp_timer_start() __attribute__((weak));     // see esp_timer.h
+
+extern uint8_t __start_rtc_data[] __attribute__((weak));
+extern uint8_t __stop_rtc_data[] __attribute__((weak));
+
+host_world_t* g_host_world = NULL;
+bool g_host_is_device = false;      // true in the wake process
+
+// scheduler of the wake process
+host_task_t g_host_tasks[HOST_MAX_TASKS];
+uint8_t g_host_task_cnt = 0;
+uint8_t g_host_last_task = 0;
+host_task_t* g_host_current = NULL;  // NULL - scheduler context (timers, interrupts)
+ucontext_t g_host_sched_ctx;
+host_item_t* g_host_items = NULL;
+uint64_t g_host_item_seq = 0;
+host_deferred_t g_host_deferred[HOST_MAX_DEFERRED];
+void (*g_host_sleep_hooks[HOST_MAX_SLEEP_HOOKS])(void);
+uint8_t g_host_sleep_hook_cnt = 0;
+
+host_world_t* host_world();
+void host_fail(const char* fmt, ...);
+void host_end_wake(host_end_t end, const char* fmt, ...);
+
+
+// creates the world in memory shared with the wake processes, must be
+// done before the first wake
+void host_init()
+{
+    if (g_host_world != NULL)
+        return;
+
+    void* mem = mmap(NULL, HOST_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        abort();
+    }
+
+    g_host_world = (host_world_t*)mem;
+    memset(g_host_world, 0, sizeof(*g_host_world));
+    g_host_world->arena_used = (sizeof(host_world_t) + 15) & ~(size_t)15;
+    g_host_world->random_state = 0x9E3779B97F4A7C15ULL;
+    g_host_world->stub_start_us = HOST_STUB_START_US;
+    g_host_world->button_pin = 3;
+    g_host_world->i2c_sda_pin = 6;
+    g_host_world->i2c_scl_pin = 7;
+    g_host_world->temp_q8_8 = (int16_t)(36.6 * 256);
+    g_host_world->max30205.config = 0;
+    memset(g_host_world->flash, 0xFF, sizeof(g_host_world->flash));    // erased chip
+
+    const char* log_level = getenv("HOST_LOG");
+    g_host_world->log_level = log_level != NULL ? atoi(log_level) : 0;
+
+    size_t rtc_len = __start_rtc_data != NULL ? (size_t)(__stop_rtc_data - __start_rtc_data) : 0;
+    if (rtc_len > HOST_RTC_MEM_SIZE)
+        host_fail("RTC data (%zu bytes) doesn't fit into RTC memory (%d bytes)", rtc_len, HOST_RTC_MEM_SIZE);
+    g_host_world->rtc_len = rtc_len;
+}
+
+
+host_world_t* host_world()
+{
+    if (g_host_world == NULL)
+        host_init();
+    return g_host_world;
+}
+
+
+// allocates zeroed memory shared with the wake processes, must be done
+// before the first wake (the models keep their state in it)
+void* host_shared_alloc(size_t size)
+{
+    host_world_t* world = host_world();
+    if (g_host_is_device)
+        host_fail("shared memory is allocated in the wake process");
+    if (world->arena_used + size > HOST_ARENA_SIZE)
+        host_fail("shared memory is over (%zu bytes more)", size);
+
+    void* mem = (uint8_t*)world + world->arena_used;
+    world->arena_used += (size + 15) & ~(size_t)15;
+    memset(mem, 0, size);
+    return mem;
+}
+
+
+void host_log_v(char level, const char* tag, const char* fmt, va_list args)
+{
+    host_world_t* world = host_world();
+    int need = level == 'E' || level == 'W' ? 1 : 2;
+    if (world->log_level < need)
+        return;
+
+    printf("[%4lld.%06lld] %c %s: ", (long long)(world->now_us / 1000000), (long long)(world->now_us % 1000000),
+           level, tag);
+    vprintf(fmt, args);
+    printf("\n");
+}
+
+
+void host_log(char level, const char* tag, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    host_log_v(level, tag, fmt, args);
+    va_end(args);
+}
+
+
+// stops the simulation: the wake ends with a crash, outside of the wake
+// (unit tests) the program aborts
+void host_fail(const char* fmt, ...)
+{
+    char reason[160];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, args);
+    va_end(args);
+
+    if (g_host_is_device)
+        host_end_wake(HOST_END_CRASH, "%s", reason);
+
+    fprintf(stderr, "host: %s\n", reason);
+    abort();
+}
+
+
+// ---------------------------------------------------------------- clock
+
+int64_t host_now_us()
+{
+    return host_world()->now_us;
+}
+
+
+// advances the clock, used for the busy work (ROM delays, bus transfers)
+void host_advance_us(int64_t us)
+{
+    if (us > 0)
+        host_world()->now_us += us;
+}
+
+
+// RTC time since power-on, it counts with the drift of the RTC clock
+int64_t host_rtc_time_us()
+{
+    host_world_t* world = host_world();
+    int64_t elapsed_us = world->now_us - world->power_on_us;
+    return elapsed_us + elapsed_us / 1000000 * world->rtc_drift_ppm;
+}
+
+
+// world time of RTC sleep time
+int64_t host_rtc_to_world_us(uint64_t rtc_us)
+{
+    return (int64_t)rtc_us - (int64_t)rtc_us / 1000000 * host_world()->rtc_drift_ppm;
+}
+
+
+// the device takes its time from RTC (see system.h), the build wraps
+// gettimeofday, so it returns the simulated RTC time
+int __wrap_gettimeofday(struct timeval* tv, void* tz)
+{
+    (void)tz;
+    int64_t rtc_us = host_rtc_time_us();
+    tv->tv_sec = rtc_us / 1000000;
+    tv->tv_usec = rtc_us % 1000000;
+    return 0;
+}
+
+
+uint64_t host_random()
+{
+    host_world_t* world = host_world();
+    uint64_t x = world->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    world->random_state = x;
+    return x;
+}
+
+
+// ---------------------------------------------------------------- button
+
+// adds a press of the button, the level is high while it is pressed
+void host_press_button(int64_t at_us, int64_t duration_us)
+{
+    host_world_t* world = host_world();
+    if (world->button_edge_cnt + 2 > HOST_MAX_BUTTON_EDGES)
+        host_fail("too many button presses");
+
+    world->button_edges[world->button_edge_cnt++] = (host_edge_t){.time_us = at_us, .level = true};
+    world->button_edges[world->button_edge_cnt++] = (host_edge_t){.time_us = at_us + duration_us, .level = false};
+}
+
+
+bool host_button_level(int64_t time_us)
+{
+    host_world_t* world = host_world();
+    bool level = false;
+    int64_t level_time = INT64_MIN;
+    for (uint8_t i = 0; i < world->button_edge_cnt; i++)
+    {
+        if (world->button_edges[i].time_us <= time_us && world->button_edges[i].time_us >= level_time)
+        {
+            level = world->button_edges[i].level;
+            level_time = world->button_edges[i].time_us;
+        }
+    }
+    return level;
+}
+
+
+// returns the time of the first button edge after the given time (INT64_MAX - none)
+int64_t host_button_next_edge(int64_t after_us)
+{
+    host_world_t* world = host_world();
+    int64_t next = INT64_MAX;
+    for (uint8_t i = 0; i < world->button_edge_cnt; i++)
+        if (world->button_edges[i].time_us > after_us && world->button_edges[i].time_us < next)
+            next = world->button_edges[i].time_us;
+    return next;
+}
+
+
+// returns the first time from the given one when the button is pressed
+int64_t host_button_next_high(int64_t from_us)
+{
+    if (host_button_level(from_us))
+        return from_us;
+
+    int64_t time_us = from_us;
+    while ((time_us = host_button_next_edge(time_us)) != INT64_MAX)
+        if (host_button_level(time_us))
+            return time_us;
+    return INT64_MAX;
+}
+
+
+// ---------------------------------------------------------------- timed items
+
+void host_item_disarm(host_item_t* item)
+{
+    if (!item->is_armed)
+        return;
+
+    for (host_item_t** it = &g_host_items; *it != NULL; it = &(*it)->next)
+    {
+        if (*it == item)
+        {
+            *it = item->next;
+            break;
+        }
+    }
+    item->is_armed = false;
+    item->next = NULL;
+}
+
+
+// schedules the item, items with the same time run in the order they were armed
+void host_item_arm(host_item_t* item, int64_t due_us)
+{
+    host_item_disarm(item);
+
+    item->due_us = due_us < host_now_us() ? host_now_us() : due_us;
+    item->seq = ++g_host_item_seq;
+    item->is_armed = true;
+
+    host_item_t** it = &g_host_items;
+    while (*it != NULL && (*it)->due_us <= item->due_us)
+        it = &(*it)->next;
+    item->next = *it;
+    *it = item;
+}
+
+
+static void host_deferred_run(host_item_t* item)
+{
+    host_deferred_t* deferred = HOST_CONTAINER_OF(item, host_deferred_t, item);
+    deferred->in_use = false;
+    deferred->fn(deferred->arg);
+}
+
+
+// calls the function in the scheduler context after the delay
+void host_defer(int64_t delay_us, void (*fn)(void* arg), void* arg)
+{
+    for (int i = 0; i < HOST_MAX_DEFERRED; i++)
+    {
+        if (!g_host_deferred[i].in_use)
+        {
+            g_host_deferred[i].in_use = true;
+            g_host_deferred[i].fn = fn;
+            g_host_deferred[i].arg = arg;
+            g_host_deferred[i].item.fn = host_deferred_run;
+            host_item_arm(&g_host_deferred[i].item, host_now_us() + delay_us);
+            return;
+        }
+    }
+    host_fail("too many deferred calls");
+}
+
+
+// ---------------------------------------------------------------- tasks
+
+static void host_task_entry()
+{
+    host_task_t* task = g_host_current;
+    task->fn(task->arg);
+    task->is_done = true;
+    task->is_ready = false;
+    // returns to the scheduler (uc_link)
+}
+
+
+static void host_task_on_timeout(host_item_t* item)
+{
+    host_task_t* task = HOST_CONTAINER_OF(item, host_task_t, timeout_item);
+    if (task->is_ready || task->is_done)
+        return;
+    task->is_timed_out = true;
+    task->is_ready = true;
+    task->wait_obj = NULL;
+}
+
+
+host_task_t* host_task_create(const char* name, void (*fn)(void*), void* arg, int prio)
+{
+    if (g_host_task_cnt >= HOST_MAX_TASKS)
+        host_fail("too many tasks (%s)", name);
+
+    host_task_t* task = &g_host_tasks[g_host_task_cnt++];
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->fn = fn;
+    task->arg = arg;
+    task->prio = prio;
+    task->is_ready = true;
+    task->timeout_item.fn = host_task_on_timeout;
+    task->stack = malloc(HOST_TASK_STACK_SIZE);
+
+    getcontext(&task->ctx);
+    task->ctx.uc_stack.ss_sp = task->stack;
+    task->ctx.uc_stack.ss_size = HOST_TASK_STACK_SIZE;
+    task->ctx.uc_link = &g_host_sched_ctx;
+    makecontext(&task->ctx, host_task_entry, 0);
+    return task;
+}
+
+
+host_task_t* host_task_current()
+{
+    return g_host_current;
+}
+
+
+// blocks the current task until it is unblocked or the timeout (us, -1 -
+// forever) is over, returns false on timeout
+bool host_task_block(const void* wait_obj, int64_t timeout_us)
+{
+    host_task_t* task = g_host_current;
+    if (task == NULL)
+        host_fail("blocking call out of a task");
+
+    task->is_ready = false;
+    task->is_timed_out = false;
+    task->wait_obj = wait_obj;
+    if (timeout_us >= 0)
+        host_item_arm(&task->timeout_item, host_now_us() + timeout_us);
+
+    swapcontext(&task->ctx, &g_host_sched_ctx);
+
+    host_item_disarm(&task->timeout_item);
+    return !task->is_timed_out;
+}
+
+
+void host_task_unblock(host_task_t* task)
+{
+    if (task->is_done || task->is_ready)
+        return;
+    task->is_ready = true;
+    task->wait_obj = NULL;
+}
+
+
+// unblocks all tasks that wait for the object
+void host_task_unblock_waiters(const void* wait_obj)
+{
+    for (uint8_t i = 0; i < g_host_task_cnt; i++)
+        if (!g_host_tasks[i].is_ready && !g_host_tasks[i].is_done && g_host_tasks[i].wait_obj == wait_obj)
+            host_task_unblock(&g_host_tasks[i]);
+}
+
+
+// ends the current task (vTaskDelete(NULL))
+void host_task_exit()
+{
+    host_task_t* task = g_host_current;
+    if (task == NULL)
+        host_fail("task exit out of a task");
+    task->is_done = true;
+    task->is_ready = false;
+    swapcontext(&task->ctx, &g_host_sched_ctx);
+}
+
+
+// ready task with the highest priority, the equal ones take turns
+static host_task_t* host_pick_task()
+{
+    host_task_t* best = NULL;
+    for (uint8_t n = 1; n <= g_host_task_cnt; n++)
+    {
+        uint8_t i = (g_host_last_task + n) % g_host_task_cnt;
+        host_task_t* task = &g_host_tasks[i];
+        if (task->is_ready && !task->is_done && (best == NULL || task->prio > best->prio))
+            best = task;
+    }
+    if (best != NULL)
+        g_host_last_task = (uint8_t)(best - g_host_tasks);
+    return best;
+}
+
+
+static void host_describe_tasks(char* dest, size_t size)
+{
+    size_t len = 0;
+    for (uint8_t i = 0; i < g_host_task_cnt && len < size; i++)
+        if (!g_host_tasks[i].is_done)
+            len += snprintf(dest + len, size - len, "%s%s", len ? ", " : "", g_host_tasks[i].name);
+}
+
+
+// runs the tasks and the timed items until the wake ends
+static void host_sched_run()
+{
+    host_world_t* world = host_world();
+    getcontext(&g_host_sched_ctx);
+
+    while (true)
+    {
+        host_task_t* task = host_pick_task();
+        if (task != NULL)
+        {
+            g_host_current = task;
+            swapcontext(&g_host_sched_ctx, &task->ctx);
+            g_host_current = NULL;
+            continue;
+        }
+
+        host_item_t* item = g_host_items;
+        if (item == NULL)
+        {
+            char tasks[96] = "";
+            host_describe_tasks(tasks, sizeof(tasks));
+            host_end_wake(HOST_END_HANG, "nothing to do after %lld ms awake (tasks: %s)",
+                          (long long)((world->now_us - world->boot_us) / 1000), tasks);
+        }
+        if (item->due_us - world->boot_us > HOST_MAX_AWAKE_US)
+            host_end_wake(HOST_END_TIMEOUT, "awake for %lld s", (long long)(HOST_MAX_AWAKE_US / 1000000));
+
+        g_host_items = item->next;
+        item->next = NULL;
+        item->is_armed = false;
+        if (item->due_us > world->now_us)
+            world->now_us = item->due_us;
+        item->fn(item);
+    }
+}
+
+
+// ---------------------------------------------------------------- wakes
+
+// registers a function that runs right before the deep sleep (the models
+// close their accounting)
+void host_at_sleep(void (*hook)(void))
+{
+    if (g_host_sleep_hook_cnt < HOST_MAX_SLEEP_HOOKS)
+        g_host_sleep_hooks[g_host_sleep_hook_cnt++] = hook;
+}
+
+
+static void host_rtc_save()
+{
+    host_world_t* world = host_world();
+    if (world->rtc_len > 0)
+        memcpy(world->rtc_image, __start_rtc_data, world->rtc_len);
+    world->rtc_is_valid = true;
+}
+
+
+static void host_rtc_restore()
+{
+    host_world_t* world = host_world();
+    if (world->rtc_is_valid && world->rtc_len > 0)
+        memcpy(__start_rtc_data, world->rtc_image, world->rtc_len);
+}
+
+
+// returns the address of RTC variable in the saved image, so the scenarios
+// can check the state the device keeps in deep sleep
+void* host_rtc_addr(const void* var)
+{
+    host_world_t* world = host_world();
+    size_t offset = (const uint8_t*)var - __start_rtc_data;
+    if ((const uint8_t*)var < __start_rtc_data || offset >= world->rtc_len)
+        host_fail("not an RTC variable");
+    return world->rtc_is_valid ? world->rtc_image + offset : (void*)var;
+}
+
+#define HOST_RTC_VAR(var) (*(__typeof__(&(var)))host_rtc_addr(&(var)))
+
+
+// ends the wake process, the RTC memory is saved for the next wake
+void host_end_wake(host_end_t end, const char* fmt, ...)
+{
+    host_world_t* world = host_world();
+    if (!g_host_is_device)
+        host_fail("the wake ends out of the wake process");
+
+    if (end == HOST_END_DEEP_SLEEP || end == HOST_END_STUB_SLEEP)
+        for (uint8_t i = 0; i < g_host_sleep_hook_cnt; i++)
+            g_host_sleep_hooks[i]();
+
+    world->sleep.end = end;
+    world->sleep.time_us = world->now_us;
+    world->sleep.reason[0] = '\0';
+    if (fmt != NULL)
+    {
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(world->sleep.reason, sizeof(world->sleep.reason), fmt, args);
+        va_end(args);
+    }
+
+    if (end == HOST_END_STUB_SLEEP)
+        world->stats.stub_us += world->now_us - world->wake_us;
+    else
+        world->stats.awake_us += world->now_us - world->boot_us;
+
+    if (end != HOST_END_DEEP_SLEEP && end != HOST_END_STUB_SLEEP && end != HOST_END_POWER_LOSS)
+        host_log('E', "host", "wake ended: %s", world->sleep.reason);
+
+    host_rtc_save();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+}
+
+
+static void host_main_task(void* arg)
+{
+    app_main();
+}
+
+
+// body of the wake process: the wake stub, then the boot and app_main
+static void host_device_main()
+{
+    host_world_t* world = host_world();
+    g_host_is_device = true;
+    host_rtc_restore();
+
+    if (world->wake_cause == 4 /* ESP_SLEEP_WAKEUP_TIMER */ && esp_wake_deep_sleep != NULL)
+    {
+        host_advance_us(world->stub_start_us);
+        esp_wake_deep_sleep();
+    }
+
+    // the stub returned, so the device boots
+    world->stats.boots++;
+    host_advance_us(HOST_BOOT_US);
+    world->boot_us = world->now_us;
+
+    if (host_esp_timer_start != NULL)
+        host_esp_timer_start();
+    if (app_main != NULL)
+        host_task_create("main", host_main_task, NULL, 1);
+    host_sched_run();
+}
+
+
+// runs one wake of the device in a forked process
+static void host_run_wake(int cause)
+{
+    host_world_t* world = host_world();
+    world->wake_cause = cause;
+    world->wake_us = world->now_us;
+    if (cause == 4)
+        world->stats.timer_wakes++;
+    else if (cause == 7 /* ESP_SLEEP_WAKEUP_GPIO */)
+        world->stats.gpio_wakes++;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        abort();
+    }
+    if (pid == 0)
+    {
+        host_device_main();
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (WIFSIGNALED(status))
+    {
+        world->sleep.end = HOST_END_CRASH;
+        snprintf(world->sleep.reason, sizeof(world->sleep.reason), "killed by signal %d", WTERMSIG(status));
+        host_log('E', "host", "wake ended: %s", world->sleep.reason);
+    }
+}
+
+
+// the device is powered: RTC memory is lost, NVS and the flash are kept
+void host_power_on()
+{
+    host_world_t* world = host_world();
+    world->rtc_is_valid = false;
+    world->power_on_us = world->now_us;
+    world->stats.power_ons++;
+    world->sleep = (host_sleep_t){0};
+    host_run_wake(0 /* ESP_SLEEP_WAKEUP_UNDEFINED */);
+}
+
+
+const host_sleep_t* host_last_sleep()
+{
+    return &host_world()->sleep;
+}
+
+
+bool host_is_asleep()
+{
+    host_end_t end = host_world()->sleep.end;
+    return end == HOST_END_DEEP_SLEEP || end == HOST_END_STUB_SLEEP;
+}
+
+
+// runs the device until the time, it wakes up on the timer and on the button.
+// returns false if a wake didn't end with sleep (see host_last_sleep)
+bool host_run_until(int64_t until_us)
+{
+    host_world_t* world = host_world();
+    while (host_is_asleep())
+    {
+        const host_sleep_t* sleep = &world->sleep;
+        int64_t wake_us = INT64_MAX;
+        int cause = 0;
+
+        if (sleep->timer_armed)
+        {
+            wake_us = sleep->time_us + host_rtc_to_world_us(sleep->timer_us);
+            cause = 4;
+        }
+        if (sleep->gpio_mask & (1ULL << world->button_pin))
+        {
+            int64_t press_us = host_button_next_high(sleep->time_us);
+            if (press_us < wake_us)
+            {
+                wake_us = press_us;
+                cause = 7;
+            }
+        }
+
+        if (wake_us > until_us)
+            break;
+        if (wake_us > world->now_us)
+            world->now_us = wake_us;
+        host_run_wake(cause);
+    }
+
+    if (!host_is_asleep() && world->sleep.end != HOST_END_NONE)
+        return false;
+    if (world->now_us < until_us)
+        world->now_us = until_us;
+    return true;
+}
+
+
+#endif /* HOST_HAL_HOST_SIM_H_ */
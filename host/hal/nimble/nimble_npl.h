@@ -0,0 +1,206 @@
+/*
+ * nimble_npl.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_NIMBLE_NIMBLE_NPL_H_
+#define HOST_HAL_NIMBLE_NIMBLE_NPL_H_
+
+#include "freertos/FreeRTOS.h"
+
+// NimBLE porting layer: event queues and callouts. An expired callout
+// puts its event into the queue, the events run in the task that gets
+// them from the queue (the host task for the default queue).
+
+#define BLE_NPL_TIME_FOREVER    UINT32_MAX
+
+typedef uint32_t ble_npl_time_t;
+typedef int32_t ble_npl_stime_t;
+
+typedef enum {
+    BLE_NPL_OK = 0,
+    BLE_NPL_ENOMEM = 1,
+    BLE_NPL_EINVAL = 2,
+    BLE_NPL_INVALID_PARAM = 3,
+    BLE_NPL_MEM_NOT_ALIGNED = 4,
+    BLE_NPL_BAD_MUTEX = 5,
+    BLE_NPL_TIMEOUT = 6,
+    BLE_NPL_ERR_IN_ISR = 7,
+    BLE_NPL_ERR_PRIV = 8,
+    BLE_NPL_OS_NOT_STARTED = 9,
+    BLE_NPL_ENOENT = 10,
+    BLE_NPL_EBUSY = 11,
+    BLE_NPL_ERROR = 12,
+} ble_npl_error_t;
+
+struct ble_npl_event;
+typedef void ble_npl_event_fn(struct ble_npl_event* ev);
+
+struct ble_npl_event {
+    bool is_queued;
+    ble_npl_event_fn* fn;
+    void* arg;
+    struct ble_npl_event* next;
+};
+
+struct ble_npl_eventq {
+    struct ble_npl_event* head;
+    struct ble_npl_event* tail;
+};
+
+struct ble_npl_callout {
+    host_item_t item;
+    struct ble_npl_event ev;
+    struct ble_npl_eventq* evq;
+};
+
+
+void ble_npl_event_init(struct ble_npl_event* ev, ble_npl_event_fn* fn, void* arg)
+{
+    memset(ev, 0, sizeof(*ev));
+    ev->fn = fn;
+    ev->arg = arg;
+}
+
+
+void* ble_npl_event_get_arg(struct ble_npl_event* ev)
+{
+    return ev->arg;
+}
+
+
+void ble_npl_event_run(struct ble_npl_event* ev)
+{
+    ev->fn(ev);
+}
+
+
+void ble_npl_eventq_init(struct ble_npl_eventq* evq)
+{
+    evq->head = NULL;
+    evq->tail = NULL;
+}
+
+
+// queues the event (once, a queued event is not queued again)
+void ble_npl_eventq_put(struct ble_npl_eventq* evq, struct ble_npl_event* ev)
+{
+    if (ev->is_queued)
+        return;
+
+    ev->is_queued = true;
+    ev->next = NULL;
+    if (evq->tail != NULL)
+        evq->tail->next = ev;
+    else
+        evq->head = ev;
+    evq->tail = ev;
+    host_task_unblock_waiters(evq);
+}
+
+
+void ble_npl_eventq_remove(struct ble_npl_eventq* evq, struct ble_npl_event* ev)
+{
+    if (!ev->is_queued)
+        return;
+
+    struct ble_npl_event* prev = NULL;
+    for (struct ble_npl_event* it = evq->head; it != NULL; prev = it, it = it->next)
+    {
+        if (it != ev)
+            continue;
+        if (prev != NULL)
+            prev->next = it->next;
+        else
+            evq->head = it->next;
+        if (evq->tail == it)
+            evq->tail = prev;
+        break;
+    }
+    ev->is_queued = false;
+    ev->next = NULL;
+}
+
+
+// returns the next event, waits for it up to the timeout (in ticks)
+struct ble_npl_event* ble_npl_eventq_get(struct ble_npl_eventq* evq, ble_npl_time_t tmo)
+{
+    if (evq->head == NULL && tmo != 0)
+        host_task_block(evq, tmo == BLE_NPL_TIME_FOREVER ? -1 : host_ticks_to_timeout_us(tmo));
+
+    struct ble_npl_event* ev = evq->head;
+    if (ev == NULL)
+        return NULL;
+
+    evq->head = ev->next;
+    if (evq->head == NULL)
+        evq->tail = NULL;
+    ev->is_queued = false;
+    ev->next = NULL;
+    return ev;
+}
+
+
+bool ble_npl_eventq_is_empty(struct ble_npl_eventq* evq)
+{
+    return evq->head == NULL;
+}
+
+
+static void host_npl_callout_expired(host_item_t* item)
+{
+    struct ble_npl_callout* co = HOST_CONTAINER_OF(item, struct ble_npl_callout, item);
+    ble_npl_eventq_put(co->evq, &co->ev);
+}
+
+
+void ble_npl_callout_init(struct ble_npl_callout* co, struct ble_npl_eventq* evq, ble_npl_event_fn* fn, void* arg)
+{
+    memset(co, 0, sizeof(*co));
+    co->item.fn = host_npl_callout_expired;
+    co->evq = evq;
+    ble_npl_event_init(&co->ev, fn, arg);
+}
+
+
+ble_npl_error_t ble_npl_callout_reset(struct ble_npl_callout* co, ble_npl_time_t ticks)
+{
+    ble_npl_eventq_remove(co->evq, &co->ev);
+    host_item_arm(&co->item, host_now_us() + host_ticks_to_timeout_us(ticks));
+    return BLE_NPL_OK;
+}
+
+
+void ble_npl_callout_stop(struct ble_npl_callout* co)
+{
+    host_item_disarm(&co->item);
+    ble_npl_eventq_remove(co->evq, &co->ev);
+}
+
+
+bool ble_npl_callout_is_active(struct ble_npl_callout* co)
+{
+    return co->item.is_armed;
+}
+
+
+ble_npl_time_t ble_npl_time_get()
+{
+    return (ble_npl_time_t)((host_now_us() - host_world()->boot_us) / HOST_TICK_US);
+}
+
+
+ble_npl_time_t ble_npl_time_ms_to_ticks32(uint32_t ms)
+{
+    return pdMS_TO_TICKS(ms);
+}
+
+
+uint32_t ble_npl_time_ticks_to_ms32(ble_npl_time_t ticks)
+{
+    return ticks * portTICK_PERIOD_MS;
+}
+
+#endif /* HOST_HAL_NIMBLE_NIMBLE_NPL_H_ */
@@ -0,0 +1,13 @@
+/*
+ * nimble_port.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_NIMBLE_NIMBLE_PORT_H_
+#define HOST_HAL_NIMBLE_NIMBLE_PORT_H_
+
+#include "host_ble.h"
+
+#endif /* HOST_HAL_NIMBLE_NIMBLE_PORT_H_ */
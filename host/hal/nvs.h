@@ -0,0 +1,203 @@
+/*
+ * nvs.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_NVS_H_
+#define HOST_HAL_NVS_H_
+
+#include "host_sim.h"
+#include "esp_err.h"
+
+// NVS keeps the entries in the world, so they survive the deep sleep and
+// the power loss. Writes are visible at once, commit is only counted.
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE,
+} nvs_open_mode_t;
+
+typedef enum {
+    HOST_NVS_TYPE_U16 = 1,
+    HOST_NVS_TYPE_U32,
+    HOST_NVS_TYPE_BLOB,
+} host_nvs_type_t;
+
+#define HOST_NVS_HANDLE_WRITE   0x100   // handle is open for writing
+
+bool g_host_nvs_is_init = false;
+
+
+static host_nvs_entry_t* host_nvs_find(nvs_handle_t handle, const char* key)
+{
+    host_world_t* world = host_world();
+    for (int i = 0; i < HOST_NVS_MAX_ENTRIES; i++)
+        if (world->nvs[i].in_use && world->nvs[i].ns == (handle & 0xFF) && strcmp(world->nvs[i].key, key) == 0)
+            return &world->nvs[i];
+    return NULL;
+}
+
+
+esp_err_t nvs_open(const char* name, nvs_open_mode_t open_mode, nvs_handle_t* out_handle)
+{
+    host_world_t* world = host_world();
+    if (!g_host_nvs_is_init)
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    if (strlen(name) > 15)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+
+    for (uint8_t i = 0; i < HOST_NVS_MAX_NAMESPACES; i++)
+    {
+        if (strcmp(world->nvs_namespaces[i], name) == 0)
+        {
+            *out_handle = (i + 1) | (open_mode == NVS_READWRITE ? HOST_NVS_HANDLE_WRITE : 0);
+            return ESP_OK;
+        }
+    }
+
+    // namespace is created by the first read-write open
+    if (open_mode == NVS_READONLY)
+        return ESP_ERR_NVS_NOT_FOUND;
+    for (uint8_t i = 0; i < HOST_NVS_MAX_NAMESPACES; i++)
+    {
+        if (world->nvs_namespaces[i][0] == '\0')
+        {
+            strcpy(world->nvs_namespaces[i], name);
+            *out_handle = (i + 1) | HOST_NVS_HANDLE_WRITE;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    host_world()->stats.nvs_commits++;
+    return ESP_OK;
+}
+
+
+static esp_err_t host_nvs_set(nvs_handle_t handle, const char* key, host_nvs_type_t type, const void* value, size_t len)
+{
+    if (!(handle & HOST_NVS_HANDLE_WRITE))
+        return ESP_ERR_NVS_READ_ONLY;
+    if (strlen(key) > 15)
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    if (len > HOST_NVS_MAX_VALUE_LEN)
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+
+    host_nvs_entry_t* entry = host_nvs_find(handle, key);
+    for (int i = 0; entry == NULL && i < HOST_NVS_MAX_ENTRIES; i++)
+        if (!host_world()->nvs[i].in_use)
+            entry = &host_world()->nvs[i];
+    if (entry == NULL)
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+
+    entry->in_use = true;
+    entry->ns = handle & 0xFF;
+    entry->type = type;
+    strcpy(entry->key, key);
+    entry->len = len;
+    memcpy(entry->value, value, len);
+    return ESP_OK;
+}
+
+
+static esp_err_t host_nvs_get(nvs_handle_t handle, const char* key, host_nvs_type_t type, void* out_value, size_t* len)
+{
+    host_nvs_entry_t* entry = host_nvs_find(handle, key);
+    if (entry == NULL)
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (entry->type != type)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+
+    if (type == HOST_NVS_TYPE_BLOB)
+    {
+        // length query or a buffer that is too small
+        if (out_value == NULL)
+        {
+            *len = entry->len;
+            return ESP_OK;
+        }
+        if (*len < entry->len)
+        {
+            *len = entry->len;
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        *len = entry->len;
+    }
+    memcpy(out_value, entry->value, entry->len);
+    return ESP_OK;
+}
+
+
+esp_err_t nvs_set_u16(nvs_handle_t handle, const char* key, uint16_t value)
+{
+    return host_nvs_set(handle, key, HOST_NVS_TYPE_U16, &value, sizeof(value));
+}
+
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char* key, uint32_t value)
+{
+    return host_nvs_set(handle, key, HOST_NVS_TYPE_U32, &value, sizeof(value));
+}
+
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char* key, const void* value, size_t length)
+{
+    return host_nvs_set(handle, key, HOST_NVS_TYPE_BLOB, value, length);
+}
+
+
+esp_err_t nvs_get_u16(nvs_handle_t handle, const char* key, uint16_t* out_value)
+{
+    return host_nvs_get(handle, key, HOST_NVS_TYPE_U16, out_value, NULL);
+}
+
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char* key, uint32_t* out_value)
+{
+    return host_nvs_get(handle, key, HOST_NVS_TYPE_U32, out_value, NULL);
+}
+
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char* key, void* out_value, size_t* length)
+{
+    return host_nvs_get(handle, key, HOST_NVS_TYPE_BLOB, out_value, length);
+}
+
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char* key)
+{
+    if (!(handle & HOST_NVS_HANDLE_WRITE))
+        return ESP_ERR_NVS_READ_ONLY;
+
+    host_nvs_entry_t* entry = host_nvs_find(handle, key);
+    if (entry == NULL)
+        return ESP_ERR_NVS_NOT_FOUND;
+    entry->in_use = false;
+    return ESP_OK;
+}
+
+
+// returns the blob stored in the namespace (NULL - none), for the scenarios
+const host_nvs_entry_t* host_nvs_entry(const char* ns, const char* key)
+{
+    host_world_t* world = host_world();
+    for (uint8_t i = 0; i < HOST_NVS_MAX_NAMESPACES; i++)
+        if (strcmp(world->nvs_namespaces[i], ns) == 0)
+            return host_nvs_find(i + 1, key);
+    return NULL;
+}
+
+#endif /* HOST_HAL_NVS_H_ */
@@ -0,0 +1,28 @@
+/*
+ * nvs_flash.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_NVS_FLASH_H_
+#define HOST_HAL_NVS_FLASH_H_
+
+#include "nvs.h"
+
+esp_err_t nvs_flash_init()
+{
+    g_host_nvs_is_init = true;
+    return ESP_OK;
+}
+
+
+esp_err_t nvs_flash_erase()
+{
+    host_world_t* world = host_world();
+    memset(world->nvs, 0, sizeof(world->nvs));
+    memset(world->nvs_namespaces, 0, sizeof(world->nvs_namespaces));
+    return ESP_OK;
+}
+
+#endif /* HOST_HAL_NVS_FLASH_H_ */
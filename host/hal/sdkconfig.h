@@ -0,0 +1,52 @@
+/*
+ * sdkconfig.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SDKCONFIG_H_
+#define HOST_HAL_SDKCONFIG_H_
+
+// Options of the ESP32-C3 build with sdkconfig.defaults (see Kconfig.projbuild),
+// the host build overrides them with -D to run other configurations
+
+#ifndef CONFIG_EXAMPLE_EXTENDED_ADV
+#define CONFIG_EXAMPLE_EXTENDED_ADV         1
+#endif
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+#define CONFIG_BT_NIMBLE_EXT_ADV            1
+#endif
+
+#ifndef CONFIG_TEMP_STORE_AND_FORWARD
+#define CONFIG_TEMP_STORE_AND_FORWARD       1
+#endif
+#ifndef CONFIG_TEMP_PACKET_AUTH
+#define CONFIG_TEMP_PACKET_AUTH             1
+#endif
+#ifndef CONFIG_TEMP_POWER_MANAGEMENT
+#define CONFIG_TEMP_POWER_MANAGEMENT        1
+#endif
+
+#ifndef CONFIG_TEMP_WHITE_LIST_SIZE
+#define CONFIG_TEMP_WHITE_LIST_SIZE         8
+#endif
+#define CONFIG_TEMP_PAIRING_TIMEOUT_MS      120000
+#define CONFIG_TEMP_PAIRING_RADIO_BUDGET_MS 30000
+#define CONFIG_TEMP_DATA_RADIO_BUDGET_MS    20000
+#define CONFIG_TEMP_PM_MIN_FREQ_MHZ         40
+#define CONFIG_TEMP_SYNC_WINDOW_PERIOD_MS   30000
+#define CONFIG_TEMP_SYNC_WINDOW_LEN_MS      1000
+#define CONFIG_TEMP_SLEEP_MIN_INTERVAL_MS   5000
+#define CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS   300000
+#define CONFIG_TEMP_HEARTBEAT_INTERVAL_MS   600000
+
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ     160
+#define CONFIG_PM_ENABLE                    1
+#define CONFIG_PM_PROFILING                 0
+#define CONFIG_PM_LIGHT_SLEEP_CALLBACKS     1
+#define CONFIG_FREERTOS_HZ                  100
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS    3
+#define CONFIG_BT_NIMBLE_SM_SC              1
+
+#endif /* HOST_HAL_SDKCONFIG_H_ */
@@ -0,0 +1,25 @@
+/*
+ * ble_svc_gap.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SERVICES_GAP_BLE_SVC_GAP_H_
+#define HOST_HAL_SERVICES_GAP_BLE_SVC_GAP_H_
+
+#include "host_ble.h"
+
+// GAP service takes the first handles (device name and appearance)
+void ble_svc_gap_init(void)
+{
+    g_host_ble.next_handle += 5;
+}
+
+
+int ble_svc_gap_device_name_set(const char* name)
+{
+    return strlen(name) > 31 ? BLE_HS_EINVAL : 0;
+}
+
+#endif /* HOST_HAL_SERVICES_GAP_BLE_SVC_GAP_H_ */
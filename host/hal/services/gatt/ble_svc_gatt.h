@@ -0,0 +1,19 @@
+/*
+ * ble_svc_gatt.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SERVICES_GATT_BLE_SVC_GATT_H_
+#define HOST_HAL_SERVICES_GATT_BLE_SVC_GATT_H_
+
+#include "host_ble.h"
+
+// GATT service takes the handles after GAP (service changed)
+void ble_svc_gatt_init(void)
+{
+    g_host_ble.next_handle += 4;
+}
+
+#endif /* HOST_HAL_SERVICES_GATT_BLE_SVC_GATT_H_ */
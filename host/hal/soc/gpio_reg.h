@@ -0,0 +1,22 @@
+/*
+ * gpio_reg.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SOC_GPIO_REG_H_
+#define HOST_HAL_SOC_GPIO_REG_H_
+
+#include "soc/soc.h"
+
+#define GPIO_OUT_REG                    HOST_GPIO_OUT_REG
+#define GPIO_OUT_W1TS_REG               HOST_GPIO_OUT_W1TS_REG
+#define GPIO_OUT_W1TC_REG               HOST_GPIO_OUT_W1TC_REG
+#define GPIO_ENABLE_REG                 HOST_GPIO_ENABLE_REG
+#define GPIO_ENABLE_W1TS_REG            HOST_GPIO_ENABLE_W1TS_REG
+#define GPIO_ENABLE_W1TC_REG            HOST_GPIO_ENABLE_W1TC_REG
+#define GPIO_IN_REG                     HOST_GPIO_IN_REG
+#define GPIO_FUNC0_OUT_SEL_CFG_REG      (HOST_GPIO_BASE + 0x0554)
+
+#endif /* HOST_HAL_SOC_GPIO_REG_H_ */
@@ -0,0 +1,13 @@
+/*
+ * gpio_sig_map.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SOC_GPIO_SIG_MAP_H_
+#define HOST_HAL_SOC_GPIO_SIG_MAP_H_
+
+#define SIG_GPIO_OUT_IDX    128
+
+#endif /* HOST_HAL_SOC_GPIO_SIG_MAP_H_ */
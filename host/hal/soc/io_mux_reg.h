@@ -0,0 +1,24 @@
+/*
+ * io_mux_reg.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SOC_IO_MUX_REG_H_
+#define HOST_HAL_SOC_IO_MUX_REG_H_
+
+#include "soc/soc.h"
+
+// io mux is not modeled, every pin works as gpio with pull-up
+
+#define IO_MUX_GPIO0_REG                0x60009004
+#define PIN_FUNC_GPIO                   1
+
+#define PIN_FUNC_SELECT(reg, func)      ((void)(reg), (void)(func))
+#define PIN_INPUT_ENABLE(reg)           ((void)(reg))
+#define PIN_INPUT_DISABLE(reg)          ((void)(reg))
+#define PIN_PULLUP_EN(reg)              ((void)(reg))
+#define PIN_PULLUP_DIS(reg)             ((void)(reg))
+
+#endif /* HOST_HAL_SOC_IO_MUX_REG_H_ */
@@ -0,0 +1,17 @@
+/*
+ * rtc.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SOC_RTC_H_
+#define HOST_HAL_SOC_RTC_H_
+
+#include "soc/soc.h"
+
+// wakeup causes of RTC_CNTL_SLP_WAKEUP_CAUSE (esp_wake_stub_get_wakeup_cause)
+#define RTC_GPIO_TRIG_EN    BIT(2)
+#define RTC_TIMER_TRIG_EN   BIT(3)
+
+#endif /* HOST_HAL_SOC_RTC_H_ */
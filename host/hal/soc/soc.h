@@ -0,0 +1,22 @@
+/*
+ * soc.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_HAL_SOC_SOC_H_
+#define HOST_HAL_SOC_SOC_H_
+
+#include "host_periph.h"
+
+#ifndef BIT
+#define BIT(nr) (1UL << (nr))
+#endif
+
+#define REG_WRITE(addr, value)  host_reg_write((uint32_t)(addr), (uint32_t)(value))
+#define REG_READ(addr)          host_reg_read((uint32_t)(addr))
+#define REG_SET_BIT(addr, bit)  REG_WRITE(addr, REG_READ(addr) | (bit))
+#define REG_CLR_BIT(addr, bit)  REG_WRITE(addr, REG_READ(addr) & ~(bit))
+
+#endif /* HOST_HAL_SOC_SOC_H_ */
@@ -0,0 +1,577 @@
+/*
+ * scenarios.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// Scripted scenarios of the host target (see hal/host_sim.h): the world
+// around the device is set up, the device runs in simulated time and the
+// state it keeps in deep sleep (RTC memory), the gateway model and the
+// world stats are checked. Every scenario is a separate process:
+//   ./scenarios <name>      - runs one scenario (returns 0 if it passed)
+//   ./scenarios             - lists the scenarios
+// HOST_LOG=2 prints the logs of the firmware.
+
+#include "main.c"
+#include "sim_gateway.h"
+
+
+#define S_US    1000000LL
+#define MIN_US  (60 * S_US)
+#define HOUR_US (60 * MIN_US)
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond))                                                            \
+        {                                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1;                                                           \
+        }                                                                       \
+    } while (0)
+
+#define CHECK_ASLEEP()                                                          \
+    do {                                                                        \
+        if (!host_is_asleep())                                                  \
+        {                                                                       \
+            fprintf(stderr, "%s:%d: device is not asleep: %s\n", __FILE__, __LINE__, \
+                    host_last_sleep()->reason);                                 \
+            return 1;                                                           \
+        }                                                                       \
+    } while (0)
+
+static const uint8_t s_gateway_addr[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+
+
+// ---------------------------------------------------------------- helpers
+
+// the device with the flash log streams the backlog to the gateway that
+// connects to the data adv (see backlog_sync.h), without it the batches
+// are received passively
+static gw_ack_mode_t data_ack_mode()
+{
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    return GW_ACK_CONNECT;
+#else
+    return GW_ACK_NONE;
+#endif
+}
+
+
+// powers the device on and registers the gateway with the medium press
+static int power_on_and_register(sim_gateway_t* gw)
+{
+    host_power_on();
+    CHECK_ASLEEP();
+
+    gw->wants_registration = true;
+    int64_t press_us = host_now_us() + S_US;
+    host_press_button(press_us, 2 * S_US);
+    CHECK(host_run_until(press_us + MIN_US));
+    CHECK_ASLEEP();
+    CHECK(gw->is_registered);
+    return 0;
+}
+
+
+// ---------------------------------------------------------------- scenarios
+
+// after power-on the device sleeps until the button is pressed
+static int scenario_power_on()
+{
+    host_power_on();
+    CHECK_ASLEEP();
+
+    const host_sleep_t* sleep = host_last_sleep();
+    CHECK(!sleep->timer_armed);
+    CHECK(sleep->gpio_mask & (1ULL << host_world()->button_pin));
+    CHECK(sleep->pm_locks_held == 0);
+    CHECK(HOST_RTC_VAR(white_list_len) == 0);
+    return 0;
+}
+
+
+// medium press: the gateway connects to the registration adv, reads the
+// time (and the key), the device keeps it in the white list and starts
+// collecting samples
+static int scenario_registration()
+{
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, GW_ACK_NONE);
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    CHECK(gw->connections == 1);
+    CHECK(gw->cts_reads == 1);
+#if CONFIG_TEMP_PACKET_AUTH
+    CHECK(gw->has_key);
+#endif
+    CHECK(HOST_RTC_VAR(white_list_len) == 1);
+    CHECK(memcmp(HOST_RTC_VAR(white_list)[0].val, s_gateway_addr, 6) == 0);
+    CHECK(HOST_RTC_VAR(pairing_stats).paired_cnt == 1);
+    CHECK(host_last_sleep()->timer_armed);
+    return 0;
+}
+
+
+// the registered device sends batches for two hours: every sample the
+// gateway gets is a real one, the MAC is valid, most wakes are handled
+// by the wake stub alone and the awake time is counted in the power modes
+static int scenario_batch()
+{
+    host_set_temperature(37.25);
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    int64_t start_us = host_now_us();
+    CHECK(host_run_until(start_us + 2 * HOUR_US));
+    CHECK_ASLEEP();
+
+    host_stats_t* stats = &host_world()->stats;
+    CHECK(gw->packets > 0);
+    // the interval stretches to the max one with the steady temperature,
+    // the samples of the last unsent batch are not counted
+    CHECK(gw->sample_cnt >= HOUR_US / (CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS * 1000LL));
+    CHECK(gw->auth_failures == 0);
+    CHECK(stats->stub_wakes > 0);
+    CHECK(stats->sensor_early_reads == 0);
+    for (uint32_t i = 0; i < gw->sample_cnt; i++)
+    {
+        CHECK(gw->samples[i].sensor == 0);
+        CHECK(gw->samples[i].value == (uint16_t)(37.25 * 256));
+        CHECK(gw->samples[i].time_us >= start_us - MIN_US && gw->samples[i].time_us <= host_now_us());
+    }
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    CHECK(gw->sync_ends > 0);
+#endif
+
+    // the whole awake time is counted in the power modes (see power_mgmt.h),
+    // with power management the connections run at max frequency and most
+    // of the rest at min frequency, the baseline runs at max frequency
+    int64_t pm_total_us = HOST_RTC_VAR(pm_max_freq_us) + HOST_RTC_VAR(pm_min_freq_us) +
+                          HOST_RTC_VAR(pm_light_sleep_us);
+    CHECK(llabs(pm_total_us - stats->awake_us) <= stats->boots * 1000LL);
+#if CONFIG_TEMP_POWER_MANAGEMENT
+    CHECK(HOST_RTC_VAR(pm_max_freq_us) >= stats->conn_us);
+    CHECK(HOST_RTC_VAR(pm_min_freq_us) > HOST_RTC_VAR(pm_max_freq_us));
+#else
+    CHECK(HOST_RTC_VAR(pm_max_freq_us) == pm_total_us);
+#endif
+    return 0;
+}
+
+
+// body temperature that rises by 1/256 C every second from 37 C and
+// starts over every 256 s, so every sample tells when it was measured
+static int16_t sawtooth_temp_q8_8(int64_t time_us)
+{
+    return 37 * 256 + (time_us / S_US) % 256;
+}
+
+
+// the wakeups take longer than the stub counts for (the latency is
+// exaggerated, like the RTC drift), so its estimated clock falls behind,
+// but every sample the gateway gets is still timed by the RTC: its value
+// matches the temperature at its time
+static int scenario_stub_time()
+{
+    host_world()->stub_start_us = 400 * 1000;
+    host_set_temperature_fn(sawtooth_temp_q8_8);
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    CHECK(host_run_until(host_now_us() + 2 * HOUR_US));
+    CHECK_ASLEEP();
+    CHECK(host_world()->stats.stub_wakes > SAMPLES_PER_BATCH);
+    CHECK(gw->sample_cnt > 0);
+    for (uint32_t i = 0; i < gw->sample_cnt; i++)
+    {
+        int err_s = (int)(int16_t)gw->samples[i].value - sawtooth_temp_q8_8(gw->samples[i].time_us);
+        err_s = (err_s + 384) % 256 - 128;   // the sawtooth starts over
+        CHECK(abs(err_s) <= 2);
+    }
+    return 0;
+}
+
+
+// the white list is full: the next gateway is disconnected right after
+// it connects to the registration adv, it reads neither the time nor the
+// key, and the registered gateways are kept
+static int scenario_registration_full()
+{
+    sim_gateway_t* gws[WHITE_LIST_SIZE + 1];
+    for (uint8_t i = 0; i <= WHITE_LIST_SIZE; i++)
+    {
+        uint8_t addr[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x60 + i};
+        gws[i] = sim_gateway_add(addr, GW_ACK_NONE);
+    }
+    if (power_on_and_register(gws[0]) != 0)
+        return 1;
+    for (uint8_t i = 1; i <= WHITE_LIST_SIZE; i++)
+    {
+        gws[i]->wants_registration = true;
+        int64_t press_us = host_now_us() + 10 * S_US;
+        host_press_button(press_us, 2 * S_US);
+        CHECK(host_run_until(press_us + MIN_US));
+        CHECK_ASLEEP();
+        CHECK(gws[i]->connections == 1);
+    }
+
+    sim_gateway_t* rejected = gws[WHITE_LIST_SIZE];
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+        CHECK(gws[i]->is_registered);
+    CHECK(!rejected->is_registered && rejected->cts_reads == 0);
+    CHECK(!rejected->has_key);
+    CHECK(HOST_RTC_VAR(white_list_len) == WHITE_LIST_SIZE);
+    for (uint8_t i = 0; i < WHITE_LIST_SIZE; i++)
+        CHECK(memcmp(HOST_RTC_VAR(white_list)[i].val, rejected->peer->addr.val, 6) != 0);
+    CHECK(host_last_sleep()->timer_armed);
+    return 0;
+}
+
+
+// nobody connects to the registration adv: the pairing times out within
+// the radio budget and the device sleeps without the timer
+static int scenario_registration_timeout()
+{
+    host_power_on();
+    CHECK_ASLEEP();
+
+    int64_t press_us = host_now_us() + S_US;
+    host_press_button(press_us, 2 * S_US);
+    CHECK(host_run_until(press_us + 5 * MIN_US));
+    CHECK_ASLEEP();
+
+    CHECK(HOST_RTC_VAR(pairing_stats).timeout_cnt == 1);
+    CHECK(HOST_RTC_VAR(white_list_len) == 0);
+    CHECK(host_world()->stats.adv_us <= (CONFIG_TEMP_PAIRING_RADIO_BUDGET_MS + 5000) * 1000LL);
+    CHECK(!host_last_sleep()->timer_armed);
+    return 0;
+}
+
+
+// long press: the registered gateway connects to the deletion adv, the
+// device removes it from the white list and stops collecting samples
+static int scenario_deletion()
+{
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, GW_ACK_NONE);
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    gw->wants_deletion = true;
+    int64_t press_us = host_now_us() + 10 * S_US;
+    host_press_button(press_us, 6 * S_US);
+    CHECK(host_run_until(press_us + MIN_US));
+    CHECK_ASLEEP();
+
+    CHECK(gw->is_deleted);
+    CHECK(HOST_RTC_VAR(white_list_len) == 0);
+    CHECK(!host_last_sleep()->timer_armed);
+    return 0;
+}
+
+
+// two gateways are registered and one of them is deleted: the key is
+// replaced and the epoch goes on, so the packets the deleted gateway
+// could forge with its key fail the MAC. The other gateway reads the new
+// key on its next data connection and gets the samples of every batch.
+static int scenario_deletion_rekey()
+{
+    static const uint8_t other_addr[6] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x77};
+    host_set_temperature(37.25);
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, GW_ACK_NONE);
+    sim_gateway_t* other = sim_gateway_add(other_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+    other->wants_registration = true;
+    int64_t press_us = host_now_us() + 10 * S_US;
+    host_press_button(press_us, 2 * S_US);
+    CHECK(host_run_until(press_us + MIN_US));
+    CHECK(other->is_registered);
+
+#if CONFIG_TEMP_PACKET_AUTH
+    uint16_t epoch = HOST_RTC_VAR(auth_epoch);
+    CHECK(memcmp(gw->key, other->key, AUTH_KEY_SIZE) == 0);
+#endif
+    gw->wants_deletion = true;
+    press_us = host_now_us() + 10 * S_US;
+    host_press_button(press_us, 6 * S_US);
+    CHECK(host_run_until(press_us + MIN_US));
+    CHECK(gw->is_deleted);
+    CHECK(HOST_RTC_VAR(white_list_len) == 1);
+#if CONFIG_TEMP_PACKET_AUTH
+    CHECK(HOST_RTC_VAR(auth_epoch) > epoch);
+    CHECK(memcmp(gw->key, HOST_RTC_VAR(auth_key), AUTH_KEY_SIZE) != 0);
+#endif
+
+    uint32_t batches = gw->batches, other_batches = other->batches;
+    int64_t start_us = host_now_us();
+    CHECK(host_run_until(start_us + 2 * HOUR_US));
+    CHECK_ASLEEP();
+    CHECK(other->batches > other_batches);
+    CHECK(other->auth_failures == 0);
+    CHECK(gw_find_sample(other, 0, start_us + 30 * MIN_US) != NULL);
+    CHECK(llabs(gw_find_sample(other, 0, start_us)->time_us - start_us) <= CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS * 1000LL);
+#if CONFIG_TEMP_PACKET_AUTH
+    CHECK(other->key_reads == 2);
+    CHECK(memcmp(other->key, HOST_RTC_VAR(auth_key), AUTH_KEY_SIZE) == 0);
+    CHECK(gw->batches == batches && gw->auth_failures > 0);
+
+    // the new key is the one kept in NVS
+    host_power_on();
+    CHECK_ASLEEP();
+    CHECK(memcmp(other->key, HOST_RTC_VAR(auth_key), AUTH_KEY_SIZE) == 0);
+#endif
+    return 0;
+}
+
+
+// the power is lost after the registration: the white list is restored
+// from NVS on power-on and the device goes on collecting samples
+static int scenario_power_cycle()
+{
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    uint32_t sample_cnt = gw->sample_cnt;
+    host_power_on();
+    CHECK_ASLEEP();
+    CHECK(HOST_RTC_VAR(white_list_len) == 1);
+    CHECK(host_last_sleep()->timer_armed);
+
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+    CHECK(gw->sample_cnt > sample_cnt);
+    CHECK(gw->auth_failures == 0);
+    return 0;
+}
+
+
+// the gateway doesn't see extended pdus: after a few unacknowledged
+// extended batches the device falls back to legacy ones, so the gateway
+// gets the samples of the later batches
+static int scenario_ext_fallback()
+{
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, GW_ACK_CONNECT);
+    gw->is_legacy_only = true;
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    int64_t start_us = host_now_us();
+    CHECK(host_run_until(start_us + 3 * HOUR_US));
+    CHECK_ASLEEP();
+
+    CHECK(gw->batches > 0);
+    CHECK(gw->auth_failures == 0);
+    // without the flash log the samples of the missed batches are lost
+    CHECK(gw->sample_cnt >= HOUR_US / (CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS * 1000LL));
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    CHECK(HOST_RTC_VAR(g_ext_unacked_cnt) == EXT_ADV_MAX_UNACKED);
+#endif
+    return 0;
+}
+
+
+// the gateway is out of range for hours: the samples are kept in the
+// flash log and streamed over the connection once it's back in range.
+// the temperature keeps changing, so the samples are taken often and
+// the backlog takes a few KB
+static int scenario_backlog()
+{
+    host_set_temperature_fn(sawtooth_temp_q8_8);
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    gw->peer->is_in_range = false;
+    int64_t start_us = host_now_us();
+    CHECK(host_run_until(start_us + 6 * HOUR_US));
+    CHECK_ASLEEP();
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    uint32_t logged_cnt = HOST_RTC_VAR(flash_log_tail_seq) - HOST_RTC_VAR(flash_log_head_seq);
+    CHECK(logged_cnt >= 6 * HOUR_US / (CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS * 1000LL) - SAMPLES_PER_EXT_BATCH);
+#endif
+
+    gw->peer->is_in_range = true;
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    uint32_t start_sync_bytes = gw->sync_bytes;
+    int64_t start_sync_us = gw->sync_us;
+#endif
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+    CHECK(gw->auth_failures == 0);
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    CHECK(HOST_RTC_VAR(flash_log_tail_seq) == HOST_RTC_VAR(flash_log_head_seq));
+    CHECK(gw->sync_records >= logged_cnt);
+    // the backlog is streamed at the target rate at least
+    uint32_t sync_bytes = gw->sync_bytes - start_sync_bytes;
+    int64_t sync_us = gw->sync_us - start_sync_us;
+    CHECK(sync_us > 0 && sync_bytes * S_US / sync_us >= SYNC_TARGET_BYTES_PER_S);
+    // every sample of the hours out of range is received
+    for (int64_t time_us = start_us + HOUR_US; time_us < start_us + 6 * HOUR_US; time_us += HOUR_US)
+    {
+        const gw_sample_t* sample = gw_find_sample(gw, 0, time_us);
+        CHECK(sample != NULL && llabs(sample->time_us - time_us) <= CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS * 1000LL);
+    }
+#endif
+    return 0;
+}
+
+
+// a phone that is not registered connects to the data adv: it gets the
+// last sample indicated, but its Measurement Interval is rejected even
+// over the encrypted link, the device disconnects once the indication is
+// confirmed, and an idle phone is held for DATA_CONN_GUEST_HOLD_US at
+// most. Once the phone is registered, its interval is taken.
+static int scenario_hts_phone()
+{
+    static const uint8_t phone_addr[6] = {0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6};
+    host_set_temperature(37.25);
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, GW_ACK_NONE);
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    sim_gateway_t* phone = sim_gateway_add(phone_addr, GW_ACK_NONE);
+    phone->is_phone = true;
+    phone->hts_interval_s = 60;
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+
+    CHECK(phone->connections > 0);
+    CHECK(phone->hts_indications == phone->connections);
+    CHECK(phone->hts_last_centi == 3725);
+    CHECK(phone->hts_interval_status == BLE_ATT_ERR_INSUFFICIENT_AUTHOR);
+    CHECK(HOST_RTC_VAR(sched_fixed_interval_ms) == 0);
+    // the phone doesn't disconnect, the device does after the indication
+    CHECK(phone->max_conn_us < 2 * S_US);
+    CHECK(gw->batches > 0);
+
+    // the idle phone is not kept for the idle timeout
+    phone->is_hts_idle = true;
+    uint32_t connections = phone->connections;
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+    CHECK(phone->connections > connections);
+    CHECK(phone->max_conn_us <= DATA_CONN_GUEST_HOLD_US + 100 * 1000);
+
+    // the registered phone sets the interval
+    phone->is_hts_idle = false;
+    phone->wants_registration = true;
+    int64_t press_us = host_now_us() + 10 * S_US;
+    host_press_button(press_us, 2 * S_US);
+    CHECK(host_run_until(press_us + MIN_US));
+    CHECK(phone->is_registered);
+    uint32_t indications = phone->hts_indications;
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+    CHECK(phone->hts_indications > indications);
+    CHECK(phone->hts_interval_status == 0);
+    CHECK(HOST_RTC_VAR(sched_fixed_interval_ms) == 60 * 1000);
+    return 0;
+}
+
+
+// RC_FAST clocks the led in light sleep, it must not stay powered in deep
+// sleep, and a failed deinit must not keep the led mutex
+static int scenario_led()
+{
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+    CHECK(!host_last_sleep()->rc_fast_is_on);
+    CHECK(host_run_until(host_now_us() + 10 * MIN_US));
+    CHECK_ASLEEP();
+    CHECK(!host_last_sleep()->rc_fast_is_on);
+
+    CHECK(led_init(GPIO_LED) == ESP_OK);
+    CHECK(host_sleep_pd_option(ESP_PD_DOMAIN_RC_FAST) == ESP_PD_OPTION_ON);
+    host_ledc_fail_stop(ESP_FAIL);
+    CHECK(led_deinit() == ESP_FAIL);
+    CHECK(xSemaphoreTake(led_mutex, 0) == pdTRUE);
+    xSemaphoreGive(led_mutex);
+    CHECK(host_sleep_pd_option(ESP_PD_DOMAIN_RC_FAST) == ESP_PD_OPTION_AUTO);
+    return 0;
+}
+
+
+// the gateway keeps asking for the whole backlog again, the data wake
+// ends once its radio budget is used up instead of streaming forever
+static int scenario_radio_cap()
+{
+    sim_gateway_t* gw = sim_gateway_add(s_gateway_addr, data_ack_mode());
+    if (power_on_and_register(gw) != 0)
+        return 1;
+
+    gw->peer->is_in_range = false;
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+
+    gw->peer->is_in_range = true;
+    gw->is_sync_stuck = true;
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    int64_t conn_us = host_world()->stats.conn_us;
+    uint32_t connections = gw->connections;
+#endif
+    CHECK(host_run_until(host_now_us() + HOUR_US));
+    CHECK_ASLEEP();
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    CHECK(gw->connections > connections);
+    CHECK(host_world()->stats.conn_us - conn_us <=
+          (int64_t)(gw->connections - connections) * (DATA_RADIO_BUDGET_MS * 1000LL + S_US));
+    CHECK(gw->sync_ends > gw->connections - connections);     // resent within the connection
+    CHECK(HOST_RTC_VAR(flash_log_tail_seq) != HOST_RTC_VAR(flash_log_head_seq));
+#endif
+    return 0;
+}
+
+
+typedef struct {
+    const char* name;
+    int (*fn)();
+} scenario_t;
+
+static const scenario_t s_scenarios[] = {
+    {"power_on", scenario_power_on},
+    {"registration", scenario_registration},
+    {"batch", scenario_batch},
+    {"stub_time", scenario_stub_time},
+    {"registration_full", scenario_registration_full},
+    {"registration_timeout", scenario_registration_timeout},
+    {"deletion", scenario_deletion},
+    {"deletion_rekey", scenario_deletion_rekey},
+    {"power_cycle", scenario_power_cycle},
+    {"ext_fallback", scenario_ext_fallback},
+    {"backlog", scenario_backlog},
+    {"hts_phone", scenario_hts_phone},
+    {"led", scenario_led},
+    {"radio_cap", scenario_radio_cap},
+};
+
+
+int main(int argc, char** argv)
+{
+    size_t cnt = sizeof(s_scenarios) / sizeof(s_scenarios[0]);
+    if (argc < 2)
+    {
+        for (size_t i = 0; i < cnt; i++)
+            printf("%s\n", s_scenarios[i].name);
+        return 0;
+    }
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (strcmp(argv[1], s_scenarios[i].name) != 0)
+            continue;
+
+        host_init();
+        int rc = s_scenarios[i].fn();
+        printf("%s: %s\n", s_scenarios[i].name, rc == 0 ? "passed" : "FAILED");
+        return rc;
+    }
+
+    fprintf(stderr, "unknown scenario: %s\n", argv[1]);
+    return 2;
+}
@@ -0,0 +1,666 @@
+/*
+ * sim_gateway.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_SIM_GATEWAY_H_
+#define HOST_SIM_GATEWAY_H_
+
+
+#include "host_ble.h"
+#include "mbedtls/aes.h"
+#include "app_packet.h"
+#include "packet_auth.h"
+#include "backlog_sync.h"
+#include "time_sync.h"
+#include "health_thermometer.h"
+#include "adv_pdu.h"
+
+// Gateway (or phone) in range of the sensor, it is a peer of host_ble.h
+// with the state in shared memory, so it lives across the wakes:
+// - it scans (in the scan windows if set) and opens the app packet in the
+//   manufacturer's data of the adv, checks the MAC with the key it read
+//   at registration (with its own CMAC) and keeps decoded samples with
+//   the absolute time (receive time - age), duplicates are dropped. A
+//   registered gateway that fails the MAC (the key was replaced) keeps
+//   the packet, connects to the data adv, reads the key again and opens
+//   the packet with it;
+// - it acknowledges data packets with a scan request or a connection
+//   (then it subscribes to the backlog, acknowledges the streamed records
+//   with the cursor and disconnects, a stuck one asks for all of them
+//   again and again);
+// - it connects to the registration adv (reads the key, pairing if the
+//   link must be encrypted) and to the deletion adv when asked to, it is
+//   registered once the device has read its time;
+// - it serves the Current Time characteristic from its own clock;
+// - as a phone it writes the Measurement Interval (pairing if the link
+//   must be encrypted) and then subscribes to the Temperature Measurement
+//   indications, an idle one keeps the link and does nothing.
+
+#define GW_MAX_SAMPLES      4096
+#define GW_EPOCH_LOOKAHEAD  4       // next epochs tried to verify the MAC
+#define GW_TIME_OFFSET_US   1700000000000000LL  // gateway clock at world time 0 (Nov 2023)
+#define GW_DUP_WINDOW_S     1       // samples of a sensor closer in time are duplicates
+
+typedef enum {
+    GW_ACK_NONE = 0,        // passive scanning
+    GW_ACK_SCAN_REQ,        // scan request to the data adv
+    GW_ACK_CONNECT,         // connection to the data adv (backlog sync)
+} gw_ack_mode_t;
+
+typedef enum {
+    GW_CONN_NONE = 0,
+    GW_CONN_REGISTRATION,
+    GW_CONN_DELETION,
+    GW_CONN_DATA,
+} gw_conn_purpose_t;
+
+typedef struct {
+    int64_t time_us;        // world time of the measurement (estimated from the age)
+    uint16_t value;
+    uint8_t sensor;
+} gw_sample_t;
+
+typedef struct {
+    host_ble_peer_t* peer;
+    gw_ack_mode_t ack_mode;
+    bool wants_registration;    // connects to the registration adv
+    bool wants_deletion;        // connects to the deletion adv
+    bool is_phone;              // connects to the data adv for HTS indications only
+    uint16_t hts_interval_s;    // Measurement Interval the phone writes (0 - none)
+    bool is_hts_idle;           // the phone doesn't subscribe and keeps the link
+    bool is_legacy_only;        // doesn't see extended pdus (no BLE 5)
+    bool is_sync_stuck;         // acks none of the backlog and keeps the link (it is resent forever)
+    int64_t window_period_us;   // scan windows of the gateway time (0 - always scans)
+    int64_t window_len_us;
+    int64_t time_offset_us;     // gateway time - world time
+
+    gw_conn_purpose_t conn_purpose;
+    uint32_t conn_cts_reads;    // cts_reads when the connection was opened
+    int64_t conn_start_us;
+    bool is_registered;
+    bool is_deleted;
+    bool has_key;
+    uint8_t key[AUTH_KEY_SIZE];
+    uint32_t last_counter;      // epoch << 16 | seq of the last verified packet
+    bool has_counter;
+    uint16_t key_epoch;         // epoch read with the key
+    bool has_pending;           // the packet that failed the MAC, it's opened after the key is read
+    bool is_reopening;
+    uint8_t pending_len;
+    uint8_t pending[UINT8_MAX];
+    bool has_last_seq;
+    uint16_t last_seq;          // seq of the last opened packet (the adv repeats it)
+    uint16_t last_header;
+
+    uint32_t sync_first_seq;    // first record of the backlog on this connection
+    uint32_t sync_next_seq;     // next expected record of the backlog
+    uint8_t sync_ack[4];        // written cursor (rewritten once the link is encrypted)
+    bool sync_is_started;
+    int64_t sync_start_us;      // the first chunk of this connection is received at
+
+    uint32_t packets;           // unique packets opened
+    uint32_t batches;
+    uint32_t telemetry_packets;
+    uint32_t auth_failures;
+    uint32_t acks;
+    uint32_t scan_reqs_sent;
+    uint32_t connections;
+    int64_t conn_us;            // time connected to the device
+    int64_t max_conn_us;        // the longest connection
+    uint32_t sync_chunks;
+    uint32_t sync_records;
+    uint32_t sync_ends;
+    uint32_t sync_bytes;        // chunk bytes received (the end chunks too)
+    int64_t sync_us;            // time from the first chunk to the end of the backlog
+    uint32_t cts_reads;
+    uint32_t key_reads;
+    uint32_t hts_indications;
+    int hts_interval_status;    // ATT status of the last Measurement Interval write
+    int16_t hts_last_centi;
+    telemetry_summary_t last_telemetry;
+
+    uint32_t sample_cnt;
+    gw_sample_t samples[GW_MAX_SAMPLES];
+} sim_gateway_t;
+
+
+static const ble_uuid128_t gw_key_uuid = AUTH_KEY_CHR_UUID;
+static const ble_uuid128_t gw_sync_data_uuid = SYNC_DATA_CHR_UUID;
+static const ble_uuid128_t gw_sync_cursor_uuid = SYNC_CURSOR_CHR_UUID;
+
+static void gw_on_adv(host_ble_peer_t* peer, const host_ble_adv_view_t* adv);
+static void gw_on_connect(host_ble_peer_t* peer);
+static void gw_on_disconnect(host_ble_peer_t* peer, int reason);
+static void gw_on_notify(host_ble_peer_t* peer, uint16_t attr_handle, const uint8_t* data, uint16_t len,
+                         bool is_indication);
+static int gw_on_read(host_ble_peer_t* peer, uint16_t uuid16, uint8_t* dest, uint16_t* len);
+
+
+// adds the gateway in range, must be done before the first wake
+sim_gateway_t* sim_gateway_add(const uint8_t addr[6], gw_ack_mode_t ack_mode)
+{
+    sim_gateway_t* gw = host_shared_alloc(sizeof(sim_gateway_t));
+    gw->peer = host_ble_add_peer(addr);
+    gw->peer->ctx = gw;
+    gw->peer->on_adv = gw_on_adv;
+    gw->peer->on_connect = gw_on_connect;
+    gw->peer->on_disconnect = gw_on_disconnect;
+    gw->peer->on_notify = gw_on_notify;
+    gw->peer->on_read = gw_on_read;
+    gw->ack_mode = ack_mode;
+    gw->time_offset_us = GW_TIME_OFFSET_US;
+    return gw;
+}
+
+
+int64_t gw_time_us(const sim_gateway_t* gw)
+{
+    return host_now_us() + gw->time_offset_us;
+}
+
+
+// ---------------------------------------------------------------- CMAC
+
+// AES-CMAC (RFC 4493) of the message, the gateway has its own, so the
+// MAC of the sensor is checked against an independent implementation
+void gw_cmac(const uint8_t* key, const uint8_t* msg, size_t msg_len, uint8_t* dest)
+{
+    mbedtls_aes_context aes;
+    mbedtls_aes_init(&aes);
+    mbedtls_aes_setkey_enc(&aes, key, 128);
+
+    uint8_t l[16] = {0}, k1[16], k2[16];
+    mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, l, l);
+    for (int i = 0; i < 16; i++)
+        k1[i] = (l[i] << 1) | (i < 15 ? l[i + 1] >> 7 : 0);
+    if (l[0] & 0x80)
+        k1[15] ^= 0x87;
+    for (int i = 0; i < 16; i++)
+        k2[i] = (k1[i] << 1) | (i < 15 ? k1[i + 1] >> 7 : 0);
+    if (k1[0] & 0x80)
+        k2[15] ^= 0x87;
+
+    size_t blocks = msg_len == 0 ? 1 : (msg_len + 15) / 16;
+    bool is_complete = msg_len > 0 && msg_len % 16 == 0;
+    uint8_t x[16] = {0};
+    for (size_t b = 0; b < blocks; b++)
+    {
+        uint8_t block[16];
+        for (int i = 0; i < 16; i++)
+        {
+            size_t pos = b * 16 + i;
+            block[i] = pos < msg_len ? msg[pos] : (pos == msg_len ? 0x80 : 0);
+        }
+        if (b == blocks - 1)
+            for (int i = 0; i < 16; i++)
+                block[i] ^= is_complete ? k1[i] : k2[i];
+        for (int i = 0; i < 16; i++)
+            x[i] ^= block[i];
+        mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, x, x);
+    }
+    memcpy(dest, x, 16);
+    mbedtls_aes_free(&aes);
+}
+
+
+// finds the counter the packet was sealed with (the same epoch with a
+// larger seq or one of the next epochs), returns false if the MAC is wrong
+// or the packet is a replay
+static bool gw_verify_mac(sim_gateway_t* gw, const uint8_t* packet, uint8_t len, uint16_t seq)
+{
+    if (!gw->has_key)
+        return false;
+
+    uint16_t epoch = gw->has_counter ? gw->last_counter >> 16 : gw->key_epoch;
+    for (uint16_t e = epoch; e <= epoch + GW_EPOCH_LOOKAHEAD; e++)
+    {
+        uint32_t counter = ((uint32_t)e << 16) | seq;
+        if (gw->has_counter && counter <= gw->last_counter)
+            continue;
+
+        uint8_t msg[AUTH_MAX_MSG_SIZE];
+        msg[0] = counter >> 24;
+        msg[1] = counter >> 16;
+        msg[2] = counter >> 8;
+        msg[3] = counter;
+        memcpy(msg + AUTH_COUNTER_SIZE, packet, len);
+        uint8_t mac[16];
+        gw_cmac(gw->key, msg, AUTH_COUNTER_SIZE + len, mac);
+        if (memcmp(mac, packet + len, PACKET_MAC_SIZE) == 0)
+        {
+            gw->last_counter = counter;
+            gw->has_counter = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// ---------------------------------------------------------------- samples
+
+static void gw_store_sample(sim_gateway_t* gw, uint8_t sensor, uint16_t value, int64_t time_us)
+{
+    for (uint32_t i = gw->sample_cnt; i-- > 0;)
+    {
+        const gw_sample_t* sample = &gw->samples[i];
+        int64_t diff_us = sample->time_us - time_us;
+        if (sample->sensor == sensor && diff_us <= GW_DUP_WINDOW_S * 1000000LL &&
+            diff_us >= -GW_DUP_WINDOW_S * 1000000LL)
+            return;
+    }
+    if (gw->sample_cnt == GW_MAX_SAMPLES)
+        host_fail("gateway sample storage is full");
+    gw->samples[gw->sample_cnt++] = (gw_sample_t){.time_us = time_us, .value = value, .sensor = sensor};
+}
+
+
+// decodes the batch received at rx_us, returns the number of samples
+static uint8_t gw_store_batch(sim_gateway_t* gw, const uint8_t* batch, uint8_t len, int64_t rx_us)
+{
+    packet_sample_t samples[BATCH_MAX_SAMPLES];
+    uint8_t cnt = 0;
+    if (decode_batch(samples, BATCH_MAX_SAMPLES, &cnt, batch, len) != 0)
+        return 0;
+    for (uint8_t i = 0; i < cnt; i++)
+        gw_store_sample(gw, samples[i].sensor, samples[i].value, rx_us - (int64_t)samples[i].time_s * 1000000);
+    return cnt;
+}
+
+
+// returns the sample of the sensor closest to the time (NULL - none)
+const gw_sample_t* gw_find_sample(const sim_gateway_t* gw, uint8_t sensor, int64_t time_us)
+{
+    const gw_sample_t* best = NULL;
+    for (uint32_t i = 0; i < gw->sample_cnt; i++)
+    {
+        const gw_sample_t* sample = &gw->samples[i];
+        if (sample->sensor != sensor)
+            continue;
+        if (best == NULL || llabs(sample->time_us - time_us) < llabs(best->time_us - time_us))
+            best = sample;
+    }
+    return best;
+}
+
+
+// ---------------------------------------------------------------- adv
+
+static bool gw_is_scanning(const sim_gateway_t* gw)
+{
+    if (gw->window_period_us == 0)
+        return true;
+    return gw_time_us(gw) % gw->window_period_us < gw->window_len_us;
+}
+
+
+// finds the manufacturer's data field
+static bool gw_find_mfg_data(const uint8_t* data, uint16_t len, const uint8_t** dest, uint8_t* dest_len)
+{
+    uint16_t pos = 0;
+    while (pos + 1 < len)
+    {
+        uint8_t field_len = data[pos];
+        if (field_len == 0 || pos + 1 + field_len > len)
+            return false;
+        if (data[pos + 1] == ADV_TYPE_MFG_DATA)
+        {
+            *dest = data + pos + 2;
+            *dest_len = field_len - 1;
+            return true;
+        }
+        pos += 1 + field_len;
+    }
+    return false;
+}
+
+
+// opens the data packet, returns true if it's new and valid
+static bool gw_on_data_packet(sim_gateway_t* gw, const uint8_t* packet, uint8_t packet_len,
+                              const packet_info_t* info)
+{
+    if (gw->has_last_seq && gw->last_seq == info->seq && gw->last_header == info->header)
+        return true;    // the same packet on the next adv event
+
+    if (info->is_auth)
+    {
+        uint8_t len = packet_len - PACKET_MAC_SIZE;
+        if (!gw_verify_mac(gw, packet, len, info->seq))
+        {
+            if (gw->is_registered && !gw->has_pending && !gw->is_reopening)
+            {
+                memcpy(gw->pending, packet, packet_len);
+                gw->pending_len = packet_len;
+                gw->has_pending = true;
+            }
+            else
+                gw->auth_failures++;
+            return false;
+        }
+    }
+
+    gw->has_last_seq = true;
+    gw->last_seq = info->seq;
+    gw->last_header = info->header;
+    gw->packets++;
+
+    if (info->header == BATCH_HEADER)
+    {
+        gw->batches++;
+        gw_store_batch(gw, info->payload, info->payload_len, host_now_us());
+    }
+    else if (info->header == TELEMETRY_HEADER)
+    {
+        gw->telemetry_packets++;
+        decode_telemetry(&gw->last_telemetry, info->payload, info->payload_len);
+    }
+    return true;
+}
+
+
+static void gw_on_adv(host_ble_peer_t* peer, const host_ble_adv_view_t* adv)
+{
+    sim_gateway_t* gw = peer->ctx;
+    if (!gw_is_scanning(gw) || host_ble_peer_is_connected(peer) || (adv->is_ext_pdu && gw->is_legacy_only))
+        return;
+
+    const uint8_t* packet;
+    uint8_t packet_len;
+    packet_info_t info;
+    if (!gw_find_mfg_data(adv->data, adv->data_len, &packet, &packet_len) ||
+        open_packet(&info, packet, packet_len) != 0)
+        return;
+
+    if (info.header == REG_HEADER || info.header == DEL_HEADER)
+    {
+        bool wants = info.header == REG_HEADER ? gw->wants_registration : gw->wants_deletion;
+        if (wants && adv->is_connectable && host_ble_peer_connect(peer) == 0)
+            gw->conn_purpose = info.header == REG_HEADER ? GW_CONN_REGISTRATION : GW_CONN_DELETION;
+        return;
+    }
+
+    if (gw->is_phone)
+    {
+        if (adv->is_connectable && host_ble_peer_connect(peer) == 0)
+            gw->conn_purpose = GW_CONN_DATA;
+        return;
+    }
+
+    if (!gw_on_data_packet(gw, packet, packet_len, &info))
+    {
+        if (gw->has_pending && gw->conn_purpose == GW_CONN_NONE && adv->is_connectable &&
+            host_ble_peer_connect(peer) == 0)
+            gw->conn_purpose = GW_CONN_DATA;
+        return;
+    }
+
+    switch (gw->ack_mode)
+    {
+        case GW_ACK_SCAN_REQ:
+            if (adv->is_scannable && host_ble_peer_scan_req(peer, NULL, NULL) == 0)
+                gw->scan_reqs_sent++;
+            break;
+        case GW_ACK_CONNECT:
+            if (adv->is_connectable && host_ble_peer_connect(peer) == 0)
+                gw->conn_purpose = GW_CONN_DATA;
+            break;
+        default:
+            break;
+    }
+}
+
+
+// ---------------------------------------------------------------- connection
+
+static void gw_on_key_read(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len);
+static void gw_start_sync(host_ble_peer_t* peer);
+
+static void gw_on_encrypted(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    if (status == 0)
+        host_ble_peer_read(peer, &gw_key_uuid.u, gw_on_key_read);
+}
+
+
+static void gw_on_key_read(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    sim_gateway_t* gw = peer->ctx;
+    if (status == BLE_ATT_ERR_INSUFFICIENT_ENC)
+    {
+        host_ble_peer_encrypt(peer, gw_on_encrypted);
+        return;
+    }
+    if (status == 0 && len == AUTH_KEY_VALUE_SIZE)
+    {
+        memcpy(gw->key, data, AUTH_KEY_SIZE);
+        gw->key_epoch = (data[AUTH_KEY_SIZE] << 8) | data[AUTH_KEY_SIZE + 1];
+        gw->has_key = true;
+        gw->has_counter = false;
+        gw->key_reads++;
+    }
+    if (gw->conn_purpose != GW_CONN_DATA)
+        return;
+
+    // the key is read again on the data connection, the packet that
+    // failed the MAC is opened with it, then the backlog goes on
+    if (gw->has_pending)
+    {
+        packet_info_t info;
+        gw->has_pending = false;
+        gw->is_reopening = true;
+        if (open_packet(&info, gw->pending, gw->pending_len) == 0)
+            gw_on_data_packet(gw, gw->pending, gw->pending_len, &info);
+        gw->is_reopening = false;
+    }
+    gw_start_sync(peer);
+}
+
+
+static void gw_on_sync_ack(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len);
+
+static void gw_on_sync_encrypted(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    sim_gateway_t* gw = peer->ctx;
+    if (status == 0)
+        host_ble_peer_write(peer, &gw_sync_cursor_uuid.u, gw->sync_ack, sizeof(gw->sync_ack), gw_on_sync_ack);
+}
+
+
+static void gw_on_sync_ack(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    sim_gateway_t* gw = peer->ctx;
+    // the cursor is written over the encrypted link only
+    if (status == BLE_ATT_ERR_INSUFFICIENT_ENC)
+    {
+        host_ble_peer_encrypt(peer, gw_on_sync_encrypted);
+        return;
+    }
+    if (gw->is_sync_stuck)
+        return;
+
+    // the backlog is received, the connection is not needed anymore
+    host_ble_peer_disconnect(peer);
+}
+
+
+static void gw_on_sync_subscribed(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    // the device has no backlog service, the connection was the ack
+    if (status != 0)
+        host_ble_peer_disconnect(peer);
+}
+
+
+// the data connection is the ack, the gateway subscribes to the backlog
+static void gw_start_sync(host_ble_peer_t* peer)
+{
+    sim_gateway_t* gw = peer->ctx;
+    gw->acks++;
+    gw->sync_is_started = false;
+    host_ble_peer_subscribe(peer, &gw_sync_data_uuid.u, true, false, gw_on_sync_subscribed);
+}
+
+
+static void gw_on_hts_interval_written(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len);
+
+static void gw_on_hts_encrypted(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    sim_gateway_t* gw = peer->ctx;
+    uint8_t interval[2] = {gw->hts_interval_s & 0xFF, gw->hts_interval_s >> 8};
+    if (status == 0)
+        host_ble_peer_write(peer, BLE_UUID16_DECLARE(HTS_INTERVAL_CHR_UUID), interval, sizeof(interval),
+                            gw_on_hts_interval_written);
+}
+
+
+// the interval is written over the encrypted link only, the phone
+// subscribes once the write is over (accepted or not)
+static void gw_on_hts_interval_written(host_ble_peer_t* peer, int status, const uint8_t* data, uint16_t len)
+{
+    sim_gateway_t* gw = peer->ctx;
+    if (status == BLE_ATT_ERR_INSUFFICIENT_ENC)
+    {
+        host_ble_peer_encrypt(peer, gw_on_hts_encrypted);
+        return;
+    }
+    gw->hts_interval_status = status;
+    host_ble_peer_subscribe(peer, BLE_UUID16_DECLARE(HTS_MEASUREMENT_CHR_UUID), false, true, NULL);
+}
+
+
+static void gw_on_connect(host_ble_peer_t* peer)
+{
+    sim_gateway_t* gw = peer->ctx;
+    gw->connections++;
+    gw->conn_cts_reads = gw->cts_reads;
+    gw->conn_start_us = host_now_us();
+
+    switch (gw->conn_purpose)
+    {
+        case GW_CONN_REGISTRATION:
+#if CONFIG_TEMP_PACKET_AUTH
+            host_ble_peer_read(peer, &gw_key_uuid.u, gw_on_key_read);
+#endif
+            break;
+        case GW_CONN_DATA:
+            if (gw->is_phone)
+            {
+                if (gw->is_hts_idle)
+                    break;
+                if (gw->hts_interval_s != 0)
+                {
+                    uint8_t interval[2] = {gw->hts_interval_s & 0xFF, gw->hts_interval_s >> 8};
+                    host_ble_peer_write(peer, BLE_UUID16_DECLARE(HTS_INTERVAL_CHR_UUID), interval, sizeof(interval),
+                                        gw_on_hts_interval_written);
+                }
+                else
+                    host_ble_peer_subscribe(peer, BLE_UUID16_DECLARE(HTS_MEASUREMENT_CHR_UUID), false, true, NULL);
+            }
+            else if (gw->has_pending)
+                host_ble_peer_read(peer, &gw_key_uuid.u, gw_on_key_read);
+            else
+                gw_start_sync(peer);
+            break;
+        default:
+            break;
+    }
+}
+
+
+static void gw_on_disconnect(host_ble_peer_t* peer, int reason)
+{
+    sim_gateway_t* gw = peer->ctx;
+    int64_t conn_us = host_now_us() - gw->conn_start_us;
+    gw->conn_us += conn_us;
+    if (conn_us > gw->max_conn_us)
+        gw->max_conn_us = conn_us;
+
+    // the device reads the time of the gateway it took, a rejected one
+    // is disconnected right away
+    if (gw->conn_purpose == GW_CONN_REGISTRATION && gw->cts_reads > gw->conn_cts_reads)
+    {
+        gw->is_registered = true;
+        gw->wants_registration = false;
+    }
+    else if (gw->conn_purpose == GW_CONN_DELETION)
+    {
+        gw->is_deleted = true;
+        gw->is_registered = false;
+        gw->wants_deletion = false;
+    }
+    gw->conn_purpose = GW_CONN_NONE;
+}
+
+
+static void gw_on_notify(host_ble_peer_t* peer, uint16_t attr_handle, const uint8_t* data, uint16_t len,
+                         bool is_indication)
+{
+    sim_gateway_t* gw = peer->ctx;
+    if (is_indication)
+    {
+        // Temperature Measurement: flags, FLOAT (centi-degrees), [timestamp]
+        if (len >= 5)
+        {
+            gw->hts_indications++;
+            gw->hts_last_centi = (int16_t)(data[1] | (data[2] << 8));
+        }
+        return;
+    }
+
+    if (len < SYNC_CHUNK_HEADER_SIZE)
+        return;
+    uint32_t seq = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    uint16_t span = (data[4] << 8) | data[5];
+    gw->sync_chunks++;
+    gw->sync_bytes += len;
+    if (!gw->sync_is_started)
+    {
+        gw->sync_first_seq = seq;
+        gw->sync_next_seq = seq;
+        gw->sync_start_us = host_now_us();
+        gw->sync_is_started = true;
+    }
+
+    if (span == 0)
+    {
+        // end of the backlog, the received records are acknowledged
+        gw->sync_ends++;
+        gw->sync_us += host_now_us() - gw->sync_start_us;
+        uint32_t ack_seq = gw->is_sync_stuck ? gw->sync_first_seq : gw->sync_next_seq;
+        gw->sync_ack[0] = ack_seq >> 24;
+        gw->sync_ack[1] = ack_seq >> 16;
+        gw->sync_ack[2] = ack_seq >> 8;
+        gw->sync_ack[3] = ack_seq;
+        host_ble_peer_write(peer, &gw_sync_cursor_uuid.u, gw->sync_ack, sizeof(gw->sync_ack), gw_on_sync_ack);
+        return;
+    }
+
+    if (seq != gw->sync_next_seq)
+        return;     // a lost chunk, the rest is resent after the ack
+    gw->sync_records += gw_store_batch(gw, data + SYNC_CHUNK_HEADER_SIZE, len - SYNC_CHUNK_HEADER_SIZE,
+                                       host_now_us()) > 0 ? span : 0;
+    gw->sync_next_seq = seq + span;
+}
+
+
+// Current Time of the gateway clock
+static int gw_on_read(host_ble_peer_t* peer, uint16_t uuid16, uint8_t* dest, uint16_t* len)
+{
+    sim_gateway_t* gw = peer->ctx;
+    if (uuid16 != TIME_SYNC_CTS_UUID)
+        return BLE_ATT_ERR_ATTR_NOT_FOUND;
+
+    int64_t time_us = gw_time_us(gw);
+    memset(dest, 0, TIME_SYNC_CTS_LEN);
+    convert_us_to_date_time(time_us, dest);
+    dest[8] = (time_us % 1000000) * 256 / 1000000;
+    *len = TIME_SYNC_CTS_LEN;
+    gw->cts_reads++;
+    return 0;
+}
+
+
+#endif /* HOST_SIM_GATEWAY_H_ */
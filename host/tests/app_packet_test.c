@@ -0,0 +1,555 @@
+/*
+ * app_packet_test.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// Batch codec of app_packet.h: the samples decoded by the gateway are the
+// encoded ones (values, sensors and ages), the oldest samples are kept when
+// not all of them fit, and malformed payloads are rejected. Packets of all
+// types open to what was sealed and a flipped bit is caught by the crc.
+// fuzz feeds mutated packets and payloads to the decoders of the gateway,
+// app_packet_test_asan runs it with the address and undefined behaviour
+// sanitizers, and with HOST_LIBFUZZER the same body is the entry point of
+// libFuzzer (clang -fsanitize=fuzzer). bench_codec measures batch encode
+// and decode over synthetic body temperature traces, bench_packet the
+// whole packet as the device forms it and the gateway ingests it.
+
+#include "host_test.h"
+#include "app_packet.h"
+
+
+#define LEGACY_PAYLOAD_SIZE 18      // batch payload of legacy pdu with the MAC (see adv_pdu.h)
+#define EXT_PAYLOAD_SIZE    171     // batch payload of extended pdu with the MAC
+#define NOW_S               1000000
+#define MAX_PACKET_SIZE     255
+
+
+// fills samples of the trace from the oldest to the newest, the newest
+// one is measured at NOW_S
+static void make_samples(packet_sample_t* samples, uint8_t cnt, host_test_trace_t* trace, bool irregular,
+                         uint8_t sensors_cnt)
+{
+    uint32_t time_s = NOW_S;
+    for (uint8_t i = cnt; i-- > 0;)
+    {
+        samples[i].value = host_test_trace_next(trace);
+        samples[i].sensor = sensors_cnt > 1 ? host_test_rand() % sensors_cnt : 0;
+        samples[i].time_s = time_s;
+        time_s -= irregular ? 5 + host_test_rand() % 600 : 5;
+    }
+}
+
+
+// encodes the samples, decodes the payload and compares, the decoded
+// samples of several sensors come group by group (in the order of the
+// first sample of every sensor)
+static int check_round_trip(const packet_sample_t* samples, uint8_t cnt, uint8_t payload_size, uint8_t* dest_encoded_cnt)
+{
+    uint8_t payload[255];
+    uint8_t payload_len = 0;
+    uint8_t encoded_cnt = encode_batch(payload, payload_size, &payload_len, samples, cnt, NOW_S);
+    CHECK(encoded_cnt > 0 && encoded_cnt <= cnt);
+    CHECK(payload_len <= payload_size);
+
+    packet_sample_t decoded[BATCH_MAX_SAMPLES];
+    uint8_t decoded_cnt = 0;
+    CHECK(decode_batch(decoded, BATCH_MAX_SAMPLES, &decoded_cnt, payload, payload_len) == 0);
+    CHECK(decoded_cnt == encoded_cnt);
+
+    bool is_checked[BATCH_MAX_SAMPLES] = {};
+    uint8_t pos = 0;
+    for (uint8_t first = 0; first < encoded_cnt; first++)
+    {
+        if (is_checked[first])
+            continue;
+        for (uint8_t i = first; i < encoded_cnt; i++)
+        {
+            if (samples[i].sensor != samples[first].sensor)
+                continue;
+            is_checked[i] = true;
+            CHECK(decoded[pos].sensor == samples[i].sensor);
+            CHECK(decoded[pos].value == samples[i].value);
+            CHECK(decoded[pos].time_s == NOW_S - samples[i].time_s);
+            pos++;
+        }
+    }
+    CHECK(pos == decoded_cnt);
+
+    if (dest_encoded_cnt != NULL)
+        *dest_encoded_cnt = encoded_cnt;
+    return 0;
+}
+
+
+// forms a packet of the kind (batch of legacy or extended pdu, telemetry,
+// registration) from the trace, returns its length
+static uint8_t make_packet(uint8_t* packet, uint8_t kind, uint16_t seq, host_test_trace_t* trace)
+{
+    if (kind == 2)
+    {
+        telemetry_summary_t summary = {.wake_cnt = host_test_rand(), .boot_cnt = host_test_rand(),
+                                       .error_cnt = host_test_rand() % 4};
+        for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++)
+        {
+            summary.phase_avg[i] = host_test_rand() % 5000;
+            summary.phase_max[i] = summary.phase_avg[i] + host_test_rand() % 5000;
+        }
+        encode_telemetry(packet + PACKET_HEADER_SIZE, TELEMETRY_PAYLOAD_SIZE, &summary);
+        return seal_packet(packet, TELEMETRY_HEADER, seq, TELEMETRY_PAYLOAD_SIZE);
+    }
+    if (kind == 3)
+        return seal_packet(packet, REG_HEADER, seq, 0);
+
+    packet_sample_t samples[BATCH_MAX_SAMPLES];
+    uint8_t cnt = kind == 0 ? 12 : 48;
+    uint8_t payload_len = 0;
+    make_samples(samples, cnt, trace, host_test_rand() % 4 == 0, host_test_rand() % 4 == 0 ? 3 : 1);
+    encode_batch(packet + PACKET_HEADER_SIZE, kind == 0 ? LEGACY_PAYLOAD_SIZE : EXT_PAYLOAD_SIZE, &payload_len,
+                 samples, cnt, NOW_S);
+    return seal_packet(packet, BATCH_HEADER, seq, payload_len);
+}
+
+
+// one input of the fuzzer: a received packet, or a payload (the gateway
+// decodes the payload of the packet it opened). Nothing is read out of the
+// input, what is accepted is consistent, and the decoded batches and
+// telemetry encode back to the same samples and bytes
+static int fuzz_input(const uint8_t* data, uint8_t len)
+{
+    packet_sample_t samples[BATCH_MAX_SAMPLES];
+    uint8_t cnt = 0;
+    if (decode_batch(samples, BATCH_MAX_SAMPLES, &cnt, data, len) == 0)
+        CHECK(cnt > 0 && cnt <= BATCH_MAX_SAMPLES);
+
+    packet_info_t info;
+    if (open_packet(&info, data, len) != 0)
+        return 0;
+    CHECK(header_is_valid(info.header) && info.header == data[1]);
+    CHECK(info.payload == data + PACKET_HEADER_SIZE);
+    CHECK(info.payload_len + (info.is_auth ? PACKET_AUTH_OVERHEAD : PACKET_OVERHEAD) == len);
+    if (!info.is_auth)
+    {
+        uint8_t packet[MAX_PACKET_SIZE];
+        memcpy(packet, data, len);
+        CHECK(seal_packet(packet, info.header, info.seq, info.payload_len) == len);
+        CHECK(memcmp(packet, data, len) == 0);
+    }
+
+    if (info.header == TELEMETRY_HEADER)
+    {
+        telemetry_summary_t summary;
+        uint8_t payload[TELEMETRY_PAYLOAD_SIZE];
+        if (decode_telemetry(&summary, info.payload, info.payload_len) == 0)
+        {
+            CHECK(encode_telemetry(payload, sizeof(payload), &summary) == 0);
+            CHECK(memcmp(payload, info.payload, TELEMETRY_PAYLOAD_SIZE) == 0);
+        }
+    }
+
+    // a batch of one sensor is encoded again from the decoded ages (the
+    // encoding may differ, e.g. the shortest varints), the groups of
+    // several sensors may be merged, so they are not
+    if (info.header == BATCH_HEADER && info.payload_len > 0 && !(info.payload[0] & BATCH_F_MULTI) &&
+        decode_batch(samples, BATCH_MAX_SAMPLES, &cnt, info.payload, info.payload_len) == 0)
+    {
+        packet_sample_t times[BATCH_MAX_SAMPLES], decoded[BATCH_MAX_SAMPLES];
+        for (uint8_t i = 0; i < cnt; i++)
+        {
+            times[i] = samples[i];
+            times[i].time_s = NOW_S - samples[i].time_s;
+        }
+        uint8_t payload[MAX_PACKET_SIZE];
+        uint8_t payload_len = 0;
+        uint8_t decoded_cnt = 0;
+        CHECK(encode_batch(payload, sizeof(payload), &payload_len, times, cnt, NOW_S) == cnt);
+        CHECK(decode_batch(decoded, BATCH_MAX_SAMPLES, &decoded_cnt, payload, payload_len) == 0);
+        CHECK(decoded_cnt == cnt);
+        for (uint8_t i = 0; i < cnt; i++)
+            CHECK(decoded[i].value == samples[i].value && decoded[i].time_s == samples[i].time_s &&
+                  decoded[i].sensor == samples[i].sensor);
+    }
+    return 0;
+}
+
+
+// runs the input from a buffer of its size, so the sanitizers catch any
+// read out of it
+static int fuzz_packet(const uint8_t* data, size_t size)
+{
+    uint8_t len = size > MAX_PACKET_SIZE ? MAX_PACKET_SIZE : size;
+    uint8_t* input = malloc(len ? len : 1);
+    memcpy(input, data, len);
+    int rc = fuzz_input(input, len);
+    free(input);
+    return rc;
+}
+
+
+#ifdef HOST_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (fuzz_packet(data, size) != 0)
+        abort();
+    return 0;
+}
+#endif
+
+
+// ---------------------------------------------------------------- cases
+
+static int test_varint()
+{
+    static const uint32_t values[] = {0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 268435455, 268435456,
+                                      UINT32_MAX};
+    for (size_t i = 0; i < HOST_TEST_CNT(values); i++)
+    {
+        uint8_t buff[VARINT_MAX_SIZE];
+        uint8_t len = write_varint(buff, sizeof(buff), values[i]);
+        CHECK(len == varint_size(values[i]));
+        CHECK(write_varint(buff, len - 1, values[i]) == 0);
+
+        uint32_t value = 0;
+        CHECK(read_varint(&value, buff, len) == len && value == values[i]);
+        CHECK(read_varint(&value, buff, len - 1) == 0);     // truncated
+    }
+
+    // more than 5 bytes is malformed
+    static const uint8_t too_long[] = {0x80, 0x80, 0x80, 0x80, 0x80, 0x01};
+    uint32_t value;
+    CHECK(read_varint(&value, too_long, sizeof(too_long)) == 0);
+
+    static const int32_t deltas[] = {0, -1, 1, -64, 63, -65, 64, INT32_MIN, INT32_MAX};
+    for (size_t i = 0; i < HOST_TEST_CNT(deltas); i++)
+        CHECK(zigzag_decode(zigzag_encode(deltas[i])) == deltas[i]);
+    CHECK(zigzag_encode(-64) == 127 && zigzag_encode(63) == 126);   // one byte deltas
+    return 0;
+}
+
+
+static int test_regular()
+{
+    host_test_trace_t trace = {};
+    for (int run = 0; run < 20000; run++)
+    {
+        packet_sample_t samples[BATCH_MAX_SAMPLES];
+        uint8_t cnt = 1 + host_test_rand() % BATCH_MAX_SAMPLES;
+        make_samples(samples, cnt, &trace, false, 1);
+        if (check_round_trip(samples, cnt, LEGACY_PAYLOAD_SIZE, NULL) != 0 ||
+            check_round_trip(samples, cnt, EXT_PAYLOAD_SIZE, NULL) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+static int test_irregular()
+{
+    host_test_trace_t trace = {};
+    for (int run = 0; run < 20000; run++)
+    {
+        packet_sample_t samples[BATCH_MAX_SAMPLES];
+        uint8_t cnt = 2 + host_test_rand() % (BATCH_MAX_SAMPLES - 1);
+        make_samples(samples, cnt, &trace, true, 1);
+        if (check_round_trip(samples, cnt, LEGACY_PAYLOAD_SIZE, NULL) != 0 ||
+            check_round_trip(samples, cnt, EXT_PAYLOAD_SIZE, NULL) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+static int test_multi_sensor()
+{
+    host_test_trace_t trace = {};
+    for (int run = 0; run < 20000; run++)
+    {
+        packet_sample_t samples[BATCH_MAX_SAMPLES];
+        uint8_t cnt = 2 + host_test_rand() % (BATCH_MAX_SAMPLES - 1);
+        make_samples(samples, cnt, &trace, run % 2, 3);
+        samples[0].sensor = 1;      // the batch has groups
+        if (check_round_trip(samples, cnt, LEGACY_PAYLOAD_SIZE, NULL) != 0 ||
+            check_round_trip(samples, cnt, EXT_PAYLOAD_SIZE, NULL) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+// a batch of legacy pdu holds the samples collected for it when the
+// temperature is stable, the extended one holds the extended batch
+static int test_capacity()
+{
+    host_test_trace_t trace = {};
+    for (int run = 0; run < 1000; run++)
+    {
+        packet_sample_t samples[BATCH_MAX_SAMPLES];
+        uint8_t encoded_cnt = 0;
+        make_samples(samples, 12, &trace, false, 1);
+        if (check_round_trip(samples, 12, LEGACY_PAYLOAD_SIZE, &encoded_cnt) != 0)
+            return 1;
+        CHECK(encoded_cnt == 12);
+
+        make_samples(samples, 48, &trace, false, 1);
+        if (check_round_trip(samples, 48, EXT_PAYLOAD_SIZE, &encoded_cnt) != 0)
+            return 1;
+        CHECK(encoded_cnt == 48);
+    }
+    return 0;
+}
+
+
+static int test_malformed()
+{
+    host_test_trace_t trace = {};
+    for (int run = 0; run < 5000; run++)
+    {
+        packet_sample_t samples[BATCH_MAX_SAMPLES];
+        uint8_t cnt = 1 + host_test_rand() % BATCH_MAX_SAMPLES;
+        make_samples(samples, cnt, &trace, run % 2, run % 3 == 0 ? 2 : 1);
+
+        uint8_t payload[EXT_PAYLOAD_SIZE];
+        uint8_t payload_len = 0;
+        CHECK(encode_batch(payload, sizeof(payload), &payload_len, samples, cnt, NOW_S) > 0);
+
+        // every truncated payload is rejected
+        packet_sample_t decoded[BATCH_MAX_SAMPLES];
+        uint8_t decoded_cnt = 0;
+        for (uint8_t len = 0; len < payload_len; len++)
+            CHECK(decode_batch(decoded, BATCH_MAX_SAMPLES, &decoded_cnt, payload, len) != 0);
+
+        // so is the batch that doesn't fit into the destination
+        if (decode_batch(decoded, BATCH_MAX_SAMPLES, &decoded_cnt, payload, payload_len) == 0 && decoded_cnt > 1)
+            CHECK(decode_batch(decoded, decoded_cnt - 1, &decoded_cnt, payload, payload_len) != 0);
+    }
+
+    uint8_t no_samples[] = {0x00, 0x00, 0x05, 0x24, 0x90};
+    packet_sample_t decoded[BATCH_MAX_SAMPLES];
+    uint8_t decoded_cnt = 0;
+    CHECK(decode_batch(decoded, BATCH_MAX_SAMPLES, &decoded_cnt, no_samples, sizeof(no_samples)) != 0);
+    CHECK(encode_batch(no_samples, sizeof(no_samples), &decoded_cnt, NULL, 1, NOW_S) == 0);
+    return 0;
+}
+
+
+// packets of all types and payload lengths open to what was sealed, a
+// flipped bit is caught (by the version and type checks or the crc)
+static int test_packet()
+{
+    static const uint16_t headers[] = {REG_HEADER, DEL_HEADER, DATA_HEADER, BATCH_HEADER, TELEMETRY_HEADER};
+    for (size_t h = 0; h < HOST_TEST_CNT(headers); h++)
+    {
+        for (uint16_t payload_len = 0; payload_len <= MAX_PACKET_SIZE - PACKET_OVERHEAD; payload_len++)
+        {
+            uint8_t payload[MAX_PACKET_SIZE], packet[MAX_PACKET_SIZE];
+            for (uint16_t i = 0; i < payload_len; i++)
+                payload[i] = host_test_rand();
+            uint16_t seq = host_test_rand();
+            CHECK(form_packet(packet, payload_len + PACKET_OVERHEAD - 1, headers[h], seq, payload, payload_len) == -1);
+            int16_t len = form_packet(packet, sizeof(packet), headers[h], seq, payload, payload_len);
+            CHECK(len == payload_len + PACKET_OVERHEAD);
+
+            packet_info_t info;
+            CHECK(open_packet(&info, packet, len) == 0);
+            CHECK(info.header == headers[h] && info.seq == seq && !info.is_auth);
+            CHECK(info.payload_len == payload_len && memcmp(info.payload, payload, payload_len) == 0);
+
+            for (uint16_t bit = 0; bit < len * 8; bit++)
+            {
+                packet[bit / 8] ^= 1 << (bit % 8);
+                if (bit / 8 != 0 || bit % 8 != 7)   // the auth flag, the packet is opened without the crc
+                    CHECK(open_packet(&info, packet, len) != 0);
+                packet[bit / 8] ^= 1 << (bit % 8);
+            }
+        }
+    }
+
+    uint8_t packet[PACKET_OVERHEAD] = {PACKET_VERSION, 0x06};
+    packet_info_t info;
+    CHECK(seal_packet(packet, 0x06, 0, 0) == PACKET_OVERHEAD && open_packet(&info, packet, PACKET_OVERHEAD) != 0);
+    CHECK(open_packet(&info, packet, PACKET_OVERHEAD - 1) != 0);
+    return 0;
+}
+
+
+// mutations of valid packets (bit flips, random bytes, cuts and tails)
+// and random bytes, half of the mutated packets get a valid crc again, so
+// the payload decoders get them too
+static int test_fuzz()
+{
+    host_test_trace_t trace = {};
+    for (uint32_t run = 0; run < 500000; run++)
+    {
+        uint8_t packet[MAX_PACKET_SIZE + 1];
+        uint16_t len = make_packet(packet, run % 4, run, &trace);
+        uint8_t mutations = host_test_rand() % 4;
+        for (uint8_t m = 0; m < mutations; m++)
+        {
+            switch (host_test_rand() % 5)
+            {
+            case 0:
+                packet[host_test_rand() % len] ^= 1 << (host_test_rand() % 8);
+                break;
+            case 1:
+                packet[host_test_rand() % len] = host_test_rand();
+                break;
+            case 2:
+                len -= len > 1 ? host_test_rand() % (len / 2 + 1) : 0;
+                break;
+            case 3:
+                while (len < MAX_PACKET_SIZE && host_test_rand() % 4)
+                    packet[len++] = host_test_rand();
+                break;
+            default:
+                len = 1 + host_test_rand() % MAX_PACKET_SIZE;
+                for (uint16_t i = 0; i < len; i++)
+                    packet[i] = host_test_rand();
+            }
+        }
+        if (host_test_rand() % 2 && len > PACKET_CRC_SIZE)
+            packet[len - 1] = crc8(packet, len - 1);
+
+        if (fuzz_packet(packet, len) != 0 || fuzz_packet(packet + PACKET_HEADER_SIZE, len > PACKET_HEADER_SIZE ?
+                                                         len - PACKET_HEADER_SIZE : 0) != 0)
+        {
+            fprintf(stderr, "run %u, input:", run);
+            for (uint16_t i = 0; i < len; i++)
+                fprintf(stderr, " %02X", packet[i]);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// encodes and decodes batches of synthetic traces (legacy and extended
+// batch sizes), prints samples per second and the mean payload size
+static int bench_codec()
+{
+    static const struct {
+        const char* name;
+        uint8_t samples_cnt;
+        uint8_t payload_size;
+    } configs[] = {
+        {"legacy", 12, LEGACY_PAYLOAD_SIZE},
+        {"extended", 48, EXT_PAYLOAD_SIZE},
+    };
+    const uint32_t batches_cnt = 200000;
+
+    for (size_t c = 0; c < HOST_TEST_CNT(configs); c++)
+    {
+        uint8_t samples_cnt = configs[c].samples_cnt;
+        packet_sample_t* samples = malloc(sizeof(packet_sample_t) * samples_cnt * batches_cnt);
+        uint8_t* payloads = malloc((size_t)configs[c].payload_size * batches_cnt);
+        uint8_t* lens = malloc(batches_cnt);
+        host_test_trace_t trace = {};
+        for (uint32_t b = 0; b < batches_cnt; b++)
+            make_samples(samples + b * samples_cnt, samples_cnt, &trace, false, 1);
+
+        uint64_t encoded_cnt = 0, bytes_cnt = 0;
+        int64_t start_ns = host_test_now_ns();
+        for (uint32_t b = 0; b < batches_cnt; b++)
+            encoded_cnt += encode_batch(payloads + (size_t)b * configs[c].payload_size, configs[c].payload_size,
+                                        &lens[b], samples + b * samples_cnt, samples_cnt, NOW_S);
+        int64_t encode_ns = host_test_now_ns() - start_ns;
+
+        uint64_t decoded_cnt = 0;
+        start_ns = host_test_now_ns();
+        for (uint32_t b = 0; b < batches_cnt; b++)
+        {
+            packet_sample_t decoded[BATCH_MAX_SAMPLES];
+            uint8_t cnt = 0;
+            if (decode_batch(decoded, BATCH_MAX_SAMPLES, &cnt, payloads + (size_t)b * configs[c].payload_size,
+                             lens[b]) == 0)
+                decoded_cnt += cnt;
+            bytes_cnt += lens[b];
+        }
+        int64_t decode_ns = host_test_now_ns() - start_ns;
+
+        printf("%-8s %2u samples: encode %6.1f M samples/s, decode %6.1f M samples/s, %.1f bytes per batch (%.2f per sample)\n",
+               configs[c].name, samples_cnt, encoded_cnt * 1e3 / encode_ns, decoded_cnt * 1e3 / decode_ns,
+               (double)bytes_cnt / batches_cnt, (double)bytes_cnt / decoded_cnt);
+        free(samples);
+        free(payloads);
+        free(lens);
+        CHECK(decoded_cnt == encoded_cnt);
+    }
+    return 0;
+}
+
+
+// forms packets as the device does (encode and seal) and ingests them as
+// the gateway does (open and decode) for the batches of legacy and extended
+// pdu and the telemetry, prints packets per second
+static int bench_packet()
+{
+    static const char* names[] = {"legacy", "extended", "telemetry"};
+    const uint32_t packets_cnt = 200000;
+
+    for (uint8_t kind = 0; kind < HOST_TEST_CNT(names); kind++)
+    {
+        // the forming is timed with making the samples of the trace
+        uint8_t* packets = malloc((size_t)MAX_PACKET_SIZE * packets_cnt);
+        uint8_t* lens = malloc(packets_cnt);
+        host_test_trace_t trace = {};
+        int64_t start_ns = host_test_now_ns();
+        for (uint32_t p = 0; p < packets_cnt; p++)
+            lens[p] = make_packet(packets + (size_t)p * MAX_PACKET_SIZE, kind, p, &trace);
+        int64_t form_ns = host_test_now_ns() - start_ns;
+
+        uint64_t samples_cnt = 0, bytes_cnt = 0;
+        uint32_t ingested_cnt = 0;
+        start_ns = host_test_now_ns();
+        for (uint32_t p = 0; p < packets_cnt; p++)
+        {
+            packet_info_t info;
+            if (open_packet(&info, packets + (size_t)p * MAX_PACKET_SIZE, lens[p]) != 0)
+                continue;
+
+            packet_sample_t samples[BATCH_MAX_SAMPLES];
+            telemetry_summary_t summary;
+            uint8_t cnt = 0;
+            if (info.header == BATCH_HEADER && decode_batch(samples, BATCH_MAX_SAMPLES, &cnt, info.payload,
+                                                            info.payload_len) == 0)
+                samples_cnt += cnt;
+            else if (info.header != TELEMETRY_HEADER ||
+                     decode_telemetry(&summary, info.payload, info.payload_len) != 0)
+                continue;
+            ingested_cnt++;
+            bytes_cnt += lens[p];
+        }
+        int64_t ingest_ns = host_test_now_ns() - start_ns;
+
+        printf("%-9s: form %5.2f M packets/s (with the samples), ingest %5.2f M packets/s, %.1f bytes per packet, %.1f samples\n",
+               names[kind], packets_cnt * 1e3 / form_ns, packets_cnt * 1e3 / ingest_ns,
+               (double)bytes_cnt / packets_cnt, (double)samples_cnt / packets_cnt);
+        free(packets);
+        free(lens);
+        CHECK(ingested_cnt == packets_cnt);
+    }
+    return 0;
+}
+
+
+#ifndef HOST_LIBFUZZER
+static const host_test_t s_tests[] = {
+    {"varint", test_varint},
+    {"regular", test_regular},
+    {"irregular", test_irregular},
+    {"multi_sensor", test_multi_sensor},
+    {"capacity", test_capacity},
+    {"malformed", test_malformed},
+    {"packet", test_packet},
+    {"fuzz", test_fuzz},
+    {"bench_codec", bench_codec},
+    {"bench_packet", bench_packet},
+};
+
+
+int main(int argc, char** argv)
+{
+    return host_test_main(argc, argv, s_tests, HOST_TEST_CNT(s_tests));
+}
+#endif
@@ -0,0 +1,267 @@
+/*
+ * flash_log_test.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// Flash log of flash_log.h on the simulated "samples" partition (see
+// esp_partition.h): the samples come back in order and the oldest ones are
+// dropped when the log wraps, and the power cut on every write and erase
+// (half of the page written, half of the sector erased) loses no page that
+// was written before it. The appends that lose the power run in a forked
+// process like the wakes of the scenarios (the flash is shared with it),
+// the test then powers on the log and checks what it recovered.
+
+#include <sys/wait.h>
+#include "host_test.h"
+#include "flash_log.h"
+
+
+#define FIRST_TIME_S    1000000
+#define MAX_READ        (HOST_FLASH_SIZE / FLASH_LOG_RECORD_SIZE)
+
+// sample i of the test, the log keeps it as the record with seq i
+#define SAMPLE_TIME_S(i)    (FIRST_TIME_S + (i))
+#define SAMPLE_VALUE(i)     ((uint16_t)((i) * 7 + 9000))
+#define SAMPLE_SENSOR(i)    ((uint8_t)((i) % 3))
+
+
+static packet_sample_t s_read[MAX_READ];
+
+
+// powers on the log as after the power loss (RTC memory is lost)
+static esp_err_t power_on_flash_log()
+{
+    flash_log_partition = NULL;
+    flash_log_is_recovered = false;
+    flash_log_head_seq = 0;
+    flash_log_tail_seq = 0;
+    memset(flash_log_page, 0, sizeof(flash_log_page));
+    return init_flash_log();
+}
+
+
+static esp_err_t erase_flash_log()
+{
+    memset(host_world()->flash, 0xFF, HOST_FLASH_SIZE);
+    host_flash_cut_power_at(0);
+    return power_on_flash_log();
+}
+
+
+static esp_err_t append_samples(uint32_t from, uint32_t cnt)
+{
+    for (uint32_t i = from; i < from + cnt; i++)
+    {
+        esp_err_t err = flash_log_append(SAMPLE_SENSOR(i), SAMPLE_VALUE(i), SAMPLE_TIME_S(i));
+        if (err != ESP_OK)
+            return err;
+    }
+    return ESP_OK;
+}
+
+
+// reads all unsent samples (without consuming them), returns their number
+static uint32_t read_all()
+{
+    uint32_t cnt = 0;
+    uint32_t seq = get_flash_log_head_seq();
+    while (cnt < MAX_READ)
+    {
+        uint8_t read_cnt = 0;
+        uint32_t span = 0;
+        uint8_t size = MAX_READ - cnt > BATCH_MAX_SAMPLES ? BATCH_MAX_SAMPLES : MAX_READ - cnt;
+        if (flash_log_read_from(seq, s_read + cnt, size, &read_cnt, &span) != ESP_OK || span == 0)
+            break;
+        cnt += read_cnt;
+        seq += span;
+    }
+    return cnt;
+}
+
+
+// the samples that were read are the test samples from the first one on,
+// none is missing or damaged
+static int check_samples(uint32_t cnt, uint32_t first)
+{
+    for (uint32_t i = 0; i < cnt; i++)
+    {
+        CHECK(s_read[i].time_s == SAMPLE_TIME_S(first + i));
+        CHECK(s_read[i].value == SAMPLE_VALUE(first + i));
+        CHECK(s_read[i].sensor == SAMPLE_SENSOR(first + i));
+    }
+    return 0;
+}
+
+
+// ---------------------------------------------------------------- cases
+
+static int test_append_read()
+{
+    CHECK(erase_flash_log() == ESP_OK);
+    CHECK(flash_log_is_empty());
+
+    // the staged records are read too, before their page is written
+    CHECK(append_samples(0, 100) == ESP_OK);
+    CHECK(get_flash_log_len() == 100);
+    CHECK(read_all() == 100 && check_samples(100, 0) == 0);
+
+    // batches are consumed from the oldest
+    uint8_t cnt = 0;
+    uint32_t span = 0;
+    CHECK(flash_log_read(s_read, 12, &cnt, &span) == ESP_OK && cnt == 12 && span == 12);
+    CHECK(check_samples(12, 0) == 0);
+    CHECK(flash_log_consume(span) == ESP_OK);
+    CHECK(flash_log_consume(100) == ESP_FAIL);
+    CHECK(flash_log_read(s_read, 12, &cnt, &span) == ESP_OK && cnt == 12 && check_samples(12, 12) == 0);
+    CHECK(flash_log_consume_until(90) == ESP_OK && get_flash_log_len() == 10);
+    CHECK(flash_log_read_from(80, s_read, 12, &cnt, &span) == ESP_FAIL);   // consumed already
+    CHECK(flash_log_read_from(95, s_read, 12, &cnt, &span) == ESP_OK && cnt == 5 && check_samples(5, 95) == 0);
+
+    // the power loss keeps the written pages, the consumed records are replayed again
+    CHECK(power_on_flash_log() == ESP_OK);
+    CHECK(get_flash_log_head_seq() == 0 && get_flash_log_tail_seq() == 96);
+    CHECK(read_all() == 96 && check_samples(96, 0) == 0);
+    return 0;
+}
+
+
+// the log wraps many times, the newest samples are kept and the oldest
+// ones are dropped a sector at a time
+static int test_wrap()
+{
+    CHECK(erase_flash_log() == ESP_OK);
+    uint32_t capacity = flash_log_capacity;
+    CHECK(capacity == HOST_FLASH_SIZE / FLASH_LOG_RECORD_SIZE);
+
+    uint32_t appended = 0;
+    for (uint32_t chunk = 1; appended < 5 * capacity; chunk = chunk * 3 % 1000 + 1)
+    {
+        CHECK(append_samples(appended, chunk) == ESP_OK);
+        appended += chunk;
+
+        uint32_t len = get_flash_log_len();
+        CHECK(get_flash_log_tail_seq() == appended);
+        // the staged records of the next sector are counted before it's erased
+        CHECK(len == appended || (len + FLASH_LOG_RECORDS_PER_SECTOR + FLASH_LOG_RECORDS_PER_PAGE > capacity &&
+                                  len < capacity + FLASH_LOG_RECORDS_PER_PAGE));
+    }
+
+    uint32_t cnt = read_all();
+    CHECK(cnt == get_flash_log_len());
+    CHECK(check_samples(cnt, appended - cnt) == 0);
+
+    CHECK(power_on_flash_log() == ESP_OK);
+    uint32_t written = appended - appended % FLASH_LOG_RECORDS_PER_PAGE;
+    CHECK(get_flash_log_tail_seq() == written);
+    cnt = read_all();
+    CHECK(cnt + FLASH_LOG_RECORDS_PER_SECTOR >= capacity);
+    CHECK(check_samples(cnt, written - cnt) == 0);
+    return 0;
+}
+
+
+// appends samples from the first one until the power is cut on the
+// cut_at-th flash operation (in a wake process), then powers on the log
+// and checks it: the samples are in order from the oldest recovered one,
+// every page written before the cut is there, and no more than a sector
+// of the history is lost. Then the log is used again.
+static int check_power_cut(uint32_t first, int32_t cut_at)
+{
+    static uint32_t* s_written_cnt = NULL;     // samples in written pages (shared)
+    if (s_written_cnt == NULL)
+        s_written_cnt = host_shared_alloc(sizeof(uint32_t));
+    *s_written_cnt = first - first % FLASH_LOG_RECORDS_PER_PAGE;
+
+    host_flash_cut_power_at(cut_at);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        g_host_is_device = true;
+        for (uint32_t i = first; i < first + 1000000; i++)
+        {
+            flash_log_append(SAMPLE_SENSOR(i), SAMPLE_VALUE(i), SAMPLE_TIME_S(i));
+            if (get_flash_log_tail_seq() % FLASH_LOG_RECORDS_PER_PAGE == 0)
+                *s_written_cnt = i + 1;
+        }
+        _exit(1);   // the power was not cut
+    }
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(host_world()->flash_power_is_cut);
+
+    uint32_t written_cnt = *s_written_cnt;
+    CHECK(power_on_flash_log() == ESP_OK);
+    uint32_t cnt = read_all();
+    uint32_t oldest = cnt ? s_read[0].time_s - FIRST_TIME_S : 0;
+    if (check_samples(cnt, oldest) != 0)
+        return 1;
+    CHECK(oldest + cnt >= written_cnt);
+    uint32_t history = written_cnt < flash_log_capacity ? written_cnt : flash_log_capacity;
+    CHECK(cnt + FLASH_LOG_RECORDS_PER_SECTOR >= history);
+
+    // the log goes on after the recovered records, the new pages are
+    // recovered after the next power loss
+    uint32_t next = oldest + cnt + 50;
+    CHECK(flash_log_consume(get_flash_log_len()) == ESP_OK);
+    uint32_t tail_seq = get_flash_log_tail_seq();
+    CHECK(append_samples(next, 2 * FLASH_LOG_RECORDS_PER_PAGE) == ESP_OK);
+    CHECK(power_on_flash_log() == ESP_OK);
+    CHECK(get_flash_log_tail_seq() == tail_seq + 2 * FLASH_LOG_RECORDS_PER_PAGE);
+    cnt = read_all();
+    CHECK(cnt >= 2 * FLASH_LOG_RECORDS_PER_PAGE);
+    memmove(s_read, s_read + cnt - 2 * FLASH_LOG_RECORDS_PER_PAGE, 2 * FLASH_LOG_RECORDS_PER_PAGE * sizeof(s_read[0]));
+    return check_samples(2 * FLASH_LOG_RECORDS_PER_PAGE, next);
+}
+
+
+// the power is cut on every flash operation of the first sectors
+static int test_power_loss_fresh()
+{
+    for (int32_t cut_at = 1; cut_at <= 3 * (FLASH_LOG_SECTOR_SIZE / FLASH_LOG_PAGE_SIZE + 1); cut_at++)
+    {
+        CHECK(erase_flash_log() == ESP_OK);
+        CHECK(append_samples(0, 5) == ESP_OK);
+        if (check_power_cut(5, cut_at) != 0)
+        {
+            fprintf(stderr, "power cut on flash operation %d\n", cut_at);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// the same when the log wraps, the erases drop the oldest records
+static int test_power_loss_wrapped()
+{
+    for (int32_t cut_at = 1; cut_at <= 3 * (FLASH_LOG_SECTOR_SIZE / FLASH_LOG_PAGE_SIZE + 1); cut_at++)
+    {
+        CHECK(erase_flash_log() == ESP_OK);
+        uint32_t first = flash_log_capacity * 3 / 2 + 7;
+        CHECK(append_samples(0, first) == ESP_OK);
+        if (check_power_cut(first, cut_at) != 0)
+        {
+            fprintf(stderr, "power cut on flash operation %d\n", cut_at);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static const host_test_t s_tests[] = {
+    {"append_read", test_append_read},
+    {"wrap", test_wrap},
+    {"power_loss_fresh", test_power_loss_fresh},
+    {"power_loss_wrapped", test_power_loss_wrapped},
+};
+
+
+int main(int argc, char** argv)
+{
+    return host_test_main(argc, argv, s_tests, HOST_TEST_CNT(s_tests));
+}
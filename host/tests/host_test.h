@@ -0,0 +1,119 @@
+/*
+ * host_test.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef HOST_TESTS_HOST_TEST_H_
+#define HOST_TESTS_HOST_TEST_H_
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Unit tests of the modules that don't need the simulated device: a test
+// program includes the headers of main/ it checks and lists its cases,
+// like the scenarios (see scenarios.c):
+//   ./<module>_test <case>     - runs one case (returns 0 if it passed)
+//   ./<module>_test            - lists the cases
+// Cases named bench_* are benchmarks, they print figures of the host CPU
+// and are not run by ctest. Timing is the wall clock of the host, it only
+// compares implementations with each other, it is not the time on the chip.
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond))                                                            \
+        {                                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1;                                                           \
+        }                                                                       \
+    } while (0)
+
+#define HOST_TEST_CNT(tests) (sizeof(tests) / sizeof(tests[0]))
+
+typedef struct {
+    const char* name;
+    int (*fn)();
+} host_test_t;
+
+
+// monotonic clock of the host (in ns), for the benchmarks
+int64_t host_test_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+// deterministic pseudo-random numbers (xorshift64), so failures repeat
+uint64_t g_host_test_rand = 0x2545F4914F6CDD1DULL;
+
+uint32_t host_test_rand()
+{
+    g_host_test_rand ^= g_host_test_rand << 13;
+    g_host_test_rand ^= g_host_test_rand >> 7;
+    g_host_test_rand ^= g_host_test_rand << 17;
+    return (uint32_t)(g_host_test_rand >> 32);
+}
+
+
+// body temperature trace in Q8.8: a slow daily swing, fever episodes and
+// sensor noise, the state moves with every call (one sample)
+typedef struct {
+    int32_t base_q8_8;
+    int32_t fever_q8_8;
+    uint32_t step;
+} host_test_trace_t;
+
+uint16_t host_test_trace_next(host_test_trace_t* trace)
+{
+    trace->step++;
+    if (trace->base_q8_8 == 0)
+        trace->base_q8_8 = (int32_t)(36.6 * 256);
+
+    // +-0.4 C daily swing as a triangle wave (steps of 5 s)
+    uint32_t phase = trace->step % 17280;
+    int32_t swing = (int32_t)(phase < 8640 ? phase : 17280 - phase) * 205 / 8640 - 102;
+
+    // fever rises and falls slowly
+    if (host_test_rand() % 20000 == 0)
+        trace->fever_q8_8 = 256 + host_test_rand() % 512;
+    else if (trace->fever_q8_8 > 0 && host_test_rand() % 64 == 0)
+        trace->fever_q8_8--;
+
+    int32_t noise = (int32_t)(host_test_rand() % 5) - 2;
+    return (uint16_t)(int16_t)(trace->base_q8_8 + swing + trace->fever_q8_8 + noise);
+}
+
+
+int host_test_main(int argc, char** argv, const host_test_t* tests, size_t cnt)
+{
+    if (argc < 2)
+    {
+        for (size_t i = 0; i < cnt; i++)
+            printf("%s\n", tests[i].name);
+        return 0;
+    }
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (strcmp(argv[1], tests[i].name) != 0)
+            continue;
+
+        int rc = tests[i].fn();
+        printf("%s: %s\n", tests[i].name, rc == 0 ? "passed" : "FAILED");
+        return rc;
+    }
+
+    fprintf(stderr, "unknown case: %s\n", argv[1]);
+    return 2;
+}
+
+
+#endif /* HOST_TESTS_HOST_TEST_H_ */
@@ -0,0 +1,124 @@
+/*
+ * max30205_test.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// Fixed point conversion of max30205.h against the float conversion it
+// replaced (kept here as the reference) for all 65,536 raw inputs.
+// bench_convert compares the cost of both on the host CPU.
+
+#include <math.h>
+#include "host_test.h"
+#include "max30205.h"
+
+
+// the conversion of the raw value before the fixed point one: the
+// fraction is built bit by bit
+static float legacy_convert_temp_data_to_float(uint8_t temp_msb, uint8_t temp_lsb)
+{
+    float ret_val = (float)(temp_msb & 0b01111111);
+    for (int i = 0; i < 8; i++)
+        ret_val += ((temp_lsb >> (7-i)) & 1) / (float)(2 << i);
+    return ret_val * ((temp_msb>>7) & 1 ? -1.0 : 1.0);
+}
+
+
+// ---------------------------------------------------------------- cases
+
+// Q8.8 is exact: it is the reference value times 256
+static int test_q8_8()
+{
+    for (uint32_t raw = 0; raw <= 0xFFFF; raw++)
+    {
+        uint8_t msb = raw >> 8, lsb = raw & 0xFF;
+        float expected = legacy_convert_temp_data_to_float(msb, lsb);
+        int16_t q8_8 = convert_temp_data_to_q8_8(msb, lsb);
+        if (q8_8 / 256.0f != expected)
+        {
+            fprintf(stderr, "raw 0x%04X: q8.8 %d, reference %f\n", raw, q8_8, expected);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// centi-degrees are the reference value rounded half away from zero
+static int test_centi()
+{
+    for (uint32_t raw = 0; raw <= 0xFFFF; raw++)
+    {
+        uint8_t msb = raw >> 8, lsb = raw & 0xFF;
+        double expected = round((double)legacy_convert_temp_data_to_float(msb, lsb) * 100);
+        int16_t centi = convert_temp_data_to_centi(msb, lsb);
+        if (centi != expected)
+        {
+            fprintf(stderr, "raw 0x%04X: centi %d, reference %.0f\n", raw, centi, expected);
+            return 1;
+        }
+    }
+
+    CHECK(convert_temp_data_to_centi(0x24, 0x40) == 3625);  // 36.25 C
+    CHECK(convert_temp_data_to_centi(0x80, 0x80) == -50);   // -0.5 C
+    CHECK(convert_temp_data_to_centi(0x00, 0x02) == 1);     // 0.0078 C
+    return 0;
+}
+
+
+// converts all raw inputs many times with every conversion, prints ns per
+// conversion (the sum keeps the compiler from dropping the work)
+static int bench_convert()
+{
+    const int rounds = 500;
+    volatile int64_t sink = 0;
+
+    int64_t start_ns = host_test_now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        float sum = 0;
+        for (uint32_t raw = 0; raw <= 0xFFFF; raw++)
+            sum += legacy_convert_temp_data_to_float(raw >> 8, raw & 0xFF);
+        sink += (int64_t)sum;
+    }
+    int64_t float_ns = host_test_now_ns() - start_ns;
+
+    start_ns = host_test_now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        int64_t sum = 0;
+        for (uint32_t raw = 0; raw <= 0xFFFF; raw++)
+            sum += convert_temp_data_to_q8_8(raw >> 8, raw & 0xFF);
+        sink += sum;
+    }
+    int64_t q8_8_ns = host_test_now_ns() - start_ns;
+
+    start_ns = host_test_now_ns();
+    for (int r = 0; r < rounds; r++)
+    {
+        int64_t sum = 0;
+        for (uint32_t raw = 0; raw <= 0xFFFF; raw++)
+            sum += convert_temp_data_to_centi(raw >> 8, raw & 0xFF);
+        sink += sum;
+    }
+    int64_t centi_ns = host_test_now_ns() - start_ns;
+
+    double cnt = rounds * 65536.0;
+    printf("float loop: %.2f ns, q8.8: %.2f ns, centi: %.2f ns per conversion (host FPU, %lld)\n",
+           float_ns / cnt, q8_8_ns / cnt, centi_ns / cnt, (long long)sink);
+    return 0;
+}
+
+
+static const host_test_t s_tests[] = {
+    {"q8_8", test_q8_8},
+    {"centi", test_centi},
+    {"bench_convert", bench_convert},
+};
+
+
+int main(int argc, char** argv)
+{
+    return host_test_main(argc, argv, s_tests, HOST_TEST_CNT(s_tests));
+}
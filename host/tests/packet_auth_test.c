@@ -0,0 +1,289 @@
+/*
+ * packet_auth_test.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// AES-CMAC of packet_auth.h and of the simulated gateway (gw_cmac of
+// sim_gateway.h) against the test vectors of RFC 4493 (section 4), and
+// against each other on random keys and packets of all lengths. The
+// device MAC is the counter and the packet, so the vectors are given as
+// the counter (first 4 bytes) and the rest, the MAC is the first 4 bytes
+// of the tag. The epoch goes on after the power loss, when seq wraps and
+// when the key is replaced.
+// bench_mac measures the MAC of the legacy and extended batch packets.
+
+#include "host_test.h"
+#include "nvs_flash.h"
+#include "sim_gateway.h"
+
+
+// RFC 4493, section 4
+static const uint8_t s_rfc_key[AUTH_KEY_SIZE] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+static const uint8_t s_rfc_k1[AUTH_BLOCK_SIZE] = {
+    0xfb, 0xee, 0xd6, 0x18, 0x35, 0x71, 0x33, 0x66, 0x7c, 0x85, 0xe0, 0x8f, 0x72, 0x36, 0xa8, 0xde,
+};
+static const uint8_t s_rfc_k2[AUTH_BLOCK_SIZE] = {
+    0xf7, 0xdd, 0xac, 0x30, 0x6a, 0xe2, 0x66, 0xcc, 0xf9, 0x0b, 0xc1, 0x1e, 0xe4, 0x6d, 0x51, 0x3b,
+};
+static const uint8_t s_rfc_msg[64] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+    0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+static const struct {
+    uint8_t msg_len;
+    uint8_t tag[AUTH_BLOCK_SIZE];
+} s_rfc_examples[] = {
+    {0, {0xbb, 0x1d, 0x69, 0x29, 0xe9, 0x59, 0x37, 0x28, 0x7f, 0xa3, 0x7d, 0x12, 0x9b, 0x75, 0x67, 0x46}},
+    {16, {0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44, 0xf7, 0x9b, 0xdd, 0x9d, 0xd0, 0x4a, 0x28, 0x7c}},
+    {40, {0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30, 0x30, 0xca, 0x32, 0x61, 0x14, 0x97, 0xc8, 0x27}},
+    {64, {0x51, 0xf0, 0xbe, 0xbf, 0x7e, 0x3b, 0x9d, 0x92, 0xfc, 0x49, 0x74, 0x17, 0x79, 0x36, 0x3c, 0xfe}},
+};
+
+
+// sets the key of the device as init_packet_auth does after loading it
+static int set_device_key(const uint8_t* key)
+{
+    memcpy(auth_key, key, AUTH_KEY_SIZE);
+    auth_aes_is_set = false;
+    CHECK(auth_derive_subkeys() == ESP_OK);
+    return 0;
+}
+
+
+// the device MAC of the message (the counter and the packet)
+static int device_mac(const uint8_t* msg, uint16_t msg_len, uint8_t* dest_mac)
+{
+    CHECK(msg_len >= AUTH_COUNTER_SIZE && msg_len <= AUTH_MAX_MSG_SIZE);
+    uint32_t counter = (uint32_t)msg[0] << 24 | msg[1] << 16 | msg[2] << 8 | msg[3];
+    CHECK(compute_packet_mac(dest_mac, counter, msg + AUTH_COUNTER_SIZE, msg_len - AUTH_COUNTER_SIZE) == ESP_OK);
+    return 0;
+}
+
+
+// ---------------------------------------------------------------- cases
+
+static int test_rfc4493_subkeys()
+{
+    if (set_device_key(s_rfc_key) != 0)
+        return 1;
+    CHECK(memcmp(auth_subkey1, s_rfc_k1, AUTH_BLOCK_SIZE) == 0);
+    CHECK(memcmp(auth_subkey2, s_rfc_k2, AUTH_BLOCK_SIZE) == 0);
+    return 0;
+}
+
+
+// the examples of 16, 40 and 64 bytes (the empty one is shorter than the
+// counter), the last block is complete, padded and complete again
+static int test_rfc4493_device()
+{
+    if (set_device_key(s_rfc_key) != 0)
+        return 1;
+    for (size_t e = 0; e < HOST_TEST_CNT(s_rfc_examples); e++)
+    {
+        if (s_rfc_examples[e].msg_len < AUTH_COUNTER_SIZE)
+            continue;
+        uint8_t mac[PACKET_MAC_SIZE];
+        if (device_mac(s_rfc_msg, s_rfc_examples[e].msg_len, mac) != 0)
+            return 1;
+        CHECK(memcmp(mac, s_rfc_examples[e].tag, PACKET_MAC_SIZE) == 0);
+    }
+    return 0;
+}
+
+
+static int test_rfc4493_gateway()
+{
+    for (size_t e = 0; e < HOST_TEST_CNT(s_rfc_examples); e++)
+    {
+        uint8_t tag[AUTH_BLOCK_SIZE];
+        gw_cmac(s_rfc_key, s_rfc_msg, s_rfc_examples[e].msg_len, tag);
+        CHECK(memcmp(tag, s_rfc_examples[e].tag, AUTH_BLOCK_SIZE) == 0);
+    }
+    return 0;
+}
+
+
+// random keys and messages of all lengths the device MACs
+static int test_cross()
+{
+    for (int run = 0; run < 200; run++)
+    {
+        uint8_t key[AUTH_KEY_SIZE];
+        for (uint8_t i = 0; i < AUTH_KEY_SIZE; i++)
+            key[i] = host_test_rand();
+        if (set_device_key(key) != 0)
+            return 1;
+
+        for (uint16_t msg_len = AUTH_COUNTER_SIZE; msg_len <= AUTH_MAX_MSG_SIZE; msg_len++)
+        {
+            uint8_t msg[AUTH_MAX_MSG_SIZE], tag[AUTH_BLOCK_SIZE], mac[PACKET_MAC_SIZE];
+            for (uint16_t i = 0; i < msg_len; i++)
+                msg[i] = host_test_rand();
+            gw_cmac(key, msg, msg_len, tag);
+            if (device_mac(msg, msg_len, mac) != 0)
+                return 1;
+            CHECK(memcmp(mac, tag, PACKET_MAC_SIZE) == 0);
+        }
+    }
+    return 0;
+}
+
+
+// the sealed packet opens as authenticated and its MAC is the one of the
+// counter of the current epoch, the epoch grows after the power loss and
+// when seq wraps
+static int test_epoch()
+{
+    nvs_flash_init();
+    nvs_flash_erase();
+    auth_is_loaded = false;
+    CHECK(init_packet_auth() == ESP_OK && packet_auth_is_enabled());
+    CHECK(auth_epoch == 1);
+    uint8_t key[AUTH_KEY_SIZE];
+    memcpy(key, auth_key, AUTH_KEY_SIZE);
+
+    auth_is_loaded = false;     // power loss, the key is kept in NVS
+    memset(auth_key, 0, AUTH_KEY_SIZE);
+    CHECK(init_packet_auth() == ESP_OK);
+    CHECK(auth_epoch == 2 && memcmp(auth_key, key, AUTH_KEY_SIZE) == 0);
+
+    static const uint16_t seqs[] = {5, 6, 0xFFFF, 0, 3};
+    static const uint16_t epochs[] = {2, 2, 2, 3, 3};
+    for (size_t s = 0; s < HOST_TEST_CNT(seqs); s++)
+    {
+        uint8_t packet[PACKET_AUTH_OVERHEAD + 8] = {0};
+        for (uint8_t i = 0; i < 8; i++)
+            packet[PACKET_HEADER_SIZE + i] = host_test_rand();
+        uint8_t len = seal_auth_packet(packet, BATCH_HEADER, seqs[s], 8);
+        CHECK(len == sizeof(packet));
+
+        packet_info_t info;
+        CHECK(open_packet(&info, packet, len) == 0 && info.is_auth && info.seq == seqs[s] && info.payload_len == 8);
+
+        uint32_t counter = (uint32_t)epochs[s] << 16 | seqs[s];
+        uint8_t msg[AUTH_MAX_MSG_SIZE] = {counter >> 24, counter >> 16, counter >> 8, counter};
+        memcpy(msg + AUTH_COUNTER_SIZE, packet, len - PACKET_MAC_SIZE);
+        uint8_t tag[AUTH_BLOCK_SIZE];
+        gw_cmac(key, msg, AUTH_COUNTER_SIZE + len - PACKET_MAC_SIZE, tag);
+        CHECK(memcmp(tag, packet + len - PACKET_MAC_SIZE, PACKET_MAC_SIZE) == 0);
+    }
+    return 0;
+}
+
+
+// the key is replaced (a gateway is deleted): the epoch goes on, the MAC
+// with the old key doesn't match, and the new key is the one loaded after
+// the power loss
+static int test_rotate()
+{
+    nvs_flash_init();
+    nvs_flash_erase();
+    auth_is_loaded = false;
+    CHECK(rotate_packet_auth_key() == ESP_FAIL);
+    CHECK(init_packet_auth() == ESP_OK);
+    uint8_t old_key[AUTH_KEY_SIZE];
+    memcpy(old_key, auth_key, AUTH_KEY_SIZE);
+    uint16_t epoch = auth_epoch;
+
+    CHECK(rotate_packet_auth_key() == ESP_OK);
+    CHECK(auth_epoch == epoch + 1 && memcmp(auth_key, old_key, AUTH_KEY_SIZE) != 0);
+    uint8_t key[AUTH_KEY_SIZE];
+    memcpy(key, auth_key, AUTH_KEY_SIZE);
+
+    uint8_t packet[PACKET_AUTH_OVERHEAD + 8] = {0};
+    uint8_t len = seal_auth_packet(packet, BATCH_HEADER, 7, 8);
+    uint32_t counter = (uint32_t)auth_epoch << 16 | 7;
+    uint8_t msg[AUTH_MAX_MSG_SIZE] = {counter >> 24, counter >> 16, counter >> 8, counter};
+    memcpy(msg + AUTH_COUNTER_SIZE, packet, len - PACKET_MAC_SIZE);
+    uint8_t tag[AUTH_BLOCK_SIZE];
+    gw_cmac(key, msg, AUTH_COUNTER_SIZE + len - PACKET_MAC_SIZE, tag);
+    CHECK(memcmp(tag, packet + len - PACKET_MAC_SIZE, PACKET_MAC_SIZE) == 0);
+    gw_cmac(old_key, msg, AUTH_COUNTER_SIZE + len - PACKET_MAC_SIZE, tag);
+    CHECK(memcmp(tag, packet + len - PACKET_MAC_SIZE, PACKET_MAC_SIZE) != 0);
+
+    auth_is_loaded = false;     // power loss
+    memset(auth_key, 0, AUTH_KEY_SIZE);
+    CHECK(init_packet_auth() == ESP_OK);
+    CHECK(auth_epoch == epoch + 2 && memcmp(auth_key, key, AUTH_KEY_SIZE) == 0);
+    return 0;
+}
+
+
+// MACs of the legacy and extended batch packets by the device (subkeys in
+// RTC memory, the key is set once) and by the gateway (gw_cmac sets the key
+// and derives the subkeys every time), prints us per MAC. The host AES is
+// a software one, the chip encrypts the blocks on the AES peripheral, so
+// the AES blocks per MAC are the figure to compare
+static int bench_mac()
+{
+    static const struct {
+        const char* name;
+        uint8_t payload_len;
+    } configs[] = {
+        {"legacy", 18},
+        {"extended", 171},
+    };
+    const uint32_t macs_cnt = 100000;
+    uint8_t key[AUTH_KEY_SIZE];
+    for (uint8_t i = 0; i < AUTH_KEY_SIZE; i++)
+        key[i] = host_test_rand();
+    if (set_device_key(key) != 0)
+        return 1;
+
+    for (size_t c = 0; c < HOST_TEST_CNT(configs); c++)
+    {
+        uint8_t msg[AUTH_MAX_MSG_SIZE];
+        uint16_t msg_len = AUTH_COUNTER_SIZE + PACKET_HEADER_SIZE + configs[c].payload_len;
+        for (uint16_t i = 0; i < msg_len; i++)
+            msg[i] = host_test_rand();
+
+        volatile uint8_t sink = 0;
+        int64_t start_ns = host_test_now_ns();
+        for (uint32_t m = 0; m < macs_cnt; m++)
+        {
+            uint8_t mac[PACKET_MAC_SIZE];
+            msg[msg_len - 1] = m;
+            device_mac(msg, msg_len, mac);
+            sink += mac[0];
+        }
+        int64_t device_ns = host_test_now_ns() - start_ns;
+
+        start_ns = host_test_now_ns();
+        for (uint32_t m = 0; m < macs_cnt; m++)
+        {
+            uint8_t tag[AUTH_BLOCK_SIZE];
+            msg[msg_len - 1] = m;
+            gw_cmac(key, msg, msg_len, tag);
+            sink += tag[0];
+        }
+        int64_t gateway_ns = host_test_now_ns() - start_ns;
+
+        printf("%-8s %3u bytes: %2u AES blocks, device %.2f us, gateway %.2f us per MAC (%u)\n", configs[c].name,
+               msg_len, (msg_len + AUTH_BLOCK_SIZE - 1) / AUTH_BLOCK_SIZE, device_ns / 1e3 / macs_cnt,
+               gateway_ns / 1e3 / macs_cnt, sink);
+    }
+    return 0;
+}
+
+
+static const host_test_t s_tests[] = {
+    {"rfc4493_subkeys", test_rfc4493_subkeys},
+    {"rfc4493_device", test_rfc4493_device},
+    {"rfc4493_gateway", test_rfc4493_gateway},
+    {"cross", test_cross},
+    {"epoch", test_epoch},
+    {"rotate", test_rotate},
+    {"bench_mac", bench_mac},
+};
+
+
+int main(int argc, char** argv)
+{
+    return host_test_main(argc, argv, s_tests, HOST_TEST_CNT(s_tests));
+}
@@ -0,0 +1,278 @@
+/*
+ * white_list_test.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// White list of white_list.h against a reference list (an unsorted array
+// scanned linearly, as the list was kept before the binary search): random
+// inserts and removes keep the list sorted with the same addrs, a full
+// list rejects new addrs, and the NVS copy survives the power loss and is
+// written only when it changes. bench_ops measures lookup, insert and
+// remove at 1, 8 and 64 entries (64 runs in white_list_test_64, the build
+// with CONFIG_TEMP_WHITE_LIST_SIZE 64).
+
+#include "host_test.h"
+#include "nvs_flash.h"
+#include "white_list.h"
+
+
+typedef struct {
+    ble_addr_t addrs[WHITE_LIST_SIZE];
+    uint8_t len;
+} ref_list_t;
+
+
+static ble_addr_t random_addr(uint8_t distinct_cnt)
+{
+    // few distinct addrs, so inserts and removes hit existing ones too
+    uint32_t n = distinct_cnt ? host_test_rand() % distinct_cnt : host_test_rand();
+    ble_addr_t addr = {.type = n & 1};
+    for (int i = 0; i < 6; i++)
+        addr.val[i] = (uint8_t)(n * 37 + i * (n >> 3));
+    return addr;
+}
+
+
+static int ref_find(const ref_list_t* ref, const ble_addr_t* addr)
+{
+    for (uint8_t i = 0; i < ref->len; i++)
+        if (ref->addrs[i].type == addr->type && memcmp(ref->addrs[i].val, addr->val, 6) == 0)
+            return i;
+    return -1;
+}
+
+
+// empties the list as the power loss does (RTC memory and NVS are lost)
+static void reset_white_list()
+{
+    deinit_white_list();
+    white_list_len = 0;
+    white_list_is_loaded = false;
+    white_list_is_dirty = false;
+    white_list_write_cnt = 0;
+    nvs_flash_init();
+    nvs_flash_erase();
+    init_white_list();
+}
+
+
+// the list has the addrs of the reference, sorted and without duplicates
+static int check_same(const ref_list_t* ref)
+{
+    CHECK(get_white_list_len() == ref->len);
+    CHECK(white_list_is_empty() == (ref->len == 0));
+    for (uint8_t i = 0; i < ref->len; i++)
+    {
+        ble_addr_t addr;
+        CHECK(get_white_list_addr(i, &addr) == ESP_OK);
+        CHECK(ref_find(ref, &addr) >= 0);
+        CHECK(white_list_contains_addr(&ref->addrs[i]));
+        if (i > 0)
+        {
+            ble_addr_t prev;
+            get_white_list_addr(i - 1, &prev);
+            CHECK(compare_addrs(&prev, &addr) < 0);
+        }
+    }
+    ble_addr_t addr;
+    CHECK(get_white_list_addr(ref->len, &addr) == ESP_FAIL);
+    return 0;
+}
+
+
+// ---------------------------------------------------------------- cases
+
+static int test_sorted()
+{
+    reset_white_list();
+    ref_list_t ref = {};
+    for (int op = 0; op < 200000; op++)
+    {
+        ble_addr_t addr = random_addr(WHITE_LIST_SIZE * 2);
+        int idx = ref_find(&ref, &addr);
+        if (host_test_rand() % 2)
+        {
+            esp_err_t expected = idx >= 0 || ref.len < WHITE_LIST_SIZE ? ESP_OK : ESP_FAIL;
+            CHECK(push_to_white_list(addr) == expected);
+            if (idx < 0 && expected == ESP_OK)
+                ref.addrs[ref.len++] = addr;
+        }
+        else
+        {
+            CHECK(remove_from_white_list_by_addr(&addr) == (idx >= 0 ? ESP_OK : ESP_FAIL));
+            if (idx >= 0)
+                ref.addrs[idx] = ref.addrs[--ref.len];
+        }
+        CHECK(white_list_contains_addr(&addr) == (ref_find(&ref, &addr) >= 0));
+        if (check_same(&ref) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+// a full list takes no new addrs, the registered ones are still accepted,
+// and nothing works before init
+static int test_full()
+{
+    reset_white_list();
+    ref_list_t ref = {};
+    while (ref.len < WHITE_LIST_SIZE)
+    {
+        ble_addr_t addr = random_addr(0);
+        if (ref_find(&ref, &addr) >= 0)
+            continue;
+        CHECK(push_to_white_list(addr) == ESP_OK);
+        ref.addrs[ref.len++] = addr;
+    }
+
+    ble_addr_t addr;
+    do
+        addr = random_addr(0);
+    while (ref_find(&ref, &addr) >= 0);
+    CHECK(push_to_white_list(addr) == ESP_FAIL);
+    CHECK(push_to_white_list(ref.addrs[0]) == ESP_OK);
+    CHECK(check_same(&ref) == 0);
+
+    CHECK(deinit_white_list() == ESP_OK);
+    CHECK(deinit_white_list() == ESP_FAIL);
+    CHECK(!white_list_contains_addr(&ref.addrs[0]));
+    CHECK(push_to_white_list(addr) == ESP_FAIL);
+    CHECK(remove_from_white_list_by_addr(&ref.addrs[0]) == ESP_FAIL);
+    CHECK(get_white_list_addr(0, &addr) == ESP_FAIL);
+    CHECK(init_white_list() == ESP_OK);
+    CHECK(init_white_list() == ESP_FAIL);
+    return 0;
+}
+
+
+static int test_nvs()
+{
+    reset_white_list();
+    ble_addr_t addrs[3] = {random_addr(0), random_addr(0), random_addr(0)};
+
+    // nothing is written while the list is the stored one
+    CHECK(store_white_list_to_nvs() == ESP_OK);
+    CHECK(get_white_list_write_cnt() == 0);
+    CHECK(push_to_white_list(addrs[0]) == ESP_OK);
+    CHECK(remove_from_white_list_by_addr(&addrs[0]) == ESP_OK);
+    CHECK(store_white_list_to_nvs() == ESP_OK);
+    CHECK(get_white_list_write_cnt() == 0);
+
+    // all changes of a session are one write
+    for (int i = 0; i < 3; i++)
+        CHECK(push_to_white_list(addrs[i]) == ESP_OK);
+    CHECK(store_white_list_to_nvs() == ESP_OK);
+    CHECK(get_white_list_write_cnt() == 1);
+    CHECK(store_white_list_to_nvs() == ESP_OK);
+    CHECK(get_white_list_write_cnt() == 1);
+
+    // the power loss keeps NVS alone, the list is rebuilt from it
+    ble_addr_t stored[3];
+    for (int i = 0; i < 3; i++)
+        get_white_list_addr(i, &stored[i]);
+    deinit_white_list();
+    white_list_len = 0;
+    white_list_is_loaded = false;
+    white_list_write_cnt = 0;
+    CHECK(init_white_list() == ESP_OK);
+    CHECK(get_white_list_len() == 3);
+    CHECK(get_white_list_write_cnt() == 1);
+    for (int i = 0; i < 3; i++)
+    {
+        ble_addr_t addr;
+        CHECK(get_white_list_addr(i, &addr) == ESP_OK && addrs_are_equal(&addr, &stored[i]));
+    }
+
+    // the empty list is stored as no blob, so it loads as empty
+    for (int i = 0; i < 3; i++)
+        CHECK(remove_from_white_list_by_addr(&addrs[i]) == ESP_OK);
+    CHECK(store_white_list_to_nvs() == ESP_OK);
+    CHECK(get_white_list_write_cnt() == 2);
+    white_list_len = 3;
+    white_list_is_loaded = false;
+    CHECK(load_white_list_from_nvs() == ESP_OK);
+    CHECK(get_white_list_len() == 0);
+    return 0;
+}
+
+
+// fills the list with cnt random addrs, the addrs are kept for the lookups
+static void fill_white_list(ble_addr_t* addrs, uint8_t cnt)
+{
+    reset_white_list();
+    for (uint8_t i = 0; i < cnt;)
+    {
+        addrs[i] = random_addr(0);
+        if (!white_list_contains_addr(&addrs[i]) && push_to_white_list(addrs[i]) == ESP_OK)
+            i++;
+    }
+}
+
+
+// lookups (half of them miss), inserts and removes of the list and of the
+// reference list at 1, 8 and 64 entries (the ones that fit the list),
+// prints ns per operation
+static int bench_ops()
+{
+    static const uint8_t sizes[] = {1, 8, 64};
+    const uint32_t ops_cnt = 2000000;
+
+    for (size_t s = 0; s < HOST_TEST_CNT(sizes); s++)
+    {
+        uint8_t cnt = sizes[s];
+        if (cnt > WHITE_LIST_SIZE)
+            continue;
+
+        ble_addr_t addrs[WHITE_LIST_SIZE], misses[64];
+        fill_white_list(addrs, cnt);
+        for (uint8_t i = 0; i < 64; i++)
+            do
+                misses[i] = random_addr(0);
+            while (white_list_contains_addr(&misses[i]));
+        ref_list_t ref = {.len = cnt};
+        memcpy(ref.addrs, addrs, sizeof(ble_addr_t) * cnt);
+
+        volatile uint32_t sink = 0;
+        int64_t start_ns = host_test_now_ns();
+        for (uint32_t i = 0; i < ops_cnt; i++)
+            sink += white_list_contains_addr(i % 2 ? &addrs[i % cnt] : &misses[i % 64]);
+        int64_t lookup_ns = host_test_now_ns() - start_ns;
+
+        start_ns = host_test_now_ns();
+        for (uint32_t i = 0; i < ops_cnt; i++)
+            sink += ref_find(&ref, i % 2 ? &addrs[i % cnt] : &misses[i % 64]) >= 0;
+        int64_t ref_lookup_ns = host_test_now_ns() - start_ns;
+
+        // an entry is removed and inserted back, so the length stays
+        start_ns = host_test_now_ns();
+        for (uint32_t i = 0; i < ops_cnt / 2; i++)
+        {
+            sink += remove_from_white_list_by_addr(&addrs[i % cnt]);
+            sink += push_to_white_list(addrs[i % cnt]);
+        }
+        int64_t update_ns = host_test_now_ns() - start_ns;
+        CHECK(get_white_list_len() == cnt);
+
+        printf("%2u entries: lookup %5.1f ns (linear %5.1f ns), insert + remove %5.1f ns (%u)\n", cnt,
+               (double)lookup_ns / ops_cnt, (double)ref_lookup_ns / ops_cnt, (double)update_ns / (ops_cnt / 2),
+               sink);
+    }
+    return 0;
+}
+
+
+static const host_test_t s_tests[] = {
+    {"sorted", test_sorted},
+    {"full", test_full},
+    {"nvs", test_nvs},
+    {"bench_ops", bench_ops},
+};
+
+
+int main(int argc, char** argv)
+{
+    return host_test_main(argc, argv, s_tests, HOST_TEST_CNT(s_tests));
+}
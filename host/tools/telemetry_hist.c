@@ -0,0 +1,241 @@
+/*
+ * telemetry_hist.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// Decodes the telemetry packets (see telemetry.h) that gateways received
+// from a deployment and prints per-node histograms of the wake phase
+// durations and of the estimated charge per boot, so slow or misbehaving
+// nodes stand out:
+//   ./telemetry_hist               - decodes generated packets of a few nodes
+//   ./telemetry_hist <file>...     - decodes recorded packets ("-" - stdin)
+// A recorded packet is a "<node> <hex>" line: the node (e.g. its MAC) and
+// the whole app packet as the gateway got it from the manufacturer's data.
+// Other packet types are skipped, the MAC of authenticated packets is not
+// checked (it needs the key of the node).
+//
+// The charge is estimated from the average phase durations and assumed
+// currents of every phase (ESP32-C3 datasheet figures, -i changes them),
+// it compares nodes with each other, it is not a measurement. Wakes
+// handled by the wake stub alone have no phases and are not counted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "app_packet.h"
+
+#define MAX_NODES       256
+#define NODE_NAME_SIZE  32
+#define HIST_BUCKETS    12      // log2 buckets of ms: <1, 1-2, 2-4, ... >=1024
+
+static const char* s_phase_names[TELEMETRY_PHASE_CNT] = {"boot", "i2c", "ble sync", "adv"};
+
+// assumed current of every phase (mA): CPU at max frequency, CPU with the
+// sensor converting (light sleep allowed), CPU and the controller, radio
+static double s_phase_ma[TELEMETRY_PHASE_CNT] = {25, 5, 30, 20};
+
+typedef struct {
+    char name[NODE_NAME_SIZE];
+    uint32_t summaries;
+    uint32_t wakes;
+    uint32_t boots;
+    uint32_t errors;
+    uint32_t phase_hist[TELEMETRY_PHASE_CNT][HIST_BUCKETS];     // of the average durations
+    uint32_t phase_max_100us[TELEMETRY_PHASE_CNT];
+    uint32_t charge_hist[HIST_BUCKETS];                         // of the charge per boot (uC)
+    double charge_uc;                                           // of all boots
+} node_stats_t;
+
+static node_stats_t s_nodes[MAX_NODES];
+static uint32_t s_nodes_cnt = 0;
+static uint32_t s_skipped_cnt = 0;
+
+
+static uint8_t hist_bucket(double value)
+{
+    uint8_t bucket = 0;
+    for (double limit = 1; value >= limit && bucket < HIST_BUCKETS - 1; limit *= 2)
+        bucket++;
+    return bucket;
+}
+
+
+static node_stats_t* find_node(const char* name)
+{
+    for (uint32_t i = 0; i < s_nodes_cnt; i++)
+        if (strcmp(s_nodes[i].name, name) == 0)
+            return &s_nodes[i];
+    if (s_nodes_cnt == MAX_NODES)
+        return NULL;
+
+    node_stats_t* node = &s_nodes[s_nodes_cnt++];
+    memset(node, 0, sizeof(*node));
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    return node;
+}
+
+
+// adds the packet of the node, returns false if it's not a telemetry packet
+static bool add_packet(const char* node_name, const uint8_t* packet, uint8_t packet_len)
+{
+    packet_info_t info;
+    telemetry_summary_t summary;
+    if (open_packet(&info, packet, packet_len) != 0 || info.header != TELEMETRY_HEADER ||
+        decode_telemetry(&summary, info.payload, info.payload_len) != 0)
+        return false;
+
+    node_stats_t* node = find_node(node_name);
+    if (node == NULL)
+        return false;
+
+    node->summaries++;
+    node->wakes += summary.wake_cnt;
+    node->boots += summary.boot_cnt;
+    node->errors += summary.error_cnt;
+
+    double charge_uc = 0;
+    for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++)
+    {
+        double avg_ms = summary.phase_avg[i] * TELEMETRY_TIME_UNIT_US / 1000.0;
+        node->phase_hist[i][hist_bucket(avg_ms)]++;
+        if (summary.phase_max[i] > node->phase_max_100us[i])
+            node->phase_max_100us[i] = summary.phase_max[i];
+        charge_uc += avg_ms * s_phase_ma[i];    // mA * ms = uC
+    }
+    node->charge_hist[hist_bucket(charge_uc)]++;
+    node->charge_uc += charge_uc * summary.boot_cnt;
+    return true;
+}
+
+
+static int hex_to_bytes(const char* hex, uint8_t* dest, uint8_t dest_size)
+{
+    size_t len = strlen(hex);
+    if (len % 2 != 0 || len / 2 > dest_size)
+        return -1;
+    for (size_t i = 0; i < len / 2; i++)
+    {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        dest[i] = byte;
+    }
+    return len / 2;
+}
+
+
+static void read_file(FILE* file)
+{
+    char line[600];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char node_name[NODE_NAME_SIZE], hex[520];
+        uint8_t packet[255];
+        int packet_len;
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%31s %519s", node_name, hex) != 2 ||
+            (packet_len = hex_to_bytes(hex, packet, sizeof(packet))) < 0 ||
+            !add_packet(node_name, packet, packet_len))
+            s_skipped_cnt++;
+    }
+}
+
+
+// packets of a small deployment: a day of summaries of healthy nodes, a
+// node with a slow sensor bus and a node that often misses the gateway
+static void add_generated_packets()
+{
+    uint32_t seed = 1;
+    for (int n = 0; n < 5; n++)
+    {
+        char node_name[NODE_NAME_SIZE];
+        snprintf(node_name, sizeof(node_name), "node-%d", n);
+        for (int s = 0; s < 24; s++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint32_t jitter = (seed >> 16) % 20;
+            telemetry_summary_t summary = {
+                .wake_cnt = 288, .boot_cnt = 24, .error_cnt = n == 3 ? 6 : 0,
+                .phase_avg = {2800 + jitter, 450 + jitter, 1900 + jitter, 1200 + jitter * 10},
+                .phase_max = {3100, 520, 2400, 10000},
+            };
+            if (n == 3)     // slow bus, the sensor reads are retried
+            {
+                summary.phase_avg[TELEMETRY_PHASE_I2C] = 2600 + jitter * 10;
+                summary.phase_max[TELEMETRY_PHASE_I2C] = 9000;
+            }
+            if (n == 4)     // out of range, every batch advertises for the whole window
+                summary.phase_avg[TELEMETRY_PHASE_ADV] = 10000;
+
+            uint8_t packet[PACKET_OVERHEAD + TELEMETRY_PAYLOAD_SIZE];
+            encode_telemetry(packet + PACKET_HEADER_SIZE, TELEMETRY_PAYLOAD_SIZE, &summary);
+            uint8_t packet_len = seal_packet(packet, TELEMETRY_HEADER, s, TELEMETRY_PAYLOAD_SIZE);
+            add_packet(node_name, packet, packet_len);
+        }
+    }
+}
+
+
+static void print_hist(const char* name, const uint32_t* hist, uint32_t max_100us)
+{
+    printf("  %-9s", name);
+    for (uint8_t b = 0; b < HIST_BUCKETS; b++)
+        printf(" %5u", hist[b]);
+    if (max_100us != UINT32_MAX)
+        printf("   max %.1f ms", max_100us * TELEMETRY_TIME_UNIT_US / 1000.0);
+    printf("\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    int first_file = 1;
+    if (argc > 2 && strcmp(argv[1], "-i") == 0)
+    {
+        if (sscanf(argv[2], "%lf,%lf,%lf,%lf", &s_phase_ma[0], &s_phase_ma[1], &s_phase_ma[2], &s_phase_ma[3]) != 4)
+        {
+            fprintf(stderr, "usage: %s [-i boot,i2c,sync,adv mA] [file...]\n", argv[0]);
+            return 2;
+        }
+        first_file = 3;
+    }
+
+    if (first_file >= argc)
+        add_generated_packets();
+    for (int i = first_file; i < argc; i++)
+    {
+        FILE* file = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        read_file(file);
+        if (file != stdin)
+            fclose(file);
+    }
+
+    printf("assumed currents (mA): boot %.0f, i2c %.0f, ble sync %.0f, adv %.0f\n",
+           s_phase_ma[0], s_phase_ma[1], s_phase_ma[2], s_phase_ma[3]);
+    printf("histograms of the average per summary, buckets (ms or uC): <1");
+    for (uint32_t b = 1, limit = 1; b < HIST_BUCKETS; b++, limit *= 2)
+        printf(" %u+", limit);
+    printf("\n");
+
+    for (uint32_t n = 0; n < s_nodes_cnt; n++)
+    {
+        const node_stats_t* node = &s_nodes[n];
+        printf("\n%s: %u summaries, %u wakes, %u boots, %u errors (%.1f%% of boots), %.1f mC per boot\n",
+               node->name, node->summaries, node->wakes, node->boots, node->errors,
+               node->boots ? 100.0 * node->errors / node->boots : 0.0,
+               node->boots ? node->charge_uc / node->boots / 1000 : 0.0);
+        for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++)
+            print_hist(s_phase_names[i], node->phase_hist[i], node->phase_max_100us[i]);
+        print_hist("charge", node->charge_hist, UINT32_MAX);
+    }
+    printf("\n%u nodes, %u lines skipped\n", s_nodes_cnt, s_skipped_cnt);
+    return s_nodes_cnt > 0 ? 0 : 1;
+}
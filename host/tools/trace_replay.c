@@ -0,0 +1,235 @@
+/*
+ * trace_replay.c
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+// Replays temperature traces through the sleep scheduler (see
+// sleep_scheduler.h) and reports the cost and the quality of the sampling:
+// wakes per day and the error of the trace the gateway reconstructs from
+// the samples (linear interpolation between them), compared with the
+// fixed min and max intervals.
+//   ./trace_replay                 - replays the built-in synthetic traces
+//   ./trace_replay <file.csv>...   - replays recorded traces
+// A recorded trace has a "time_s,temp_c" line per reading (any step, lines
+// starting with # are skipped), it's read as a step function.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sleep_scheduler.h"
+#include "max30205.h"
+
+#define TRACE_MAX_POINTS    (8 * 24 * 3600)     // 8 days at 1 s
+#define DAY_S               (24 * 3600)
+#define ERROR_LIMIT_C       0.1                 // error that is counted as a miss
+
+typedef struct {
+    const char* name;
+    uint32_t cnt;
+    uint32_t* time_s;
+    float* temp_c;
+} trace_t;
+
+typedef struct {
+    const char* name;
+    uint32_t fixed_interval_ms;     // 0 - adaptive
+} policy_t;
+
+typedef struct {
+    double wakes_per_day;
+    double rms_error_c;
+    double max_error_c;
+    double miss_pct;                // time with error over ERROR_LIMIT_C
+} replay_result_t;
+
+
+// ---------------------------------------------------------------- traces
+
+static trace_t trace_alloc(const char* name, uint32_t cnt)
+{
+    trace_t trace = {.name = name, .cnt = cnt};
+    trace.time_s = malloc(sizeof(uint32_t) * cnt);
+    trace.temp_c = malloc(sizeof(float) * cnt);
+    return trace;
+}
+
+
+// 2 days at 1 s: the daily swing, a fever episode and sensor noise (the
+// MAX30205 resolution is 1/256 C)
+static trace_t trace_synthetic(const char* name, int kind)
+{
+    trace_t trace = trace_alloc(name, 2 * DAY_S);
+    uint32_t seed = 12345 + kind;
+    for (uint32_t t = 0; t < trace.cnt; t++)
+    {
+        double temp = 36.6 + 0.4 * sin(2 * M_PI * t / DAY_S);
+        if (kind == 1 && t >= 30000)           // fever: +2 C within an hour, back within 6 h
+        {
+            double since = t - 30000.0;
+            temp += since < 3600 ? 2.0 * since / 3600 : fmax(0, 2.0 - 2.0 * (since - 3600) / (6 * 3600));
+        }
+        if (kind == 2 && (t / 600) % 12 == 0)  // exercise: 10 min of +0.8 C every 2 h
+            temp += 0.8 * sin(M_PI * (t % 600) / 600.0);
+
+        seed = seed * 1103515245 + 12345;
+        temp += ((int)((seed >> 16) % 3) - 1) / 256.0;
+        trace.time_s[t] = t;
+        trace.temp_c[t] = temp;
+    }
+    return trace;
+}
+
+
+static int trace_load(const char* path, trace_t* dest)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    *dest = trace_alloc(path, TRACE_MAX_POINTS);
+    dest->cnt = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL && dest->cnt < TRACE_MAX_POINTS)
+    {
+        unsigned long time_s;
+        float temp_c;
+        if (line[0] == '#' || sscanf(line, "%lu,%f", &time_s, &temp_c) != 2)
+            continue;
+        if (dest->cnt > 0 && time_s <= dest->time_s[dest->cnt - 1])
+            continue;
+        dest->time_s[dest->cnt] = time_s;
+        dest->temp_c[dest->cnt] = temp_c;
+        dest->cnt++;
+    }
+    fclose(file);
+
+    if (dest->cnt < 2)
+    {
+        fprintf(stderr, "%s: less than 2 readings\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+
+// temperature at the time (the last reading before it)
+static float trace_at(const trace_t* trace, uint32_t time_s, uint32_t* idx)
+{
+    while (*idx + 1 < trace->cnt && trace->time_s[*idx + 1] <= time_s)
+        (*idx)++;
+    return trace->temp_c[*idx];
+}
+
+
+// raw MAX30205 value of the temperature (see max30205.h)
+static uint16_t temp_to_raw(float temp_c)
+{
+    int32_t q8_8 = (int32_t)lround(temp_c * 256);
+    uint16_t magnitude = (uint16_t)(q8_8 < 0 ? -q8_8 : q8_8) & 0x7FFF;
+    return q8_8 < 0 ? magnitude | 0x8000 : magnitude;
+}
+
+
+// ---------------------------------------------------------------- replay
+
+static replay_result_t replay(const trace_t* trace, const policy_t* policy)
+{
+    sched_set_fixed_interval_ms(policy->fixed_interval_ms);
+    sched_reset();
+
+    // wakes follow the scheduler, the samples are what the gateway gets
+    uint32_t start_s = trace->time_s[0];
+    uint32_t end_s = trace->time_s[trace->cnt - 1];
+    uint32_t samples_cap = (end_s - start_s) / (SCHED_MIN_INTERVAL_MS / 1000) + 2;
+    uint32_t* sample_time_ms = malloc(sizeof(uint32_t) * samples_cap);
+    float* sample_temp = malloc(sizeof(float) * samples_cap);
+    uint32_t samples_cnt = 0;
+
+    uint64_t time_ms = (uint64_t)start_s * 1000;
+    uint32_t idx = 0;
+    while (time_ms <= (uint64_t)end_s * 1000 && samples_cnt < samples_cap)
+    {
+        uint16_t raw = temp_to_raw(trace_at(trace, time_ms / 1000, &idx));
+        uint32_t interval_ms = sched_update(raw);
+        sample_time_ms[samples_cnt] = time_ms - (uint64_t)start_s * 1000;
+        sample_temp[samples_cnt] = convert_temp_data_to_q8_8(raw >> 8, raw & 0xFF) / 256.0f;
+        samples_cnt++;
+        time_ms += interval_ms;
+    }
+
+    // the trace is compared with the interpolation between the samples
+    replay_result_t result = {};
+    double sum_sq = 0;
+    uint32_t miss_cnt = 0, cmp_cnt = 0, s = 0;
+    for (uint32_t i = 0; i < trace->cnt; i++)
+    {
+        uint64_t t_ms = (uint64_t)(trace->time_s[i] - start_s) * 1000;
+        while (s + 1 < samples_cnt && sample_time_ms[s + 1] <= t_ms)
+            s++;
+        if (s + 1 >= samples_cnt)
+            break;      // after the last sample nothing is known yet
+
+        double frac = (double)(t_ms - sample_time_ms[s]) / (sample_time_ms[s + 1] - sample_time_ms[s]);
+        double estimate = sample_temp[s] + frac * (sample_temp[s + 1] - sample_temp[s]);
+        double error = fabs(estimate - trace->temp_c[i]);
+        sum_sq += error * error;
+        if (error > result.max_error_c)
+            result.max_error_c = error;
+        miss_cnt += error > ERROR_LIMIT_C;
+        cmp_cnt++;
+    }
+
+    result.wakes_per_day = samples_cnt * (double)DAY_S / (end_s - start_s);
+    result.rms_error_c = cmp_cnt ? sqrt(sum_sq / cmp_cnt) : 0;
+    result.miss_pct = cmp_cnt ? 100.0 * miss_cnt / cmp_cnt : 0;
+    free(sample_time_ms);
+    free(sample_temp);
+    return result;
+}
+
+
+int main(int argc, char** argv)
+{
+    const policy_t policies[] = {
+        {"adaptive", 0},
+        {"fixed min", SCHED_MIN_INTERVAL_MS},
+        {"fixed max", SCHED_MAX_INTERVAL_MS},
+    };
+
+    trace_t traces[16];
+    int traces_cnt = 0;
+    if (argc < 2)
+    {
+        traces[traces_cnt++] = trace_synthetic("stable", 0);
+        traces[traces_cnt++] = trace_synthetic("fever", 1);
+        traces[traces_cnt++] = trace_synthetic("exercise", 2);
+    }
+    for (int i = 1; i < argc && traces_cnt < 16; i++)
+    {
+        if (trace_load(argv[i], &traces[traces_cnt]) != 0)
+            return 1;
+        traces_cnt++;
+    }
+
+    printf("intervals: min %u ms, max %u ms, heartbeat %u ms, error limit %.2f C\n",
+           SCHED_MIN_INTERVAL_MS, SCHED_MAX_INTERVAL_MS, SCHED_HEARTBEAT_INTERVAL_MS, ERROR_LIMIT_C);
+    printf("%-20s %-10s %10s %8s %8s %8s\n", "trace", "policy", "wakes/day", "rms C", "max C", "miss %");
+    for (int t = 0; t < traces_cnt; t++)
+    {
+        for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+        {
+            replay_result_t result = replay(&traces[t], &policies[p]);
+            printf("%-20s %-10s %10.0f %8.3f %8.3f %8.2f\n", traces[t].name, policies[p].name,
+                   result.wakes_per_day, result.rms_error_c, result.max_error_c, result.miss_pct);
+        }
+        free(traces[t].time_s);
+        free(traces[t].temp_c);
+    }
+    return 0;
+}
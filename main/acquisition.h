@@ -0,0 +1,191 @@
+/*
+ * acquisition.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_ACQUISITION_H_
+#define MAIN_ACQUISITION_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sensor.h"
+#include "sample_buffer.h"
+
+// Per-wake acquisition of all sensors of the node (see sensor.h): the
+// conversions of all sensors are started first, then every sensor is read
+// as soon as its conversion is ready (the earliest first), and the results
+// go into the shared sample buffer with the same time. So the wake takes
+// as long as the slowest conversion plus a few bus transactions per
+// sensor, instead of the sum of all conversions. While waiting, the task
+// sleeps (the wait is rounded up to whole ticks, a sensor is read at most
+// a tick late), so the chip may light sleep (see power_mgmt.h).
+//
+// Sensors are registered once per boot, before the first deep sleep, so
+// the number of sensors is known when the wake stub is armed (the stub
+// reads the body temperature only, see wake_stub.h).
+
+#define ACQ_MAX_SENSORS     4   // max number of sensors of the node
+
+
+// structure that describes result of one sensor
+typedef struct {
+    uint8_t sensor;     // sensor id
+    uint16_t value;     // raw value (valid if err is ESP_OK)
+    esp_err_t err;      // result of start and read
+
+} acq_result_t;
+
+const char* g_tag_acq = "ACQ";  // tag used in logs
+
+const sensor_driver_t* acq_sensors[ACQ_MAX_SENSORS];   // registered sensors
+uint8_t acq_sensors_cnt = 0;        // number of registered sensors
+bool acq_is_inited = false;         // flag that the sensors were added to the bus
+int64_t acq_bus_time_us = 0;        // bus time of the last acquisition (in us)
+int64_t acq_total_time_us = 0;      // duration of the last acquisition (in us)
+
+esp_err_t acq_register_sensor(const sensor_driver_t* sensor);
+esp_err_t acq_init();
+uint8_t acq_get_sensors_cnt();
+uint8_t acq_run(uint32_t time_s, acq_result_t* dest_results);
+int64_t acq_get_bus_time_us();
+int64_t acq_get_total_time_us();
+static void acq_wait_until(int64_t time_us);
+
+
+// adds the sensor to the pipeline, no bus transaction is made
+esp_err_t acq_register_sensor(const sensor_driver_t* sensor)
+{
+    if (sensor == NULL || acq_sensors_cnt == ACQ_MAX_SENSORS)
+        return ESP_FAIL;
+
+    for (uint8_t i = 0; i < acq_sensors_cnt; i++)
+        if (acq_sensors[i] == sensor)
+            return ESP_OK;
+
+    acq_sensors[acq_sensors_cnt++] = sensor;
+    return ESP_OK;
+}
+
+
+// adds all registered sensors to the bus (the bus must be created)
+esp_err_t acq_init()
+{
+    if (acq_is_inited)
+        return ESP_OK;
+
+    esp_err_t init_status = ESP_OK;
+    for (uint8_t i = 0; i < acq_sensors_cnt; i++)
+    {
+        if (acq_sensors[i]->init() != ESP_OK)
+        {
+            ESP_LOGE(g_tag_acq, "%s init failed!", acq_sensors[i]->name);
+            init_status = ESP_FAIL;
+        }
+    }
+
+    acq_is_inited = true;
+    return init_status;
+}
+
+
+// returns the number of registered sensors
+uint8_t acq_get_sensors_cnt()
+{
+    return acq_sensors_cnt;
+}
+
+
+// takes one sample of every sensor and pushes it into the sample buffer
+// with time_s, results (one per sensor, in the order of registration) are
+// copied to dest_results (if not NULL). returns the number of read sensors
+uint8_t acq_run(uint32_t time_s, acq_result_t* dest_results)
+{
+    acq_result_t results[ACQ_MAX_SENSORS];
+    int64_t ready_time[ACQ_MAX_SENSORS];
+    bool is_pending[ACQ_MAX_SENSORS];
+    int64_t start_time = esp_timer_get_time();
+    acq_bus_time_us = 0;
+
+    // start all conversions
+    for (uint8_t i = 0; i < acq_sensors_cnt; i++)
+    {
+        int64_t trans_start_time = esp_timer_get_time();
+        results[i].sensor = acq_sensors[i]->id;
+        results[i].value = 0;
+        results[i].err = acq_sensors[i]->start_conv();
+
+        int64_t trans_end_time = esp_timer_get_time();
+        acq_bus_time_us += trans_end_time - trans_start_time;
+        ready_time[i] = trans_end_time + acq_sensors[i]->conv_time_us;
+        is_pending[i] = results[i].err == ESP_OK;
+    }
+
+    // read the conversions in the order they are ready
+    uint8_t read_cnt = 0;
+    while (true)
+    {
+        int8_t next = -1;
+        for (uint8_t i = 0; i < acq_sensors_cnt; i++)
+            if (is_pending[i] && (next < 0 || ready_time[i] < ready_time[next]))
+                next = i;
+        if (next < 0)
+            break;
+
+        acq_wait_until(ready_time[next]);
+
+        int64_t trans_start_time = esp_timer_get_time();
+        results[next].err = acq_sensors[next]->read(&results[next].value);
+        acq_bus_time_us += esp_timer_get_time() - trans_start_time;
+        is_pending[next] = false;
+
+        if (results[next].err == ESP_OK)
+        {
+            push_to_sample_buffer(results[next].sensor, results[next].value, time_s);
+            read_cnt++;
+        }
+        else
+            ESP_LOGE(g_tag_acq, "%s read failed!", acq_sensors[next]->name);
+    }
+
+    acq_total_time_us = esp_timer_get_time() - start_time;
+    if (dest_results != NULL)
+        memcpy(dest_results, results, acq_sensors_cnt * sizeof(acq_result_t));
+    return read_cnt;
+}
+
+
+// returns the bus time of the last acquisition (starts and reads, in us)
+int64_t acq_get_bus_time_us()
+{
+    return acq_bus_time_us;
+}
+
+
+// returns the duration of the last acquisition (in us)
+int64_t acq_get_total_time_us()
+{
+    return acq_total_time_us;
+}
+
+
+// sleeps until time_us, the delay is rounded up to whole ticks. a tick
+// delay may end up to one tick early (it counts tick interrupts, the first
+// one may come right away), so it is repeated for the rest
+static void acq_wait_until(int64_t time_us)
+{
+    const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+    int64_t wait_us;
+    while ((wait_us = time_us - esp_timer_get_time()) > 0)
+        vTaskDelay((wait_us + tick_us - 1) / tick_us);
+}
+
+
+#endif /* MAIN_ACQUISITION_H_ */
@@ -0,0 +1,239 @@
+/*
+ * adv_pdu.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_ADV_PDU_H_
+#define MAIN_ADV_PDU_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "system.h"
+#include "app_packet.h"
+#include "packet_auth.h"
+
+// Advertising data is set raw (see start_adv in main.c) instead of
+// serialising ble_hs_adv_fields on every wake. The data of every mode is
+// built once (after power-on) and kept in RTC memory:
+//   data (legacy pdu)   - [flags][manufacturer's data: packet]
+//   data (extended pdu) - [flags][uuid 0x1809][name][manufacturer's data: packet]
+//   registration        - [flags (discoverable)][uuid 0x1809][manufacturer's data: REG_HEADER]
+//   deletion            - [flags][uuid 0x1809][manufacturer's data: DEL_HEADER]
+//   scan response       - [uuid 0x1809][name]
+// The static prefix comes first, so the app packet (see app_packet.h) is
+// always at the same offset and every data adv only patches the length of
+// the manufacturer's data field and the packet header and crc, the payload
+// is encoded right into the adv data. The uuid and the long device name
+// are sent in the scan response of legacy pdus (only active scanners
+// request it), so the adv pdu is shorter on air and leaves more space for
+// the payload. Extended non-scannable pdu has no scan response, so they
+// stay in its data.
+//
+// With packet authentication the data packet ends with the MAC instead of
+// the crc (see packet_auth.h), batches are sized to fit it. A longer
+// packet (the telemetry in legacy pdu) is sent with the crc.
+
+#define ADV_DEVICE_NAME         "Nemivika-Temp"
+#define ADV_DEVICE_NAME_LEN     (sizeof(ADV_DEVICE_NAME) - 1)
+#define ADV_LEGACY_DATA_SIZE    31      // max adv (and scan response) data of legacy pdu
+#define ADV_EXT_DATA_SIZE       200     // adv data of extended pdu used by this device
+
+// ad types and flags (Core Specification Supplement, part A)
+#define ADV_TYPE_FLAGS          0x01
+#define ADV_TYPE_COMP_UUIDS16   0x03    // complete list of 16-bit uuids
+#define ADV_TYPE_COMP_NAME      0x09    // complete local name
+#define ADV_TYPE_MFG_DATA       0xFF    // manufacturer's specific data
+#define ADV_F_DISC_GEN          0x02    // general discoverable
+#define ADV_F_BREDR_UNSUP       0x04    // classic bluetooth is unsupported
+#define ADV_UUID16_HTS          0x1809  // health thermometer
+
+#define ADV_FIELD_HEADER_SIZE   2       // length and type of an ad field
+#define ADV_FLAGS_FIELD_SIZE    3
+#define ADV_UUID_FIELD_SIZE     4
+#define ADV_NAME_FIELD_SIZE     (ADV_FIELD_HEADER_SIZE + ADV_DEVICE_NAME_LEN)
+#define ADV_PACKET_OFFSET       (ADV_FLAGS_FIELD_SIZE + ADV_FIELD_HEADER_SIZE)
+#define ADV_MODE_PACKET_OFFSET  (ADV_FLAGS_FIELD_SIZE + ADV_UUID_FIELD_SIZE + ADV_FIELD_HEADER_SIZE)
+#define ADV_EXT_PACKET_OFFSET   (ADV_FLAGS_FIELD_SIZE + ADV_UUID_FIELD_SIZE + ADV_NAME_FIELD_SIZE + \
+                                 ADV_FIELD_HEADER_SIZE)
+
+// the rest of the adv data is left for the app packet payload (21 bytes
+// in legacy pdu, 18 bytes if the packet is authenticated)
+#define ADV_PAYLOAD_MAX_SIZE    (ADV_LEGACY_DATA_SIZE - ADV_PACKET_OFFSET - PACKET_OVERHEAD)
+#define EXT_ADV_PAYLOAD_MAX_SIZE (ADV_EXT_DATA_SIZE - ADV_EXT_PACKET_OFFSET - PACKET_OVERHEAD)
+#define ADV_AUTH_PAYLOAD_MAX_SIZE (ADV_LEGACY_DATA_SIZE - ADV_PACKET_OFFSET - PACKET_AUTH_OVERHEAD)
+#define EXT_ADV_AUTH_PAYLOAD_MAX_SIZE (ADV_EXT_DATA_SIZE - ADV_EXT_PACKET_OFFSET - PACKET_AUTH_OVERHEAD)
+#if CONFIG_TEMP_PACKET_AUTH
+#define BATCH_PAYLOAD_SIZE      ADV_AUTH_PAYLOAD_MAX_SIZE
+#define EXT_BATCH_PAYLOAD_SIZE  EXT_ADV_AUTH_PAYLOAD_MAX_SIZE
+#else
+#define BATCH_PAYLOAD_SIZE      ADV_PAYLOAD_MAX_SIZE
+#define EXT_BATCH_PAYLOAD_SIZE  EXT_ADV_PAYLOAD_MAX_SIZE
+#endif
+
+
+// struct that describes raw advertising data and scan response
+typedef struct
+{
+    const uint8_t* data;        // adv data
+    uint8_t data_len;
+    const uint8_t* rsp_data;    // scan response data, NULL if there is none
+    uint8_t rsp_data_len;
+} adv_pdu_t;
+
+
+void init_adv_pdus();
+uint8_t* get_data_adv_payload(bool ext_pdu);
+adv_pdu_t get_data_adv_pdu(uint16_t header, uint8_t payload_len, bool ext_pdu);
+adv_pdu_t get_mode_adv_pdu(uint16_t header);
+uint16_t get_adv_packet_seq();
+
+
+// raw data, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR uint8_t adv_data[ADV_LEGACY_DATA_SIZE];       // data adv (legacy pdu)
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+RTC_DATA_ATTR uint8_t adv_ext_data[ADV_EXT_DATA_SIZE];      // data adv (extended pdu)
+#endif
+RTC_DATA_ATTR uint8_t adv_reg_data[ADV_MODE_PACKET_OFFSET + PACKET_OVERHEAD];  // registration adv
+RTC_DATA_ATTR uint8_t adv_del_data[ADV_MODE_PACKET_OFFSET + PACKET_OVERHEAD];  // deletion adv
+RTC_DATA_ATTR uint8_t adv_rsp_data[ADV_UUID_FIELD_SIZE + ADV_NAME_FIELD_SIZE]; // scan response
+RTC_DATA_ATTR bool adv_pdus_are_built = false;  // flag that the data is built (cleared on power loss)
+RTC_DATA_ATTR uint16_t adv_packet_seq = 0;      // seq of the next data packet (see app_packet.h)
+
+
+// writes the flags field, returns its length
+static uint8_t put_adv_flags(uint8_t* dest, uint8_t flags)
+{
+    dest[0] = 2;
+    dest[1] = ADV_TYPE_FLAGS;
+    dest[2] = flags;
+    return ADV_FLAGS_FIELD_SIZE;
+}
+
+
+// writes the uuid field, returns its length
+static uint8_t put_adv_uuid(uint8_t* dest)
+{
+    dest[0] = 3;
+    dest[1] = ADV_TYPE_COMP_UUIDS16;
+    dest[2] = ADV_UUID16_HTS & 0xFF;
+    dest[3] = ADV_UUID16_HTS >> 8;
+    return ADV_UUID_FIELD_SIZE;
+}
+
+
+// writes the device name field, returns its length
+static uint8_t put_adv_name(uint8_t* dest)
+{
+    dest[0] = 1 + ADV_DEVICE_NAME_LEN;
+    dest[1] = ADV_TYPE_COMP_NAME;
+    memcpy(dest + ADV_FIELD_HEADER_SIZE, ADV_DEVICE_NAME, ADV_DEVICE_NAME_LEN);
+    return ADV_NAME_FIELD_SIZE;
+}
+
+
+// seals the app packet with the payload already in place (with the MAC if
+// is_auth is set, otherwise with the crc) and writes the header of
+// manufacturer's data field, returns the length of the field
+static uint8_t put_adv_packet(uint8_t* dest, uint16_t header, uint16_t seq, uint8_t payload_len, bool is_auth)
+{
+    uint8_t* packet = dest + ADV_FIELD_HEADER_SIZE;
+    uint8_t packet_len = 0;
+    if (is_auth)
+        packet_len = seal_auth_packet(packet, header, seq, payload_len);
+    if (packet_len == 0)
+        packet_len = seal_packet(packet, header, seq, payload_len);
+    dest[0] = 1 + packet_len;
+    dest[1] = ADV_TYPE_MFG_DATA;
+    return ADV_FIELD_HEADER_SIZE + packet_len;
+}
+
+
+// builds the data of all modes, it's done once after power-on
+void init_adv_pdus()
+{
+    if (adv_pdus_are_built)
+        return;
+
+    uint8_t len = put_adv_flags(adv_data, ADV_F_BREDR_UNSUP);
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    len = put_adv_flags(adv_ext_data, ADV_F_BREDR_UNSUP);
+    len += put_adv_uuid(adv_ext_data + len);
+    put_adv_name(adv_ext_data + len);
+#endif
+
+    // the gateway (or phone) looks for the sensor only in registration
+    // mode, packets of both modes have no payload and seq 0
+    len = put_adv_flags(adv_reg_data, ADV_F_DISC_GEN | ADV_F_BREDR_UNSUP);
+    len += put_adv_uuid(adv_reg_data + len);
+    put_adv_packet(adv_reg_data + len, REG_HEADER, 0, 0, false);
+    len = put_adv_flags(adv_del_data, ADV_F_BREDR_UNSUP);
+    len += put_adv_uuid(adv_del_data + len);
+    put_adv_packet(adv_del_data + len, DEL_HEADER, 0, 0, false);
+
+    len = put_adv_uuid(adv_rsp_data);
+    put_adv_name(adv_rsp_data + len);
+    adv_pdus_are_built = true;
+}
+
+
+// returns the buffer to encode the app packet payload into (up to
+// ADV_PAYLOAD_MAX_SIZE or EXT_ADV_PAYLOAD_MAX_SIZE bytes, payloads up to
+// BATCH_PAYLOAD_SIZE or EXT_BATCH_PAYLOAD_SIZE bytes are authenticated)
+uint8_t* get_data_adv_payload(bool ext_pdu)
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    if (ext_pdu)
+        return adv_ext_data + ADV_EXT_PACKET_OFFSET + PACKET_HEADER_SIZE;
+#endif
+    return adv_data + ADV_PACKET_OFFSET + PACKET_HEADER_SIZE;
+}
+
+
+// seals the app packet with the payload encoded into get_data_adv_payload
+// buffer (with the next seq) and returns the data adv
+adv_pdu_t get_data_adv_pdu(uint16_t header, uint8_t payload_len, bool ext_pdu)
+{
+    adv_pdu_t pdu = {.data = adv_data, .data_len = 0, .rsp_data = adv_rsp_data, .rsp_data_len = sizeof(adv_rsp_data)};
+    uint16_t seq = adv_packet_seq++;
+    bool is_auth = packet_auth_is_enabled() &&
+                   payload_len <= (ext_pdu ? EXT_ADV_AUTH_PAYLOAD_MAX_SIZE : ADV_AUTH_PAYLOAD_MAX_SIZE);
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    if (ext_pdu)
+    {
+        uint8_t offset = ADV_EXT_PACKET_OFFSET - ADV_FIELD_HEADER_SIZE;
+        pdu.data = adv_ext_data;
+        pdu.data_len = offset + put_adv_packet(adv_ext_data + offset, header, seq, payload_len, is_auth);
+        pdu.rsp_data = NULL;
+        pdu.rsp_data_len = 0;
+        return pdu;
+    }
+#endif
+
+    uint8_t offset = ADV_PACKET_OFFSET - ADV_FIELD_HEADER_SIZE;
+    pdu.data_len = offset + put_adv_packet(adv_data + offset, header, seq, payload_len, is_auth);
+    return pdu;
+}
+
+
+// returns the registration (REG_HEADER) or deletion (DEL_HEADER) adv
+adv_pdu_t get_mode_adv_pdu(uint16_t header)
+{
+    adv_pdu_t pdu = {.data = header == REG_HEADER ? adv_reg_data : adv_del_data, .data_len = sizeof(adv_reg_data),
+                     .rsp_data = adv_rsp_data, .rsp_data_len = sizeof(adv_rsp_data)};
+    return pdu;
+}
+
+
+// returns seq of the next data packet
+uint16_t get_adv_packet_seq()
+{
+    return adv_packet_seq;
+}
+
+
+#endif /* MAIN_ADV_PDU_H_ */
@@ -9,89 +9,582 @@
 #define MAIN_APP_PACKET_H_
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include "system.h"
 
+// Packet (v2) is formed as follows, all fields are big-endian:
+//   [version]  - 1 byte, PACKET_VERSION (the high byte of the v1 header, so 0 in v1)
+//   [type]     - 1 byte, one of the headers below
+//   [seq]      - 2 bytes, sequence number of the packet, it grows by one with
+//                every sent packet of the node (the gateway drops duplicates
+//                and counts lost packets by it), 0 after power loss
+//   [payload]  - type specific payload
+//   [crc]      - 1 byte, CRC-8 (poly 0x07) of all previous bytes
+// Authenticated packet has PACKET_F_AUTH set in the version byte and a
+// 4-byte MAC instead of the crc (see packet_auth.h).
+// Fields are written with shifts, so the byte order is fixed at compile
+// time and encoding has no branches.
 #define REG_HEADER  0x0001
 #define DEL_HEADER  0x0002
 #define DATA_HEADER 0x0003
-#define HEADER_SIZE 2//sizeof(uint16_t)
+#define BATCH_HEADER 0x0004   // data packet with several samples (see sample_buffer.h)
+#define TELEMETRY_HEADER 0x0005 // per-wake performance summary (see telemetry.h)
+#define HEADER_SIZE 2   // version and type
+#define PACKET_VERSION      0x02
+#define PACKET_SEQ_SIZE     2
+#define PACKET_HEADER_SIZE  (HEADER_SIZE + PACKET_SEQ_SIZE)
+#define PACKET_CRC_SIZE     1
+#define PACKET_OVERHEAD     (PACKET_HEADER_SIZE + PACKET_CRC_SIZE)
+#define PACKET_F_AUTH       0x80    // flag of authenticated packet (in the version byte)
+#define PACKET_MAC_SIZE     4
+#define PACKET_AUTH_OVERHEAD (PACKET_HEADER_SIZE + PACKET_MAC_SIZE)
 
+// Batch packet payload (after the header) is encoded as follows:
+//   [count | flags]  - 1 byte, number of samples (bits 0-5) and flags (bits 6-7)
+//   [age]            - varint, seconds between the newest sample and packet forming
+//   [period]         - varint, seconds between samples (only for regular batches)
+//   [base]           - 2 bytes, first sample raw value (big-endian)
+//   then for each next sample:
+//   [interval]       - varint, seconds since previous sample (only for irregular batches)
+//   [delta]          - zig-zag varint, difference with the previous raw value
+// Body temperature changes slowly, so most deltas fit into one byte and
+// a regular batch of n samples takes only about 4 + n bytes.
+//
+// Samples of a node with several sensors (see sensor.h) are grouped by
+// the sensor, every group is encoded as the batch above:
+//   [groups | F_MULTI] - 1 byte, number of groups (bits 0-5) and BATCH_F_MULTI
+//   then for each group:
+//   [sensor]           - 1 byte, id of the sensor
+//   [batch]            - samples of the sensor, the same as the whole batch above
+// A batch with body temperature samples only has no groups, so it is the
+// same as on a node with one sensor.
+#define BATCH_MAX_SAMPLES       63      // max number of samples in one batch packet
+#define BATCH_CNT_MASK          0x3F    // bits of the first byte with number of samples
+#define BATCH_F_IRREGULAR       0x80    // samples are not equally spaced in time
+#define BATCH_F_MULTI           0x40    // samples are grouped by the sensor
+#define BATCH_MIN_LEN           4       // count, age, period and base (two bytes)
+#define BATCH_GROUP_HEADER_SIZE 1       // sensor id
+#define VARINT_MAX_SIZE         5       // max size of the varint encoded uint32_t
 
-// forms a packet by adding a header and optional data
-int8_t form_packet(uint8_t* dest_buff, uint16_t header_tag, const uint8_t* data_buff, uint8_t data_buff_len)
+
+// struct that describes one sample in the batch packet
+// while encoding time_s is the time of measurement (in s), after decoding
+// it is the age of the sample - seconds before the packet was formed
+typedef struct
+{
+    uint16_t value;     // raw sensor value (msb << 8 | lsb)
+    uint8_t sensor;     // id of the sensor (see sensor.h), 0 - body temperature
+    uint32_t time_s;    // time of measurement or age of the sample (in s)
+} packet_sample_t;
+
+// Telemetry packet payload (after the header), all fields are big-endian:
+//   [wakes]      - 2 bytes, number of wakes (with and without boot) since last summary
+//   [boots]      - 1 byte, number of wakes with full boot
+//   [errors]     - 1 byte, number of errors (sensor read, adv start)
+//   [avg x 4]    - 2 bytes each, average duration of every phase
+//   [max x 4]    - 2 bytes each, max duration of every phase
+// durations are in TELEMETRY_TIME_UNIT_US units, counters are saturated
+#define TELEMETRY_PHASE_BOOT        0   // startup until app_main
+#define TELEMETRY_PHASE_I2C         1   // sensor read transaction
+#define TELEMETRY_PHASE_BLE_SYNC    2   // sensor read until ble host sync
+#define TELEMETRY_PHASE_ADV         3   // adv start until adv complete
+#define TELEMETRY_PHASE_CNT         4
+#define TELEMETRY_TIME_UNIT_US      100
+#define TELEMETRY_PAYLOAD_SIZE      (4 + 4 * TELEMETRY_PHASE_CNT)
+
+
+// struct that describes opened packet, payload points into the packet
+typedef struct
+{
+    uint16_t header;
+    uint16_t seq;
+    const uint8_t* payload;
+    uint8_t payload_len;
+    bool is_auth;   // packet has the MAC (it is not checked by open_packet)
+} packet_info_t;
+
+
+// struct that describes telemetry summary
+typedef struct
+{
+    uint16_t wake_cnt;
+    uint8_t boot_cnt;
+    uint8_t error_cnt;
+    uint16_t phase_avg[TELEMETRY_PHASE_CNT];    // in TELEMETRY_TIME_UNIT_US
+    uint16_t phase_max[TELEMETRY_PHASE_CNT];    // in TELEMETRY_TIME_UNIT_US
+} telemetry_summary_t;
+
+
+// checks if the header matches valid types (registration, deletion, data, batch or telemetry)
+bool header_is_valid(uint16_t header)
+{
+    return (header == REG_HEADER) || (header == DEL_HEADER) ||
+           (header == DATA_HEADER) || (header == BATCH_HEADER) ||
+           (header == TELEMETRY_HEADER);
+}
+
+
+// CRC-8 (poly 0x07) table for 4 bits, calculated without branches
+static const uint8_t crc8_nibble_table[16] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+    0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D
+};
+
+
+uint8_t crc8(const uint8_t* data, uint8_t len)
+{
+    uint8_t crc = 0;
+    for (uint8_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        crc = (crc << 4) ^ crc8_nibble_table[crc >> 4];
+        crc = (crc << 4) ^ crc8_nibble_table[crc >> 4];
+    }
+    return crc;
+}
+
+
+// writes version (with flags), type and seq of the packet
+void put_packet_header(uint8_t* packet, uint16_t header, uint16_t seq, uint8_t flags)
+{
+    packet[0] = PACKET_VERSION | flags;
+    packet[1] = header & 0xFF;
+    packet[2] = seq >> 8;
+    packet[3] = seq & 0xFF;
+}
+
+
+// writes version, type and seq before the payload that is already at
+// packet + PACKET_HEADER_SIZE and the crc after it, returns the packet length
+uint8_t seal_packet(uint8_t* packet, uint16_t header, uint16_t seq, uint8_t payload_len)
+{
+    put_packet_header(packet, header, seq, 0);
+
+    uint8_t len = PACKET_HEADER_SIZE + payload_len;
+    packet[len] = crc8(packet, len);
+    return len + PACKET_CRC_SIZE;
+}
+
+
+// forms a packet by adding a header and optional data, returns the packet
+// length or -1 if it doesn't fit into the destination buffer
+int16_t form_packet(uint8_t* dest_buff, uint8_t dest_buff_len, uint16_t header, uint16_t seq,
+                    const uint8_t* data_buff, uint8_t data_buff_len)
 {
-    if (dest_buff == NULL)  // check if the destination buffer is not NULL
+    if (dest_buff == NULL || (data_buff == NULL && data_buff_len > 0) ||
+        dest_buff_len < PACKET_OVERHEAD + data_buff_len)
         return -1;
 
-    // if the system uses little-endian, reverse the bytes of the header
-    uint8_t endianness = check_endianness();
-    if (endianness == L_ENDIAN)
-        reverse_bytes((uint8_t*)&header_tag, sizeof(header_tag));
+    if (data_buff_len > 0)
+        memmove(dest_buff + PACKET_HEADER_SIZE, data_buff, data_buff_len);
 
-    memcpy(dest_buff, &header_tag, HEADER_SIZE);
+    return seal_packet(dest_buff, header, seq, data_buff_len);
+}
 
-    // if there is data, copy it into the destination buffer after the header
-    if (data_buff != NULL)
-        memcpy(dest_buff + HEADER_SIZE, data_buff, data_buff_len);
 
+// extracts and validates the header (version and type) from a packet,
+// the crc is not checked
+int8_t get_packet_header(uint16_t* dest_header, const uint8_t* packet, uint8_t packet_len)
+{
+    if (dest_header == NULL || packet == NULL || packet_len < PACKET_OVERHEAD)
+        return -1;
+
+    if ((packet[0] & ~PACKET_F_AUTH) != PACKET_VERSION || !header_is_valid(packet[1]))
+        return -1;
+
+    *dest_header = packet[1];
     return 0;
 }
 
 
-// opens and parses a packet, extracting the header and optional data
-int8_t open_packet(uint16_t* dest_header, uint8_t* dest_buff, const uint8_t* packet, uint8_t packet_len)
+// opens and checks a packet (version, type and crc), the payload is not
+// copied, it points into the packet. MAC of authenticated packet must be
+// checked with the key of the node (see packet_auth.h)
+int8_t open_packet(packet_info_t* dest_info, const uint8_t* packet, uint8_t packet_len)
 {
-    // if the packet length is too small to contain a header or
-    // the packet is NULL, return error
-    if (packet_len < HEADER_SIZE || packet == NULL)
+    uint16_t header;
+    if (dest_info == NULL || get_packet_header(&header, packet, packet_len) != 0)
+        return -1;
+
+    bool is_auth = packet[0] & PACKET_F_AUTH;
+    if (is_auth && packet_len < PACKET_AUTH_OVERHEAD)
+        return -1;
+
+    uint8_t len = packet_len - (is_auth ? PACKET_MAC_SIZE : PACKET_CRC_SIZE);
+    if (!is_auth && packet[len] != crc8(packet, len))
         return -1;
 
-    uint8_t header_arr[HEADER_SIZE];
-    memcpy(header_arr, packet, HEADER_SIZE);
+    dest_info->header = header;
+    dest_info->is_auth = is_auth;
+    dest_info->seq = (packet[2] << 8) | packet[3];
+    dest_info->payload = packet + PACKET_HEADER_SIZE;
+    dest_info->payload_len = len - PACKET_HEADER_SIZE;
+    return 0;
+}
+
+
+// writes an unsigned varint (7 bits per byte, lsb first), returns its
+// size or 0 if it does not fit into the destination buffer
+uint8_t write_varint(uint8_t* dest_buff, uint8_t dest_buff_len, uint32_t value)
+{
+    uint8_t len = 0;
+    do
+    {
+        if (len == dest_buff_len)
+            return 0;
+
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        dest_buff[len++] = value ? (byte | 0x80) : byte;
+    } while (value);
+
+    return len;
+}
 
-    // if the system uses little-endian, reverse the bytes of the header
-    uint8_t endianness = check_endianness();
-    if (endianness == L_ENDIAN)
-        reverse_bytes((uint8_t*)&header_arr, sizeof(header_arr));
 
-    // check if the header matches valid types (registration, deletion, or data)
-    uint16_t header = *(uint16_t*)header_arr;
-    if ((header != REG_HEADER) && (header != DEL_HEADER) && (header != DATA_HEADER))
+// reads an unsigned varint, returns its size or 0 if it is malformed
+uint8_t read_varint(uint32_t* dest_value, const uint8_t* buff, uint8_t buff_len)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < buff_len && i < VARINT_MAX_SIZE; i++)
+    {
+        value |= (uint32_t)(buff[i] & 0x7F) << (7 * i);
+        if (!(buff[i] & 0x80))
+        {
+            *dest_value = value;
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+// maps signed value to unsigned, so small negative deltas stay small
+uint32_t zigzag_encode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+
+int32_t zigzag_decode(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+
+// returns the size of the varint encoded value
+uint8_t varint_size(uint32_t value)
+{
+    uint8_t len = 1;
+    while (value >>= 7)
+        len++;
+    return len;
+}
+
+
+// returns the size of one encoded sample (except the first one)
+uint8_t batch_sample_size(const packet_sample_t* sample, const packet_sample_t* prev_sample, bool irregular)
+{
+    int32_t delta = (int32_t)(int16_t)sample->value - (int16_t)prev_sample->value;
+    uint8_t len = varint_size(zigzag_encode(delta));
+    if (irregular)
+        len += varint_size(sample->time_s - prev_sample->time_s);
+    return len;
+}
+
+
+// encodes samples[idx[0..samples_cnt-1]] (from the oldest to the newest)
+// as one batch of a sensor, if not all samples fit, only the oldest ones
+// are encoded. returns the number of encoded samples (0 on error)
+static uint8_t encode_sensor_batch(uint8_t* dest_buff, uint8_t dest_buff_len, uint8_t* dest_len,
+                                   const packet_sample_t* samples, const uint8_t* idx, uint8_t samples_cnt, uint32_t now_s)
+{
+    // samples are regular if all of them are equally spaced in time
+    uint32_t period = samples_cnt > 1 ? samples[idx[1]].time_s - samples[idx[0]].time_s : 0;
+    bool irregular = false;
+    for (uint8_t i = 2; i < samples_cnt && !irregular; i++)
+        irregular = samples[idx[i]].time_s - samples[idx[i-1]].time_s != period;
+
+    // find how many samples fit, the age field depends on the newest one
+    uint8_t prefix_len = 1 + 2 + (irregular ? 0 : varint_size(period));
+    uint16_t body_len = 0;
+    uint8_t fit_cnt = 0;
+    for (uint8_t i = 0; i < samples_cnt; i++)
+    {
+        if (i > 0)
+            body_len += batch_sample_size(&samples[idx[i]], &samples[idx[i-1]], irregular);
+
+        if (prefix_len + varint_size(now_s - samples[idx[i]].time_s) + body_len > dest_buff_len)
+            break;
+        fit_cnt = i + 1;
+    }
+
+    if (fit_cnt == 0)   // not even the first sample fits
+        return 0;
+
+    uint8_t pos = 0;
+    dest_buff[pos++] = fit_cnt | (irregular ? BATCH_F_IRREGULAR : 0);
+    pos += write_varint(dest_buff + pos, dest_buff_len - pos, now_s - samples[idx[fit_cnt - 1]].time_s);
+    if (!irregular)
+        pos += write_varint(dest_buff + pos, dest_buff_len - pos, period);
+
+    dest_buff[pos++] = samples[idx[0]].value >> 8;
+    dest_buff[pos++] = samples[idx[0]].value & 0xFF;
+
+    for (uint8_t i = 1; i < fit_cnt; i++)
+    {
+        if (irregular)
+            pos += write_varint(dest_buff + pos, dest_buff_len - pos, samples[idx[i]].time_s - samples[idx[i-1]].time_s);
+
+        int32_t delta = (int32_t)(int16_t)samples[idx[i]].value - (int16_t)samples[idx[i-1]].value;
+        pos += write_varint(dest_buff + pos, dest_buff_len - pos, zigzag_encode(delta));
+    }
+
+    *dest_len = pos;
+    return fit_cnt;
+}
+
+
+// encodes samples_cnt oldest samples grouped by the sensor (in the order
+// of the first sample of every sensor), returns false if they don't fit
+static bool encode_multi_batch(uint8_t* dest_buff, uint8_t dest_buff_len, uint8_t* dest_len,
+                               const packet_sample_t* samples, uint8_t samples_cnt, uint32_t now_s)
+{
+    uint8_t idx[BATCH_MAX_SAMPLES];
+    bool is_grouped[BATCH_MAX_SAMPLES] = {};
+    uint8_t groups_cnt = 0;
+    uint8_t pos = 1;
+
+    for (uint8_t first = 0; first < samples_cnt; first++)
+    {
+        if (is_grouped[first])
+            continue;
+
+        // indexes of all samples of the sensor
+        uint8_t group_cnt = 0;
+        for (uint8_t i = first; i < samples_cnt; i++)
+        {
+            if (samples[i].sensor != samples[first].sensor)
+                continue;
+            idx[group_cnt++] = i;
+            is_grouped[i] = true;
+        }
+
+        uint8_t group_len = 0;
+        if (pos + BATCH_GROUP_HEADER_SIZE > dest_buff_len)
+            return false;
+        dest_buff[pos] = samples[first].sensor;
+        if (encode_sensor_batch(dest_buff + pos + BATCH_GROUP_HEADER_SIZE, dest_buff_len - pos - BATCH_GROUP_HEADER_SIZE,
+                                &group_len, samples, idx, group_cnt, now_s) != group_cnt)
+            return false;
+        pos += BATCH_GROUP_HEADER_SIZE + group_len;
+        groups_cnt++;
+    }
+
+    dest_buff[0] = groups_cnt | BATCH_F_MULTI;
+    *dest_len = pos;
+    return true;
+}
+
+
+// encodes samples (from the oldest to the newest) into the batch payload,
+// if not all samples fit, only the oldest ones are encoded. returns the
+// number of encoded samples (0 on error), now_s is the time of packet forming (in s)
+uint8_t encode_batch(uint8_t* dest_buff, uint8_t dest_buff_len, uint8_t* dest_len,
+                     const packet_sample_t* samples, uint8_t samples_cnt, uint32_t now_s)
+{
+    if (dest_buff == NULL || dest_len == NULL || samples == NULL || samples_cnt == 0)
+        return 0;
+
+    if (samples_cnt > BATCH_MAX_SAMPLES)
+        samples_cnt = BATCH_MAX_SAMPLES;
+
+    bool is_multi = false;
+    for (uint8_t i = 0; i < samples_cnt && !is_multi; i++)
+        is_multi = samples[i].sensor != 0;
+
+    // body temperature only - one batch without groups
+    if (!is_multi)
+    {
+        uint8_t idx[BATCH_MAX_SAMPLES];
+        for (uint8_t i = 0; i < samples_cnt; i++)
+            idx[i] = i;
+        return encode_sensor_batch(dest_buff, dest_buff_len, dest_len, samples, idx, samples_cnt, now_s);
+    }
+
+    // the longest run of the oldest samples that fits is searched for,
+    // the encoded length grows with the number of samples
+    uint8_t fit_cnt = 0;
+    uint8_t low = 1, high = samples_cnt;
+    while (low <= high)
+    {
+        uint8_t mid = (low + high) / 2;
+        if (encode_multi_batch(dest_buff, dest_buff_len, dest_len, samples, mid, now_s))
+        {
+            fit_cnt = mid;
+            low = mid + 1;
+        }
+        else
+            high = mid - 1;
+    }
+
+    // the last try may be not the one that fits
+    if (fit_cnt == 0 || !encode_multi_batch(dest_buff, dest_buff_len, dest_len, samples, fit_cnt, now_s))
+        return 0;
+    return fit_cnt;
+}
+
+
+// decodes the batch of one sensor into samples, time_s of each sample is
+// its age - seconds before the packet was formed. returns the number of
+// read bytes or -1 if the batch is malformed
+static int16_t decode_sensor_batch(packet_sample_t* dest_samples, uint8_t dest_samples_size, uint8_t* dest_cnt,
+                                   const uint8_t* payload, uint8_t payload_len, uint8_t sensor)
+{
+    if (payload_len < BATCH_MIN_LEN)
+        return -1;
+
+    uint8_t samples_cnt = payload[0] & BATCH_CNT_MASK;
+    bool irregular = payload[0] & BATCH_F_IRREGULAR;
+    if (samples_cnt == 0 || samples_cnt > dest_samples_size || (payload[0] & BATCH_F_MULTI))
         return -1;
 
-    *dest_header = header;
+    uint8_t pos = 1;
+    uint8_t field_len;
+    uint32_t age, period = 0;
+
+    if (!(field_len = read_varint(&age, payload + pos, payload_len - pos)))
+        return -1;
+    pos += field_len;
+
+    if (!irregular)
+    {
+        if (!(field_len = read_varint(&period, payload + pos, payload_len - pos)))
+            return -1;
+        pos += field_len;
+    }
+
+    if (payload_len - pos < 2)
+        return -1;
+    dest_samples[0].value = (payload[pos] << 8) | payload[pos + 1];
+    dest_samples[0].sensor = sensor;
+    dest_samples[0].time_s = 0;
+    pos += 2;
+
+    // first, store times relative to the first sample
+    for (uint8_t i = 1; i < samples_cnt; i++)
+    {
+        uint32_t interval = period;
+        if (irregular)
+        {
+            if (!(field_len = read_varint(&interval, payload + pos, payload_len - pos)))
+                return -1;
+            pos += field_len;
+        }
+
+        uint32_t zz_delta;
+        if (!(field_len = read_varint(&zz_delta, payload + pos, payload_len - pos)))
+            return -1;
+        pos += field_len;
+
+        dest_samples[i].value = (uint16_t)((int16_t)dest_samples[i-1].value + zigzag_decode(zz_delta));
+        dest_samples[i].sensor = sensor;
+        dest_samples[i].time_s = dest_samples[i-1].time_s + interval;
+    }
 
-    // if packet is longer than header (contains data) and destination buffer not NULL
-    if (packet_len > HEADER_SIZE && dest_buff != NULL)
-        memcpy(dest_buff, packet + HEADER_SIZE, packet_len - HEADER_SIZE);
+    // then convert them into ages using the age of the newest sample
+    uint32_t newest_time = dest_samples[samples_cnt - 1].time_s;
+    for (uint8_t i = 0; i < samples_cnt; i++)
+        dest_samples[i].time_s = newest_time - dest_samples[i].time_s + age;
 
+    *dest_cnt = samples_cnt;
+    return pos;
+}
+
+
+// decodes the batch payload (without header) into samples, time_s of each
+// sample is its age - seconds before the packet was formed. samples of
+// several sensors are decoded group by group (sensor by sensor)
+int8_t decode_batch(packet_sample_t* dest_samples, uint8_t dest_samples_size, uint8_t* dest_cnt,
+                    const uint8_t* payload, uint8_t payload_len)
+{
+    if (dest_samples == NULL || dest_cnt == NULL || payload == NULL || payload_len == 0)
+        return -1;
+
+    if (!(payload[0] & BATCH_F_MULTI))
+        return decode_sensor_batch(dest_samples, dest_samples_size, dest_cnt, payload, payload_len, 0) < 0 ? -1 : 0;
+
+    uint8_t groups_cnt = payload[0] & BATCH_CNT_MASK;
+    uint8_t pos = 1;
+    uint8_t samples_cnt = 0;
+    for (uint8_t g = 0; g < groups_cnt; g++)
+    {
+        if (payload_len - pos < BATCH_GROUP_HEADER_SIZE)
+            return -1;
+        uint8_t sensor = payload[pos];
+        pos += BATCH_GROUP_HEADER_SIZE;
+
+        uint8_t group_cnt = 0;
+        int16_t group_len = decode_sensor_batch(dest_samples + samples_cnt, dest_samples_size - samples_cnt, &group_cnt,
+                                                payload + pos, payload_len - pos, sensor);
+        if (group_len < 0)
+            return -1;
+        pos += group_len;
+        samples_cnt += group_cnt;
+    }
+
+    if (samples_cnt == 0)
+        return -1;
+    *dest_cnt = samples_cnt;
     return 0;
 }
 
 
-// extracts and validates the header from a packet
-int8_t get_packet_header(uint16_t* dest_header, const uint8_t* packet)
+// encodes telemetry summary into the telemetry payload
+int8_t encode_telemetry(uint8_t* dest_buff, uint8_t dest_buff_len, const telemetry_summary_t* summary)
 {
-    // if the packet size is smaller than the header size or
-    // the packet is NULL, return error
-    if (sizeof(packet) < HEADER_SIZE || packet == NULL)
+    if (dest_buff == NULL || summary == NULL || dest_buff_len < TELEMETRY_PAYLOAD_SIZE)
         return -1;
 
-    uint8_t header_arr[HEADER_SIZE];
-    memcpy(header_arr, packet, HEADER_SIZE);
+    uint8_t pos = 0;
+    dest_buff[pos++] = summary->wake_cnt >> 8;
+    dest_buff[pos++] = summary->wake_cnt & 0xFF;
+    dest_buff[pos++] = summary->boot_cnt;
+    dest_buff[pos++] = summary->error_cnt;
+    for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++)
+    {
+        dest_buff[pos++] = summary->phase_avg[i] >> 8;
+        dest_buff[pos++] = summary->phase_avg[i] & 0xFF;
+    }
+    for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++)
+    {
+        dest_buff[pos++] = summary->phase_max[i] >> 8;
+        dest_buff[pos++] = summary->phase_max[i] & 0xFF;
+    }
 
-    // if the system uses little-endian, reverse the bytes of the header
-    uint8_t endianness = check_endianness();
-    if (endianness == L_ENDIAN)
-        reverse_bytes((uint8_t*)&header_arr, sizeof(header_arr));
+    return 0;
+}
 
-    // check if the header matches valid types (registration, deletion, or data)
-    uint16_t header = *(uint16_t*)header_arr;
-    if ((header != REG_HEADER) && (header != DEL_HEADER) && (header != DATA_HEADER))
+
+// decodes the telemetry payload (without header) into summary
+int8_t decode_telemetry(telemetry_summary_t* dest_summary, const uint8_t* payload, uint8_t payload_len)
+{
+    if (dest_summary == NULL || payload == NULL || payload_len < TELEMETRY_PAYLOAD_SIZE)
         return -1;
 
-    *dest_header = header;
+    uint8_t pos = 0;
+    dest_summary->wake_cnt = (payload[pos] << 8) | payload[pos + 1];
+    pos += 2;
+    dest_summary->boot_cnt = payload[pos++];
+    dest_summary->error_cnt = payload[pos++];
+    for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++, pos += 2)
+        dest_summary->phase_avg[i] = (payload[pos] << 8) | payload[pos + 1];
+    for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++, pos += 2)
+        dest_summary->phase_max[i] = (payload[pos] << 8) | payload[pos + 1];
+
     return 0;
 }
 
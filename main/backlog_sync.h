@@ -0,0 +1,347 @@
+/*
+ * backlog_sync.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_BACKLOG_SYNC_H_
+#define MAIN_BACKLOG_SYNC_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+#include "flash_log.h"
+#include "white_list.h"
+
+// Replaying the flash log (see flash_log.h) over advertising sends about a
+// dozen samples per acknowledged adv. When a registered gateway connects
+// to the data adv instead, the backlog is streamed over the connection:
+// the sensor asks for the large ATT MTU, data length extension and a short
+// connection interval, and sends the log as back-to-back notifications of
+// the data characteristic (while the gateway is subscribed).
+//
+// Every notification is a chunk: [seq 4B][span 2B][batch] - seq of the
+// first record in the chunk, number of records it covers and the records
+// encoded the same way as in the batch packet (see app_packet.h). A chunk
+// with zero span marks the end of the backlog. Chunks are queued by the
+// pump that runs on a NimBLE callout in the host task: every run queues a
+// few chunks while the host has free mbufs and the link is up, then the
+// pump runs again after about a connection interval. NOTIFY_TX can't pace
+// the stream, it fires while the notification is queued.
+// The stream is sized for SYNC_TARGET_BYTES_PER_S. The host backlog
+// scenario checks it against the connection events of its BLE model, the
+// rate over the air is only logged when the transfer stops.
+//
+// The gateway acknowledges the received records by writing seq of the
+// next expected record into the cursor characteristic, the records before
+// it are consumed, only over the encrypted link of the gateway that runs
+// the transfer. Reading the cursor returns [head seq 4B][tail seq 4B].
+// Only acknowledged records are consumed, so an interrupted transfer
+// continues from the last acknowledged record on the next connection.
+
+#define SYNC_PREFERRED_MTU          247     // max MTU that fits into one LL packet with DLE
+#define SYNC_DATA_LEN_OCTETS        251     // max LL payload (data length extension)
+#define SYNC_DATA_LEN_TIME_US       2120    // max LL packet time for 251 octets on 1M PHY
+#define SYNC_CONN_ITVL_MIN          6       // 7.5 ms (in 1.25 ms units)
+#define SYNC_CONN_ITVL_MAX          12      // 15 ms (in 1.25 ms units)
+#define SYNC_SUPERVISION_TIMEOUT    100     // 1 s (in 10 ms units)
+#define SYNC_MIN_FREE_MBUFS         4       // mbufs left to the host (responses, other links)
+#define SYNC_CHUNKS_PER_PUMP        4       // chunks queued per run of the pump
+#define SYNC_PUMP_PERIOD_MS         10      // about the connection interval
+#define SYNC_CHUNK_HEADER_SIZE      6       // seq and span
+#define SYNC_IDLE_TIMEOUT_US        (5 * 1000 * 1000)   // disconnect if the gateway is idle
+#define SYNC_TARGET_BYTES_PER_S     (10 * 1024)         // hours of backlog in about a second (host checks it)
+
+// 128-bit UUIDs of the service and its characteristics
+#define SYNC_SVC_UUID       BLE_UUID128_INIT(0x6e, 0x65, 0x6d, 0x69, 0x76, 0x2d, 0x73, 0x79, \
+                                             0x6e, 0x63, 0x2d, 0x73, 0x00, 0x00, 0x53, 0x42)
+#define SYNC_DATA_CHR_UUID  BLE_UUID128_INIT(0x6e, 0x65, 0x6d, 0x69, 0x76, 0x2d, 0x73, 0x79, \
+                                             0x6e, 0x63, 0x2d, 0x73, 0x01, 0x00, 0x53, 0x42)
+#define SYNC_CURSOR_CHR_UUID BLE_UUID128_INIT(0x6e, 0x65, 0x6d, 0x69, 0x76, 0x2d, 0x73, 0x79, \
+                                              0x6e, 0x63, 0x2d, 0x73, 0x02, 0x00, 0x53, 0x42)
+
+
+const char* g_tag_sync = "SYNC";    // tag used in logs
+
+uint16_t sync_conn_handle = BLE_HS_CONN_HANDLE_NONE;    // connection of the transfer
+uint16_t sync_data_val_hndl = 0;    // value handle of the data characteristic
+bool sync_is_subscribed = false;    // flag that the gateway enabled notifications
+bool sync_end_is_sent = false;      // flag that the end of the backlog was sent
+uint32_t sync_stream_seq = 0;       // seq of the next record to stream
+uint32_t sync_sent_bytes = 0;       // number of sent bytes (for throughput)
+int64_t sync_start_time = 0;        // time when streaming started (in us)
+esp_timer_handle_t sync_idle_timer = NULL;
+struct ble_npl_callout sync_pump_callout;   // runs the pump in the host task
+
+int backlog_sync_register();
+esp_err_t backlog_sync_start(uint16_t conn_handle);
+void backlog_sync_stop();
+bool backlog_sync_is_active();
+void backlog_sync_on_subscribe(const struct ble_gap_event* event);
+static int backlog_sync_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg);
+static void backlog_sync_pump();
+static void backlog_sync_on_pump_callout(struct ble_npl_event* ev);
+
+
+static const ble_uuid128_t sync_svc_uuid = SYNC_SVC_UUID;
+static const ble_uuid128_t sync_data_chr_uuid = SYNC_DATA_CHR_UUID;
+static const ble_uuid128_t sync_cursor_chr_uuid = SYNC_CURSOR_CHR_UUID;
+
+// service definition, it is used by the host after registration, so it is static
+static const struct ble_gatt_svc_def sync_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &sync_svc_uuid.u,
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = &sync_data_chr_uuid.u,
+                .access_cb = backlog_sync_access,
+                .flags = BLE_GATT_CHR_F_NOTIFY,
+                .val_handle = &sync_data_val_hndl,
+            },
+            {
+                .uuid = &sync_cursor_chr_uuid.u,
+                .access_cb = backlog_sync_access,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC,
+            },
+            {0}
+        },
+    },
+    {0}
+};
+
+
+static void backlog_sync_on_idle(void* arg)
+{
+    ESP_LOGI(g_tag_sync, "Gateway is idle, disconnect.");
+    ble_gap_terminate(sync_conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+
+static void backlog_sync_touch()
+{
+    esp_timer_stop(sync_idle_timer);
+    esp_timer_start_once(sync_idle_timer, SYNC_IDLE_TIMEOUT_US);
+}
+
+
+static void put_u32_be(uint8_t* dest, uint32_t value)
+{
+    dest[0] = value >> 24;
+    dest[1] = value >> 16;
+    dest[2] = value >> 8;
+    dest[3] = value;
+}
+
+
+// registers the service, must be called after nimble_port_init and
+// before the host is synced
+int backlog_sync_register()
+{
+    ble_npl_callout_init(&sync_pump_callout, nimble_port_get_dflt_eventq(), backlog_sync_on_pump_callout, NULL);
+    ble_att_set_preferred_mtu(SYNC_PREFERRED_MTU);
+
+    int rc = ble_gatts_count_cfg(sync_svcs);
+    if (rc != 0)
+        return rc;
+    return ble_gatts_add_svcs(sync_svcs);
+}
+
+
+// starts the transfer on the new connection of registered gateway, the
+// backlog is streamed once the gateway subscribes
+esp_err_t backlog_sync_start(uint16_t conn_handle)
+{
+    if (sync_idle_timer == NULL)
+    {
+        esp_timer_create_args_t timer_args = {
+                .callback = backlog_sync_on_idle,
+                .name = "sync_idle"};
+        if (esp_timer_create(&timer_args, &sync_idle_timer) != ESP_OK)
+            return ESP_FAIL;
+    }
+
+    sync_conn_handle = conn_handle;
+    sync_is_subscribed = false;
+    sync_end_is_sent = false;
+    sync_stream_seq = get_flash_log_head_seq();
+    sync_sent_bytes = 0;
+    sync_start_time = esp_timer_get_time();
+
+    // large MTU, long LL packets and short interval to send the backlog fast
+    ble_gattc_exchange_mtu(conn_handle, NULL, NULL);
+    ble_gap_set_data_len(conn_handle, SYNC_DATA_LEN_OCTETS, SYNC_DATA_LEN_TIME_US);
+
+    struct ble_gap_upd_params conn_params;
+    memset(&conn_params, 0, sizeof(conn_params));
+    conn_params.itvl_min = SYNC_CONN_ITVL_MIN;
+    conn_params.itvl_max = SYNC_CONN_ITVL_MAX;
+    conn_params.latency = 0;
+    conn_params.supervision_timeout = SYNC_SUPERVISION_TIMEOUT;
+    ble_gap_update_params(conn_handle, &conn_params);
+
+    ESP_LOGI(g_tag_sync, "Transfer is started: %lu records.", get_flash_log_len());
+    backlog_sync_touch();
+    return ESP_OK;
+}
+
+
+// ends the transfer (on disconnect) and reports the throughput
+void backlog_sync_stop()
+{
+    if (sync_conn_handle == BLE_HS_CONN_HANDLE_NONE)
+        return;
+
+    esp_timer_stop(sync_idle_timer);
+    ble_npl_callout_stop(&sync_pump_callout);
+    int64_t duration_us = esp_timer_get_time() - sync_start_time;
+    ESP_LOGI(g_tag_sync, "Transfer is stopped: %lu bytes in %lld us (%lld B/s), %lu records left.",
+             sync_sent_bytes, duration_us, duration_us > 0 ? sync_sent_bytes * 1000000LL / duration_us : 0,
+             get_flash_log_len());
+    sync_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    sync_is_subscribed = false;
+}
+
+
+// checks if the gateway is connected for the transfer
+bool backlog_sync_is_active()
+{
+    return sync_conn_handle != BLE_HS_CONN_HANDLE_NONE;
+}
+
+
+// starts streaming when the gateway enables notifications
+void backlog_sync_on_subscribe(const struct ble_gap_event* event)
+{
+    if (event->subscribe.conn_handle != sync_conn_handle || event->subscribe.attr_handle != sync_data_val_hndl)
+        return;
+
+    sync_is_subscribed = event->subscribe.cur_notify;
+    if (sync_is_subscribed)
+    {
+        sync_start_time = esp_timer_get_time();
+        backlog_sync_pump();
+    }
+}
+
+
+static void backlog_sync_on_pump_callout(struct ble_npl_event* ev)
+{
+    backlog_sync_pump();
+}
+
+
+// queues a few chunks while the host has free mbufs, runs again on the
+// callout until the end of the backlog is sent
+static void backlog_sync_pump()
+{
+    struct ble_gap_conn_desc conn_desc;
+    if (!sync_is_subscribed || sync_end_is_sent || ble_gap_conn_find(sync_conn_handle, &conn_desc) != 0)
+        return;
+
+    uint8_t chunks_cnt = 0;
+    while (!sync_end_is_sent && chunks_cnt < SYNC_CHUNKS_PER_PUMP && os_msys_num_free() > SYNC_MIN_FREE_MBUFS)
+    {
+        // chunk is cut to the notification (MTU - 3 bytes of ATT header),
+        // BATCH_MAX_SAMPLES records take about 70 bytes, so with the large
+        // MTU a chunk is shorter than the notification
+        uint8_t chunk[SYNC_PREFERRED_MTU - 3];
+        uint16_t chunk_size = ble_att_mtu(sync_conn_handle) - 3;
+        if (chunk_size > sizeof(chunk))
+            chunk_size = sizeof(chunk);
+
+        // records acknowledged during the transfer may be dropped from the
+        // log on overflow, so streaming continues with the oldest one
+        if (sync_stream_seq - get_flash_log_head_seq() > get_flash_log_len())
+            sync_stream_seq = get_flash_log_head_seq();
+
+        packet_sample_t samples[BATCH_MAX_SAMPLES];
+        uint8_t samples_cnt = 0;
+        uint32_t span = 0;
+        flash_log_read_from(sync_stream_seq, samples, BATCH_MAX_SAMPLES, &samples_cnt, &span);
+
+        uint8_t batch_len = 0;
+        if (samples_cnt > 0)
+        {
+            uint8_t sent_cnt = encode_batch(chunk + SYNC_CHUNK_HEADER_SIZE, chunk_size - SYNC_CHUNK_HEADER_SIZE,
+                                            &batch_len, samples, samples_cnt, get_time_s());
+            if (sent_cnt < samples_cnt)     // span of the samples that fit
+                flash_log_read_from(sync_stream_seq, samples, sent_cnt, &samples_cnt, &span);
+        }
+
+        // zero span marks the end of the backlog
+        put_u32_be(chunk, sync_stream_seq);
+        chunk[4] = span >> 8;
+        chunk[5] = span & 0xFF;
+
+        struct os_mbuf* om = ble_hs_mbuf_from_flat(chunk, SYNC_CHUNK_HEADER_SIZE + batch_len);
+        if (om == NULL)
+            break;  // no buffers, wait for the queued notifications
+        if (ble_gatts_notify_custom(sync_conn_handle, sync_data_val_hndl, om) != 0)
+            break;
+
+        chunks_cnt++;
+        sync_sent_bytes += SYNC_CHUNK_HEADER_SIZE + batch_len;
+        sync_stream_seq += span;
+        sync_end_is_sent = span == 0;
+    }
+
+    // the gateway is idle if it doesn't take the chunks
+    if (chunks_cnt > 0)
+        backlog_sync_touch();
+    if (!sync_end_is_sent)
+        ble_npl_callout_reset(&sync_pump_callout, ble_npl_time_ms_to_ticks32(SYNC_PUMP_PERIOD_MS));
+}
+
+
+// cursor characteristic access: read returns head and tail seq, write
+// acknowledges the records before the written seq
+static int backlog_sync_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg)
+{
+    if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR)
+    {
+        uint8_t cursor[8];
+        put_u32_be(cursor, get_flash_log_head_seq());
+        put_u32_be(cursor + 4, get_flash_log_tail_seq());
+        return os_mbuf_append(ctxt->om, cursor, sizeof(cursor)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
+    if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR)
+    {
+        // the link is encrypted by the host (WRITE_ENC), records are
+        // consumed by the registered gateway of the transfer only
+        struct ble_gap_conn_desc conn_desc;
+        if (conn_handle != sync_conn_handle || ble_gap_conn_find(conn_handle, &conn_desc) != 0 ||
+            !white_list_contains_addr(&conn_desc.peer_id_addr))
+            return BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+
+        uint8_t ack[4];
+        uint16_t ack_len = 0;
+        if (ble_hs_mbuf_to_flat(ctxt->om, ack, sizeof(ack), &ack_len) != 0 || ack_len != sizeof(ack))
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+        uint32_t ack_seq = ((uint32_t)ack[0] << 24) | ((uint32_t)ack[1] << 16) | ((uint32_t)ack[2] << 8) | ack[3];
+        if (flash_log_consume_until(ack_seq) != ESP_OK)
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+
+        // after the end of the backlog, ack of less than all records asks
+        // to resend from the acknowledged record
+        if (sync_end_is_sent && ack_seq != get_flash_log_tail_seq())
+        {
+            sync_stream_seq = ack_seq;
+            sync_end_is_sent = false;
+        }
+        backlog_sync_pump();
+        return 0;
+    }
+
+    return BLE_ATT_ERR_UNLIKELY;
+}
+
+
+#endif /* MAIN_BACKLOG_SYNC_H_ */
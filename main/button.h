@@ -10,10 +10,15 @@
 
 
 #include <unistd.h>
+#include <stdatomic.h>
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "driver/gpio.h"
+#include "esp_sleep.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_check_err.h"
+#include "task_priorities_rtos.h"
 
 
 // To ensure reliable operation of the button functionality, proper
@@ -24,6 +29,23 @@
 // are many ways to solve this problem, and one of the simplest is to
 // disable interrupt handling until the contact bouncing subsides, which
 // is the solution used in this case.
+//
+// Edge interrupts don't wake the chip from light sleep (see
+// power_mgmt.h), so the gpio interrupt is level triggered and is also the
+// light sleep wakeup source. After every debounced edge it is switched to
+// the opposite level: high while released, low while pressed.
+//
+// The debounce timer runs in the esp_timer task, which is shared with
+// every other timer, so it only records the debounced edge (level and
+// time) into a small lock-free queue and wakes the dispatcher task. The
+// dispatcher classifies the press length (integer us, no float math) and
+// runs the press callbacks, so they may take long (start advertising,
+// enter deep sleep) without blocking the timers. The delay between the
+// release edge and the callback is logged as the button latency.
+
+#define BUTTON_DEBOUNCE_US          (10 * 1000) // time to wait for the contact bouncing to subside
+#define BUTTON_EDGE_QUEUE_SIZE      8           // max number of not dispatched edges (power of 2)
+#define BUTTON_DISPATCHER_STACK_SIZE 4096       // press callbacks use BLE and logging
 
 // structure that describes button gpio
 typedef struct {
@@ -45,22 +67,54 @@ typedef struct {
 
 } button_cnfg_t;
 
+
+// debounced edge of the button gpio
+typedef struct {
+    int64_t time_us;    // time point of the edge (esp_timer time)
+    uint8_t level;      // new gpio level, 1 - pressed, 0 - released
+
+} button_edge_t;
+
+
+// length class of a finished press
+typedef enum {
+    SHORT_BUTTON_PRESS,
+    MEDIUM_BUTTON_PRESS,
+    LONG_BUTTON_PRESS
+
+} button_press_t;
+
 const char* g_tag_butt = "BUTT";    // tag used in ESP_CHECK
 
 button_cnfg_t g_button_cnfg;        // button configuration
 button_gpio_t g_button_gpio = {};   // button gpio
 int64_t g_button_pressed_time;      // time point when button was pressed
 int64_t g_button_released_time;     // time point when button was released
+TaskHandle_t g_button_dispatcher_hndl = NULL;   // handle for the dispatcher task
+uint32_t g_button_max_latency_us = 0;           // max delay between release and dispatch
+
+// single producer (debounce timer) single consumer (dispatcher) queue,
+// the producer only moves the tail and the consumer only moves the head
+button_edge_t button_edge_queue[BUTTON_EDGE_QUEUE_SIZE];
+atomic_uint_fast8_t button_edge_head = 0;   // index of the oldest edge
+atomic_uint_fast8_t button_edge_tail = 0;   // index to put the next edge
+atomic_uint_fast32_t button_edges_dropped = 0;  // number of edges lost on a full queue
 
 
 esp_err_t button_init(button_cnfg_t button_cnfg);
 esp_err_t button_deinit();
+esp_err_t button_enable_wakeup(gpio_num_t gpio_num);
+button_press_t classify_button_press(int64_t pressed_period_us);
+static bool push_button_edge(const button_edge_t* edge);
+static bool pop_button_edge(button_edge_t* dest_edge);
+static void button_dispatcher(void* arg);
+static void dispatch_button_edge(const button_edge_t* edge);
 static void glitching_timer_cb(void* arg);
 static void IRAM_ATTR gpio_isr_handler(void* arg);
 
 
 // inits button configuration and sets up gpio, interrupt, and timer for debouncing
-// the button pin is configured to trigger interrupts on any edge
+// the button pin is configured to trigger interrupts on the level of the next edge
 esp_err_t button_init(button_cnfg_t button_cnfg)
 {
     esp_err_t init_status = ESP_OK; // TODO
@@ -72,19 +126,30 @@ esp_err_t button_init(button_cnfg_t button_cnfg)
     gpio_button_cnfg.mode = GPIO_MODE_INPUT;                // configure the pin as input
     gpio_button_cnfg.pull_up_en = GPIO_PULLUP_DISABLE;      // low level on release
     gpio_button_cnfg.pull_down_en = GPIO_PULLDOWN_ENABLE;   // high level on press
-    gpio_button_cnfg.intr_type = GPIO_INTR_ANYEDGE;         // enable interrupt on both edges
+    gpio_button_cnfg.intr_type = GPIO_INTR_HIGH_LEVEL;      // wait for the press
 
     // configure gpio button pin, enable interrupt, enable deep sleep wakeup on high level
     ESP_CHECK(gpio_config(&gpio_button_cnfg), g_tag_butt);
     ESP_CHECK(gpio_intr_enable(g_button_cnfg.gpio_num), g_tag_butt);
-    ESP_CHECK(gpio_deep_sleep_wakeup_enable(g_button_cnfg.gpio_num, GPIO_INTR_HIGH_LEVEL), g_tag_butt);
+    button_enable_wakeup(g_button_cnfg.gpio_num);
 
-    ESP_CHECK(esp_deep_sleep_enable_gpio_wakeup(1ULL << g_button_cnfg.gpio_num, ESP_GPIO_WAKEUP_GPIO_HIGH), g_tag_butt);
+    // wake up from light sleep on the press level (switched on every edge)
+    ESP_CHECK(gpio_wakeup_enable(g_button_cnfg.gpio_num, GPIO_INTR_HIGH_LEVEL), g_tag_butt);
+    ESP_CHECK(esp_sleep_enable_gpio_wakeup(), g_tag_butt);
 
 
     // init button_gpio_t structure for further passing to function
     g_button_gpio.gpio_num = g_button_cnfg.gpio_num;
 
+    // create the dispatcher task which runs the press callbacks
+    if (g_button_dispatcher_hndl == NULL &&
+        xTaskCreate(button_dispatcher, "button_dispatcher", BUTTON_DISPATCHER_STACK_SIZE, NULL,
+                    tskIDLE_PRIORITY + MEDIUM_TASK_PRIORITY, &g_button_dispatcher_hndl) != pdPASS)
+    {
+        ESP_LOGE(g_tag_butt, "Dispatcher task creation failed!");
+        return ESP_FAIL;
+    }
+
     // configure the glitching timer for debouncing
     const esp_timer_create_args_t glitching_timer_args = {
         .name = "glitching timer",
@@ -111,10 +176,31 @@ esp_err_t button_deinit()
 
     esp_timer_delete(g_button_gpio.glitching_timer); // delete the glitching timer
 
+    // delete the dispatcher task, not dispatched edges are dropped
+    if (g_button_dispatcher_hndl != NULL)
+    {
+        vTaskDelete(g_button_dispatcher_hndl);
+        g_button_dispatcher_hndl = NULL;
+    }
+    atomic_store(&button_edge_head, atomic_load(&button_edge_tail));
+
     return deinit_status;
 }
 
 
+// enables deep sleep wakeup on high level of the button gpio. wakeup
+// configuration doesn't survive deep sleep, so it must be set on every wake,
+// even if the button itself isn't inited (e.g. on timer wakeup)
+esp_err_t button_enable_wakeup(gpio_num_t gpio_num)
+{
+    ESP_CHECK(gpio_pullup_dis(gpio_num), g_tag_butt);    // low level on release
+    ESP_CHECK(gpio_pulldown_en(gpio_num), g_tag_butt);   // high level on press
+    ESP_CHECK(gpio_deep_sleep_wakeup_enable(gpio_num, GPIO_INTR_HIGH_LEVEL), g_tag_butt);
+    ESP_CHECK(esp_deep_sleep_enable_gpio_wakeup(1ULL << gpio_num, ESP_GPIO_WAKEUP_GPIO_HIGH), g_tag_butt);
+    return ESP_OK;
+}
+
+
 // interrupt service routine handler for the button gpio
 // disables interrupts temporarily and starts a debounce timer.
 static void gpio_isr_handler(void* arg)
@@ -123,64 +209,148 @@ static void gpio_isr_handler(void* arg)
     // disable further interrupts for this GPIO pin
     gpio_intr_disable(gpio->gpio_num);
     // start a timer for debounce to prevent handling noisy signals
-    esp_timer_start_once(gpio->glitching_timer,  10 * 1000);  // 10 ms
+    esp_timer_start_once(gpio->glitching_timer, BUTTON_DEBOUNCE_US);
 }
 
 
-// callback for the glitching timer. once the debounce time
-// is completed, the function checks the button state and triggers
-// the appropriate actions based on the press duration (short, medium, or long).
+// callback for the glitching timer. once the debounce time is completed,
+// the function checks the button state and queues the edge if the state
+// has changed, the press itself is handled by the dispatcher task
 static void glitching_timer_cb(void* arg)
 {
     button_gpio_t* gpio = (button_gpio_t*) arg;
     static int prev_gpio_level = 0;
     int new_gpio_level = gpio_get_level(gpio->gpio_num);
 
-    // re-enable the GPIO interrupt after the debounce period
+    // re-enable the GPIO interrupt after the debounce period on the level
+    // of the next edge (it also sets the light sleep wakeup level)
+    gpio_wakeup_enable(gpio->gpio_num, new_gpio_level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
     gpio_intr_enable(gpio->gpio_num);
 
     // if the state of the button has changed
-    if(prev_gpio_level != new_gpio_level)
+    if (prev_gpio_level != new_gpio_level)
     {
-        if (new_gpio_level == 1)        // BUTTON IS PRESSED
-            g_button_pressed_time = esp_timer_get_time();   // record press time
-        else if(new_gpio_level == 0)    // BUTTON IS RELEASED
-        {
-            g_button_released_time = esp_timer_get_time();  // record release time
-
-            // calculate the duration of the button press
-            int64_t button_pressed_period = g_button_released_time - g_button_pressed_time;
-            if (button_pressed_period < 0)
-                ESP_LOGE(g_tag_butt, "Button pressed period measurement error.");
-
-            ESP_LOGI(g_tag_butt, "Button was pressed for %lld us = %f s", button_pressed_period, button_pressed_period/1000000.0);
-
-            if (button_pressed_period/1000.0 < g_button_cnfg.short_button_press_period_ms)          // SHORT BUTTON PRESS
-            {
-                ESP_LOGI(g_tag_butt, "Short button pressed period.");
-                if (g_button_cnfg.on_short_button_press_cb != NULL)
-                    (*g_button_cnfg.on_short_button_press_cb)();
-            }
-            else if(button_pressed_period/1000.0 >= g_button_cnfg.short_button_press_period_ms &&
-                    button_pressed_period/1000.0 <  g_button_cnfg.medium_button_press_period_ms)      // MEDIUM BUTTON PRESS
-            {
-                ESP_LOGI(g_tag_butt, "Medium button pressed period.");
-                if (g_button_cnfg.on_medium_button_press_cb != NULL)
-                    (*g_button_cnfg.on_medium_button_press_cb)();
-            }
-            else if(button_pressed_period/1000.0 >= g_button_cnfg.medium_button_press_period_ms)      // LONG BUTTON PRESS
-            {
-                ESP_LOGI(g_tag_butt, "Long button pressed period.");
-                if (g_button_cnfg.on_long_button_press_cb != NULL)
-                    (*g_button_cnfg.on_long_button_press_cb)();
-            }
-        }
+        button_edge_t edge = {
+            .time_us = esp_timer_get_time(),
+            .level = new_gpio_level
+        };
+        if (push_button_edge(&edge) && g_button_dispatcher_hndl != NULL)
+            xTaskNotifyGive(g_button_dispatcher_hndl);
 
         prev_gpio_level = new_gpio_level;   // update previous gpio state
     }
 }
 
 
+// puts the edge into the queue, returns false if the queue is full
+static bool push_button_edge(const button_edge_t* edge)
+{
+    uint_fast8_t tail = atomic_load_explicit(&button_edge_tail, memory_order_relaxed);
+    uint_fast8_t head = atomic_load_explicit(&button_edge_head, memory_order_acquire);
+    if ((uint8_t)(tail - head) == BUTTON_EDGE_QUEUE_SIZE)
+    {
+        atomic_fetch_add_explicit(&button_edges_dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    button_edge_queue[tail % BUTTON_EDGE_QUEUE_SIZE] = *edge;
+    // the edge must be written before the consumer can see the new tail
+    atomic_store_explicit(&button_edge_tail, (uint8_t)(tail + 1), memory_order_release);
+    return true;
+}
+
+
+// takes the oldest edge from the queue, returns false if the queue is empty
+static bool pop_button_edge(button_edge_t* dest_edge)
+{
+    uint_fast8_t head = atomic_load_explicit(&button_edge_head, memory_order_relaxed);
+    uint_fast8_t tail = atomic_load_explicit(&button_edge_tail, memory_order_acquire);
+    if (head == tail)
+        return false;
+
+    *dest_edge = button_edge_queue[head % BUTTON_EDGE_QUEUE_SIZE];
+    // the slot must be read before the producer can reuse it
+    atomic_store_explicit(&button_edge_head, (uint8_t)(head + 1), memory_order_release);
+    return true;
+}
+
+
+// dispatcher task, waits for edges and handles them in order
+static void button_dispatcher(void* arg)
+{
+    button_edge_t edge;
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (pop_button_edge(&edge))
+            dispatch_button_edge(&edge);
+
+        uint32_t dropped = atomic_exchange_explicit(&button_edges_dropped, 0, memory_order_relaxed);
+        if (dropped)
+            ESP_LOGE(g_tag_butt, "%lu button edges were dropped.", (unsigned long)dropped);
+    }
+}
+
+
+// records the press time or, on release, classifies the press length
+// and runs the corresponding callback
+static void dispatch_button_edge(const button_edge_t* edge)
+{
+    if (edge->level == 1)   // BUTTON IS PRESSED
+    {
+        g_button_pressed_time = edge->time_us;  // record press time
+        return;
+    }
+
+    // BUTTON IS RELEASED
+    g_button_released_time = edge->time_us;     // record release time
+
+    // calculate the duration of the button press
+    int64_t button_pressed_period = g_button_released_time - g_button_pressed_time;
+    if (button_pressed_period < 0)
+        ESP_LOGE(g_tag_butt, "Button pressed period measurement error.");
+
+    uint32_t latency_us = esp_timer_get_time() - edge->time_us;
+    if (latency_us > g_button_max_latency_us)
+        g_button_max_latency_us = latency_us;
+
+    ESP_LOGI(g_tag_butt, "Button was pressed for %lld us, dispatch latency = %lu us (max %lu us)",
+             button_pressed_period, (unsigned long)latency_us, (unsigned long)g_button_max_latency_us);
+
+    void (*press_cb)(void) = NULL;
+    switch (classify_button_press(button_pressed_period))
+    {
+        case SHORT_BUTTON_PRESS:
+            ESP_LOGI(g_tag_butt, "Short button pressed period.");
+            press_cb = g_button_cnfg.on_short_button_press_cb;
+            break;
+        case MEDIUM_BUTTON_PRESS:
+            ESP_LOGI(g_tag_butt, "Medium button pressed period.");
+            press_cb = g_button_cnfg.on_medium_button_press_cb;
+            break;
+        case LONG_BUTTON_PRESS:
+            ESP_LOGI(g_tag_butt, "Long button pressed period.");
+            press_cb = g_button_cnfg.on_long_button_press_cb;
+            break;
+    }
+
+    if (press_cb != NULL)
+        (*press_cb)();
+}
+
+
+// classifies the press length, thresholds are compared in us, so
+// no division is needed
+button_press_t classify_button_press(int64_t pressed_period_us)
+{
+    if (pressed_period_us < (int64_t)g_button_cnfg.short_button_press_period_ms * 1000)
+        return SHORT_BUTTON_PRESS;
+    if (pressed_period_us < (int64_t)g_button_cnfg.medium_button_press_period_ms * 1000)
+        return MEDIUM_BUTTON_PRESS;
+    return LONG_BUTTON_PRESS;
+}
+
+
 // force an interrupt for the button
 void force_interupt()
 {
@@ -0,0 +1,315 @@
+/*
+ * flash_log.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_FLASH_LOG_H_
+#define MAIN_FLASH_LOG_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "system.h"
+#include "app_packet.h"
+
+// Samples that were advertised but not acknowledged by a gateway (e.g. the
+// patient walked out of range) are kept in an append-only circular log in
+// a dedicated flash partition (see partitions.csv) and replayed once the
+// gateway acknowledges a batch again.
+//
+// Every record has a sequence number, the flash offset of the record is
+// derived from it, so the log needs no index. Records are staged in RTC
+// memory and written one page at a time, so a write is always page aligned
+// and RAM usage is one page. A sector is erased right before the first
+// page is written into it, if it still holds unsent records, they are
+// dropped (the oldest samples are lost first).
+//
+// Read and consume pointers are kept in RTC memory. After power loss the
+// log is scanned once to find the newest record and all records still in
+// the partition are replayed again (the gateway drops duplicates by time).
+
+#define FLASH_LOG_PARTITION_TYPE    ESP_PARTITION_TYPE_DATA
+#define FLASH_LOG_PARTITION_SUBTYPE 0x40        // custom data subtype (see partitions.csv)
+#define FLASH_LOG_PARTITION_LABEL   "samples"
+#define FLASH_LOG_RECORD_SIZE       16          // size of the record in flash (bytes)
+#define FLASH_LOG_PAGE_SIZE         256         // flash page, unit of a write (bytes)
+#define FLASH_LOG_SECTOR_SIZE       4096        // flash sector, unit of an erase (bytes)
+#define FLASH_LOG_RECORDS_PER_PAGE  (FLASH_LOG_PAGE_SIZE / FLASH_LOG_RECORD_SIZE)
+#define FLASH_LOG_RECORDS_PER_SECTOR (FLASH_LOG_SECTOR_SIZE / FLASH_LOG_RECORD_SIZE)
+#define FLASH_LOG_MAGIC             0x5A3C96E1  // mixed into the check of the record
+
+
+// struct that describes record in flash
+typedef struct
+{
+    uint32_t seq;       // sequence number, 0xFFFFFFFF in erased flash
+    uint32_t time_s;    // time when the sample was measured (in s)
+    uint16_t value;     // raw sample value
+    uint8_t sensor_inv; // id of the sensor inverted, so 0xFF (erased flash, older records) is body temperature
+    uint8_t reserved;
+    uint32_t check;     // check of the fields, detects torn writes
+} flash_log_record_t;
+
+
+const char* g_tag_log = "LOG";  // tag used in logs
+
+const esp_partition_t* flash_log_partition = NULL;  // partition with the log
+uint32_t flash_log_capacity = 0;    // number of records in the partition
+
+esp_err_t init_flash_log();
+esp_err_t flash_log_append(uint8_t sensor, uint16_t value, uint32_t time_s);
+esp_err_t flash_log_read(packet_sample_t* dest_samples, uint8_t dest_samples_size, uint8_t* dest_cnt, uint32_t* dest_span);
+esp_err_t flash_log_read_from(uint32_t from_seq, packet_sample_t* dest_samples, uint8_t dest_samples_size,
+                              uint8_t* dest_cnt, uint32_t* dest_span);
+esp_err_t flash_log_consume(uint32_t span);
+esp_err_t flash_log_consume_until(uint32_t seq);
+uint32_t get_flash_log_head_seq();
+uint32_t get_flash_log_tail_seq();
+uint32_t get_flash_log_len();
+bool flash_log_is_empty();
+
+
+// log state, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR flash_log_record_t flash_log_page[FLASH_LOG_RECORDS_PER_PAGE];    // staged records
+RTC_DATA_ATTR uint32_t flash_log_head_seq = 0;  // seq of the oldest unsent record
+RTC_DATA_ATTR uint32_t flash_log_tail_seq = 0;  // seq of the next record
+RTC_DATA_ATTR bool flash_log_is_recovered = false;  // flag that pointers are valid (cleared on power loss)
+
+
+static uint32_t flash_log_check(const flash_log_record_t* record)
+{
+    return record->seq ^ record->time_s ^ ((uint32_t)record->value << 16) ^
+           ((uint32_t)(uint8_t)~record->sensor_inv << 8) ^ FLASH_LOG_MAGIC;
+}
+
+
+static uint32_t flash_log_offset(uint32_t seq)
+{
+    return (seq % flash_log_capacity) * FLASH_LOG_RECORD_SIZE;
+}
+
+
+// seq of the first record that is not in flash yet (first staged one)
+static uint32_t flash_log_page_seq()
+{
+    return flash_log_tail_seq - flash_log_tail_seq % FLASH_LOG_RECORDS_PER_PAGE;
+}
+
+
+// reads the record with seq from flash, returns false if it's not valid
+static bool flash_log_read_record(uint32_t seq, flash_log_record_t* record)
+{
+    if (esp_partition_read(flash_log_partition, flash_log_offset(seq), record, sizeof(*record)) != ESP_OK)
+        return false;
+    return record->seq == seq && record->check == flash_log_check(record);
+}
+
+
+// finds the log partition, after power-on restores the pointers by
+// scanning the first record of every page for the newest one
+esp_err_t init_flash_log()
+{
+    if (flash_log_partition != NULL)
+        return ESP_OK;
+
+    flash_log_partition = esp_partition_find_first(FLASH_LOG_PARTITION_TYPE, FLASH_LOG_PARTITION_SUBTYPE,
+                                                   FLASH_LOG_PARTITION_LABEL);
+    if (flash_log_partition == NULL)
+    {
+        ESP_LOGE(g_tag_log, "Partition \"%s\" is not found!", FLASH_LOG_PARTITION_LABEL);
+        return ESP_FAIL;
+    }
+
+    // whole sectors only, so erasing a sector never touches the next one
+    flash_log_capacity = flash_log_partition->size / FLASH_LOG_SECTOR_SIZE * FLASH_LOG_RECORDS_PER_SECTOR;
+    if (flash_log_capacity < 2 * FLASH_LOG_RECORDS_PER_SECTOR)
+    {
+        ESP_LOGE(g_tag_log, "Partition \"%s\" is too small!", FLASH_LOG_PARTITION_LABEL);
+        flash_log_partition = NULL;
+        return ESP_FAIL;
+    }
+
+    if (flash_log_is_recovered)
+        return ESP_OK;
+
+    // pages are written whole, so the first record shows if the page is valid
+    bool found = false;
+    uint32_t newest_seq = 0;
+    uint32_t oldest_seq = 0;
+    for (uint32_t idx = 0; idx < flash_log_capacity; idx += FLASH_LOG_RECORDS_PER_PAGE)
+    {
+        flash_log_record_t record;
+        if (esp_partition_read(flash_log_partition, idx * FLASH_LOG_RECORD_SIZE, &record, sizeof(record)) != ESP_OK)
+            continue;
+        if (record.check != flash_log_check(&record) || record.seq % flash_log_capacity != idx)
+            continue;
+
+        if (!found || record.seq > newest_seq)
+            newest_seq = record.seq;
+        if (!found || record.seq < oldest_seq)
+            oldest_seq = record.seq;
+        found = true;
+    }
+
+    // continue with the page after the newest one, pages of the older
+    // sectors that were overwritten are not valid anymore
+    flash_log_tail_seq = found ? newest_seq + FLASH_LOG_RECORDS_PER_PAGE : 0;
+    flash_log_head_seq = found ? oldest_seq : 0;
+    if (flash_log_tail_seq - flash_log_head_seq > flash_log_capacity)
+        flash_log_head_seq = flash_log_tail_seq - flash_log_capacity;
+    flash_log_is_recovered = true;
+
+    ESP_LOGI(g_tag_log, "Log is recovered: %lu records to replay.", get_flash_log_len());
+    return ESP_OK;
+}
+
+
+// writes the staged page to flash, erasing the sector first if the page
+// is its first one
+static esp_err_t flash_log_write_page()
+{
+    uint32_t page_seq = flash_log_page_seq() - FLASH_LOG_RECORDS_PER_PAGE;
+    uint32_t offset = flash_log_offset(page_seq);
+
+    if (offset % FLASH_LOG_SECTOR_SIZE == 0)
+    {
+        esp_err_t err = esp_partition_erase_range(flash_log_partition, offset, FLASH_LOG_SECTOR_SIZE);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(g_tag_log, "Erase failed! Error: %s", esp_err_to_name(err));
+            return err;
+        }
+
+        // drop unsent records of the erased sector (oldest ones)
+        uint32_t sector_end_seq = page_seq + FLASH_LOG_RECORDS_PER_SECTOR;
+        if (sector_end_seq - flash_log_head_seq > flash_log_capacity)
+        {
+            uint32_t new_head_seq = sector_end_seq - flash_log_capacity;
+            ESP_LOGW(g_tag_log, "Log is full, %lu records are dropped.", new_head_seq - flash_log_head_seq);
+            flash_log_head_seq = new_head_seq;
+        }
+    }
+
+    esp_err_t err = esp_partition_write(flash_log_partition, offset, flash_log_page, sizeof(flash_log_page));
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_log, "Write failed! Error: %s", esp_err_to_name(err));
+    return err;
+}
+
+
+// appends the sample to the log, the page is written when it's full
+esp_err_t flash_log_append(uint8_t sensor, uint16_t value, uint32_t time_s)
+{
+    if (flash_log_partition == NULL)
+        return ESP_FAIL;
+
+    flash_log_record_t* record = &flash_log_page[flash_log_tail_seq % FLASH_LOG_RECORDS_PER_PAGE];
+    record->seq = flash_log_tail_seq;
+    record->time_s = time_s;
+    record->value = value;
+    record->sensor_inv = ~sensor;
+    record->reserved = 0xFF;
+    record->check = flash_log_check(record);
+    flash_log_tail_seq++;
+
+    if (flash_log_tail_seq % FLASH_LOG_RECORDS_PER_PAGE != 0)
+        return ESP_OK;
+
+    return flash_log_write_page();
+}
+
+
+// copies the oldest unsent samples (up to dest_samples_size) into the
+// destination array, records that are not valid anymore are skipped.
+// span is the number of records covered (read and skipped)
+esp_err_t flash_log_read(packet_sample_t* dest_samples, uint8_t dest_samples_size, uint8_t* dest_cnt, uint32_t* dest_span)
+{
+    return flash_log_read_from(flash_log_head_seq, dest_samples, dest_samples_size, dest_cnt, dest_span);
+}
+
+
+// the same as flash_log_read, but starts with from_seq record (e.g. to
+// stream records that are not acknowledged yet), span is counted from it
+esp_err_t flash_log_read_from(uint32_t from_seq, packet_sample_t* dest_samples, uint8_t dest_samples_size,
+                              uint8_t* dest_cnt, uint32_t* dest_span)
+{
+    if (dest_samples == NULL || dest_cnt == NULL || dest_span == NULL || flash_log_partition == NULL)
+        return ESP_FAIL;
+
+    if (from_seq - flash_log_head_seq > get_flash_log_len())  // out of unsent records
+        return ESP_FAIL;
+
+    *dest_cnt = 0;
+    uint32_t page_seq = flash_log_page_seq();
+    uint32_t seq = from_seq;
+    for (; seq != flash_log_tail_seq && *dest_cnt < dest_samples_size; seq++)
+    {
+        flash_log_record_t record;
+        if (seq >= page_seq)    // record is still staged
+            record = flash_log_page[seq % FLASH_LOG_RECORDS_PER_PAGE];
+        else if (!flash_log_read_record(seq, &record))
+            continue;
+
+        dest_samples[*dest_cnt].value = record.value;
+        dest_samples[*dest_cnt].sensor = (uint8_t)~record.sensor_inv;
+        dest_samples[*dest_cnt].time_s = record.time_s;
+        (*dest_cnt)++;
+    }
+
+    *dest_span = seq - from_seq;
+    return ESP_OK;
+}
+
+
+// marks span oldest records as sent (after they were acknowledged)
+esp_err_t flash_log_consume(uint32_t span)
+{
+    if (span > get_flash_log_len())
+        return ESP_FAIL;
+
+    flash_log_head_seq += span;
+    return ESP_OK;
+}
+
+
+// marks all records before seq as sent
+esp_err_t flash_log_consume_until(uint32_t seq)
+{
+    return flash_log_consume(seq - flash_log_head_seq);
+}
+
+
+// returns seq of the oldest unsent record
+uint32_t get_flash_log_head_seq()
+{
+    return flash_log_head_seq;
+}
+
+
+// returns seq of the next record (after the newest one)
+uint32_t get_flash_log_tail_seq()
+{
+    return flash_log_tail_seq;
+}
+
+
+// returns the number of unsent records
+uint32_t get_flash_log_len()
+{
+    return flash_log_tail_seq - flash_log_head_seq;
+}
+
+
+// checks if there is nothing to replay
+bool flash_log_is_empty()
+{
+    return flash_log_tail_seq == flash_log_head_seq;
+}
+
+
+#endif /* MAIN_FLASH_LOG_H_ */
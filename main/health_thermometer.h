@@ -0,0 +1,229 @@
+/*
+ * health_thermometer.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_HEALTH_THERMOMETER_H_
+#define MAIN_HEALTH_THERMOMETER_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "max30205.h"
+#include "sample_buffer.h"
+#include "sleep_scheduler.h"
+#include "time_sync.h"
+#include "white_list.h"
+
+// Health Thermometer service (HTS 1.0), so off-the-shelf gateways and
+// phones can get readings from the sensor over a short connection:
+// - Temperature Measurement (0x2A1C) is indicated as soon as the peer
+//   subscribes, the value is the last taken sample (IEEE-11073 32-bit FLOAT
+//   in Celsius, with a timestamp if the gateway time is known), so no I2C
+//   transaction is made during the connection. The connection to the data
+//   adv is kept until the indication is confirmed (see main.c);
+// - Temperature Type (0x2A1D) is the fixed body location;
+// - Measurement Interval (0x2A21) is the sleep interval in s, writing it
+//   fixes the interval of the scheduler (see sleep_scheduler.h), 0 returns
+//   to the adaptive interval. Any peer can connect to the data adv, so the
+//   interval is written over the encrypted link (WRITE_ENC) and by
+//   registered gateways only, others can read it.
+
+#define HTS_SVC_UUID                0x1809  // Health Thermometer service
+#define HTS_MEASUREMENT_CHR_UUID    0x2A1C  // Temperature Measurement
+#define HTS_TEMP_TYPE_CHR_UUID      0x2A1D  // Temperature Type
+#define HTS_INTERVAL_CHR_UUID       0x2A21  // Measurement Interval
+#define HTS_VALID_RANGE_DSC_UUID    0x2906  // Valid Range descriptor
+
+#define HTS_FLAG_TIMESTAMP          0x02    // timestamp field is present (bit 0 is 0 - Celsius)
+#define HTS_TEMP_TYPE_BODY          0x02    // Body (general)
+#define HTS_FLOAT_NAN               0x007FFFFF  // mantissa of NaN, exponent 0
+#define HTS_CENTI_EXPONENT          -2      // centi-degrees are sent with 10^-2
+#define HTS_MEASUREMENT_MAX_SIZE    12      // flags + FLOAT + date time
+#define HTS_MIN_INTERVAL_S          (SCHED_MIN_INTERVAL_MS / 1000)
+#define HTS_MAX_INTERVAL_S          (SCHED_MAX_INTERVAL_MS / 1000)
+#define HTS_ERR_OUT_OF_RANGE        0x80    // application error code of the service
+
+
+const char* g_tag_hts = "HTS";  // tag used in logs
+
+uint16_t hts_measurement_val_hndl = 0;  // value handle of the Temperature Measurement
+
+int hts_register();
+void hts_on_subscribe(const struct ble_gap_event* event);
+bool hts_on_notify_tx(const struct ble_gap_event* event);
+uint8_t encode_hts_measurement(uint8_t* dest, const packet_sample_t* sample);
+void encode_ieee11073_float(uint8_t* dest, int32_t mantissa, int8_t exponent);
+static int hts_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg);
+
+
+// service definition, it is used by the host after registration, so it is static
+static const struct ble_gatt_svc_def hts_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(HTS_SVC_UUID),
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = BLE_UUID16_DECLARE(HTS_MEASUREMENT_CHR_UUID),
+                .access_cb = hts_access,
+                .flags = BLE_GATT_CHR_F_INDICATE,
+                .val_handle = &hts_measurement_val_hndl,
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HTS_TEMP_TYPE_CHR_UUID),
+                .access_cb = hts_access,
+                .flags = BLE_GATT_CHR_F_READ,
+            },
+            {
+                .uuid = BLE_UUID16_DECLARE(HTS_INTERVAL_CHR_UUID),
+                .access_cb = hts_access,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC,
+                .descriptors = (struct ble_gatt_dsc_def[]) {
+                    {
+                        .uuid = BLE_UUID16_DECLARE(HTS_VALID_RANGE_DSC_UUID),
+                        .att_flags = BLE_ATT_F_READ,
+                        .access_cb = hts_access,
+                    },
+                    {0}
+                },
+            },
+            {0}
+        },
+    },
+    {0}
+};
+
+
+// registers the service, must be called before the host is synced
+int hts_register()
+{
+    int rc = ble_gatts_count_cfg(hts_svcs);
+    if (rc != 0)
+        return rc;
+    return ble_gatts_add_svcs(hts_svcs);
+}
+
+
+// indicates the last sample once the peer enables indications
+void hts_on_subscribe(const struct ble_gap_event* event)
+{
+    if (event->subscribe.attr_handle != hts_measurement_val_hndl || !event->subscribe.cur_indicate)
+        return;
+
+    packet_sample_t sample;
+    bool has_sample = get_last_sample(&sample) == ESP_OK;
+
+    uint8_t measurement[HTS_MEASUREMENT_MAX_SIZE];
+    uint8_t len = encode_hts_measurement(measurement, has_sample ? &sample : NULL);
+
+    struct os_mbuf* om = ble_hs_mbuf_from_flat(measurement, len);
+    if (om == NULL || ble_gatts_indicate_custom(event->subscribe.conn_handle, hts_measurement_val_hndl, om) != 0)
+        ESP_LOGE(g_tag_hts, "Measurement indication failed!");
+}
+
+
+// returns true once the measurement indication is over: the peer
+// confirmed it (BLE_HS_EDONE) or it failed
+bool hts_on_notify_tx(const struct ble_gap_event* event)
+{
+    if (event->notify_tx.attr_handle != hts_measurement_val_hndl || !event->notify_tx.indication)
+        return false;
+    return event->notify_tx.status != 0;
+}
+
+
+// encodes the Temperature Measurement value of the sample (NaN if there
+// is no sample yet) and returns its length
+uint8_t encode_hts_measurement(uint8_t* dest, const packet_sample_t* sample)
+{
+    uint8_t len = 0;
+    bool has_timestamp = sample != NULL && time_sync_is_valid();
+    dest[len++] = has_timestamp ? HTS_FLAG_TIMESTAMP : 0;
+
+    if (sample != NULL)
+    {
+        int16_t temp_centi = convert_temp_data_to_centi(sample->value >> 8, sample->value & 0xFF);
+        encode_ieee11073_float(dest + len, temp_centi, HTS_CENTI_EXPONENT);
+    }
+    else
+        encode_ieee11073_float(dest + len, HTS_FLOAT_NAN, 0);
+    len += 4;
+
+    // samples are timestamped with the local time, it's converted into the gateway one
+    if (has_timestamp)
+    {
+        convert_us_to_date_time(time_sync_to_gateway_us((int64_t)sample->time_s * 1000000), dest + len);
+        len += TIME_SYNC_DATE_TIME_LEN;
+    }
+    return len;
+}
+
+
+// encodes IEEE-11073 32-bit FLOAT (24-bit mantissa, 8-bit exponent, little endian)
+void encode_ieee11073_float(uint8_t* dest, int32_t mantissa, int8_t exponent)
+{
+    dest[0] = mantissa;
+    dest[1] = mantissa >> 8;
+    dest[2] = mantissa >> 16;
+    dest[3] = exponent;
+}
+
+
+static int hts_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg)
+{
+    uint16_t uuid = ble_uuid_u16(ctxt->op == BLE_GATT_ACCESS_OP_READ_DSC ? ctxt->dsc->uuid : ctxt->chr->uuid);
+
+    switch (ctxt->op)
+    {
+        case BLE_GATT_ACCESS_OP_READ_CHR:
+        {
+            if (uuid == HTS_TEMP_TYPE_CHR_UUID)
+            {
+                uint8_t temp_type = HTS_TEMP_TYPE_BODY;
+                return os_mbuf_append(ctxt->om, &temp_type, 1) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+            }
+
+            // the adaptive interval is reported as the current one
+            uint32_t interval_ms = sched_get_fixed_interval_ms() ? sched_get_fixed_interval_ms() : sched_get_interval_ms();
+            uint16_t interval_s = interval_ms / 1000;
+            uint8_t interval[2] = {interval_s & 0xFF, interval_s >> 8};
+            return os_mbuf_append(ctxt->om, interval, sizeof(interval)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        }
+        case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        {
+            // the link is encrypted by the host (WRITE_ENC), the interval
+            // is set by registered gateways only
+            struct ble_gap_conn_desc conn_desc;
+            if (ble_gap_conn_find(conn_handle, &conn_desc) != 0 || !white_list_contains_addr(&conn_desc.peer_id_addr))
+                return BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+
+            uint8_t interval[2];
+            uint16_t len = 0;
+            if (ble_hs_mbuf_to_flat(ctxt->om, interval, sizeof(interval), &len) != 0 || len != sizeof(interval))
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+
+            uint16_t interval_s = interval[0] | (interval[1] << 8);
+            if (interval_s != 0 && (interval_s < HTS_MIN_INTERVAL_S || interval_s > HTS_MAX_INTERVAL_S))
+                return HTS_ERR_OUT_OF_RANGE;
+
+            sched_set_fixed_interval_ms((uint32_t)interval_s * 1000);
+            ESP_LOGI(g_tag_hts, "Measurement interval = %u s (0 - adaptive).", interval_s);
+            return 0;
+        }
+        case BLE_GATT_ACCESS_OP_READ_DSC:
+        {
+            uint8_t range[4] = {HTS_MIN_INTERVAL_S & 0xFF, HTS_MIN_INTERVAL_S >> 8,
+                                HTS_MAX_INTERVAL_S & 0xFF, HTS_MAX_INTERVAL_S >> 8};
+            return os_mbuf_append(ctxt->om, range, sizeof(range)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        }
+        default:
+            return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+
+#endif /* MAIN_HEALTH_THERMOMETER_H_ */
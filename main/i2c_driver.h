@@ -11,72 +11,160 @@
 
 #include <unistd.h>
 #include "esp_log.h"
-#include "driver/i2c.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/i2c_master.h"
+#include "power_mgmt.h"
 
-#include "esp_check_err.h"
+// The bus is created once and shared by all sensors of the node, each
+// sensor gets its own preallocated device handle (with its own clock
+// speed), so transactions don't build command lists on every call.
+// Duration of the last transaction is kept in the device structure (the
+// acquisition pipeline sums the bus time of all sensors, see acquisition.h).
+// Light sleep is locked during the transactions (see power_mgmt.h).
+
+#define I2C_STANDARD_MODE_HZ    100000  // 100 kHz
+#define I2C_FAST_MODE_HZ        400000  // 400 kHz
+#define I2C_TIMEOUT_MS          10      // transaction timeout
+#define I2C_MAX_READ_LEN        8       // max number of bytes in one read
+
+
+// structure that describes device on the i2c bus
+typedef struct {
+    i2c_master_dev_handle_t dev_hndl;   // handle of the device on the bus
+    int64_t last_trans_time_us;         // duration of the last transaction (in us)
+
+} i2c_device_t;
 
 const char* g_tag_i2c = "I2C";
 
-void esp_i2c_init(i2c_port_t i2c_port, int gpio_sda, int gpio_scl);
-void esp_i2c_set_cnfg_reg(i2c_port_t i2c_port, uint8_t addr, uint8_t reg_ptr, uint8_t* max30205_cnfg_reg);
-void esp_i2c_read(i2c_port_t i2c_port, uint8_t addr, uint8_t reg_ptr, uint8_t* read_data_buff, uint8_t read_data_buff_len);
+i2c_master_bus_handle_t g_i2c_bus_hndl = NULL;  // handle of the shared bus
+
+esp_err_t esp_i2c_init(i2c_port_t i2c_port, int gpio_sda, int gpio_scl);
+esp_err_t esp_i2c_add_device(i2c_device_t* device, uint8_t addr, uint32_t scl_speed_hz);
+esp_err_t esp_i2c_set_cnfg_reg(i2c_device_t* device, uint8_t reg_ptr, uint8_t cnfg_reg);
+esp_err_t esp_i2c_read(i2c_device_t* device, uint8_t reg_ptr, uint8_t* read_data_buff, uint8_t read_data_buff_len);
+esp_err_t esp_i2c_set_cnfg_reg_and_read(i2c_device_t* device, uint8_t cnfg_reg_ptr, uint8_t cnfg_reg, uint32_t wait_us,
+                                        uint8_t reg_ptr, uint8_t* read_data_buff, uint8_t read_data_buff_len);
 
 
-// creates an I2C configuration structure and sets its fields
-void esp_i2c_init(i2c_port_t i2c_port, int gpio_sda, int gpio_scl)
+// creates the i2c master bus, if the bus already exists (shared by
+// several sensors), it is reused
+esp_err_t esp_i2c_init(i2c_port_t i2c_port, int gpio_sda, int gpio_scl)
 {
-    i2c_config_t i2c_cnfg;
-    i2c_cnfg.mode = I2C_MODE_MASTER;                    // set the I2C mode to master
-    i2c_cnfg.sda_io_num = gpio_sda;                     // set the GPIO pin for SDA line
-    i2c_cnfg.scl_io_num = gpio_scl;                     // set the GPIO pin for SCL line
-    i2c_cnfg.sda_pullup_en = GPIO_PULLUP_ENABLE;        // enable pull-up resistor for SDA line
-    i2c_cnfg.scl_pullup_en = GPIO_PULLUP_ENABLE;        // enable pull-up resistor for SCL line
-    i2c_cnfg.master.clk_speed = 100000;                 // set the I2C clock speed to 100 kHz
-    i2c_cnfg.clk_flags = I2C_SCLK_SRC_FLAG_FOR_NOMAL;   // use standard clock source
-
-    // configure the I2C parameters for the specified I2C port & install the I2C driver
-    ESP_CHECK(i2c_param_config(i2c_port, &i2c_cnfg), g_tag_i2c);
-    ESP_CHECK(i2c_driver_install(i2c_port, I2C_MODE_MASTER, 0, 0, 0), g_tag_i2c);
+    if (g_i2c_bus_hndl != NULL)
+        return ESP_OK;
+
+    i2c_master_bus_config_t bus_cnfg = {};
+    bus_cnfg.i2c_port = i2c_port;                       // set the i2c port
+    bus_cnfg.sda_io_num = gpio_sda;                     // set the GPIO pin for SDA line
+    bus_cnfg.scl_io_num = gpio_scl;                     // set the GPIO pin for SCL line
+    bus_cnfg.clk_source = I2C_CLK_SRC_DEFAULT;          // use default clock source
+    bus_cnfg.glitch_ignore_cnt = 7;                     // typical glitch filter
+    bus_cnfg.flags.enable_internal_pullup = true;       // enable pull-up resistors for both lines
+
+    esp_err_t err = i2c_new_master_bus(&bus_cnfg, &g_i2c_bus_hndl);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_i2c, "Bus init failed! Error: %s", esp_err_to_name(err));
+    return err;
 }
 
 
-// sends a sequence of I2C commands to write to a configuration register
-void esp_i2c_set_cnfg_reg(i2c_port_t i2c_port, uint8_t addr, uint8_t reg_ptr, uint8_t* max30205_cnfg_reg)
+// adds the device with 7-bit addr to the bus, the handle is kept in device
+esp_err_t esp_i2c_add_device(i2c_device_t* device, uint8_t addr, uint32_t scl_speed_hz)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (device == NULL || g_i2c_bus_hndl == NULL)
+        return ESP_FAIL;
+
+    i2c_device_config_t dev_cnfg = {};
+    dev_cnfg.dev_addr_length = I2C_ADDR_BIT_LEN_7;
+    dev_cnfg.device_address = addr;
+    dev_cnfg.scl_speed_hz = scl_speed_hz;
+
+    device->last_trans_time_us = 0;
+    esp_err_t err = i2c_master_bus_add_device(g_i2c_bus_hndl, &dev_cnfg, &device->dev_hndl);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_i2c, "Adding device 0x%02X failed! Error: %s", addr, esp_err_to_name(err));
+    return err;
+}
 
-    ESP_CHECK(i2c_master_start(cmd), g_tag_i2c);
-    ESP_CHECK(i2c_master_write_byte(cmd, addr | I2C_MASTER_WRITE, I2C_MASTER_ACK), g_tag_i2c);
-    ESP_CHECK(i2c_master_write_byte(cmd, reg_ptr, I2C_MASTER_ACK), g_tag_i2c);
 
-    ESP_CHECK(i2c_master_write_byte(cmd, *max30205_cnfg_reg, I2C_MASTER_ACK), g_tag_i2c);   // write byte to cnfg_reg
+// writes one byte to a configuration register
+esp_err_t esp_i2c_set_cnfg_reg(i2c_device_t* device, uint8_t reg_ptr, uint8_t cnfg_reg)
+{
+    int64_t start_time = esp_timer_get_time();
+
+    uint8_t write_buff[2] = {reg_ptr, cnfg_reg};
+    pm_lock_acquire(g_pm_i2c_lock);
+    esp_err_t err = i2c_master_transmit(device->dev_hndl, write_buff, sizeof(write_buff), I2C_TIMEOUT_MS);
+    pm_lock_release(g_pm_i2c_lock);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_i2c, "Write failed! Error: %s", esp_err_to_name(err));
 
-    ESP_CHECK(i2c_master_stop(cmd), g_tag_i2c);
-    ESP_CHECK(i2c_master_cmd_begin(i2c_port, cmd, 1000 / portTICK_PERIOD_MS), g_tag_i2c);
-    i2c_cmd_link_delete(cmd);
+    device->last_trans_time_us = esp_timer_get_time() - start_time;
+    return err;
 }
 
 
-// reads data from a MAX30205 data register
-void esp_i2c_read(i2c_port_t i2c_port, uint8_t addr, uint8_t reg_ptr, uint8_t* read_data_buff, uint8_t read_data_buff_len)
+// reads read_data_buff_len bytes from a data register
+esp_err_t esp_i2c_read(i2c_device_t* device, uint8_t reg_ptr, uint8_t* read_data_buff, uint8_t read_data_buff_len)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (read_data_buff == NULL || read_data_buff_len == 0 || read_data_buff_len > I2C_MAX_READ_LEN)
+        return ESP_FAIL;
 
-    ESP_CHECK(i2c_master_start(cmd), g_tag_i2c);
-    ESP_CHECK(i2c_master_write_byte(cmd, addr | I2C_MASTER_WRITE, I2C_MASTER_ACK), g_tag_i2c);
-    ESP_CHECK(i2c_master_write_byte(cmd, reg_ptr, I2C_MASTER_ACK), g_tag_i2c);
+    int64_t start_time = esp_timer_get_time();
 
-    ESP_CHECK(i2c_master_start(cmd), g_tag_i2c);
-    ESP_CHECK(i2c_master_write_byte(cmd, addr | I2C_MASTER_READ, I2C_MASTER_ACK), g_tag_i2c);
+    // write register pointer, repeated start and read
+    pm_lock_acquire(g_pm_i2c_lock);
+    esp_err_t err = i2c_master_transmit_receive(device->dev_hndl, &reg_ptr, 1,
+                                                read_data_buff, read_data_buff_len, I2C_TIMEOUT_MS);
+    pm_lock_release(g_pm_i2c_lock);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_i2c, "Read failed! Error: %s", esp_err_to_name(err));
 
-    uint8_t* temp_msb = read_data_buff;
-    uint8_t* temp_lsb = read_data_buff+1;
-    ESP_CHECK(i2c_master_read_byte(cmd, temp_msb, I2C_MASTER_ACK), g_tag_i2c);  // read first byte of data
-    ESP_CHECK(i2c_master_read_byte(cmd, temp_lsb, I2C_MASTER_NACK), g_tag_i2c); // read second byte of data
+    device->last_trans_time_us = esp_timer_get_time() - start_time;
+    return err;
+}
 
-    ESP_CHECK(i2c_master_stop(cmd), g_tag_i2c);
-    ESP_CHECK(i2c_master_cmd_begin(i2c_port, cmd, 1000 / portTICK_PERIOD_MS), g_tag_i2c);
-    i2c_cmd_link_delete(cmd);
+
+// writes a configuration register (e.g. to start a conversion), waits for
+// wait_us and reads a data register. the whole sequence is timed as one
+// transaction, the bus is free for other devices (and the chip may light
+// sleep) while waiting. the wait is rounded up to whole ticks, like the
+// one of the acquisition pipeline (see acquisition.h)
+esp_err_t esp_i2c_set_cnfg_reg_and_read(i2c_device_t* device, uint8_t cnfg_reg_ptr, uint8_t cnfg_reg, uint32_t wait_us,
+                                        uint8_t reg_ptr, uint8_t* read_data_buff, uint8_t read_data_buff_len)
+{
+    if (read_data_buff == NULL || read_data_buff_len == 0 || read_data_buff_len > I2C_MAX_READ_LEN)
+        return ESP_FAIL;
+
+    int64_t start_time = esp_timer_get_time();
+
+    uint8_t write_buff[2] = {cnfg_reg_ptr, cnfg_reg};
+    pm_lock_acquire(g_pm_i2c_lock);
+    esp_err_t err = i2c_master_transmit(device->dev_hndl, write_buff, sizeof(write_buff), I2C_TIMEOUT_MS);
+    pm_lock_release(g_pm_i2c_lock);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_i2c, "Write failed! Error: %s", esp_err_to_name(err));
+    else
+    {
+        const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+        int64_t wait_end_time = esp_timer_get_time() + wait_us;
+        int64_t left_us;
+        while ((left_us = wait_end_time - esp_timer_get_time()) > 0)
+            vTaskDelay((left_us + tick_us - 1) / tick_us);
+
+        pm_lock_acquire(g_pm_i2c_lock);
+        err = i2c_master_transmit_receive(device->dev_hndl, &reg_ptr, 1,
+                                          read_data_buff, read_data_buff_len, I2C_TIMEOUT_MS);
+        pm_lock_release(g_pm_i2c_lock);
+        if (err != ESP_OK)
+            ESP_LOGE(g_tag_i2c, "Read failed! Error: %s", esp_err_to_name(err));
+    }
+
+    device->last_trans_time_us = esp_timer_get_time() - start_time;
+    return err;
 }
 
 
@@ -12,145 +12,227 @@
 #include <unistd.h>
 #include "esp_log.h"
 #include "esp_timer.h"
-#include "driver/gpio.h"
+#include "esp_sleep.h"
+#include "driver/ledc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 #include "esp_check_err.h"
-#include "task_priorities_rtos.h"
 
-#define GPIO_LED_ON 0   // define active level for led - 0 means the led is ON
-#define GPIO_LED_OFF 1  // define inactive level for led - 1 means the led is OFF
+// The led is driven by the LEDC peripheral, indications are described as
+// patterns - constant arrays of steps (brightness and duration, the step
+// can fade to its brightness). A single esp_timer moves the pattern to
+// the next step, so no task or heap allocation is needed per indication,
+// and the CPU can idle between the steps. LEDC is clocked from RC_FAST,
+// which is kept powered in light sleep while the led is initialised, so a
+// steady or fading output holds while the CPU sleeps. The led must be
+// deinitialised before deep sleep, so RC_FAST is powered down there.
+
+#define LED_LEDC_MODE       LEDC_LOW_SPEED_MODE
+#define LED_LEDC_TIMER      LEDC_TIMER_0
+#define LED_LEDC_CHANNEL    LEDC_CHANNEL_0
+#define LED_LEDC_RESOLUTION LEDC_TIMER_10_BIT
+#define LED_LEDC_FREQ_HZ    1000        // pwm frequency, high enough to avoid flicker
+#define LED_MAX_DUTY        ((1 << LED_LEDC_RESOLUTION) - 1)
+#define LED_OUTPUT_INVERT   1           // the led is ON at low level, so the output is inverted
+#define LED_IDLE_LEVEL      1           // gpio level when ledc is stopped - the led is OFF
+
+#define LED_STEP_HOLD       0           // step duration to hold the step until the next pattern
+
+// step of the led pattern
+typedef struct {
+    uint8_t brightness_pct;     // brightness at the end of the step (0 - 100 %)
+    uint16_t time_ms;           // step duration, LED_STEP_HOLD - hold forever
+    bool fade;                  // fade to the brightness during the step instead of switching
+
+} led_step_t;
 
 
-// structure to store blink intervals for the led (on and off time in ms)
+// led pattern, it must be constant, because the engine keeps the pointer
 typedef struct {
-    uint16_t blink_on_itv;
-    uint16_t blink_off_itv;
+    const led_step_t* steps;    // steps of the pattern
+    uint8_t step_cnt;           // number of steps
+    bool repeat;                // start again after the last step
+
+} led_pattern_t;
+
+#define LED_PATTERN(steps, repeat) { steps, sizeof(steps) / sizeof(steps[0]), repeat }
+
+// patterns of the device indications
+static const led_step_t led_off_steps[] = {{0, LED_STEP_HOLD, false}};
+static const led_step_t led_on_steps[] = {{100, LED_STEP_HOLD, false}};
+static const led_step_t led_reg_success_steps[] = {{100, 100, false}, {0, 100, false}};
+static const led_step_t led_del_success_steps[] = {{100, 700, false}, {0, 700, false}};
+static const led_step_t led_reg_failure_steps[] = {{100, 100, false}, {0, 100, false}, {100, 100, false}, {0, 1000, false}};
 
-} blink_itvs_t;
+const led_pattern_t LED_PATTERN_OFF = LED_PATTERN(led_off_steps, false);
+const led_pattern_t LED_PATTERN_AWAKE = LED_PATTERN(led_on_steps, false);               // device is awake (sending data or in registration/deletion mode)
+const led_pattern_t LED_PATTERN_REG_SUCCESS = LED_PATTERN(led_reg_success_steps, true); // fast blink
+const led_pattern_t LED_PATTERN_DEL_SUCCESS = LED_PATTERN(led_del_success_steps, true); // slow blink
+const led_pattern_t LED_PATTERN_REG_FAILURE = LED_PATTERN(led_reg_failure_steps, true); // double blink, the white list is full
 
 const char* g_tag_led = "LED";    // tag used in ESP_CHECK
 
-uint8_t g_gpio_led_num;                 // gpio number for the led
 bool led_is_initialised = false;        // flag to check if the led has been inited
-TaskHandle_t blink_loop_hndl = NULL;    // handle for the blink task
-blink_itvs_t blink_itvs;                // structure holding blink intervals
+esp_timer_handle_t led_step_timer;      // timer that moves the pattern to the next step
+StaticSemaphore_t led_mutex_buf;        // static storage of the mutex
+SemaphoreHandle_t led_mutex = NULL;     // guards the pattern state (tasks and the timer)
+const led_pattern_t* led_pattern = NULL;    // current pattern
+uint8_t led_step_idx = 0;               // index of the current step
+int64_t led_step_started_us = 0;        // time point when the current step was started
 
 esp_err_t led_init(uint8_t gpio_led_num);
 esp_err_t led_deinit();
+esp_err_t led_play(const led_pattern_t* pattern);
 esp_err_t led_turn_on();
 esp_err_t led_turn_off();
-esp_err_t led_start_blink(uint16_t blink_on_itv, uint16_t blink_off_itv);
-esp_err_t led_stop_blink();
-void blink_loop(void* arg);
+static void led_apply_step();
+static void led_step_timer_cb(void* arg);
 
 
-// inits the led by configuring its gpio pin
+// inits ledc timer and channel on the led gpio, and the step timer
 esp_err_t led_init(uint8_t gpio_led_num)
 {
     if (led_is_initialised) // check if led is already initialised
         return ESP_FAIL;
 
+    ledc_timer_config_t ledc_timer_cnfg = {
+        .speed_mode = LED_LEDC_MODE,
+        .timer_num = LED_LEDC_TIMER,
+        .duty_resolution = LED_LEDC_RESOLUTION,
+        .freq_hz = LED_LEDC_FREQ_HZ,
+        .clk_cfg = LEDC_USE_RC_FAST_CLK     // keeps running in light sleep
+    };
+    ESP_CHECK(ledc_timer_config(&ledc_timer_cnfg), g_tag_led);
+
+    ledc_channel_config_t ledc_channel_cnfg = {
+        .gpio_num = gpio_led_num,
+        .speed_mode = LED_LEDC_MODE,
+        .channel = LED_LEDC_CHANNEL,
+        .timer_sel = LED_LEDC_TIMER,
+        .duty = 0,                          // the led is OFF
+        .hpoint = 0,
+        .flags.output_invert = LED_OUTPUT_INVERT
+    };
+    ESP_CHECK(ledc_channel_config(&ledc_channel_cnfg), g_tag_led);
+
+    // RC_FAST is powered down in sleep by default, it clocks the output
+    ESP_CHECK(esp_sleep_pd_config(ESP_PD_DOMAIN_RC_FAST, ESP_PD_OPTION_ON), g_tag_led);
+
+    // fade service is installed once, it is used by fading steps
+    ESP_CHECK(ledc_fade_func_install(0), g_tag_led);
+
+    const esp_timer_create_args_t led_step_timer_args = {
+        .name = "led step timer",
+        .callback = &led_step_timer_cb,
+        .skip_unhandled_events = true       // a late step is applied once
+    };
+    ESP_CHECK(esp_timer_create(&led_step_timer_args, &led_step_timer), g_tag_led);
+
+    led_mutex = xSemaphoreCreateMutexStatic(&led_mutex_buf);
+    led_pattern = &LED_PATTERN_OFF;
+    led_step_idx = 0;
     led_is_initialised = true;      // mark led as initialised
-    g_gpio_led_num = gpio_led_num;  // set gpio pin number for led
-
-    // reset and configure the gpio pin for output mode
-    ESP_CHECK(gpio_reset_pin(g_gpio_led_num), g_tag_led);
-    ESP_CHECK(gpio_set_direction(g_gpio_led_num, GPIO_MODE_OUTPUT), g_tag_led);
-
     return ESP_OK;
 }
 
 
-// deinits the led by resetting its gpio pin
+// deinits the led by stopping the pattern and ledc output
 esp_err_t led_deinit()
 {
     if (!led_is_initialised)     // check if led was not initialised
         return ESP_FAIL;
 
-    // if a blink task is running, stop it before deiniting
-    if (blink_loop_hndl != NULL)
-        led_stop_blink();
-
+    xSemaphoreTake(led_mutex, portMAX_DELAY);
+    esp_timer_stop(led_step_timer);
+    esp_timer_delete(led_step_timer);
+    ledc_fade_func_uninstall();
+    esp_err_t err = ledc_stop(LED_LEDC_MODE, LED_LEDC_CHANNEL, LED_IDLE_LEVEL);
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_led, "Output stop failed! Error: %s", esp_err_to_name(err));
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RC_FAST, ESP_PD_OPTION_AUTO);
     led_is_initialised = false;     // mark led as deinitialised
-    ESP_CHECK(gpio_reset_pin(g_gpio_led_num), g_tag_led);   // reset the gpio pin
-    return ESP_OK;
+    xSemaphoreGive(led_mutex);      // released on every path
+    return err;
 }
 
-// turns the led on
-esp_err_t led_turn_on()
+
+// starts the pattern from its first step, the current pattern is dropped
+esp_err_t led_play(const led_pattern_t* pattern)
 {
-    if (!led_is_initialised)     // check if led was not initialised
+    if (!led_is_initialised || pattern == NULL || pattern->step_cnt == 0)
         return ESP_FAIL;
 
-    if (blink_loop_hndl != NULL) // stop blinking if it's currently running
-        led_stop_blink();
-
-    // set the led gpio level to ON (active level)
-    ESP_CHECK(gpio_set_level(g_gpio_led_num, GPIO_LED_ON), g_tag_led);
+    xSemaphoreTake(led_mutex, portMAX_DELAY);
+    esp_timer_stop(led_step_timer);
+    ledc_fade_stop(LED_LEDC_MODE, LED_LEDC_CHANNEL);
+    led_pattern = pattern;
+    led_step_idx = 0;
+    led_apply_step();
+    xSemaphoreGive(led_mutex);
     return ESP_OK;
 }
 
-// turns the led off
-esp_err_t led_turn_off()
-{
-    if (!led_is_initialised)     // check if led was not initialised
-        return ESP_FAIL;
-
-    if (blink_loop_hndl != NULL) // stop blinking if it's currently running
-        led_stop_blink();
 
-    // set the led gpio level to OFF (inactive level)
-    ESP_CHECK(gpio_set_level(g_gpio_led_num, GPIO_LED_OFF), g_tag_led);
-    return ESP_OK;
+// turns the led on
+esp_err_t led_turn_on()
+{
+    return led_play(&LED_PATTERN_AWAKE);
 }
 
-// starts blinking the led with specified on and off intervals
-esp_err_t led_start_blink(uint16_t blink_on_itv, uint16_t blink_off_itv)    // in ms
-{
-    if (!led_is_initialised)     // check if led was not initialised
-        return ESP_FAIL;
 
-    // store the blink intervals
-    blink_itvs.blink_on_itv = blink_on_itv;
-    blink_itvs.blink_off_itv = blink_off_itv;
+// turns the led off
+esp_err_t led_turn_off()
+{
+    return led_play(&LED_PATTERN_OFF);
+}
 
-    if (blink_loop_hndl != NULL) // stop blinking if it's currently running
-        led_stop_blink();
 
-    // create a new task to handle the blinking loop
-    BaseType_t res = xTaskCreate(blink_loop, "blink_loop", 2048, (void*)&blink_itvs, tskIDLE_PRIORITY + LOW_TASK_PRIORITY, &blink_loop_hndl);
+// sets the brightness of the current step and starts the step timer,
+// must be called with the mutex taken
+static void led_apply_step()
+{
+    const led_step_t* step = &led_pattern->steps[led_step_idx];
+    uint32_t duty = (uint32_t)step->brightness_pct * LED_MAX_DUTY / 100;
 
-    if (res != pdPASS)
-        return ESP_FAIL;
+    if (step->fade && step->time_ms != LED_STEP_HOLD)
+        ledc_set_fade_time_and_start(LED_LEDC_MODE, LED_LEDC_CHANNEL, duty, step->time_ms, LEDC_FADE_NO_WAIT);
+    else
+        ledc_set_duty_and_update(LED_LEDC_MODE, LED_LEDC_CHANNEL, duty, 0);
 
-    return ESP_OK;
+    led_step_started_us = esp_timer_get_time();
+    if (step->time_ms != LED_STEP_HOLD)
+        esp_timer_start_once(led_step_timer, (uint64_t)step->time_ms * 1000);
 }
 
-// stops the blinking of the led
-esp_err_t led_stop_blink()
+
+// moves the pattern to the next step
+static void led_step_timer_cb(void* arg)
 {
-    // check if led is initialised and blink task is running
-    if (!led_is_initialised || blink_loop_hndl == NULL)
-        return ESP_FAIL;
+    xSemaphoreTake(led_mutex, portMAX_DELAY);
 
-    // delete the blink task
-    vTaskDelete(blink_loop_hndl);
-    blink_loop_hndl = NULL; // reset task handle
-    return ESP_OK;
-}
+    // the timer could fire while led_play was starting another pattern,
+    // then the new step is not due yet
+    const led_step_t* step = &led_pattern->steps[led_step_idx];
+    bool step_is_due = step->time_ms != LED_STEP_HOLD &&
+                       esp_timer_get_time() - led_step_started_us >= (int64_t)step->time_ms * 1000;
 
-// handles the blinking loop of the led
-void blink_loop(void* arg)
-{
-    // get the blink intervals from arguments
-    blink_itvs_t* blink_itvs = (blink_itvs_t*)arg;
-    while (true)
+    if (led_is_initialised && step_is_due)
     {
-        ESP_CHECK(gpio_set_level(g_gpio_led_num, GPIO_LED_ON), g_tag_led);  // turn the led ON
-        vTaskDelay(blink_itvs->blink_on_itv / portTICK_PERIOD_MS);      // wait for the specified ON interval
-        ESP_CHECK(gpio_set_level(g_gpio_led_num, GPIO_LED_OFF), g_tag_led); // turn the led OFF
-        vTaskDelay(blink_itvs->blink_off_itv / portTICK_PERIOD_MS);     // wait for the specified OFF interval
+        // the brightness of the last step of a not repeated pattern is kept
+        if (led_step_idx + 1 < led_pattern->step_cnt)
+        {
+            led_step_idx++;
+            led_apply_step();
+        }
+        else if (led_pattern->repeat)
+        {
+            led_step_idx = 0;
+            led_apply_step();
+        }
     }
+
+    xSemaphoreGive(led_mutex);
 }
 
 
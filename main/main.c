@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include "esp_log.h"
 #include "esp_sleep.h"
@@ -24,8 +25,23 @@
 #include "led.h"
 #include "button.h"
 #include "i2c_driver.h"
+#include "max30205_driver.h"
 #include "white_list.h"
 #include "app_packet.h"
+#include "sample_buffer.h"
+#include "wake_timing.h"
+#include "sleep_scheduler.h"
+#include "wake_stub.h"
+#include "telemetry.h"
+#include "flash_log.h"
+#include "backlog_sync.h"
+#include "time_sync.h"
+#include "health_thermometer.h"
+#include "adv_pdu.h"
+#include "packet_auth.h"
+#include "power_mgmt.h"
+#include "pairing.h"
+#include "acquisition.h"
 
 #define DEBUGGING   // enables ESP_CHECK macro (see more esp_check_err.h)
 #define GPIO_LED    GPIO_NUM_8
@@ -33,15 +49,50 @@
 #define GPIO_SCL    GPIO_NUM_7
 #define GPIO_BUTTON GPIO_NUM_3
 
-#define MAX30205_I2C_ADDR 0x90
-#define MAX30205_TEMP_REG_PTR 0x00
-#define MAX30205_CNFG_REG_PTR 0x01
-
 #define RSSI_ACCEPTABLE_LVL     -50         // acceptable rssi level for connection
-#define DEEP_SLEEP_CYCLE_TIME   5 * 1000000 // in us (5 s)
 
 #define MAC_STR_SIZE 3 * 6
 
+// adv data is built once and patched on every wake, its layout defines
+// the batch payload size (see more adv_pdu.h)
+#define ADV_INSTANCE            0   // extended advertising instance
+
+#define DATA_ADV_DURATION_MS    1000    // data adv duration if the scan window is unknown
+
+// gateways without BLE 5 don't see extended pdu, so the batch is sent with
+// legacy pdu after a few extended batches in a row were not acknowledged,
+// extended pdu is tried again once in a while (the gateway may have been
+// out of range) and after a registration
+#define EXT_ADV_MAX_UNACKED     3       // unacknowledged extended batches before falling back
+#define EXT_ADV_PROBE_PERIOD    16      // legacy batches between tries of extended pdu
+
+// telemetry packet (see telemetry.h) is short, so it is sent with legacy
+// pdu after the batch, advertising is shorter than for the batch
+#define TELEMETRY_ADV_DURATION_MS   300
+
+// registration connection is terminated by the sensor once the gateway
+// time is read and the gateway read the packet auth key (see more
+// packet_auth.h), or after the timeout if the gateway didn't finish
+#define REGISTRATION_TIMEOUT_US     (10 * 1000 * 1000)
+#define REGISTRATION_LINGER_US      (200 * 1000)    // delay to send the last response before terminating
+
+// connection to the data adv (Health Thermometer peer or the gateway) is
+// kept until the measurement indication is confirmed or the peer is idle
+// for the timeout, the backlog transfer has its own (see backlog_sync.h).
+// anyone can connect to the data adv, a peer that is not registered is
+// held for the shorter time at most, its activity doesn't extend it
+#define DATA_CONN_IDLE_TIMEOUT_US   (5 * 1000 * 1000)
+#define DATA_CONN_GUEST_HOLD_US     (2 * 1000 * 1000)
+
+// radio time of the data cycle is capped like the pairing one (see
+// pairing.h): once the budget is used up, the replay and the telemetry
+// are not started and the data adv or connection is ended, the rest of
+// the log waits for the next wake
+#ifndef CONFIG_TEMP_DATA_RADIO_BUDGET_MS
+#define CONFIG_TEMP_DATA_RADIO_BUDGET_MS    20000
+#endif
+#define DATA_RADIO_BUDGET_MS    CONFIG_TEMP_DATA_RADIO_BUDGET_MS
+
 // enumeration of possible modes for this device
 // these modes determine the current state or functionality of the device
 // UNSPECIFIED_MODE  - default or undefined mode
@@ -58,28 +109,132 @@ typedef enum {
 g_device_mode_t g_device_mode = UNSPECIFIED_MODE;  // current mode, UNSPECIFIED_MODE by default
 uint8_t g_ble_addr_type;        // addr type, set automatically in ble_hs_id_infer_auto()
 const char* s_tag_temp = "TEMP";// tag used in ESP_CHECK
+uint8_t g_sent_samples_cnt = 0; // number of samples in the advertised batch
+bool g_data_adv_pending = false;// flag to send the batch once the ble host is synced
+bool g_batch_adv_active = false;    // flag to indicate that the batch is advertised
+bool g_telemetry_adv_active = false;// flag to indicate that telemetry is advertised
+bool g_replay_adv_active = false;   // flag to indicate that logged samples are advertised
+uint32_t g_replay_span = 0;         // number of log records in the advertised replay batch
+int32_t g_data_adv_duration_ms = DATA_ADV_DURATION_MS;  // duration of the data adv
+RTC_DATA_ATTR bool g_window_wake = false;   // flag that the device slept until the scan window
+uint16_t g_reg_conn_handle = BLE_HS_CONN_HANDLE_NONE;  // registration connection
+uint8_t g_reg_steps_left = 0;       // number of unfinished steps of the registration connection
+esp_timer_handle_t g_reg_timer = NULL;  // terminates the registration connection
+uint16_t g_data_conn_handle = BLE_HS_CONN_HANDLE_NONE; // connection to the data adv
+esp_timer_handle_t g_data_conn_timer = NULL;    // terminates the idle data connection
+bool g_data_conn_is_guest = false;              // the data connection peer is not registered
+struct ble_npl_callout g_data_radio_callout;    // ends the data cycle once the radio budget is used up
+bool g_data_radio_is_over = false;  // flag that the radio budget of the data cycle is used up
+struct ble_npl_event g_medium_press_event;  // button press posted to the host task
+struct ble_npl_event g_long_press_event;
+
+// flag to indicate whether data is sent with extended advertising, it is
+// cleared (until power off) if extended advertising can't be started.
+// extended pdu is acknowledged by the connection of the gateway only
+// (see BLE_GAP_EVENT_CONNECT), legacy pdu by scan request too
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+RTC_DATA_ATTR bool g_use_ext_adv = true;
+#else
+bool g_use_ext_adv = false;
+#endif
+RTC_DATA_ATTR uint8_t g_ext_unacked_cnt = 0;    // extended batches in a row that were not acknowledged
+RTC_DATA_ATTR uint8_t g_legacy_batch_cnt = 0;   // legacy batches sent since falling back
+bool g_batch_is_ext = false;        // flag that the advertised batch is extended pdu
 
 
 // button process callbacks (see more button.h)
 void on_short_button_press();
 void on_medium_button_press();
 void on_long_button_press();
-
+static void on_medium_press_event(struct ble_npl_event* ev);
+static void on_long_press_event(struct ble_npl_event* ev);
+int start_registration_adv(int32_t duration_ms);
+int start_deletion_adv(int32_t duration_ms);
+void on_pairing_end(bool is_paired);
+
+void run_data_cycle();
+void take_sample();
+void register_sensors();
+void init_sensors();
+void send_batch();
+int send_telemetry();
+void on_data_adv_complete(bool is_acked);
+int send_replay();
+void finish_data_cycle();
+void enter_deep_sleep();
+void enter_window_sleep(uint64_t sleep_us);
+bool use_ext_pdu();
+void on_batch_ack_result(bool is_acked);
+uint8_t get_batch_size();
 void init_ble();
 void ble_app_on_sync(void);
 void host_task();
 static int ble_gap_event(struct ble_gap_event *event, void *arg);
-float convert_temp_data_to_float(uint8_t temp_msb, uint8_t temp_lsb);
-static int read_temp(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+void start_registration_steps(uint16_t conn_handle);
+void on_registration_step_done(uint16_t conn_handle);
+static void on_registration_timer(void* arg);
+void start_data_conn(uint16_t conn_handle, bool is_idle_timed, bool is_guest);
+void touch_data_conn(uint16_t conn_handle);
+static void on_data_conn_timer(void* arg);
+static void on_data_radio_callout(struct ble_npl_event* ev);
+int start_adv(const adv_pdu_t* pdu, const struct ble_gap_adv_params* adv_params, const ble_addr_t* direct_addr,
+              int32_t duration_ms, bool ext_pdu);
+int stop_adv();
+int start_data_adv(bool ext_pdu);
+int start_packet_adv(uint16_t header, uint8_t payload_len, int32_t duration_ms, bool ext_pdu);
 void get_mac_str(uint8_t* addr, char (*mac_str)[MAC_STR_SIZE]);
 
 
 void app_main(void)
 {
+    mark_wake_phase(WAKE_PHASE_BOOT);
+
+    // sensors of this node are known in every path, the wake stub is
+    // armed only if the node has the temperature sensor alone
+    register_sensors();
+
+    // enable frequency scaling and light sleep while idle, in the data
+    // cycle too (see more power_mgmt.h)
+    init_power_mgmt();
+
+    // get wakeup cause and do corresponding actions
+    esp_sleep_wakeup_cause_t wakeup_cause = esp_sleep_get_wakeup_cause();
+
+    // wakeup from timer means that device is periodically collects data
+    // and sends it in batches, it takes the fast path that inits only
+    // what the data cycle needs (see run_data_cycle)
+    if (wakeup_cause == ESP_SLEEP_WAKEUP_TIMER)
+    {
+        run_data_cycle();
+        return;
+    }
+
     // inits led (see more led.h)
     led_init(GPIO_LED);
 
-    // set up button cnfg and init button (see more button.h)
+    // init i2c and the sensors on it (see more acquisition.h)
+    init_sensors();
+
+    // set configuration register of temperature sensor
+    // MAX30205 to shut it down
+    esp_i2c_set_cnfg_reg(&g_max30205, MAX30205_CNFG_REG_PTR, MAX30205_CNFG_SHUTDOWN);
+
+    // init NVS (the white list is rebuilt from it after power-on)
+    ESP_CHECK(nvs_flash_init(), s_tag_temp);
+
+#if CONFIG_TEMP_PACKET_AUTH
+    // load the key of packet authentication (see more packet_auth.h)
+    init_packet_auth();
+#endif
+
+    //init white list (see more white_list.h)
+    init_white_list();
+
+    // init BLE
+    init_ble();
+
+    // set up button cnfg and init button (see more button.h), the presses
+    // are posted to the host task, so it's done after BLE
     button_cnfg_t button_cnfg = {
             .gpio_num = GPIO_BUTTON,
             .short_button_press_period_ms = 1000,
@@ -91,26 +246,6 @@ void app_main(void)
     };
     button_init(button_cnfg);
 
-    // init i2c (see more i2c_driver.h)
-    i2c_port_t i2c_port = I2C_NUM_0;
-    esp_i2c_init(i2c_port, GPIO_SDA, GPIO_SCL);
-
-    // set configuration register of temperature sensor
-    // MAX30205 to shut it down
-    uint8_t cnfg_reg = 0b00000001;
-    esp_i2c_set_cnfg_reg(I2C_NUM_0, MAX30205_I2C_ADDR, MAX30205_CNFG_REG_PTR, &cnfg_reg);
-
-    //init white list (see more white_list.h)
-    init_white_list();
-
-    // init NVS
-    ESP_CHECK(nvs_flash_init(), s_tag_temp);
-
-    // init BLE
-    init_ble();
-
-    // get wakeup cause and do corresponding actions
-    esp_sleep_wakeup_cause_t wakeup_cause = esp_sleep_get_wakeup_cause();
     switch (wakeup_cause)
     {
         case ESP_SLEEP_WAKEUP_GPIO:
@@ -123,112 +258,458 @@ void app_main(void)
 
             break;
         }
-        case ESP_SLEEP_WAKEUP_TIMER:
-        {
-            // wakeup from timer means that device is periodically sends data
-            ESP_LOGI(s_tag_temp, "Waking up from timer.");
-            led_turn_on(); // turn on to show that device is awaken
-
-            // set configuration register of temperature sensor
-            // MAX30205 to one shot read and shutdown
-            uint8_t cnfg_reg = 0b10000001;
-            esp_i2c_set_cnfg_reg(I2C_NUM_0, MAX30205_I2C_ADDR, MAX30205_CNFG_REG_PTR, &cnfg_reg);
-
-            // read temperature data from temp sensor MAX30205
-            ESP_LOGI(s_tag_temp, "Start data read from MAX30205.");
-            const uint8_t data_buff_len = 2;
-            uint8_t data_buff[data_buff_len];
-            esp_i2c_read(I2C_NUM_0, MAX30205_I2C_ADDR, MAX30205_TEMP_REG_PTR, data_buff, data_buff_len);
-            ESP_LOGI(s_tag_temp, "temp = %.8f", convert_temp_data_to_float(data_buff[0], data_buff[1]));
-
-            // form advertising packet
-            const char *device_name;
-            device_name = ble_svc_gap_device_name();
-
-            struct ble_hs_adv_fields adv_fields;
-            memset(&adv_fields, 0, sizeof(adv_fields));
-            adv_fields.name = (uint8_t*)device_name;    // set device name
-            adv_fields.name_len = strlen(device_name);  // set device name length
-            adv_fields.name_is_complete = 1;            // indicate the name is complete (no
-                                                        // cut down due to adv package size limit)
-            adv_fields.flags = BLE_HS_ADV_F_BREDR_UNSUP;// classic bluetooth is unsupported
-            adv_fields.uuids16 = (ble_uuid16_t[]) {BLE_UUID16_INIT(0x1809)}; // 1809 uuid - temperature
-            adv_fields.num_uuids16 = 1;                 // one UUID is used
-            adv_fields.uuids16_is_complete = 1;         // indicate the UUID list is complete
-                                                        // (no cut down due to adv package size limit)
-
-            // form application packet (see app_packet.h) with DATA_HEADER
-            // and set it as manufacturer's data
-            uint8_t packet_buff[data_buff_len + HEADER_SIZE];
-            form_packet(packet_buff, DATA_HEADER, data_buff, data_buff_len);
-            adv_fields.mfg_data = packet_buff;
-            adv_fields.mfg_data_len = data_buff_len + HEADER_SIZE;
-
-            // set and check advertising packet fields
-            ESP_CHECK(ble_gap_adv_set_fields(&adv_fields), s_tag_temp);
-
-            // set advertising parameters
-            struct ble_gap_adv_params adv_params;
-            memset(&adv_params, 0, sizeof(adv_params));
-            adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // undirected advertising
-            adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;   // non-discoverable (connect only in
-                                                            // deletion/registr. mode, not while sending data)
-            adv_params.itvl_min = 0x10;                     // min advertising interval
-            adv_params.itvl_max = 0x20;                     // max advertising interval
-            adv_params.channel_map = BLE_GAP_ADV_DFLT_CHANNEL_MAP; // default channel map
-            adv_params.high_duty_cycle = 0;                 // low transmission frequency (for saving power)
-
-            ESP_LOGI(s_tag_temp, "Sending data.......");
-
-            // get white list with addrs to set in ble_gap_adv_start for adv
-            ble_addr_t wl_addr;
-            get_white_list_addr(&wl_addr);
-
-            // start advertising for 1 s
-            int32_t adv_duration_ms = 1*1000;
-            ESP_CHECK(ble_gap_adv_start(g_ble_addr_type, &wl_addr, adv_duration_ms, &adv_params, ble_gap_event, NULL), s_tag_temp);
-
-            break;
-        }
         default:
         {
-            // if we woke up from another cause, that means something
-            // went wrong, so go back to sleep
+            // power-on or reset: the white list is restored from NVS, so
+            // a registered node goes on collecting samples (the timer and
+            // the wake stub are armed by enter_deep_sleep)
             ESP_LOGI(s_tag_temp, "Waking up from other cause.");
             ESP_LOGI(s_tag_temp, "Go to sleep.");
-            esp_deep_sleep_start();
+            enter_deep_sleep();
             break;
         }
     }
 }
 
 
+// timer wakeup fast path: reads the sample first, and only if the batch
+// is ready inits led, NVS and BLE. button is not inited - a press during
+// the data cycle wakes the device up from the next deep sleep
+void run_data_cycle()
+{
+    ESP_LOGI(s_tag_temp, "Waking up from timer.");
+    telemetry_on_boot();
+    telemetry_record_phase(TELEMETRY_PHASE_BOOT, get_wake_phase_time(WAKE_PHASE_BOOT));
+
+    // wakeup configuration is lost in deep sleep, so set it again
+    button_enable_wakeup(GPIO_BUTTON);
+
+    //init white list (see more white_list.h)
+    init_white_list();
+
+    if (g_window_wake)
+    {
+        // the device slept until the scan window of the gateway (see more
+        // time_sync.h), the sample was taken before, so just send the batch
+        g_window_wake = false;
+        mark_wake_phase(WAKE_PHASE_SENSOR_READ);
+        ESP_LOGI(s_tag_temp, "Waking up in the scan window.");
+        g_data_adv_duration_ms = TIME_SYNC_ADV_DURATION_MS;
+    }
+    else
+    {
+        take_sample();
+
+        // sample is stored in RTC memory, if the batch is not ready yet, the
+        // heartbeat is not due and the temperature is normal, there is nothing
+        // to send, so go back to sleep without advertising
+        uint8_t batch_size = get_batch_size();
+        if (!sample_batch_is_ready(batch_size) && !sched_heartbeat_is_due() &&
+            !temp_is_out_of_range(get_newest_temp_value()))
+        {
+            ESP_LOGI(s_tag_temp, "Sample is buffered (%u/%u). Go to sleep for %lu ms...",
+                     get_sample_buffer_len(), batch_size, sched_get_interval_ms());
+            report_wake_timing();
+            enter_deep_sleep();
+            return;
+        }
+
+        // the batch is sent in the scan window of the gateway, so sleep
+        // until it starts. alerts are sent right away
+        if (!temp_is_out_of_range(get_newest_temp_value()))
+        {
+            int64_t wait_us = time_sync_until_window_us(get_time_us(), WAKE_LATENCY_BUDGET_US);
+            if (wait_us > 0)
+            {
+                ESP_LOGI(s_tag_temp, "Batch is ready. Go to sleep until the scan window (%lld us)...", wait_us);
+                report_wake_timing();
+                g_window_wake = true;
+                enter_window_sleep(wait_us);
+                return;
+            }
+            if (time_sync_is_valid())
+                g_data_adv_duration_ms = TIME_SYNC_ADV_DURATION_MS;
+        }
+    }
+
+    // inits led and turns it on to show that device is sending data
+    led_init(GPIO_LED);
+    led_turn_on();
+
+    // init NVS (used by BLE controller for calibration data)
+    ESP_CHECK(nvs_flash_init(), s_tag_temp);
+
+#if CONFIG_TEMP_PACKET_AUTH
+    // the key is in RTC memory, NVS is read only after power-on (see more packet_auth.h)
+    init_packet_auth();
+#endif
+
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    // find the log for samples that won't be acknowledged (see more flash_log.h)
+    init_flash_log();
+#endif
+
+    // init BLE, the batch is advertised as soon as the host is synced
+    g_data_adv_pending = true;
+    init_ble();
+}
+
+
+// takes the sample of this wake (if the wake stub didn't), adds it to the
+// buffer and updates the sleep interval
+void take_sample()
+{
+    // the wake stub (see more wake_stub.h) reads the sample on most timer
+    // wakes and boots only when the batch is ready, so the sample of this
+    // wake may be already in the buffer. its samples are timed by the
+    // estimated clock, so they are moved onto the RTC time first (the RTC
+    // time of the wakeup is the current one less the time since the boot)
+    wake_stub_rebase_samples(get_time_us() - esp_timer_get_time());
+    if (wake_stub_take_sample())
+    {
+        mark_wake_phase(WAKE_PHASE_SENSOR_READ);
+        ESP_LOGI(s_tag_temp, "Sample is taken by the wake stub.");
+    }
+    else
+    {
+        // init i2c and the sensors on it
+        init_sensors();
+
+        // start conversions of all sensors, read them as they are ready
+        // and push the samples to the buffer (see more acquisition.h)
+        ESP_LOGI(s_tag_temp, "Start data read from %u sensors.", acq_get_sensors_cnt());
+        acq_result_t results[ACQ_MAX_SENSORS];
+        acq_run(get_time_s(), results);
+        ESP_LOGI(s_tag_temp, "Acquisition took %lld us (bus %lld us).", acq_get_total_time_us(), acq_get_bus_time_us());
+        telemetry_record_phase(TELEMETRY_PHASE_I2C, acq_get_bus_time_us());
+        mark_wake_phase(WAKE_PHASE_SENSOR_READ);
+
+        for (uint8_t i = 0; i < acq_get_sensors_cnt(); i++)
+        {
+            if (results[i].err != ESP_OK)
+            {
+                telemetry_on_error();
+                continue;
+            }
+
+            // the sleep interval follows the body temperature
+            if (results[i].sensor == SENSOR_ID_BODY_TEMP)
+            {
+                int16_t temp_centi = convert_temp_data_to_centi(results[i].value >> 8, results[i].value & 0xFF);
+                ESP_LOGI(s_tag_temp, "temp = %s%d.%02d C", temp_centi < 0 ? "-" : "", abs(temp_centi) / 100, abs(temp_centi) % 100);
+                sched_update(results[i].value);
+            }
+            else
+                ESP_LOGI(s_tag_temp, "sensor %u = 0x%04X", results[i].sensor, results[i].value);
+        }
+    }
+}
+
+
+// adds the sensors of this node to the acquisition pipeline, a node with
+// more sensors registers their drivers here (see more sensor.h)
+void register_sensors()
+{
+    acq_register_sensor(&max30205_sensor);
+}
+
+
+// inits i2c bus and adds the registered sensors to it
+void init_sensors()
+{
+    esp_i2c_init(I2C_NUM_0, GPIO_SDA, GPIO_SCL);
+    acq_init();
+}
+
+
+// starts advertising the batch, if extended advertising can't be
+// used, falls back to legacy advertising (see start_data_adv)
+void send_batch()
+{
+    g_batch_is_ext = use_ext_pdu();
+    int rc = start_data_adv(g_batch_is_ext);
+    if (rc != 0 && g_batch_is_ext)
+    {
+        ESP_LOGI(s_tag_temp, "Extended advertising failed (rc = %d), fall back to legacy.", rc);
+        g_use_ext_adv = false;
+        g_batch_is_ext = false;
+        rc = start_data_adv(false);
+    }
+    if (rc == 0)
+    {
+        g_batch_adv_active = true;
+        mark_wake_phase(WAKE_PHASE_ADV_START);
+        ble_npl_callout_reset(&g_data_radio_callout, ble_npl_time_ms_to_ticks32(DATA_RADIO_BUDGET_MS));
+        return;
+    }
+
+    // advertising can't be started, so keep the samples and try next time
+    ESP_LOGE(s_tag_temp, "Batch advertising failed! rc = %d", rc);
+    telemetry_on_error();
+    ESP_LOGI(s_tag_temp, "Go to sleep...");
+    enter_deep_sleep();
+}
+
+
+// finishes the data adv (batch, replay or telemetry) when the adv window
+// is over or the gateway acknowledged the delivery
+void on_data_adv_complete(bool is_acked)
+{
+    // replay goes on while the gateway acknowledges it
+    if (g_replay_adv_active)
+    {
+        ESP_LOGI(s_tag_temp, "Replaying logged samples is %s!", is_acked ? "acknowledged" : "not acknowledged");
+        g_replay_adv_active = false;
+        if (is_acked)
+        {
+            flash_log_consume(g_replay_span);
+            if (send_replay() == 0)
+                return;
+        }
+
+        finish_data_cycle();
+        return;
+    }
+
+    // telemetry is sent after the batch, counting starts over
+    if (g_telemetry_adv_active)
+    {
+        ESP_LOGI(s_tag_temp, "Sending telemetry is completed%s!", is_acked ? " (acknowledged)" : "");
+        g_telemetry_adv_active = false;
+        telemetry_reset();
+        finish_data_cycle();
+        return;
+    }
+
+    if (!g_batch_adv_active)
+        return;
+    g_batch_adv_active = false;
+
+    ESP_LOGI(s_tag_temp, "Sending data is completed%s!", is_acked ? " (acknowledged)" : "");
+
+    mark_wake_phase(WAKE_PHASE_ADV_COMPLETE);
+    report_wake_timing();
+    telemetry_record_phase(TELEMETRY_PHASE_ADV, get_wake_phase_time(WAKE_PHASE_ADV_COMPLETE) -
+                                                get_wake_phase_time(WAKE_PHASE_ADV_START));
+    telemetry_on_batch_sent();
+    on_batch_ack_result(is_acked);
+
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    // the gateway may be out of range, so keep the samples of not
+    // acknowledged batch in the log to replay them later
+    if (!is_acked)
+    {
+        packet_sample_t samples[SAMPLE_BUFFER_SIZE];
+        uint8_t samples_cnt = 0;
+        get_sample_buffer_data(samples, SAMPLE_BUFFER_SIZE, &samples_cnt);
+        for (uint8_t i = 0; i < g_sent_samples_cnt && i < samples_cnt; i++)
+            flash_log_append(samples[i].sensor, samples[i].value, samples[i].time_s);
+        ESP_LOGI(s_tag_temp, "%u samples are logged, %lu to replay.", g_sent_samples_cnt, get_flash_log_len());
+    }
+#endif
+
+    remove_from_sample_buffer(g_sent_samples_cnt); // the batch was sent, collect a new one
+    sched_on_send();
+
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    // the gateway is in range again, so replay the logged samples
+    if (is_acked && send_replay() == 0)
+        return;
+#endif
+
+    finish_data_cycle();
+}
+
+
+// advertises the batch of the oldest logged samples (see more flash_log.h).
+// it's done right after the gateway acknowledged the previous batch, so
+// the acks come fast and the whole log is sent in one wake
+int send_replay()
+{
+    // the connected gateway gets the log over gatt (see more backlog_sync.h)
+    if (flash_log_is_empty() || backlog_sync_is_active() || g_data_radio_is_over)
+        return -1;
+
+    packet_sample_t samples[BATCH_MAX_SAMPLES];
+    uint8_t samples_cnt = 0;
+    flash_log_read(samples, BATCH_MAX_SAMPLES, &samples_cnt, &g_replay_span);
+    if (samples_cnt == 0)   // only records that are not valid anymore
+    {
+        flash_log_consume(g_replay_span);
+        return -1;
+    }
+
+    uint8_t batch_len = 0;
+    uint8_t sent_cnt = encode_batch(get_data_adv_payload(false), BATCH_PAYLOAD_SIZE, &batch_len,
+                                    samples, samples_cnt, get_time_s());
+    if (sent_cnt == 0)
+        return -1;
+
+    // span of the samples that fit (read again with the exact count)
+    if (sent_cnt < samples_cnt)
+        flash_log_read(samples, sent_cnt, &samples_cnt, &g_replay_span);
+
+    ESP_LOGI(s_tag_temp, "Replaying %u/%lu logged samples in %u bytes.......", sent_cnt, get_flash_log_len(), batch_len);
+
+    int rc = start_packet_adv(BATCH_HEADER, batch_len, g_data_adv_duration_ms, false);
+    g_replay_adv_active = rc == 0;
+    return rc;
+}
+
+
+// sends the telemetry if it's due or goes to sleep, while the gateway (or
+// the Health Thermometer peer) is connected, it is done on disconnect
+void finish_data_cycle()
+{
+    if (backlog_sync_is_active() || g_data_conn_handle != BLE_HS_CONN_HANDLE_NONE)
+        return;
+
+    // the ble host is up anyway, so the telemetry is sent right away
+    if (telemetry_is_due() && !g_data_radio_is_over && send_telemetry() == 0)
+        return;
+
+    ESP_LOGI(s_tag_temp, "Go to sleep...");
+    ble_npl_callout_stop(&g_data_radio_callout);
+    led_turn_off(); // turn led off, because data was send and go to sleep
+    enter_deep_sleep();
+}
+
+
+// starts advertising the telemetry summary (see more telemetry.h)
+int send_telemetry()
+{
+    telemetry_summary_t summary;
+    telemetry_get_summary(&summary);
+
+    // the extended pdu has room for the MAC, in legacy one telemetry is
+    // sent with the crc (see more packet_auth.h)
+    bool ext_pdu = use_ext_pdu();
+    encode_telemetry(get_data_adv_payload(ext_pdu), TELEMETRY_PAYLOAD_SIZE, &summary);
+
+    ESP_LOGI(s_tag_temp, "Sending telemetry: %u wakes, %u boots, %u errors.",
+             summary.wake_cnt, summary.boot_cnt, summary.error_cnt);
+
+    int rc = start_packet_adv(TELEMETRY_HEADER, TELEMETRY_PAYLOAD_SIZE, TELEMETRY_ADV_DURATION_MS, ext_pdu);
+    g_telemetry_adv_active = rc == 0;
+    return rc;
+}
+
+
+// goes to deep sleep. if white list is not empty, then we have registered
+// devices to send data to => enable timer wakeup and let the wake stub
+// collect samples (it reads the temperature sensor only, so a node with
+// more sensors boots on every wake). if not, we will just go to deepsleep
+// until gpio wakeup
+void enter_deep_sleep()
+{
+    // registrations and deletions of this session are written at once
+    store_white_list_to_nvs();
+    g_window_wake = false;
+
+    if (!white_list_is_empty())
+    {
+        // sleep interval is chosen by the scheduler (see more sleep_scheduler.h)
+        if (acq_get_sensors_cnt() <= 1)
+            wake_stub_arm(get_time_us(), get_batch_size(), GPIO_SDA, GPIO_SCL);
+        else
+            wake_stub_disarm();
+        ESP_CHECK(esp_sleep_enable_timer_wakeup((uint64_t)sched_get_interval_ms() * 1000), s_tag_temp);
+    }
+    else
+    {
+        wake_stub_disarm();
+    }
+
+    pm_log_stats();
+    led_deinit();   // RC_FAST is not kept powered in deep sleep
+    esp_deep_sleep_start();
+}
+
+
+// goes to deep sleep until the scan window to send the batch, the wake
+// stub is disarmed, so the device boots right after the wake
+void enter_window_sleep(uint64_t sleep_us)
+{
+    wake_stub_disarm();
+    ESP_CHECK(esp_sleep_enable_timer_wakeup(sleep_us), s_tag_temp);
+    pm_log_stats();
+    led_deinit();
+    esp_deep_sleep_start();
+}
+
+
+// checks if the next batch is sent with extended pdu: extended adv is
+// supported and the gateway acknowledged one of the last extended
+// batches, or it's time to try extended pdu again
+bool use_ext_pdu()
+{
+    if (!g_use_ext_adv)
+        return false;
+    return g_ext_unacked_cnt < EXT_ADV_MAX_UNACKED || g_legacy_batch_cnt >= EXT_ADV_PROBE_PERIOD;
+}
+
+
+// counts unacknowledged extended batches to fall back to legacy pdu
+// (see EXT_ADV_MAX_UNACKED)
+void on_batch_ack_result(bool is_acked)
+{
+    if (!g_batch_is_ext)
+    {
+        if (g_ext_unacked_cnt >= EXT_ADV_MAX_UNACKED && g_legacy_batch_cnt < UINT8_MAX)
+            g_legacy_batch_cnt++;
+        return;
+    }
+
+    g_legacy_batch_cnt = 0;
+    if (is_acked)
+    {
+        g_ext_unacked_cnt = 0;
+        return;
+    }
+    if (g_ext_unacked_cnt < EXT_ADV_MAX_UNACKED && ++g_ext_unacked_cnt == EXT_ADV_MAX_UNACKED)
+        ESP_LOGI(s_tag_temp, "%u extended batches are not acknowledged, fall back to legacy.", g_ext_unacked_cnt);
+}
+
+
+// returns number of samples to collect before sending the batch
+uint8_t get_batch_size()
+{
+    return use_ext_pdu() ? SAMPLES_PER_EXT_BATCH : SAMPLES_PER_BATCH;
+}
+
+
 // inits nimble, gap & gatt services
 void init_ble()
 {
     nimble_port_init();
-    ble_svc_gap_device_name_set("Nemivika-Temp");
+    pairing_init();     // pairing pauses run in the host task (see more pairing.h)
+    ble_npl_callout_init(&g_data_radio_callout, nimble_port_get_dflt_eventq(), on_data_radio_callout, NULL);
+    ble_npl_event_init(&g_medium_press_event, on_medium_press_event, NULL);
+    ble_npl_event_init(&g_long_press_event, on_long_press_event, NULL);
+    ble_svc_gap_device_name_set(ADV_DEVICE_NAME);
     ble_svc_gap_init();
     ble_svc_gatt_init();
 
     // TODO add device information svc with battery info chr
-    // configure gatt characteristics
-    const struct ble_gatt_chr_def gatt_chr_temp = {
-            .uuid = BLE_UUID16_DECLARE(0x2A1C), // Temperature Measurement
-            .flags = BLE_GATT_CHR_F_READ,
-            .access_cb = read_temp};
-
-    // configure gatt services
-    const struct ble_gatt_svc_def gatt_svc_cnfg = {
-            .type = BLE_GATT_SVC_TYPE_PRIMARY,
-            .uuid = BLE_UUID16_DECLARE(0x1809), // Health Thermometer Service
-            .characteristics = (struct ble_gatt_chr_def[]){gatt_chr_temp, {0}}};
-
-
-    // set configuration
-    struct ble_gatt_svc_def gatt_svc_cnfgs[] = {gatt_svc_cnfg, {0}};
-    ble_gatts_count_cfg(gatt_svc_cnfgs);
-    ble_gatts_add_svcs(gatt_svc_cnfgs);
+    // health thermometer service (see more health_thermometer.h)
+    hts_register();
+
+#if CONFIG_TEMP_STORE_AND_FORWARD
+    // service to transfer the flash log over connection (see more backlog_sync.h)
+    backlog_sync_register();
+#endif
+
+#if CONFIG_TEMP_PACKET_AUTH
+    // service to give the auth key to the registered gateway, it's read over
+    // encrypted link only, so Just Works pairing (no bonding) is enabled
+    packet_auth_register(on_registration_step_done);
+    ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_NO_IO;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_bonding = 0;
+#endif
+
+    // raw adv data of all modes (see more adv_pdu.h)
+    init_adv_pdus();
 
     // set the callback function to be executed when the ble stack is synchronised
     ble_hs_cfg.sync_cb = ble_app_on_sync;
@@ -242,6 +723,16 @@ void ble_app_on_sync(void)
 {
     // infer and set the ble addr type
     ble_hs_id_infer_auto(0, &g_ble_addr_type);
+
+    // if the data cycle waits for BLE, send the batch
+    if (g_data_adv_pending)
+    {
+        g_data_adv_pending = false;
+        mark_wake_phase(WAKE_PHASE_BLE_SYNC);
+        telemetry_record_phase(TELEMETRY_PHASE_BLE_SYNC, get_wake_phase_time(WAKE_PHASE_BLE_SYNC) -
+                                                         get_wake_phase_time(WAKE_PHASE_SENSOR_READ));
+        send_batch();
+    }
 }
 
 
@@ -262,26 +753,37 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
         {
             // if advertisement was comlete, we may:
             // - signal that data sending was completed
-            // - TODO do something if there weren't any device
-            //   to connect with for registration or deletion
+            // - end the pairing burst if there weren't any device to
+            //   connect with for registration or deletion (see more pairing.h),
+            //   extended adv also completes on connection (reason 0), it is
+            //   handled on BLE_GAP_EVENT_CONNECT
+            if (event->adv_complete.reason == 0)
+                break;
             if (g_device_mode == REGISTRATION_MODE || g_device_mode == DELETION_MODE)
+            {
+                pairing_on_adv_complete();
                 break;
+            }
 
-            ESP_LOGI(s_tag_temp, "Sending data is completed!");
-            ESP_LOGI(s_tag_temp, "Go to sleep...");
-
-            led_turn_off(); // turn led off, because data was send and go to sleep
-
-            // if white list is not empty, then we have registered
-            // devices to get data from => enable timer wakeup.
-            // if not, we will just go to deepsleep until gpio wakeup
-            if (!white_list_is_empty())
-                ESP_CHECK(esp_sleep_enable_timer_wakeup(DEEP_SLEEP_CYCLE_TIME), s_tag_temp);
-
-            esp_deep_sleep_start();
+            on_data_adv_complete(false);
+            break;
+        }
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+        case BLE_GAP_EVENT_SCAN_REQ_RCVD:
+        {
+            // the gateway sends scan request only after it received the adv
+            // pdu, so a scan request from registered gateway acknowledges
+            // the delivery, and the rest of the adv window is not needed
+            if (!g_batch_adv_active && !g_replay_adv_active && !g_telemetry_adv_active)
+                break;
+            if (!white_list_contains_addr(&event->scan_req_rcvd.scan_addr))
+                break;
 
+            stop_adv();
+            on_data_adv_complete(true);
             break;
         }
+#endif
         case BLE_GAP_EVENT_CONNECT:
         {
             // if device is connected, we may:
@@ -295,6 +797,13 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
             {
                 ESP_LOGI(s_tag_temp, "CONNECTION established!");
 
+                // gatt handlers are served at max frequency (see more power_mgmt.h)
+                pm_on_connect();
+
+                // pairing latency is recorded (see more pairing.h)
+                if (g_device_mode == REGISTRATION_MODE || g_device_mode == DELETION_MODE)
+                    pairing_on_connect();
+
                 char our_mac[MAC_STR_SIZE];
                 char peer_mac[MAC_STR_SIZE];
                 get_mac_str(conn_desc.our_id_addr.val, &our_mac);
@@ -303,29 +812,53 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
                 ESP_LOGI(s_tag_temp, "Connected device id addr:\t%s", peer_mac);
 
                 // stop advertising
-                ble_gap_adv_stop();
+                stop_adv();
+
+                // registered gateway connected to the data adv, so it received
+                // the adv pdu (acknowledgement), the backlog is sent over the
+                // connection (see more backlog_sync.h). any peer can read the
+                // Health Thermometer service (see more health_thermometer.h),
+                // the connection is kept until the peer is done
+                if (g_batch_adv_active || g_replay_adv_active || g_telemetry_adv_active)
+                {
+                    bool is_acked = white_list_contains_addr(&conn_desc.peer_id_addr);
+#if CONFIG_TEMP_STORE_AND_FORWARD
+                    if (is_acked)
+                    {
+                        backlog_sync_start(event->connect.conn_handle);
+                        time_sync_read(event->connect.conn_handle, NULL);   // resync the time
+                    }
+#endif
+                    start_data_conn(event->connect.conn_handle, !backlog_sync_is_active(), !is_acked);
+                    on_data_adv_complete(is_acked);
+                    break;
+                }
 
                 // if this device is in registration mode:
                 //     - add to white list
+                //     - read time chr from am-gateway (see more time_sync.h)
+                //     - let am-gateway read the auth key (see more packet_auth.h)
                 //     - try to disconnect
-                //     - TODO read time chr from am-dateway and set it
                 // if this device is in deletion mode:
                 //     - delete from white list
                 //     - try to disconnect
                 if (g_device_mode == REGISTRATION_MODE)
                 {
-                    // читаємо час
-                    //ble_gattc_disc_all_svcs(event->connect.conn_handle, get_time_attr_hndl, NULL);
-                    /*int rc = ble_gattc_read(event->connect.conn_handle, 0x01, gatt_read, NULL);
-                    ESP_LOGI("GATT Client", "rc=%d", rc);
-                    if (rc != 0) {
-                        ESP_LOGE("GATT Client", "Error initiating read; rc=%d", rc);
-                    }*/
-
-                    // add to white list
-                    push_to_white_list(conn_desc.peer_id_addr);
+                    // add to white list, a full list rejects the gateway: it
+                    // gets neither the time read nor the key, the failure
+                    // is shown until the mode is left
+                    if (push_to_white_list(conn_desc.peer_id_addr) != ESP_OK)
+                    {
+                        ESP_LOGE(s_tag_temp, "Registration failed, the white list is full (%d).", WHITE_LIST_SIZE);
+                        led_play(&LED_PATTERN_REG_FAILURE);
+                        ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                        break;
+                    }
+                    // start sampling with min interval
+                    sched_reset();
+                    g_ext_unacked_cnt = 0;  // the new gateway may see extended pdu
                     // start fast blink, meaning that registration was successful
-                    led_start_blink(100, 100);
+                    led_play(&LED_PATTERN_REG_SUCCESS);
                     ESP_LOGI(s_tag_temp, "Registration is completed.");
                 }
                 else if (g_device_mode == DELETION_MODE)
@@ -334,8 +867,13 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
                     bool deleted = remove_from_white_list_by_addr(&conn_desc.peer_id_addr) == ESP_OK ? true : false;
                     if (deleted)
                     {
+#if CONFIG_TEMP_PACKET_AUTH
+                        // the deleted gateway knows the key, it is replaced
+                        // (see more packet_auth.h)
+                        rotate_packet_auth_key();
+#endif
                         // start slow blink, meaning that deletion was successful
-                        led_start_blink(700, 700);
+                        led_play(&LED_PATTERN_DEL_SUCCESS);
                         ESP_LOGI(s_tag_temp, "Deletion is completed.");
                     }
                     else
@@ -343,9 +881,15 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
                         ESP_LOGI(s_tag_temp, "Deletion failed.");
                     }
                 }
-                // try to disconnect
-                ESP_LOGI(s_tag_temp, "Try to disconnect...");
-                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                // try to disconnect, in registration mode the connection
+                // is terminated after the registration steps
+                if (g_device_mode == REGISTRATION_MODE)
+                    start_registration_steps(event->connect.conn_handle);
+                else
+                {
+                    ESP_LOGI(s_tag_temp, "Try to disconnect...");
+                    ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                }
             }
             else
             {
@@ -353,11 +897,13 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
             }
 
             // print info about white list
-            ESP_LOGI(s_tag_temp, "White List: len = %u", white_list_len);
-            for(int i = 0; i < white_list_len; i++)
+            ESP_LOGI(s_tag_temp, "White List: len = %u", get_white_list_len());
+            for(int i = 0; i < get_white_list_len(); i++)
             {
+                ble_addr_t wl_addr;
+                get_white_list_addr(i, &wl_addr);
                 char wl_mac[MAC_STR_SIZE];
-                get_mac_str(white_list[i].device_addr.val, &wl_mac);
+                get_mac_str(wl_addr.val, &wl_mac);
                 ESP_LOGI(s_tag_temp, "WL[%d] = {%s}", i, wl_mac);
             }
             break;
@@ -368,7 +914,47 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
             char peer_mac[MAC_STR_SIZE];
             get_mac_str(event->disconnect.conn.peer_id_addr.val, &peer_mac);
             ESP_LOGI(s_tag_temp, "DISCONNECTED with %s! The reason - %d.", peer_mac, event->disconnect.reason);
+            pm_on_disconnect();
 
+            // the pairing mode is left after the success indication
+            pairing_on_disconnect();
+
+            if (event->disconnect.conn.conn_handle == g_reg_conn_handle)
+            {
+                esp_timer_stop(g_reg_timer);
+                g_reg_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+                g_reg_steps_left = 0;
+            }
+
+            // the backlog transfer (or the data connection) is over, finish
+            // the data cycle
+            if (event->disconnect.conn.conn_handle == g_data_conn_handle)
+            {
+                esp_timer_stop(g_data_conn_timer);
+                g_data_conn_handle = BLE_HS_CONN_HANDLE_NONE;
+                backlog_sync_stop();
+                finish_data_cycle();
+            }
+            break;
+        }
+        case BLE_GAP_EVENT_SUBSCRIBE:
+        {
+            touch_data_conn(event->subscribe.conn_handle);
+            backlog_sync_on_subscribe(event);
+            hts_on_subscribe(event);
+            break;
+        }
+        case BLE_GAP_EVENT_NOTIFY_TX:
+        {
+            // notifications of the backlog are paced by the pump (see more
+            // backlog_sync.h), the data connection is over once the
+            // measurement indication is confirmed (unless the backlog is sent)
+            if (hts_on_notify_tx(event) && event->notify_tx.conn_handle == g_data_conn_handle &&
+                !backlog_sync_is_active())
+            {
+                ESP_LOGI(s_tag_temp, "Measurement is indicated, disconnect.");
+                ble_gap_terminate(g_data_conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+            }
             break;
         }
         default:
@@ -379,9 +965,279 @@ static int ble_gap_event(struct ble_gap_event *event, void *arg)
 }
 
 
+// starts the steps of the registration connection: the gateway time is
+// read (see more time_sync.h) and the gateway reads the auth key (see more
+// packet_auth.h), the connection is terminated when both are done
+void start_registration_steps(uint16_t conn_handle)
+{
+    if (g_reg_timer == NULL)
+    {
+        const esp_timer_create_args_t timer_args = {.callback = on_registration_timer, .name = "registration"};
+        ESP_CHECK(esp_timer_create(&timer_args, &g_reg_timer), s_tag_temp);
+    }
+
+    g_reg_conn_handle = conn_handle;
+#if CONFIG_TEMP_PACKET_AUTH
+    g_reg_steps_left = 2;
+#else
+    g_reg_steps_left = 1;
+#endif
+    esp_timer_stop(g_reg_timer);
+    esp_timer_start_once(g_reg_timer, REGISTRATION_TIMEOUT_US);
+
+    if (time_sync_read(conn_handle, on_registration_step_done) != ESP_OK)
+        on_registration_step_done(conn_handle);
+}
+
+
+// counts finished registration step, after the last one the connection
+// is terminated (a bit later, so the last response is sent)
+void on_registration_step_done(uint16_t conn_handle)
+{
+    if (conn_handle != g_reg_conn_handle || g_reg_steps_left == 0)
+        return;
+
+    if (--g_reg_steps_left == 0)
+    {
+        esp_timer_stop(g_reg_timer);
+        esp_timer_start_once(g_reg_timer, REGISTRATION_LINGER_US);
+    }
+}
+
+
+static void on_registration_timer(void* arg)
+{
+    ESP_LOGI(s_tag_temp, "Try to disconnect...");
+    ble_gap_terminate(g_reg_conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+
+// keeps the connection to the data adv, the data cycle is finished on
+// disconnect. without the backlog transfer the connection is terminated
+// if the peer is idle (see DATA_CONN_IDLE_TIMEOUT_US), the guest (not
+// registered) peer is held for DATA_CONN_GUEST_HOLD_US at most
+void start_data_conn(uint16_t conn_handle, bool is_idle_timed, bool is_guest)
+{
+    if (g_data_conn_timer == NULL)
+    {
+        esp_timer_create_args_t timer_args = {
+                .callback = on_data_conn_timer,
+                .name = "data_conn"};
+        ESP_CHECK(esp_timer_create(&timer_args, &g_data_conn_timer), s_tag_temp);
+    }
+
+    g_data_conn_handle = conn_handle;
+    g_data_conn_is_guest = is_guest;
+    esp_timer_stop(g_data_conn_timer);
+    if (is_guest)
+        esp_timer_start_once(g_data_conn_timer, DATA_CONN_GUEST_HOLD_US);
+    else if (is_idle_timed)
+        esp_timer_start_once(g_data_conn_timer, DATA_CONN_IDLE_TIMEOUT_US);
+}
+
+
+// restarts the idle timeout of the data connection on the peer activity
+void touch_data_conn(uint16_t conn_handle)
+{
+    if (conn_handle != g_data_conn_handle || g_data_conn_is_guest || backlog_sync_is_active())
+        return;
+
+    esp_timer_stop(g_data_conn_timer);
+    esp_timer_start_once(g_data_conn_timer, DATA_CONN_IDLE_TIMEOUT_US);
+}
+
+
+static void on_data_conn_timer(void* arg)
+{
+    ESP_LOGI(s_tag_temp, "Data connection is idle, disconnect.");
+    ble_gap_terminate(g_data_conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+}
+
+
+// the radio budget of the data cycle is used up: the connection is
+// terminated (the cycle is finished on disconnect) or the data adv is
+// stopped as not acknowledged
+static void on_data_radio_callout(struct ble_npl_event* ev)
+{
+    ESP_LOGI(s_tag_temp, "Radio budget of the data cycle (%d ms) is used up.", DATA_RADIO_BUDGET_MS);
+    g_data_radio_is_over = true;
+
+    if (g_data_conn_handle != BLE_HS_CONN_HANDLE_NONE)
+    {
+        ble_gap_terminate(g_data_conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
+    }
+    if (g_batch_adv_active || g_replay_adv_active || g_telemetry_adv_active)
+    {
+        stop_adv();
+        on_data_adv_complete(false);
+    }
+}
+
+
+// sets raw advertising (and scan response) data and starts advertising. with
+// extended advertising enabled in menuconfig the legacy api is unsupported,
+// so the same adv is configured on extended adv instance (with legacy pdu
+// if ext_pdu is false - the only way gateways without BLE 5 can see it)
+int start_adv(const adv_pdu_t* pdu, const struct ble_gap_adv_params* adv_params, const ble_addr_t* direct_addr,
+              int32_t duration_ms, bool ext_pdu)
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    struct ble_gap_ext_adv_params ext_params;
+    memset(&ext_params, 0, sizeof(ext_params));
+    ext_params.legacy_pdu = !ext_pdu;
+    ext_params.connectable = adv_params->conn_mode != BLE_GAP_CONN_MODE_NON;
+    // legacy connectable adv is always scannable, extended one can't be both
+    ext_params.scannable = ext_pdu ? (!ext_params.connectable && pdu->rsp_data != NULL)
+                                   : (ext_params.connectable || pdu->rsp_data != NULL);
+    ext_params.own_addr_type = g_ble_addr_type;
+    ext_params.primary_phy = BLE_HCI_LE_PHY_1M;
+    ext_params.secondary_phy = BLE_HCI_LE_PHY_1M;
+    ext_params.itvl_min = adv_params->itvl_min;
+    ext_params.itvl_max = adv_params->itvl_max;
+    ext_params.channel_map = adv_params->channel_map;
+    ext_params.filter_policy = adv_params->filter_policy;
+    ext_params.scan_req_notif = ext_params.scannable;  // scan requests are used as acks
+    ext_params.tx_power = 127;  // no preference
+    ext_params.sid = ADV_INSTANCE;
+
+    // instance can't be reconfigured while it is active
+    if (ble_gap_ext_adv_active(ADV_INSTANCE))
+        ble_gap_ext_adv_stop(ADV_INSTANCE);
+
+    int rc = ble_gap_ext_adv_configure(ADV_INSTANCE, &ext_params, NULL, ble_gap_event, NULL);
+    if (rc != 0)
+        return rc;
+
+    // copy raw data into mbuf, set_data takes its ownership
+    struct os_mbuf* data = ble_hs_mbuf_from_flat(pdu->data, pdu->data_len);
+    if (data == NULL)
+        return BLE_HS_ENOMEM;
+
+    rc = ble_gap_ext_adv_set_data(ADV_INSTANCE, data);
+    if (rc != 0)
+        return rc;
+
+    if (pdu->rsp_data != NULL && ext_params.scannable)
+    {
+        struct os_mbuf* rsp_data = ble_hs_mbuf_from_flat(pdu->rsp_data, pdu->rsp_data_len);
+        if (rsp_data == NULL)
+            return BLE_HS_ENOMEM;
+
+        rc = ble_gap_ext_adv_rsp_set_data(ADV_INSTANCE, rsp_data);
+        if (rc != 0)
+            return rc;
+    }
+
+    // duration is set in 10 ms units, 0 means forever
+    int duration = duration_ms == BLE_HS_FOREVER ? 0 : duration_ms / 10;
+    return ble_gap_ext_adv_start(ADV_INSTANCE, duration, 0);
+#else
+    int rc = ble_gap_adv_set_data(pdu->data, pdu->data_len);
+    if (rc != 0)
+        return rc;
+
+    if (pdu->rsp_data != NULL)
+    {
+        rc = ble_gap_adv_rsp_set_data(pdu->rsp_data, pdu->rsp_data_len);
+        if (rc != 0)
+            return rc;
+    }
+
+    return ble_gap_adv_start(g_ble_addr_type, direct_addr, duration_ms, adv_params, ble_gap_event, NULL);
+#endif
+}
+
+
+// stops advertising started with start_adv
+int stop_adv()
+{
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+    return ble_gap_ext_adv_stop(ADV_INSTANCE);
+#else
+    return ble_gap_adv_stop();
+#endif
+}
+
+
+// encodes the batch of buffered samples and starts advertising it for
+// 1 s. extended pdu carries several times more samples than legacy one,
+// legacy pdu is used when extended adv isn't supported
+int start_data_adv(bool ext_pdu)
+{
+    // form application packet payload (see app_packet.h) with buffered
+    // samples encoded as deltas. samples that don't fit stay in the
+    // buffer for the next batch
+    packet_sample_t samples[SAMPLE_BUFFER_SIZE];
+    uint8_t samples_cnt = 0;
+    get_sample_buffer_data(samples, SAMPLE_BUFFER_SIZE, &samples_cnt);
+
+    // the batch is encoded right into the adv data (see more adv_pdu.h)
+    uint8_t batch_buff_len = ext_pdu ? EXT_BATCH_PAYLOAD_SIZE : BATCH_PAYLOAD_SIZE;
+    uint8_t batch_len = 0;
+    g_sent_samples_cnt = encode_batch(get_data_adv_payload(ext_pdu), batch_buff_len, &batch_len,
+                                      samples, samples_cnt, get_time_s());
+
+    ESP_LOGI(s_tag_temp, "Sending %u/%u samples in %u bytes (%s adv).......",
+             g_sent_samples_cnt, samples_cnt, batch_len, ext_pdu ? "extended" : "legacy");
+
+    // start advertising for 1 s (or a short burst in the scan window, see
+    // more time_sync.h), advertising is stopped earlier if the gateway
+    // acknowledges the delivery with scan request (legacy pdu only,
+    // extended scannable adv can't carry adv data) or connects
+    return start_packet_adv(BATCH_HEADER, batch_len, g_data_adv_duration_ms, ext_pdu);
+}
+
+
+// patches application packet (header + payload encoded into the adv data
+// with get_data_adv_payload) into the prebuilt adv data and starts
+// advertising it to all registered gateways (see more adv_pdu.h)
+int start_packet_adv(uint16_t header, uint8_t payload_len, int32_t duration_ms, bool ext_pdu)
+{
+    if (payload_len > (ext_pdu ? EXT_ADV_PAYLOAD_MAX_SIZE : ADV_PAYLOAD_MAX_SIZE))
+        return BLE_HS_EINVAL;
+    adv_pdu_t pdu = get_data_adv_pdu(header, payload_len, ext_pdu);
+
+    // set advertising parameters
+    struct ble_gap_adv_params adv_params;
+    memset(&adv_params, 0, sizeof(adv_params));
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // undirected advertising (extended one is
+                                                    // connectable, but not scannable)
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;   // non-discoverable (connect only in
+                                                    // deletion/registr. mode, not while sending data)
+    adv_params.itvl_min = 0x10;                     // min advertising interval
+    adv_params.itvl_max = 0x20;                     // max advertising interval
+    adv_params.channel_map = BLE_GAP_ADV_DFLT_CHANNEL_MAP; // default channel map
+    adv_params.high_duty_cycle = 0;                 // low transmission frequency (for saving power)
+
+    // answer scan requests (acknowledgements) from registered gateways
+    // only, the filtering is done by the controller (see more white_list.h).
+    // any peer can connect to read the Health Thermometer service
+    if (load_white_list_to_controller() == ESP_OK)
+        adv_params.filter_policy = BLE_HCI_ADV_FILT_SCAN;
+
+    return start_adv(&pdu, &adv_params, NULL, duration_ms, ext_pdu);
+}
+
+
+// button callbacks run in the button task, the modes are driven by the
+// GAP events and the pairing callout in the host task, so the presses
+// are posted to the host task
+void on_medium_button_press()
+{
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &g_medium_press_event);
+}
+
+
+void on_long_button_press()
+{
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &g_long_press_event);
+}
+
+
 // pressing on button during 1 - 5 s causes entering or exiting
 // registration mode
-void on_medium_button_press()
+static void on_medium_press_event(struct ble_npl_event* ev)
 {
     // if device isn't in registration or deletion mode now,
     // then it could enter registration mode
@@ -394,70 +1250,29 @@ void on_medium_button_press()
         ESP_LOGI(s_tag_temp, "Entering register mode.");
         ESP_LOGI(s_tag_temp, "Broadcast advertising.......");
 
-        // for registration, device starts advertising
-        // form advertising packet
-        const char *device_name;
-        device_name = ble_svc_gap_device_name();
-
-        struct ble_hs_adv_fields adv_fields;
-        memset(&adv_fields, 0, sizeof(adv_fields));
-        adv_fields.name = (uint8_t*)device_name;    // set device name
-        adv_fields.name_len = strlen(device_name);  // set device name length
-        adv_fields.name_is_complete = 1;            // indicate the name is complete
-        adv_fields.flags = BLE_HS_ADV_F_BREDR_UNSUP;// classic bluetooth is unsupported
-        adv_fields.uuids16 = (ble_uuid16_t[]) {BLE_UUID16_INIT(0x1809)}; // 1809 uuid - temperature
-        adv_fields.num_uuids16 = 1;                 // one UUID is used
-        adv_fields.uuids16_is_complete = 1;         // indicate the UUID list is complete
-
-        // form application packet (see app_packet.h) with REG_HEADER
-        // and set it as manufacturer's data
-        uint8_t packet_buff[HEADER_SIZE];
-        uint8_t* data_buff = NULL;
-        form_packet(packet_buff, REG_HEADER, data_buff, 0);
-        adv_fields.mfg_data = packet_buff;
-        adv_fields.mfg_data_len = HEADER_SIZE;
-
-        // set and check advertising packet fields
-        ESP_CHECK(ble_gap_adv_set_fields(&adv_fields), s_tag_temp);
-
-        // set advertising parameters
-        struct ble_gap_adv_params adv_params;
-        memset(&adv_params, 0, sizeof(adv_params));
-        adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // undirected adv, because we want to register new device
-        adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;   // discoverable (connect in deletion/registr. mode)
-        adv_params.itvl_min = 0x0010;
-        adv_params.itvl_max = 0x0020;
-        adv_params.channel_map = BLE_GAP_ADV_DFLT_CHANNEL_MAP;
-        adv_params.high_duty_cycle = 0;
-
-        // set duration to forever (TODO not forever but some time) until device is found
-        int32_t adv_duration_ms = BLE_HS_FOREVER;
-        ESP_CHECK(ble_gap_adv_start(g_ble_addr_type, NULL, adv_duration_ms, &adv_params, ble_gap_event, NULL), s_tag_temp);
+        // advertising runs in bursts until a gateway connects or the
+        // pairing times out (see more pairing.h)
+        ESP_CHECK(pairing_start(start_registration_adv, on_pairing_end), s_tag_temp);
     }
     else if (g_device_mode == REGISTRATION_MODE)
     {
         // if device is in registration mode now, that means user exit this mode
         ESP_LOGI(s_tag_temp, "Quiting registration mode.");
-
-        // if white list is not empty, then we have registered
-        // devices to get data from => enable timer wakeup.
-        // if not, we will just go to deepsleep until gpio wakeup
-        if (!white_list_is_empty())
-            ESP_CHECK(esp_sleep_enable_timer_wakeup(DEEP_SLEEP_CYCLE_TIME), s_tag_temp);
+        pairing_stop();
 
         // turn led off as signal for exiting registration mode
         led_turn_off();
 
         // set device into unspecified mode and go to sleep
         g_device_mode = UNSPECIFIED_MODE;
-        esp_deep_sleep_start();
+        enter_deep_sleep();
     }
 }
 
 
 // pressing on button during 5 and more s causes entering or exiting
 // deletion mode
-void on_long_button_press()
+static void on_long_press_event(struct ble_npl_event* ev)
 {
     // if device isn't in registration or deletion mode now,
     // then it could enter deletion mode
@@ -468,109 +1283,96 @@ void on_long_button_press()
         led_turn_on();
 
         ESP_LOGI(s_tag_temp, "Entering deletion mode.");
-        ESP_LOGI(s_tag_temp, "Directed advertising.......");
-
-        // for deletion, device starts advertising
-        // form advertising packet
-        const char *device_name;
-        device_name = ble_svc_gap_device_name();
-
-        struct ble_hs_adv_fields adv_fields;
-        memset(&adv_fields, 0, sizeof(adv_fields));
-        adv_fields.name = (uint8_t*)device_name;    // set device name
-        adv_fields.name_len = strlen(device_name);  // set device name length
-        adv_fields.name_is_complete = 1;            // indicate the name is complete
-        adv_fields.flags = BLE_HS_ADV_F_BREDR_UNSUP;// classic bluetooth is unsupported
-        adv_fields.uuids16 = (ble_uuid16_t[]) {BLE_UUID16_INIT(0x1809)};// 1809 uuid - temperature
-        adv_fields.num_uuids16 = 1;                 // one UUID is used
-        adv_fields.uuids16_is_complete = 1;         // indicate the UUID list is complete
-
-        // form application packet (see app_packet.h) with DEL_HEADER
-        // and set it as manufacturer's data
-        uint8_t packet_buff[HEADER_SIZE];
-        uint8_t* data_buff = NULL;
-        form_packet(packet_buff, (uint8_t)DEL_HEADER, data_buff, 0);
-        adv_fields.mfg_data = packet_buff;
-        adv_fields.mfg_data_len = HEADER_SIZE;
-
-        // set and check advertising packet fields
-        ESP_CHECK(ble_gap_adv_set_fields(&adv_fields), s_tag_temp);
-
-        // set advertising parameters
-        struct ble_gap_adv_params adv_params;
-        memset(&adv_params, 0, sizeof(adv_params));
-        adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // undirected advertising
-        adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;   // discoverable (connect in deletion/registr. mode)
-        adv_params.itvl_min = 0x10;
-        adv_params.itvl_max = 0x20;
-        adv_params.channel_map = BLE_GAP_ADV_DFLT_CHANNEL_MAP;
-        adv_params.high_duty_cycle = 0;
-
-        // get white list with addrs to set in ble_gap_adv_start for adv
-        ble_addr_t wl_addr;
-        get_white_list_addr(&wl_addr);
-
-        // set duration to forever (TODO not forever but some time) until device is found
-        int32_t adv_duration_ms = BLE_HS_FOREVER;
-        ble_gap_adv_start(g_ble_addr_type, &wl_addr, adv_duration_ms, &adv_params, ble_gap_event, NULL);
+        ESP_LOGI(s_tag_temp, "Advertising to registered gateways.......");
+
+        // advertising runs in bursts until a gateway connects or the
+        // pairing times out (see more pairing.h)
+        ESP_CHECK(pairing_start(start_deletion_adv, on_pairing_end), s_tag_temp);
     }
     else if (g_device_mode == DELETION_MODE)
     {
         // if device is in deletion mode now, that means user exit this mode
         ESP_LOGI(s_tag_temp, "Quiting deletion mode.");
-
-        // if white list is not empty, then we have registered
-        // devices to get data from => enable timer wakeup.
-        // if not, we will just go to deepsleep until gpio wakeup
-        if (!white_list_is_empty())
-            ESP_CHECK(esp_sleep_enable_timer_wakeup(DEEP_SLEEP_CYCLE_TIME), s_tag_temp);
+        pairing_stop();
 
         // turn led off as signal for exiting deletion mode
         led_turn_off();
 
         // set device into unspecified mode and go to sleep
         g_device_mode = UNSPECIFIED_MODE;
-        esp_deep_sleep_start();
+        enter_deep_sleep();
     }
 }
 
 
-// no action on button press under 1 s
-void on_short_button_press()
+// starts a registration burst: advertising of prebuilt adv data with
+// REG_HEADER packet (see more adv_pdu.h) for duration_ms
+int start_registration_adv(int32_t duration_ms)
 {
-
+    adv_pdu_t pdu = get_mode_adv_pdu(REG_HEADER);
+
+    // set advertising parameters
+    struct ble_gap_adv_params adv_params;
+    memset(&adv_params, 0, sizeof(adv_params));
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // undirected adv, because we want to register new device
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;   // discoverable (connect in deletion/registr. mode)
+    adv_params.itvl_min = 0x0010;
+    adv_params.itvl_max = 0x0020;
+    adv_params.channel_map = BLE_GAP_ADV_DFLT_CHANNEL_MAP;
+    adv_params.high_duty_cycle = 0;
+
+    return start_adv(&pdu, &adv_params, NULL, duration_ms, false);
 }
 
 
-// converts raw temperature data (from two bytes) to a float value
-float convert_temp_data_to_float(uint8_t temp_msb, uint8_t temp_lsb)
+// starts a deletion burst: advertising of prebuilt adv data with
+// DEL_HEADER packet (see more adv_pdu.h) for duration_ms
+int start_deletion_adv(int32_t duration_ms)
 {
-    // extract the most significant byte (MSB) and the least significant byte (LSB)
-    float ret_val = (float)(temp_msb & 0b01111111);
+    adv_pdu_t pdu = get_mode_adv_pdu(DEL_HEADER);
+
+    // set advertising parameters
+    struct ble_gap_adv_params adv_params;
+    memset(&adv_params, 0, sizeof(adv_params));
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;   // undirected advertising
+    adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;   // discoverable (connect in deletion/registr. mode)
+    adv_params.itvl_min = 0x10;
+    adv_params.itvl_max = 0x20;
+    adv_params.channel_map = BLE_GAP_ADV_DFLT_CHANNEL_MAP;
+    adv_params.high_duty_cycle = 0;
+
+    // only registered gateways can connect to delete this device,
+    // the filtering is done by the controller (see more white_list.h)
+    if (load_white_list_to_controller() == ESP_OK)
+        adv_params.filter_policy = BLE_HCI_ADV_FILT_CONN;
+
+    return start_adv(&pdu, &adv_params, NULL, duration_ms, false);
+}
 
-    // add the fractional part by shifting the LSB and dividing by powers of 2
-    for (int i = 0; i < 8; i++)
-        ret_val += ((temp_lsb >> (7-i)) & 1) / (float)(2 << i);
 
-    // adjust for the sign based on the MSB (negative if the MSB's sign bit is 1)
-    return ret_val * ((temp_msb>>7) & 1 ? -1.0 : 1.0);
+// leaves registration or deletion mode once the gateway was paired (and
+// the success indication was shown) or the pairing timed out
+void on_pairing_end(bool is_paired)
+{
+    ESP_LOGI(s_tag_temp, "Leaving %s mode (%s).", g_device_mode == REGISTRATION_MODE ? "registration" : "deletion",
+             is_paired ? "paired" : "timed out");
+
+    led_turn_off();
+    g_device_mode = UNSPECIFIED_MODE;
+    enter_deep_sleep();
 }
 
 
-// read temperature chr (TODO not sure if needed)
-static int read_temp(uint16_t con_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+// no action on button press under 1 s
+void on_short_button_press()
 {
-    const char* str = "Hello from the server";
-    os_mbuf_append(ctxt->om, str, strlen(str));
-    return 0;
+
 }
 
 
 // makes string with mac addr for printing
 void get_mac_str(uint8_t* addr, char(*mac_str)[MAC_STR_SIZE])
 {
-    for (int i = 0; i < 6; i++)
-        sprintf(*mac_str+(i*3), "%02X:", addr[5-i]);
-
-    (*mac_str)[MAC_STR_SIZE - 1] = '\0';
+    snprintf(*mac_str, MAC_STR_SIZE, "%02X:%02X:%02X:%02X:%02X:%02X",
+             addr[5], addr[4], addr[3], addr[2], addr[1], addr[0]);
 }
@@ -0,0 +1,53 @@
+/*
+ * max30205.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_MAX30205_H_
+#define MAIN_MAX30205_H_
+
+
+#include <stdint.h>
+#include "system.h"
+
+#define MAX30205_I2C_ADDR 0x90
+#define MAX30205_I2C_DEV_ADDR (MAX30205_I2C_ADDR >> 1) // 7-bit addr for i2c_master driver
+#define MAX30205_TEMP_REG_PTR 0x00
+#define MAX30205_CNFG_REG_PTR 0x01
+
+#define MAX30205_CNFG_SHUTDOWN  0b00000001  // shutdown, conversions are stopped
+#define MAX30205_CNFG_ONE_SHOT  0b10000000  // start one conversion (in shutdown mode)
+#define MAX30205_CONV_TIME_US   (50 * 1000) // max time of one conversion (in us)
+
+
+// ESP32-C3 has no FPU, so temperature is kept in fixed point: raw value
+// has 8 fractional bits, the sign is in the msb (bit 7) of the first byte.
+// Q8.8 is the exact value, centi-degrees is the value for displaying.
+// float (if needed) is made from Q8.8 only at the edges.
+// The conversion has no driver dependencies (it is also built on the
+// host), the i2c driver of the sensor is in max30205_driver.h.
+
+int16_t convert_temp_data_to_q8_8(uint8_t temp_msb, uint8_t temp_lsb);
+int16_t convert_temp_data_to_centi(uint8_t temp_msb, uint8_t temp_lsb);
+
+
+// converts raw temperature data (from two bytes) to Q8.8 (1/256 C)
+int16_t convert_temp_data_to_q8_8(uint8_t temp_msb, uint8_t temp_lsb)
+{
+    int16_t magnitude = ((temp_msb & 0b01111111) << 8) | temp_lsb;
+    return (temp_msb >> 7) & 1 ? -magnitude : magnitude;
+}
+
+
+// converts raw temperature data (from two bytes) to centi-degrees (1/100 C),
+// rounded to the nearest (half away from zero)
+int16_t convert_temp_data_to_centi(uint8_t temp_msb, uint8_t temp_lsb)
+{
+    int32_t q8_8 = convert_temp_data_to_q8_8(temp_msb, temp_lsb);
+    return (q8_8 * 100 + (q8_8 < 0 ? -128 : 128)) / 256;
+}
+
+
+#endif /* MAIN_MAX30205_H_ */
@@ -0,0 +1,63 @@
+/*
+ * max30205_driver.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_MAX30205_DRIVER_H_
+#define MAIN_MAX30205_DRIVER_H_
+
+
+#include <stdint.h>
+#include "i2c_driver.h"
+#include "sensor.h"
+#include "max30205.h"
+
+// The sensor is sampled by the acquisition pipeline through the driver
+// below (see sensor.h): a one-shot conversion is started in shutdown
+// mode, so the sensor draws no current between the samples.
+
+i2c_device_t g_max30205;    // temperature sensor on i2c bus (see more i2c_driver.h)
+
+esp_err_t max30205_init();
+esp_err_t max30205_start_conv();
+esp_err_t max30205_read(uint16_t* dest_value);
+
+// driver of the sensor for the acquisition pipeline (see acquisition.h)
+const sensor_driver_t max30205_sensor = {
+    .name = "MAX30205",
+    .id = SENSOR_ID_BODY_TEMP,
+    .conv_time_us = MAX30205_CONV_TIME_US,
+    .init = max30205_init,
+    .start_conv = max30205_start_conv,
+    .read = max30205_read
+};
+
+
+// adds the sensor to the i2c bus (fast mode)
+esp_err_t max30205_init()
+{
+    return esp_i2c_add_device(&g_max30205, MAX30205_I2C_DEV_ADDR, I2C_FAST_MODE_HZ);
+}
+
+
+// starts one-shot conversion, the sensor shuts down after it
+esp_err_t max30205_start_conv()
+{
+    return esp_i2c_set_cnfg_reg(&g_max30205, MAX30205_CNFG_REG_PTR, MAX30205_CNFG_ONE_SHOT | MAX30205_CNFG_SHUTDOWN);
+}
+
+
+// reads the temperature register (raw value, msb << 8 | lsb)
+esp_err_t max30205_read(uint16_t* dest_value)
+{
+    uint8_t data_buff[2];
+    esp_err_t read_err = esp_i2c_read(&g_max30205, MAX30205_TEMP_REG_PTR, data_buff, sizeof(data_buff));
+    if (read_err == ESP_OK)
+        *dest_value = (data_buff[0] << 8) | data_buff[1];
+    return read_err;
+}
+
+
+#endif /* MAIN_MAX30205_DRIVER_H_ */
@@ -0,0 +1,363 @@
+/*
+ * packet_auth.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_PACKET_AUTH_H_
+#define MAIN_PACKET_AUTH_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "nvs.h"
+#include "mbedtls/aes.h"
+#include "host/ble_hs.h"
+#include "system.h"
+#include "app_packet.h"
+#include "white_list.h"
+
+// Data packets are advertised, so anyone can forge them. Instead of the
+// crc, the data packet carries the 4-byte MAC (AES-CMAC truncated to 32
+// bits, RFC 4493) of the packet with the key of the node:
+//   MAC = CMAC(key, [counter 4B][version .. payload])[0..3]
+// where counter = epoch << 16 | seq (seq of the packet, see app_packet.h).
+// Counter grows with every packet, so the gateway rejects replays. Epoch
+// is kept in NVS, it grows on every power-on (seq starts from 0 again) and
+// when seq wraps, so the gateway that knows the last counter finds the
+// current one by trying the same epoch (seq grew) and the next few ones.
+//
+// The key is random, it is generated once and kept in NVS. Registered
+// gateways read it (with the current epoch) from the key characteristic
+// during the registration connection, it can be read over an encrypted
+// link only (Just Works pairing) and by registered gateways only. The
+// key, CMAC subkeys and epoch are copied into RTC memory after power-on,
+// so data wakes don't read NVS. AES runs on the AES peripheral (mbedtls
+// hardware AES), the MAC of a legacy batch takes two block encryptions.
+//
+// All gateways share the key (the packet is broadcast, it carries one
+// MAC), so the key is replaced and the epoch goes on whenever a gateway
+// is deleted: the deleted one keeps the old key, packets it forges with
+// it fail the MAC. The other gateways fail the MAC of the first packet
+// with the new key, they connect to the data adv and read the key again.
+//
+// Telemetry is authenticated when it's sent in the extended pdu. Its
+// payload doesn't fit the legacy pdu together with the MAC, so there it
+// is sent with the crc: it carries diagnostics only (see telemetry.h),
+// the gateway takes neither samples nor the replay counter from it.
+
+#define AUTH_KEY_SIZE       16
+#define AUTH_BLOCK_SIZE     16
+#define AUTH_COUNTER_SIZE   4
+#define AUTH_MAX_MSG_SIZE   (AUTH_COUNTER_SIZE + UINT8_MAX)
+#define AUTH_KEY_VALUE_SIZE (AUTH_KEY_SIZE + 2)     // key and epoch
+
+#define AUTH_NVS_NAMESPACE  "packet_auth"
+#define AUTH_NVS_KEY_KEY    "key"       // blob with the key
+#define AUTH_NVS_KEY_EPOCH  "epoch"     // last used epoch
+
+// 128-bit UUIDs of the service and its characteristic
+#define AUTH_SVC_UUID       BLE_UUID128_INIT(0x6e, 0x65, 0x6d, 0x69, 0x76, 0x2d, 0x61, 0x75, \
+                                             0x74, 0x68, 0x2d, 0x73, 0x00, 0x00, 0x41, 0x4b)
+#define AUTH_KEY_CHR_UUID   BLE_UUID128_INIT(0x6e, 0x65, 0x6d, 0x69, 0x76, 0x2d, 0x61, 0x75, \
+                                             0x74, 0x68, 0x2d, 0x73, 0x01, 0x00, 0x41, 0x4b)
+
+
+const char* g_tag_auth = "AUTH";    // tag used in logs
+
+mbedtls_aes_context auth_aes;       // aes context with the key (lost in deep sleep)
+bool auth_aes_is_set = false;       // flag that the key is set into the context
+void (*auth_on_key_read_cb)(uint16_t conn_handle) = NULL;   // called after the gateway read the key
+
+esp_err_t init_packet_auth();
+esp_err_t rotate_packet_auth_key();
+bool packet_auth_is_enabled();
+uint8_t seal_auth_packet(uint8_t* packet, uint16_t header, uint16_t seq, uint8_t payload_len);
+esp_err_t compute_packet_mac(uint8_t* dest_mac, uint32_t counter, const uint8_t* packet, uint8_t len);
+int packet_auth_register(void (*on_key_read_cb)(uint16_t conn_handle));
+static int packet_auth_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg);
+
+
+// auth state, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR uint8_t auth_key[AUTH_KEY_SIZE];
+RTC_DATA_ATTR uint8_t auth_subkey1[AUTH_BLOCK_SIZE];    // CMAC subkey for complete last block
+RTC_DATA_ATTR uint8_t auth_subkey2[AUTH_BLOCK_SIZE];    // CMAC subkey for padded last block
+RTC_DATA_ATTR uint16_t auth_epoch = 0;          // high half of the counter
+RTC_DATA_ATTR uint16_t auth_last_seq = 0;       // seq of the last authenticated packet
+RTC_DATA_ATTR bool auth_has_last_seq = false;   // flag that last seq is set (cleared on power loss)
+RTC_DATA_ATTR bool auth_is_loaded = false;      // flag that the key is loaded (cleared on power loss)
+
+static const ble_uuid128_t auth_svc_uuid = AUTH_SVC_UUID;
+static const ble_uuid128_t auth_key_chr_uuid = AUTH_KEY_CHR_UUID;
+
+// service definition, it is used by the host after registration, so it is static
+static const struct ble_gatt_svc_def auth_svcs[] = {
+    {
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = &auth_svc_uuid.u,
+        .characteristics = (struct ble_gatt_chr_def[]) {
+            {
+                .uuid = &auth_key_chr_uuid.u,
+                .access_cb = packet_auth_access,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC,
+            },
+            {0}
+        },
+    },
+    {0}
+};
+
+
+static esp_err_t auth_encrypt_block(const uint8_t* input, uint8_t* output)
+{
+    if (!auth_aes_is_set)
+    {
+        mbedtls_aes_init(&auth_aes);
+        if (mbedtls_aes_setkey_enc(&auth_aes, auth_key, AUTH_KEY_SIZE * 8) != 0)
+            return ESP_FAIL;
+        auth_aes_is_set = true;
+    }
+    return mbedtls_aes_crypt_ecb(&auth_aes, MBEDTLS_AES_ENCRYPT, input, output) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+
+// doubles the block in GF(2^128) (subkey generation of CMAC)
+static void auth_double_block(const uint8_t* input, uint8_t* output)
+{
+    uint8_t carry = input[0] >> 7;
+    for (uint8_t i = 0; i < AUTH_BLOCK_SIZE - 1; i++)
+        output[i] = (input[i] << 1) | (input[i + 1] >> 7);
+    output[AUTH_BLOCK_SIZE - 1] = (input[AUTH_BLOCK_SIZE - 1] << 1) ^ (0x87 & -carry);
+}
+
+
+static esp_err_t auth_derive_subkeys()
+{
+    uint8_t zero[AUTH_BLOCK_SIZE] = {0};
+    uint8_t l[AUTH_BLOCK_SIZE];
+    if (auth_encrypt_block(zero, l) != ESP_OK)
+        return ESP_FAIL;
+
+    auth_double_block(l, auth_subkey1);
+    auth_double_block(auth_subkey1, auth_subkey2);
+    return ESP_OK;
+}
+
+
+static esp_err_t store_auth_epoch()
+{
+    nvs_handle_t nvs_hndl;
+    esp_err_t err = nvs_open(AUTH_NVS_NAMESPACE, NVS_READWRITE, &nvs_hndl);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u16(nvs_hndl, AUTH_NVS_KEY_EPOCH, auth_epoch);
+        if (err == ESP_OK)
+            err = nvs_commit(nvs_hndl);
+        nvs_close(nvs_hndl);
+    }
+
+    if (err != ESP_OK)
+        ESP_LOGE(g_tag_auth, "Storing epoch failed! Error: %s", esp_err_to_name(err));
+    return err;
+}
+
+
+// after power-on loads the key from NVS (generates it the first time) and
+// starts the next epoch, so NVS must be inited before
+esp_err_t init_packet_auth()
+{
+    if (auth_is_loaded)
+        return ESP_OK;
+
+    nvs_handle_t nvs_hndl;
+    esp_err_t err = nvs_open(AUTH_NVS_NAMESPACE, NVS_READWRITE, &nvs_hndl);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_auth, "NVS open failed! Error: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t key_len = sizeof(auth_key);
+    err = nvs_get_blob(nvs_hndl, AUTH_NVS_KEY_KEY, auth_key, &key_len);
+    if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && key_len != AUTH_KEY_SIZE))
+    {
+        esp_fill_random(auth_key, sizeof(auth_key));
+        err = nvs_set_blob(nvs_hndl, AUTH_NVS_KEY_KEY, auth_key, sizeof(auth_key));
+        if (err == ESP_OK)
+            err = nvs_commit(nvs_hndl);
+        ESP_LOGI(g_tag_auth, "New key is generated.");
+    }
+
+    uint16_t epoch = 0;
+    nvs_get_u16(nvs_hndl, AUTH_NVS_KEY_EPOCH, &epoch);
+    nvs_close(nvs_hndl);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_auth, "Reading key failed! Error: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // seq starts from 0 after power-on, so the epoch must be new
+    auth_epoch = epoch + 1;
+    auth_has_last_seq = false;
+    auth_aes_is_set = false;
+    if (store_auth_epoch() != ESP_OK || auth_derive_subkeys() != ESP_OK)
+        return ESP_FAIL;
+
+    auth_is_loaded = true;
+    ESP_LOGI(g_tag_auth, "Key is loaded: epoch = %u", auth_epoch);
+    return ESP_OK;
+}
+
+
+// replaces the key with a new random one (a gateway is deleted) and
+// starts the next epoch, the gateways that are left read it again
+esp_err_t rotate_packet_auth_key()
+{
+    if (!auth_is_loaded)
+        return ESP_FAIL;
+
+    nvs_handle_t nvs_hndl;
+    esp_err_t err = nvs_open(AUTH_NVS_NAMESPACE, NVS_READWRITE, &nvs_hndl);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_auth, "NVS open failed! Error: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    esp_fill_random(auth_key, sizeof(auth_key));
+    err = nvs_set_blob(nvs_hndl, AUTH_NVS_KEY_KEY, auth_key, sizeof(auth_key));
+    if (err == ESP_OK)
+        err = nvs_commit(nvs_hndl);
+    nvs_close(nvs_hndl);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_auth, "Storing key failed! Error: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    auth_epoch++;
+    if (auth_aes_is_set)
+        mbedtls_aes_free(&auth_aes);
+    auth_aes_is_set = false;
+    if (store_auth_epoch() != ESP_OK || auth_derive_subkeys() != ESP_OK)
+        return ESP_FAIL;
+
+    ESP_LOGI(g_tag_auth, "Key is replaced: epoch = %u", auth_epoch);
+    return ESP_OK;
+}
+
+
+// checks if packets can be authenticated
+bool packet_auth_is_enabled()
+{
+    return auth_is_loaded;
+}
+
+
+// writes version (with PACKET_F_AUTH), type and seq before the payload
+// that is already at packet + PACKET_HEADER_SIZE and the MAC after it,
+// returns the packet length (0 on error)
+uint8_t seal_auth_packet(uint8_t* packet, uint16_t header, uint16_t seq, uint8_t payload_len)
+{
+    // seq wrapped, so the counter goes on with the next epoch
+    if (auth_has_last_seq && seq <= auth_last_seq)
+    {
+        auth_epoch++;
+        store_auth_epoch();
+    }
+    auth_last_seq = seq;
+    auth_has_last_seq = true;
+
+    put_packet_header(packet, header, seq, PACKET_F_AUTH);
+    uint8_t len = PACKET_HEADER_SIZE + payload_len;
+    uint32_t counter = ((uint32_t)auth_epoch << 16) | seq;
+    if (compute_packet_mac(packet + len, counter, packet, len) != ESP_OK)
+        return 0;
+    return len + PACKET_MAC_SIZE;
+}
+
+
+// computes the MAC of the packet (len bytes before the MAC) with the counter
+esp_err_t compute_packet_mac(uint8_t* dest_mac, uint32_t counter, const uint8_t* packet, uint8_t len)
+{
+    uint8_t msg[AUTH_MAX_MSG_SIZE];
+    msg[0] = counter >> 24;
+    msg[1] = counter >> 16;
+    msg[2] = counter >> 8;
+    msg[3] = counter;
+    memcpy(msg + AUTH_COUNTER_SIZE, packet, len);
+    uint16_t msg_len = AUTH_COUNTER_SIZE + len;
+
+    // all blocks but the last one are chained as they are, the last one is
+    // mixed with the subkey (padded with 10..0 if it's not complete)
+    uint16_t last_pos = (msg_len - 1) / AUTH_BLOCK_SIZE * AUTH_BLOCK_SIZE;
+    uint8_t last_len = msg_len - last_pos;
+    uint8_t block[AUTH_BLOCK_SIZE] = {0};
+    for (uint16_t pos = 0; pos < last_pos; pos += AUTH_BLOCK_SIZE)
+    {
+        for (uint8_t i = 0; i < AUTH_BLOCK_SIZE; i++)
+            block[i] ^= msg[pos + i];
+        if (auth_encrypt_block(block, block) != ESP_OK)
+            return ESP_FAIL;
+    }
+
+    const uint8_t* subkey = last_len == AUTH_BLOCK_SIZE ? auth_subkey1 : auth_subkey2;
+    for (uint8_t i = 0; i < AUTH_BLOCK_SIZE; i++)
+    {
+        uint8_t byte = i < last_len ? msg[last_pos + i] : (i == last_len ? 0x80 : 0);
+        block[i] ^= byte ^ subkey[i];
+    }
+    if (auth_encrypt_block(block, block) != ESP_OK)
+        return ESP_FAIL;
+
+    memcpy(dest_mac, block, PACKET_MAC_SIZE);
+    return ESP_OK;
+}
+
+
+// registers the service, must be called before the host is synced.
+// on_key_read_cb is called after a gateway read the key
+int packet_auth_register(void (*on_key_read_cb)(uint16_t conn_handle))
+{
+    auth_on_key_read_cb = on_key_read_cb;
+
+    int rc = ble_gatts_count_cfg(auth_svcs);
+    if (rc != 0)
+        return rc;
+    return ble_gatts_add_svcs(auth_svcs);
+}
+
+
+static int packet_auth_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg)
+{
+    if (ctxt->op != BLE_GATT_ACCESS_OP_READ_CHR)
+        return BLE_ATT_ERR_UNLIKELY;
+
+    // the link is encrypted by the host (READ_ENC), the key is given to
+    // registered gateways only
+    struct ble_gap_conn_desc conn_desc;
+    if (ble_gap_conn_find(conn_handle, &conn_desc) != 0 || !white_list_contains_addr(&conn_desc.peer_id_addr))
+        return BLE_ATT_ERR_INSUFFICIENT_AUTHOR;
+    if (!auth_is_loaded)
+        return BLE_ATT_ERR_UNLIKELY;
+
+    uint8_t value[AUTH_KEY_VALUE_SIZE];
+    memcpy(value, auth_key, AUTH_KEY_SIZE);
+    value[AUTH_KEY_SIZE] = auth_epoch >> 8;
+    value[AUTH_KEY_SIZE + 1] = auth_epoch & 0xFF;
+    if (os_mbuf_append(ctxt->om, value, sizeof(value)) != 0)
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+
+    ESP_LOGI(g_tag_auth, "Key is read by the gateway.");
+    if (auth_on_key_read_cb != NULL)
+        auth_on_key_read_cb(conn_handle);
+    return 0;
+}
+
+
+#endif /* MAIN_PACKET_AUTH_H_ */
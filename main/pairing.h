@@ -0,0 +1,279 @@
+/*
+ * pairing.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_PAIRING_H_
+#define MAIN_PAIRING_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nimble/nimble_port.h"
+#include "system.h"
+
+// A sensor left in registration or deletion mode by accident used to
+// advertise until the battery was empty. The pairing scheduler advertises
+// in bursts: after every burst without a connection the radio is off for a
+// pause, which doubles up to the max (backoff), so a gateway that is
+// already in its own pairing mode connects within the first burst, and a
+// forgotten sensor mostly sleeps (see power_mgmt.h). Pairing gives up when
+// the timeout expires or the advertising time of the session reaches the
+// radio budget, whichever comes first. After a successful pairing the
+// indication is shown for a while and the mode is left as well, so the
+// device returns to the data cycle (or to sleep) by itself.
+//
+// Pauses run on a NimBLE callout, so the scheduler works in the host task
+// together with the GAP events that drive it (burst end, connect,
+// disconnect), and the end callback may stop the host or enter deep sleep.
+// pairing_start and pairing_stop must be called in the host task as well
+// (the button presses are posted to it).
+//
+// Latency (from the start of pairing to the connection) is kept in RTC
+// memory for every session and logged as min/mean/max with the number of
+// paired and timed out sessions.
+
+// defaults are used if the project is not configured (e.g. on the host)
+#ifndef CONFIG_TEMP_PAIRING_TIMEOUT_MS
+#define CONFIG_TEMP_PAIRING_TIMEOUT_MS      120000
+#define CONFIG_TEMP_PAIRING_RADIO_BUDGET_MS 30000
+#endif
+
+#define PAIRING_TIMEOUT_MS      CONFIG_TEMP_PAIRING_TIMEOUT_MS
+#define PAIRING_RADIO_BUDGET_MS CONFIG_TEMP_PAIRING_RADIO_BUDGET_MS
+#define PAIRING_BURST_MS        3000    // advertising time of a burst
+#define PAIRING_MIN_BURST_MS    500     // shorter bursts are not started
+#define PAIRING_MIN_PAUSE_MS    1000    // pause after the first burst
+#define PAIRING_MAX_PAUSE_MS    8000    // max pause (backoff limit)
+#define PAIRING_DONE_HOLD_MS    5000    // time to show the success indication
+
+
+// state of the pairing session
+typedef enum {
+    PAIRING_IDLE = 0,   // no session
+    PAIRING_BURST,      // advertising
+    PAIRING_PAUSE,      // radio is off until the next burst
+    PAIRING_CONNECTED,  // gateway is connected
+    PAIRING_DONE        // paired, waiting to leave the mode
+
+} pairing_state_t;
+
+
+// pairing statistics, kept across sleep cycles
+typedef struct {
+    uint16_t paired_cnt;        // number of successful sessions
+    uint16_t timeout_cnt;       // number of sessions that gave up
+    uint32_t min_latency_ms;    // min time from start to connection
+    uint32_t max_latency_ms;    // max time from start to connection
+    uint32_t sum_latency_ms;    // sum of latencies (for the mean)
+    uint32_t radio_on_ms;       // advertising time of all sessions
+
+} pairing_stats_t;
+
+const char* g_tag_pair = "PAIR";    // tag used in logs
+
+RTC_DATA_ATTR pairing_stats_t pairing_stats = {};   // statistics of all sessions
+
+pairing_state_t pairing_state = PAIRING_IDLE;   // state of the current session
+int64_t pairing_start_us = 0;       // time point when the session started
+int64_t pairing_burst_start_us = 0; // time point when the current burst started
+uint32_t pairing_radio_on_ms = 0;   // advertising time of the current session
+uint32_t pairing_pause_ms = 0;      // pause after the next burst
+uint16_t pairing_burst_cnt = 0;     // number of bursts of the current session
+int (*pairing_start_burst_cb)(int32_t duration_ms) = NULL; // starts advertising for the burst
+void (*pairing_on_end_cb)(bool is_paired) = NULL;          // leaves the pairing mode
+struct ble_npl_callout pairing_callout;     // ends the pause or the success indication
+
+void pairing_init();
+esp_err_t pairing_start(int (*start_burst_cb)(int32_t duration_ms), void (*on_end_cb)(bool is_paired));
+void pairing_stop();
+bool pairing_is_active();
+void pairing_on_adv_complete();
+void pairing_on_connect();
+void pairing_on_disconnect();
+void pairing_log_stats();
+static void pairing_start_burst();
+static void pairing_end_burst();
+static void pairing_give_up();
+static void pairing_on_callout(struct ble_npl_event* ev);
+
+
+// inits the callout, must be called after nimble_port_init
+void pairing_init()
+{
+    ble_npl_callout_init(&pairing_callout, nimble_port_get_dflt_eventq(), pairing_on_callout, NULL);
+}
+
+
+// starts the pairing session with the first burst, start_burst_cb starts
+// advertising for the given duration (returns 0 on success), on_end_cb is
+// called once the mode must be left (paired or gave up)
+esp_err_t pairing_start(int (*start_burst_cb)(int32_t duration_ms), void (*on_end_cb)(bool is_paired))
+{
+    if (pairing_state != PAIRING_IDLE || start_burst_cb == NULL || on_end_cb == NULL)
+        return ESP_FAIL;
+
+    pairing_start_burst_cb = start_burst_cb;
+    pairing_on_end_cb = on_end_cb;
+    pairing_start_us = esp_timer_get_time();
+    pairing_radio_on_ms = 0;
+    pairing_pause_ms = PAIRING_MIN_PAUSE_MS;
+    pairing_burst_cnt = 0;
+    pairing_start_burst();
+    return ESP_OK;
+}
+
+
+// stops the session without calling the end callback (e.g. the user left
+// the mode), advertising must be stopped by the caller
+void pairing_stop()
+{
+    ble_npl_callout_stop(&pairing_callout);
+    if (pairing_state == PAIRING_BURST)
+        pairing_radio_on_ms += (esp_timer_get_time() - pairing_burst_start_us) / 1000;
+    // the time of a paired session is already counted on connect
+    if (pairing_state == PAIRING_BURST || pairing_state == PAIRING_PAUSE)
+        pairing_stats.radio_on_ms += pairing_radio_on_ms;
+    pairing_state = PAIRING_IDLE;
+}
+
+
+// checks if the pairing session is running
+bool pairing_is_active()
+{
+    return pairing_state != PAIRING_IDLE;
+}
+
+
+// the burst ended without a connection (advertising duration expired)
+void pairing_on_adv_complete()
+{
+    if (pairing_state != PAIRING_BURST)
+        return;
+    pairing_end_burst();
+}
+
+
+// the gateway connected to the pairing advertising, latency is recorded
+void pairing_on_connect()
+{
+    if (pairing_state != PAIRING_BURST)
+        return;
+
+    int64_t now = esp_timer_get_time();
+    pairing_radio_on_ms += (now - pairing_burst_start_us) / 1000;
+    uint32_t latency_ms = (now - pairing_start_us) / 1000;
+    pairing_state = PAIRING_CONNECTED;
+
+    if (pairing_stats.paired_cnt == 0 || latency_ms < pairing_stats.min_latency_ms)
+        pairing_stats.min_latency_ms = latency_ms;
+    if (latency_ms > pairing_stats.max_latency_ms)
+        pairing_stats.max_latency_ms = latency_ms;
+    pairing_stats.sum_latency_ms += latency_ms;
+    pairing_stats.paired_cnt++;
+    pairing_stats.radio_on_ms += pairing_radio_on_ms;
+
+    ESP_LOGI(g_tag_pair, "Paired in %lu ms (%u bursts, radio on %lu ms).",
+             (unsigned long)latency_ms, pairing_burst_cnt, (unsigned long)pairing_radio_on_ms);
+    pairing_log_stats();
+}
+
+
+// the pairing connection is closed, the mode is left after the indication
+void pairing_on_disconnect()
+{
+    if (pairing_state != PAIRING_CONNECTED)
+        return;
+
+    pairing_state = PAIRING_DONE;
+    ble_npl_callout_reset(&pairing_callout, ble_npl_time_ms_to_ticks32(PAIRING_DONE_HOLD_MS));
+}
+
+
+// prints the statistics of all sessions
+void pairing_log_stats()
+{
+    uint32_t mean_latency_ms = pairing_stats.paired_cnt ? pairing_stats.sum_latency_ms / pairing_stats.paired_cnt : 0;
+    ESP_LOGI(g_tag_pair, "Pairing stats: paired = %u, timed out = %u, latency min/mean/max = %lu/%lu/%lu ms, radio on = %lu ms",
+             pairing_stats.paired_cnt, pairing_stats.timeout_cnt,
+             (unsigned long)pairing_stats.min_latency_ms, (unsigned long)mean_latency_ms,
+             (unsigned long)pairing_stats.max_latency_ms, (unsigned long)pairing_stats.radio_on_ms);
+}
+
+
+// starts advertising for the next burst, it is shortened to the remaining
+// timeout and radio budget, pairing gives up if too little is left
+static void pairing_start_burst()
+{
+    uint32_t elapsed_ms = (esp_timer_get_time() - pairing_start_us) / 1000;
+    uint32_t left_ms = elapsed_ms < PAIRING_TIMEOUT_MS ? PAIRING_TIMEOUT_MS - elapsed_ms : 0;
+    uint32_t budget_left_ms = pairing_radio_on_ms < PAIRING_RADIO_BUDGET_MS ? PAIRING_RADIO_BUDGET_MS - pairing_radio_on_ms : 0;
+
+    uint32_t burst_ms = PAIRING_BURST_MS;
+    if (burst_ms > left_ms)
+        burst_ms = left_ms;
+    if (burst_ms > budget_left_ms)
+        burst_ms = budget_left_ms;
+    if (burst_ms < PAIRING_MIN_BURST_MS)
+    {
+        pairing_give_up();
+        return;
+    }
+
+    pairing_state = PAIRING_BURST;
+    pairing_burst_start_us = esp_timer_get_time();
+    pairing_burst_cnt++;
+    if (pairing_start_burst_cb(burst_ms) != 0)
+    {
+        ESP_LOGE(g_tag_pair, "Burst %u failed to start!", pairing_burst_cnt);
+        pairing_end_burst();    // the burst is retried after the pause
+    }
+}
+
+
+// accounts the advertising time of the burst and pauses before the next one
+static void pairing_end_burst()
+{
+    pairing_radio_on_ms += (esp_timer_get_time() - pairing_burst_start_us) / 1000;
+    pairing_state = PAIRING_PAUSE;
+    ble_npl_callout_reset(&pairing_callout, ble_npl_time_ms_to_ticks32(pairing_pause_ms));
+
+    pairing_pause_ms *= 2;
+    if (pairing_pause_ms > PAIRING_MAX_PAUSE_MS)
+        pairing_pause_ms = PAIRING_MAX_PAUSE_MS;
+}
+
+
+// ends the session without a connection
+static void pairing_give_up()
+{
+    pairing_state = PAIRING_IDLE;
+    pairing_stats.timeout_cnt++;
+    pairing_stats.radio_on_ms += pairing_radio_on_ms;
+
+    ESP_LOGI(g_tag_pair, "Pairing gave up after %u bursts (radio on %lu ms).",
+             pairing_burst_cnt, (unsigned long)pairing_radio_on_ms);
+    pairing_log_stats();
+    pairing_on_end_cb(false);
+}
+
+
+// the pause is over - starts the next burst, or the success indication
+// is over - leaves the mode
+static void pairing_on_callout(struct ble_npl_event* ev)
+{
+    if (pairing_state == PAIRING_PAUSE)
+        pairing_start_burst();
+    else if (pairing_state == PAIRING_DONE)
+    {
+        pairing_state = PAIRING_IDLE;
+        pairing_on_end_cb(true);
+    }
+}
+
+
+#endif /* MAIN_PAIRING_H_ */
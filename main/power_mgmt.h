@@ -0,0 +1,207 @@
+/*
+ * power_mgmt.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_POWER_MGMT_H_
+#define MAIN_POWER_MGMT_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+
+#include "sdkconfig.h"
+
+// Registration and deletion modes advertise until a gateway connects and
+// the data cycle advertises for up to a second. With power management,
+// the CPU clock drops to the min frequency while all tasks are idle, and
+// light sleep is allowed between the advertising events (tickless idle,
+// the BLE controller wakes the chip in time for the next event). Code that
+// must not be slowed down or interrupted by sleep holds a lock:
+// - the i2c lock (no light sleep) is held for the bus transactions, but
+//   not while the sensor converts, so light sleep is allowed then too;
+// - the connection lock (max CPU frequency) is held while a gateway is
+//   connected, so GATT handlers (time sync, backlog sync, key read) answer
+//   within the connection event.
+// The button wakes the chip from light sleep by gpio level (see button.h).
+// Locks are counted, every acquire must be matched by a release. If power
+// management is disabled, the functions do nothing.
+//
+// The current saved by this has not been measured on the board, the time
+// spent in every mode is counted instead and printed before deep sleep
+// (see pm_log_stats), the totals since power-on are kept in RTC memory:
+// - max frequency: while the connection lock is held (locks that IDF
+//   drivers take on their own are not counted);
+// - light sleep: reported by the light sleep exit callback, it needs
+//   CONFIG_PM_LIGHT_SLEEP_CALLBACKS, without it light sleep is counted as
+//   min frequency;
+// - min frequency: the rest of the wake.
+// With CONFIG_TEMP_POWER_MANAGEMENT disabled the whole wake is counted at
+// max frequency, that is the baseline to compare the figures with. With
+// CONFIG_PM_PROFILING, the lock stats of IDF are printed too.
+
+#ifndef CONFIG_TEMP_PM_MIN_FREQ_MHZ
+#define CONFIG_TEMP_PM_MIN_FREQ_MHZ 40
+#endif
+
+#define PM_MAX_FREQ_MHZ     CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define PM_MIN_FREQ_MHZ     CONFIG_TEMP_PM_MIN_FREQ_MHZ
+
+
+const char* g_tag_pm = "PM";  // tag used in logs
+
+esp_pm_lock_handle_t g_pm_i2c_lock = NULL;      // no light sleep during i2c transactions
+esp_pm_lock_handle_t g_pm_conn_lock = NULL;     // max CPU frequency while connected
+bool pm_conn_lock_is_held = false;              // flag to keep the connection lock balanced
+
+int64_t pm_wake_start_time = 0;         // time when the accounting of this wake started
+int64_t pm_conn_lock_time = 0;          // time when the connection lock was acquired
+int64_t pm_wake_max_freq_us = 0;        // time at max frequency in this wake
+volatile int64_t pm_wake_light_sleep_us = 0;    // time in light sleep in this wake
+
+// totals since power-on, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR int64_t pm_max_freq_us = 0;       // time at max frequency
+RTC_DATA_ATTR int64_t pm_min_freq_us = 0;       // time at min frequency
+RTC_DATA_ATTR int64_t pm_light_sleep_us = 0;    // time in light sleep
+
+esp_err_t init_power_mgmt();
+void pm_lock_acquire(esp_pm_lock_handle_t lock);
+void pm_lock_release(esp_pm_lock_handle_t lock);
+void pm_on_connect();
+void pm_on_disconnect();
+void pm_log_stats();
+
+
+#if CONFIG_TEMP_POWER_MANAGEMENT && CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+// counts the time of light sleep, called by IDF after every light sleep
+static esp_err_t IRAM_ATTR pm_on_light_sleep_exit(int64_t sleep_time_us, void* arg)
+{
+    pm_wake_light_sleep_us += sleep_time_us;
+    return ESP_OK;
+}
+#endif
+
+
+// configures dynamic frequency scaling and automatic light sleep and
+// creates the locks, must be called before the drivers that use the locks
+// (at the start of the wake, the time of the wake is counted from it)
+esp_err_t init_power_mgmt()
+{
+    pm_wake_start_time = esp_timer_get_time();
+
+#if CONFIG_TEMP_POWER_MANAGEMENT
+    if (g_pm_i2c_lock != NULL)
+        return ESP_OK;
+
+    esp_pm_config_t pm_cnfg = {
+        .max_freq_mhz = PM_MAX_FREQ_MHZ,
+        .min_freq_mhz = PM_MIN_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+    esp_err_t pm_err = esp_pm_configure(&pm_cnfg);
+    if (pm_err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_pm, "Configuration failed! Error: %s", esp_err_to_name(pm_err));
+        return pm_err;
+    }
+
+    if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "i2c", &g_pm_i2c_lock) != ESP_OK ||
+        esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "conn", &g_pm_conn_lock) != ESP_OK)
+    {
+        ESP_LOGE(g_tag_pm, "Lock creation failed!");
+        return ESP_FAIL;
+    }
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+    esp_pm_sleep_cbs_register_config_t cbs_cnfg = {
+        .exit_cb = pm_on_light_sleep_exit
+    };
+    if (esp_pm_light_sleep_register_cbs(&cbs_cnfg) != ESP_OK)
+        ESP_LOGE(g_tag_pm, "Light sleep callback registration failed!");
+#endif
+#endif
+    return ESP_OK;
+}
+
+
+// acquires the lock
+void pm_lock_acquire(esp_pm_lock_handle_t lock)
+{
+#if CONFIG_TEMP_POWER_MANAGEMENT
+    if (lock != NULL)
+        esp_pm_lock_acquire(lock);
+#endif
+}
+
+
+// releases the lock
+void pm_lock_release(esp_pm_lock_handle_t lock)
+{
+#if CONFIG_TEMP_POWER_MANAGEMENT
+    if (lock != NULL)
+        esp_pm_lock_release(lock);
+#endif
+}
+
+
+// holds the max CPU frequency for the connection
+void pm_on_connect()
+{
+    if (pm_conn_lock_is_held)
+        return;
+    pm_lock_acquire(g_pm_conn_lock);
+    pm_conn_lock_is_held = true;
+    pm_conn_lock_time = esp_timer_get_time();
+}
+
+
+// returns to the min CPU frequency after the connection
+void pm_on_disconnect()
+{
+    if (!pm_conn_lock_is_held)
+        return;
+    pm_lock_release(g_pm_conn_lock);
+    pm_conn_lock_is_held = false;
+    pm_wake_max_freq_us += esp_timer_get_time() - pm_conn_lock_time;
+}
+
+
+// prints the time spent in every power mode of this wake and adds it to
+// the totals, must be called once right before deep sleep. the lock stats
+// are printed too (if profiling is enabled)
+void pm_log_stats()
+{
+    int64_t now = esp_timer_get_time();
+    int64_t awake_us = now - pm_wake_start_time;
+    int64_t max_freq_us = pm_wake_max_freq_us;
+    if (pm_conn_lock_is_held)
+        max_freq_us += now - pm_conn_lock_time;
+    int64_t light_sleep_us = pm_wake_light_sleep_us;
+#if !CONFIG_TEMP_POWER_MANAGEMENT
+    max_freq_us = awake_us;     // baseline, the CPU runs at max frequency all the time
+#endif
+    int64_t min_freq_us = awake_us - max_freq_us - light_sleep_us;
+    if (min_freq_us < 0)
+        min_freq_us = 0;
+
+    pm_max_freq_us += max_freq_us;
+    pm_min_freq_us += min_freq_us;
+    pm_light_sleep_us += light_sleep_us;
+    ESP_LOGI(g_tag_pm, "Awake %lld us: max freq %lld us, min freq %lld us, light sleep %lld us.",
+             awake_us, max_freq_us, min_freq_us, light_sleep_us);
+    ESP_LOGI(g_tag_pm, "Since power-on: max freq %lld us, min freq %lld us, light sleep %lld us.",
+             pm_max_freq_us, pm_min_freq_us, pm_light_sleep_us);
+
+#if CONFIG_TEMP_POWER_MANAGEMENT && CONFIG_PM_PROFILING
+    esp_pm_dump_locks(stdout);
+#endif
+}
+
+
+#endif /* MAIN_POWER_MGMT_H_ */
@@ -0,0 +1,205 @@
+/*
+ * sample_buffer.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SAMPLE_BUFFER_H_
+#define MAIN_SAMPLE_BUFFER_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "system.h"
+#include "app_packet.h"
+#include "sensor.h"
+
+// Sending one 2-byte sample per wake keeps the radio on every cycle for
+// almost no payload. Instead, samples are collected into a ring buffer
+// kept in RTC memory (it survives deep sleep the same way the white list
+// does) and the whole batch is advertised once every SAMPLES_PER_BATCH
+// wakes or as soon as the buffer is full. If the buffer overflows (e.g.
+// batch was not sent), the oldest sample is overwritten. Each sample keeps
+// its measurement time, so it can be sent with a timestamp (see app_packet.h).
+// Samples of all sensors of the node (see sensor.h) share the buffer, each
+// sample keeps the id of its sensor.
+// Functions used by the wake stub (see wake_stub.h) are placed into RTC memory.
+// The stub times its samples with an estimated clock, the app moves them
+// onto the RTC time when it takes over (see rescale_newest_sample_times).
+
+#if CONFIG_EXAMPLE_EXTENDED_ADV
+#define SAMPLE_BUFFER_SIZE  BATCH_MAX_SAMPLES   // max number of samples in the buffer
+#else
+#define SAMPLE_BUFFER_SIZE  16  // max number of samples in the buffer
+#endif
+#define SAMPLES_PER_BATCH       12  // number of samples collected before sending (legacy adv)
+#define SAMPLES_PER_EXT_BATCH   48  // number of samples collected before sending (extended adv)
+
+
+esp_err_t push_to_sample_buffer(uint8_t sensor, uint16_t value, uint32_t time_s);
+esp_err_t get_sample_buffer_data(packet_sample_t* dest_samples, uint8_t dest_samples_size, uint8_t* dest_cnt);
+esp_err_t remove_from_sample_buffer(uint8_t cnt);
+esp_err_t rescale_newest_sample_times(uint8_t cnt, int64_t base_ms, int64_t est_span_ms, int64_t real_span_ms);
+esp_err_t clear_sample_buffer();
+uint8_t get_sample_buffer_len();
+uint16_t get_newest_temp_value();
+esp_err_t get_last_sample(packet_sample_t* dest_sample);
+bool sample_buffer_is_full();
+bool sample_buffer_is_empty();
+bool sample_batch_is_ready(uint8_t batch_size);
+
+
+// ring buffer, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR packet_sample_t sample_buffer[SAMPLE_BUFFER_SIZE];
+RTC_DATA_ATTR uint8_t sample_buffer_head = 0;   // index of the oldest sample
+RTC_DATA_ATTR uint8_t sample_buffer_len = 0;    // number of samples in the buffer
+RTC_DATA_ATTR packet_sample_t last_sample;      // the newest body temperature sample (kept after it was sent)
+RTC_DATA_ATTR bool last_sample_is_set = false;  // flag to indicate whether last sample is set
+
+
+// adds a sample to the buffer, overwriting the oldest one if the buffer is full
+esp_err_t RTC_IRAM_ATTR push_to_sample_buffer(uint8_t sensor, uint16_t value, uint32_t time_s)
+{
+    uint8_t tail = (sample_buffer_head + sample_buffer_len) % SAMPLE_BUFFER_SIZE;
+    sample_buffer[tail].value = value;
+    sample_buffer[tail].sensor = sensor;
+    sample_buffer[tail].time_s = time_s;
+    if (sensor == SENSOR_ID_BODY_TEMP)
+    {
+        last_sample.value = value;
+        last_sample.sensor = sensor;
+        last_sample.time_s = time_s;
+        last_sample_is_set = true;
+    }
+
+    if (sample_buffer_len < SAMPLE_BUFFER_SIZE)
+        sample_buffer_len++;
+    else    // the buffer is full, so the oldest sample was overwritten
+        sample_buffer_head = (sample_buffer_head + 1) % SAMPLE_BUFFER_SIZE;
+
+    return ESP_OK;
+}
+
+
+// copies all samples (from the oldest to the newest) into the destination array
+esp_err_t get_sample_buffer_data(packet_sample_t* dest_samples, uint8_t dest_samples_size, uint8_t* dest_cnt)
+{
+    if (dest_samples == NULL || dest_cnt == NULL)
+        return ESP_FAIL;
+
+    if (dest_samples_size < sample_buffer_len)  // check if all samples fit
+        return ESP_FAIL;
+
+    for (uint8_t i = 0; i < sample_buffer_len; i++)
+        dest_samples[i] = sample_buffer[(sample_buffer_head + i) % SAMPLE_BUFFER_SIZE];
+
+    *dest_cnt = sample_buffer_len;
+    return ESP_OK;
+}
+
+
+// removes cnt oldest samples from the buffer (after they were sent)
+esp_err_t remove_from_sample_buffer(uint8_t cnt)
+{
+    if (cnt > sample_buffer_len)
+        return ESP_FAIL;
+
+    sample_buffer_head = (sample_buffer_head + cnt) % SAMPLE_BUFFER_SIZE;
+    sample_buffer_len -= cnt;
+    return ESP_OK;
+}
+
+
+// moves the time from the clock that counted est_span_ms since base_ms
+// onto the one that counted real_span_ms over the same period
+static uint32_t rescale_sample_time(uint32_t time_s, int64_t base_ms, int64_t est_span_ms, int64_t real_span_ms)
+{
+    int64_t since_base_ms = (int64_t)time_s * 1000 - base_ms;
+    return (uint32_t)((base_ms + since_base_ms * real_span_ms / est_span_ms) / 1000);
+}
+
+
+// rescales the times of cnt newest samples (and of the last sample, if it
+// was taken after base_ms), see rescale_sample_time
+esp_err_t rescale_newest_sample_times(uint8_t cnt, int64_t base_ms, int64_t est_span_ms, int64_t real_span_ms)
+{
+    if (est_span_ms <= 0 || real_span_ms <= 0)
+        return ESP_FAIL;
+
+    if (cnt > sample_buffer_len)    // the oldest ones may be overwritten
+        cnt = sample_buffer_len;
+
+    for (uint8_t i = 0; i < cnt; i++)
+    {
+        packet_sample_t* sample = &sample_buffer[(sample_buffer_head + sample_buffer_len - 1 - i) % SAMPLE_BUFFER_SIZE];
+        sample->time_s = rescale_sample_time(sample->time_s, base_ms, est_span_ms, real_span_ms);
+    }
+
+    if (last_sample_is_set && (int64_t)last_sample.time_s * 1000 >= base_ms)
+        last_sample.time_s = rescale_sample_time(last_sample.time_s, base_ms, est_span_ms, real_span_ms);
+    return ESP_OK;
+}
+
+
+// removes all samples from the buffer
+esp_err_t clear_sample_buffer()
+{
+    sample_buffer_head = 0;
+    sample_buffer_len = 0;
+    return ESP_OK;
+}
+
+
+// returns the number of samples in the buffer
+uint8_t get_sample_buffer_len()
+{
+    return sample_buffer_len;
+}
+
+
+// returns the raw value of the newest body temperature sample or 0 if
+// there is no sample yet
+uint16_t get_newest_temp_value()
+{
+    if (!last_sample_is_set)
+        return 0;
+    return last_sample.value;
+}
+
+
+// copies the last taken body temperature sample, it is kept after it was
+// sent (e.g. to serve reads without taking a new sample)
+esp_err_t get_last_sample(packet_sample_t* dest_sample)
+{
+    if (dest_sample == NULL || !last_sample_is_set)
+        return ESP_FAIL;
+
+    *dest_sample = last_sample;
+    return ESP_OK;
+}
+
+
+// checks if the buffer is full
+bool RTC_IRAM_ATTR sample_buffer_is_full()
+{
+    return sample_buffer_len == SAMPLE_BUFFER_SIZE;
+}
+
+
+// checks if the buffer is empty
+bool sample_buffer_is_empty()
+{
+    return sample_buffer_len == 0;
+}
+
+
+// checks if enough samples were collected to send the batch
+bool RTC_IRAM_ATTR sample_batch_is_ready(uint8_t batch_size)
+{
+    return sample_buffer_len >= batch_size || sample_buffer_is_full();
+}
+
+
+#endif /* MAIN_SAMPLE_BUFFER_H_ */
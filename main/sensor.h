@@ -0,0 +1,41 @@
+/*
+ * sensor.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SENSOR_H_
+#define MAIN_SENSOR_H_
+
+
+#include <stdint.h>
+#include "system.h"
+
+// Nodes of the BWSN share the platform and differ in sensors, so every
+// sensor is accessed through the same driver interface and is sampled by
+// the acquisition pipeline (see acquisition.h). A conversion is split into
+// start and read, so conversions of all sensors run at the same time and
+// the bus is used only to start them and to read the results.
+//
+// Sensor id is sent with every sample of the node that has more than one
+// sensor (see app_packet.h), the raw value is sensor specific.
+
+#define SENSOR_ID_BODY_TEMP     0   // body temperature (MAX30205, see max30205_driver.h)
+#define SENSOR_ID_PULSE_OX      1   // pulse oximeter (heart rate and SpO2)
+#define SENSOR_ID_IMU           2   // inertial measurement unit (movement and posture)
+
+
+// structure that describes sensor driver
+typedef struct {
+    const char* name;               // name for logs
+    uint8_t id;                     // sensor id in samples and packets
+    uint32_t conv_time_us;          // max time from the start of a conversion to its result
+    esp_err_t (*init)(void);        // adds the sensor to the bus (the bus is already created)
+    esp_err_t (*start_conv)(void);  // starts one conversion
+    esp_err_t (*read)(uint16_t* dest_value);    // reads the result of the conversion
+
+} sensor_driver_t;
+
+
+#endif /* MAIN_SENSOR_H_ */
@@ -0,0 +1,143 @@
+/*
+ * sleep_scheduler.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_SLEEP_SCHEDULER_H_
+#define MAIN_SLEEP_SCHEDULER_H_
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "system.h"
+
+// Body temperature changes slowly most of the time, so waking up every few
+// seconds mostly collects the same value. The scheduler adapts the deep
+// sleep interval to the rate of change of the temperature: while the rate
+// is low, the interval grows by half on every wake (up to the max), as soon
+// as the rate rises, it drops back to the min. The batch is sent at least
+// once per heartbeat interval, even if the buffer is not full.
+//
+// The interval can also be fixed (e.g. by a Measurement Interval write of
+// the Health Thermometer service), then it doesn't adapt.
+//
+// The scheduler is used by the wake stub too, so its state and functions
+// are placed into RTC memory. Only 32-bit arithmetic is used, because
+// 64-bit division is in flash (libgcc).
+
+// defaults are used if the project is not configured (e.g. on the host)
+#ifndef CONFIG_TEMP_SLEEP_MIN_INTERVAL_MS
+#define CONFIG_TEMP_SLEEP_MIN_INTERVAL_MS   5000
+#define CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS   300000
+#define CONFIG_TEMP_HEARTBEAT_INTERVAL_MS   600000
+#endif
+
+#define SCHED_MIN_INTERVAL_MS       CONFIG_TEMP_SLEEP_MIN_INTERVAL_MS
+#define SCHED_MAX_INTERVAL_MS       CONFIG_TEMP_SLEEP_MAX_INTERVAL_MS
+#define SCHED_HEARTBEAT_INTERVAL_MS CONFIG_TEMP_HEARTBEAT_INTERVAL_MS
+
+#define SCHED_STABLE_RATE   16      // rate to lengthen the interval (raw per min, ~0.06 C/min)
+#define SCHED_FAST_RATE     64      // rate to reset the interval to min (raw per min, 0.25 C/min)
+#define SCHED_MAX_DELTA     1000    // delta is clamped to avoid overflow (raw)
+
+
+// scheduler state, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR uint32_t sched_interval_ms = SCHED_MIN_INTERVAL_MS;   // current sleep interval
+RTC_DATA_ATTR uint32_t sched_since_send_ms = 0;     // time since the last sent batch
+RTC_DATA_ATTR uint16_t sched_prev_value = 0;        // previous raw value
+RTC_DATA_ATTR bool sched_has_prev_value = false;    // flag to indicate whether prev value is set
+RTC_DATA_ATTR uint32_t sched_fixed_interval_ms = 0; // fixed sleep interval, 0 - adaptive
+
+uint32_t sched_update(uint16_t value);
+uint32_t sched_get_interval_ms();
+bool sched_heartbeat_is_due();
+void sched_on_send();
+void sched_reset();
+void sched_set_fixed_interval_ms(uint32_t interval_ms);
+uint32_t sched_get_fixed_interval_ms();
+
+
+// updates the interval with a new sample taken after sleeping for the
+// current interval and returns the interval for the next sleep (in ms)
+uint32_t RTC_IRAM_ATTR sched_update(uint16_t value)
+{
+    uint32_t elapsed_ms = sched_interval_ms;
+    sched_since_send_ms += elapsed_ms;
+
+    if (sched_has_prev_value)
+    {
+        int32_t delta = (int32_t)(int16_t)value - (int16_t)sched_prev_value;
+        uint32_t abs_delta = delta < 0 ? -delta : delta;
+        if (abs_delta > SCHED_MAX_DELTA)
+            abs_delta = SCHED_MAX_DELTA;
+
+        uint32_t rate = abs_delta * 60000 / elapsed_ms; // raw per min
+
+        if (rate >= SCHED_FAST_RATE)        // temperature changes fast
+            sched_interval_ms = SCHED_MIN_INTERVAL_MS;
+        else if (rate <= SCHED_STABLE_RATE) // temperature is stable
+            sched_interval_ms += sched_interval_ms / 2;
+
+        if (sched_interval_ms > SCHED_MAX_INTERVAL_MS)
+            sched_interval_ms = SCHED_MAX_INTERVAL_MS;
+    }
+
+    if (sched_fixed_interval_ms)
+        sched_interval_ms = sched_fixed_interval_ms;
+
+    sched_prev_value = value;
+    sched_has_prev_value = true;
+    return sched_interval_ms;
+}
+
+
+// returns the interval for the next sleep (in ms)
+uint32_t RTC_IRAM_ATTR sched_get_interval_ms()
+{
+    return sched_interval_ms;
+}
+
+
+// checks if the batch must be sent to keep the heartbeat
+bool RTC_IRAM_ATTR sched_heartbeat_is_due()
+{
+    return sched_since_send_ms >= SCHED_HEARTBEAT_INTERVAL_MS;
+}
+
+
+// restarts the heartbeat interval after the batch was sent
+void sched_on_send()
+{
+    sched_since_send_ms = 0;
+}
+
+
+// returns to the min interval (e.g. after registration)
+void sched_reset()
+{
+    sched_interval_ms = sched_fixed_interval_ms ? sched_fixed_interval_ms : SCHED_MIN_INTERVAL_MS;
+    sched_since_send_ms = 0;
+    sched_has_prev_value = false;
+}
+
+
+// fixes the sleep interval (in ms), 0 returns to the adaptive interval
+void sched_set_fixed_interval_ms(uint32_t interval_ms)
+{
+    sched_fixed_interval_ms = interval_ms;
+    sched_interval_ms = interval_ms ? interval_ms : SCHED_MIN_INTERVAL_MS;
+}
+
+
+// returns the fixed sleep interval (in ms) or 0 if it's adaptive
+uint32_t sched_get_fixed_interval_ms()
+{
+    return sched_fixed_interval_ms;
+}
+
+
+#endif /* MAIN_SLEEP_SCHEDULER_H_ */
@@ -10,26 +10,40 @@
 
 
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
-
-#define L_ENDIAN    0x01
-#define B_ENDIAN    0x00
-
-uint8_t check_endianness()
+#include <sys/time.h>
+
+// platform independent modules (packets, sample buffer, scheduler) use only
+// these ESP-IDF definitions, so they can also be compiled on the host
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "sdkconfig.h"
+#else
+#define RTC_DATA_ATTR
+#define RTC_IRAM_ATTR
+typedef int esp_err_t;
+#define ESP_OK      0
+#define ESP_FAIL    -1
+#endif
+
+
+// returns current time in s, RTC keeps counting it during deep sleep
+uint32_t get_time_s()
 {
-    unsigned int one = 1;
-    char* first_byte = (char*)&one;
-
-    return *first_byte;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t)now.tv_sec;
 }
 
-void reverse_bytes(uint8_t* data, size_t size) {
-    for (size_t i = 0; i < size / 2; i++)
-    {
-        uint8_t temp = data[i];
-        data[i] = data[size - 1 - i];
-        data[size - 1 - i] = temp;
-    }
+
+// returns current time in us, RTC keeps counting it during deep sleep
+uint64_t get_time_us()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
 }
 
 
@@ -0,0 +1,127 @@
+/*
+ * telemetry.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_TELEMETRY_H_
+#define MAIN_TELEMETRY_H_
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "system.h"
+#include "app_packet.h"
+
+// Per-wake performance counters are accumulated in RTC memory: number of
+// wakes (the wake stub counts its own), number of full boots and errors,
+// sum and max duration of every phase of the data cycle. Once per
+// TELEMETRY_PERIOD sent batches the summary is advertised as a telemetry
+// packet (see app_packet.h) and the counters are reset, so the gateway
+// can spot slow or misbehaving nodes.
+
+#define TELEMETRY_PERIOD    24  // number of sent batches between summaries
+
+
+// struct that describes accumulated telemetry
+typedef struct
+{
+    uint32_t wake_cnt;                          // all wakes
+    uint32_t boot_cnt;                          // wakes with full boot
+    uint32_t error_cnt;                         // errors
+    uint32_t batch_cnt;                         // sent batches
+    uint32_t phase_sum[TELEMETRY_PHASE_CNT];    // sum of phase durations (in TELEMETRY_TIME_UNIT_US)
+    uint32_t phase_max[TELEMETRY_PHASE_CNT];    // max of phase durations (in TELEMETRY_TIME_UNIT_US)
+    uint32_t phase_cnt[TELEMETRY_PHASE_CNT];    // number of wakes that reached the phase
+} telemetry_t;
+
+
+void telemetry_on_stub_wake();
+void telemetry_on_boot();
+void telemetry_on_error();
+void telemetry_record_phase(uint8_t phase, int64_t duration_us);
+void telemetry_on_batch_sent();
+bool telemetry_is_due();
+void telemetry_get_summary(telemetry_summary_t* summary);
+void telemetry_reset();
+
+
+// telemetry, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR telemetry_t telemetry = {};
+
+
+// counts the wake handled by the wake stub (without boot)
+void RTC_IRAM_ATTR telemetry_on_stub_wake()
+{
+    telemetry.wake_cnt++;
+}
+
+
+// counts the wake with full boot
+void telemetry_on_boot()
+{
+    telemetry.wake_cnt++;
+    telemetry.boot_cnt++;
+}
+
+
+void telemetry_on_error()
+{
+    telemetry.error_cnt++;
+}
+
+
+// adds the duration of the phase of this wake
+void telemetry_record_phase(uint8_t phase, int64_t duration_us)
+{
+    if (phase >= TELEMETRY_PHASE_CNT || duration_us < 0)
+        return;
+
+    uint32_t duration = duration_us / TELEMETRY_TIME_UNIT_US;
+    telemetry.phase_sum[phase] += duration;
+    telemetry.phase_cnt[phase]++;
+    if (duration > telemetry.phase_max[phase])
+        telemetry.phase_max[phase] = duration;
+}
+
+
+void telemetry_on_batch_sent()
+{
+    telemetry.batch_cnt++;
+}
+
+
+// checks if it's time to send the summary
+bool telemetry_is_due()
+{
+    return telemetry.batch_cnt >= TELEMETRY_PERIOD;
+}
+
+
+// fills the summary, counters are saturated to the packet field size
+void telemetry_get_summary(telemetry_summary_t* summary)
+{
+    summary->wake_cnt = telemetry.wake_cnt > UINT16_MAX ? UINT16_MAX : telemetry.wake_cnt;
+    summary->boot_cnt = telemetry.boot_cnt > UINT8_MAX ? UINT8_MAX : telemetry.boot_cnt;
+    summary->error_cnt = telemetry.error_cnt > UINT8_MAX ? UINT8_MAX : telemetry.error_cnt;
+
+    for (uint8_t i = 0; i < TELEMETRY_PHASE_CNT; i++)
+    {
+        uint32_t avg = telemetry.phase_cnt[i] ? telemetry.phase_sum[i] / telemetry.phase_cnt[i] : 0;
+        summary->phase_avg[i] = avg > UINT16_MAX ? UINT16_MAX : avg;
+        summary->phase_max[i] = telemetry.phase_max[i] > UINT16_MAX ? UINT16_MAX : telemetry.phase_max[i];
+    }
+}
+
+
+// resets all counters (after the summary was sent)
+void telemetry_reset()
+{
+    memset(&telemetry, 0, sizeof(telemetry));
+}
+
+
+#endif /* MAIN_TELEMETRY_H_ */
@@ -0,0 +1,239 @@
+/*
+ * time_sync.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_TIME_SYNC_H_
+#define MAIN_TIME_SYNC_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "host/ble_hs.h"
+#include "system.h"
+
+// Gateways scan in windows: a window of TIME_SYNC_WINDOW_LEN_MS starts at
+// every multiple of TIME_SYNC_WINDOW_PERIOD_MS of the gateway time, so the
+// scanner can be off the rest of the time. The sensor reads the gateway
+// time (Current Time characteristic) on every connection of registered
+// gateway (registration and backlog transfer) and sends batches so that
+// advertising starts right after the window starts.
+//
+// The local time is kept by the RTC slow clock during deep sleep, which
+// drifts. The drift is measured on every resync as the difference between
+// local and gateway time elapsed since the previous sync and is used to
+// convert local time into the gateway time and back. The system time
+// itself is not changed, so timestamps of buffered samples stay valid.
+
+// defaults are used if the project is not configured (e.g. on the host)
+#ifndef CONFIG_TEMP_SYNC_WINDOW_PERIOD_MS
+#define CONFIG_TEMP_SYNC_WINDOW_PERIOD_MS   30000
+#define CONFIG_TEMP_SYNC_WINDOW_LEN_MS      1000
+#endif
+
+#define TIME_SYNC_WINDOW_PERIOD_US  ((int64_t)CONFIG_TEMP_SYNC_WINDOW_PERIOD_MS * 1000)
+#define TIME_SYNC_WINDOW_LEN_US     ((int64_t)CONFIG_TEMP_SYNC_WINDOW_LEN_MS * 1000)
+#define TIME_SYNC_GUARD_US          (20 * 1000)         // margin for the sync error
+#define TIME_SYNC_ADV_DURATION_MS   200                 // adv burst inside the window
+#define TIME_SYNC_MIN_DRIFT_PERIOD_US (10 * 60 * 1000000LL) // min time between syncs to measure drift
+#define TIME_SYNC_MAX_DRIFT_PPM     50000               // RC slow clock is within 5%
+#define TIME_SYNC_CTS_UUID          0x2A2B              // Current Time characteristic
+#define TIME_SYNC_CTS_LEN           10
+#define TIME_SYNC_DATE_TIME_LEN     7                   // Date Time (year, month, day, h, min, s)
+
+
+const char* g_tag_sync_time = "TIME";   // tag used in logs
+
+esp_err_t time_sync_read(uint16_t conn_handle, void (*on_done_cb)(uint16_t conn_handle));
+void time_sync_apply(int64_t gateway_us, int64_t local_us);
+bool time_sync_is_valid();
+int64_t time_sync_to_gateway_us(int64_t local_us);
+int64_t time_sync_until_window_us(int64_t local_us, int64_t wake_latency_us);
+int64_t convert_cts_to_us(const uint8_t* cts);
+void convert_us_to_date_time(int64_t time_us, uint8_t* dest);
+
+
+// sync state, stored in RTC memory to persist across sleep cycles
+RTC_DATA_ATTR bool time_sync_valid = false;     // flag that the reference is set
+RTC_DATA_ATTR int64_t time_sync_ref_local_us = 0;   // local time of the last sync
+RTC_DATA_ATTR int64_t time_sync_ref_gateway_us = 0; // gateway time of the last sync
+RTC_DATA_ATTR int32_t time_sync_drift_ppm = 0;  // local clock error (+ means local is fast)
+
+void (*time_sync_on_done_cb)(uint16_t conn_handle) = NULL;  // called after the read is finished
+
+
+// callback of the Current Time read
+static int time_sync_on_read(uint16_t conn_handle, const struct ble_gatt_error* error,
+                             struct ble_gatt_attr* attr, void* arg)
+{
+    if (error->status == 0 && attr != NULL)
+    {
+        uint8_t cts[TIME_SYNC_CTS_LEN];
+        uint16_t cts_len = 0;
+        if (ble_hs_mbuf_to_flat(attr->om, cts, sizeof(cts), &cts_len) == 0 && cts_len == TIME_SYNC_CTS_LEN)
+            time_sync_apply(convert_cts_to_us(cts), get_time_us());
+        else
+            ESP_LOGE(g_tag_sync_time, "Current time is not valid (len = %u).", cts_len);
+    }
+    else if (error->status != BLE_HS_EDONE)
+        ESP_LOGE(g_tag_sync_time, "Reading current time failed! Status: %d", error->status);
+
+    // read by uuid reports every attr and then the end of the procedure
+    if (time_sync_on_done_cb != NULL && error->status != 0)
+        time_sync_on_done_cb(conn_handle);
+    return 0;
+}
+
+
+// reads the gateway time (Current Time characteristic), on_done_cb (if
+// not NULL) is called after the read is finished (even if it failed)
+esp_err_t time_sync_read(uint16_t conn_handle, void (*on_done_cb)(uint16_t conn_handle))
+{
+    time_sync_on_done_cb = on_done_cb;
+    int rc = ble_gattc_read_by_uuid(conn_handle, 1, 0xFFFF, BLE_UUID16_DECLARE(TIME_SYNC_CTS_UUID),
+                                    time_sync_on_read, NULL);
+    if (rc != 0)
+    {
+        ESP_LOGE(g_tag_sync_time, "Reading current time can't be started! rc = %d", rc);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+
+// sets the new reference and measures the drift since the previous one
+void time_sync_apply(int64_t gateway_us, int64_t local_us)
+{
+    if (time_sync_valid)
+    {
+        int64_t predicted_us = time_sync_to_gateway_us(local_us);
+        int64_t gateway_elapsed_us = gateway_us - time_sync_ref_gateway_us;
+        int64_t local_elapsed_us = local_us - time_sync_ref_local_us;
+        ESP_LOGI(g_tag_sync_time, "Resync error = %lld us", gateway_us - predicted_us);
+
+        // short intervals give more noise than drift
+        if (gateway_elapsed_us >= TIME_SYNC_MIN_DRIFT_PERIOD_US)
+        {
+            int64_t drift_ppm = (local_elapsed_us - gateway_elapsed_us) * 1000000 / gateway_elapsed_us;
+            if (drift_ppm > TIME_SYNC_MAX_DRIFT_PPM)
+                drift_ppm = TIME_SYNC_MAX_DRIFT_PPM;
+            if (drift_ppm < -TIME_SYNC_MAX_DRIFT_PPM)
+                drift_ppm = -TIME_SYNC_MAX_DRIFT_PPM;
+
+            // drift depends on temperature, so it is smoothed, not replaced
+            time_sync_drift_ppm = time_sync_drift_ppm == 0 ? drift_ppm : (3 * time_sync_drift_ppm + drift_ppm) / 4;
+            ESP_LOGI(g_tag_sync_time, "Drift = %lld ppm (%ld ppm smoothed)", drift_ppm, time_sync_drift_ppm);
+        }
+        else
+            return;     // keep the older reference to measure drift over longer period
+    }
+
+    time_sync_ref_gateway_us = gateway_us;
+    time_sync_ref_local_us = local_us;
+    time_sync_valid = true;
+}
+
+
+// checks if the gateway time is known
+bool time_sync_is_valid()
+{
+    return time_sync_valid;
+}
+
+
+// converts local time into the gateway time (drift compensated)
+int64_t time_sync_to_gateway_us(int64_t local_us)
+{
+    int64_t local_elapsed_us = local_us - time_sync_ref_local_us;
+    return time_sync_ref_gateway_us + local_elapsed_us * 1000000 / (1000000 + time_sync_drift_ppm);
+}
+
+
+// returns local time to sleep to start advertising at the beginning of the
+// next scan window, 0 if advertising can be started now. wake_latency_us
+// is the time from the wake to the adv start
+int64_t time_sync_until_window_us(int64_t local_us, int64_t wake_latency_us)
+{
+    if (!time_sync_valid)
+        return 0;
+
+    int64_t pos_us = time_sync_to_gateway_us(local_us) % TIME_SYNC_WINDOW_PERIOD_US;
+    if (pos_us < 0)
+        pos_us += TIME_SYNC_WINDOW_PERIOD_US;
+
+    // the adv burst still fits into the current window
+    if (pos_us >= TIME_SYNC_GUARD_US &&
+        pos_us + TIME_SYNC_ADV_DURATION_MS * 1000 + TIME_SYNC_GUARD_US <= TIME_SYNC_WINDOW_LEN_US)
+        return 0;
+
+    int64_t wait_us = TIME_SYNC_GUARD_US - pos_us;
+    if (wait_us < 0)
+        wait_us += TIME_SYNC_WINDOW_PERIOD_US;
+    wait_us -= wake_latency_us;
+    if (wait_us <= 0)
+        return 0;
+
+    // the local clock runs at (1 + drift) of the gateway one
+    return wait_us * (1000000 + time_sync_drift_ppm) / 1000000;
+}
+
+
+// converts Current Time characteristic value (exact time 256 + adjust
+// reason) into us since epoch
+int64_t convert_cts_to_us(const uint8_t* cts)
+{
+    int32_t year = cts[0] | (cts[1] << 8);
+    int32_t month = cts[2];
+    int32_t day = cts[3];
+
+    // days from civil (proleptic gregorian calendar)
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    int32_t year_of_era = year - era * 400;
+    int32_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = (int64_t)era * 146097 + day_of_era - 719468;
+
+    int64_t seconds = days * 86400 + cts[4] * 3600 + cts[5] * 60 + cts[6];
+    return seconds * 1000000 + cts[8] * 1000000 / 256;   // cts[7] is day of week
+}
+
+
+// converts us since epoch into Date Time characteristic value (inverse
+// of convert_cts_to_us)
+void convert_us_to_date_time(int64_t time_us, uint8_t* dest)
+{
+    int64_t seconds = time_us / 1000000;
+    int32_t days = seconds / 86400;
+    int32_t day_seconds = seconds % 86400;
+    if (day_seconds < 0)
+    {
+        days--;
+        day_seconds += 86400;
+    }
+
+    // civil from days (proleptic gregorian calendar)
+    days += 719468;
+    int32_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int32_t day_of_era = days - era * 146097;
+    int32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int32_t mp = (5 * day_of_year + 2) / 153;
+    int32_t day = day_of_year - (153 * mp + 2) / 5 + 1;
+    int32_t month = mp < 10 ? mp + 3 : mp - 9;
+    int32_t year = year_of_era + era * 400 + (month <= 2);
+
+    dest[0] = year;
+    dest[1] = year >> 8;
+    dest[2] = month;
+    dest[3] = day;
+    dest[4] = day_seconds / 3600;
+    dest[5] = day_seconds / 60 % 60;
+    dest[6] = day_seconds % 60;
+}
+
+
+#endif /* MAIN_TIME_SYNC_H_ */
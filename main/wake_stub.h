@@ -0,0 +1,309 @@
+/*
+ * wake_stub.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_WAKE_STUB_H_
+#define MAIN_WAKE_STUB_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_wake_stub.h"
+#include "esp_rom_sys.h"
+#include "soc/rtc.h"
+#include "soc/gpio_reg.h"
+#include "soc/io_mux_reg.h"
+#include "soc/gpio_sig_map.h"
+
+#include "max30205.h"
+#include "sample_buffer.h"
+#include "sleep_scheduler.h"
+#include "telemetry.h"
+
+// Most timer wakes only need to add one sample to the buffer, so the full
+// boot (bootloader, app_main, BLE) is skipped for them. The deep sleep wake
+// stub runs from RTC fast memory right after wakeup, reads the sample over
+// bit-banged I2C and goes back to sleep. The normal boot continues only if
+// the batch is ready to be sent or the temperature is out of range.
+//
+// To avoid waiting for the conversion in the stub, the sample is read from
+// the conversion that was started on the previous wake, and a new one-shot
+// conversion is started before sleeping. Only the first wake after the
+// full boot has to wait for the conversion.
+//
+// The stub reads the MAX30205 only, so it is armed on nodes that have no
+// other sensor (see acquisition.h), other nodes boot on every wake.
+//
+// Flash and the drivers are not available in the stub, so everything it
+// calls is placed into RTC memory (RTC_IRAM_ATTR) or is in ROM. Time is
+// not available either, so it is estimated from the sleep time. The sleep
+// time itself is chosen by the adaptive scheduler (see sleep_scheduler.h).
+// The estimate misses the time of the wakeups (and of the stub itself), so
+// it falls behind the RTC with every stub wake. When the app boots after
+// the stub, it stretches the times of the stub samples over the time the
+// RTC counted since the arm (see wake_stub_rebase_samples).
+
+#define TEMP_ALERT_LOW_RAW  (35 << 8)   // 35 C, lower temperature to boot for (raw)
+#define TEMP_ALERT_HIGH_RAW (38 << 8)   // 38 C, upper temperature to boot for (raw)
+
+#define STUB_I2C_HALF_PERIOD_US 2       // up to 250 kHz (MAX30205 supports fast mode)
+#define STUB_IO_MUX_REG(pin)    (IO_MUX_GPIO0_REG + 4 * (pin))
+
+
+RTC_DATA_ATTR bool stub_is_armed = false;       // flag to let the stub sample (set before sleep)
+RTC_DATA_ATTR bool stub_sample_is_taken = false;// flag that the stub took the sample of this wake
+RTC_DATA_ATTR bool stub_conv_is_started = false;// flag that a conversion was started before sleep
+RTC_DATA_ATTR uint32_t stub_conv_time_s = 0;    // time when the conversion was started
+RTC_DATA_ATTR uint32_t stub_time_s = 0;         // estimated time of the current wake (s part)
+RTC_DATA_ATTR uint32_t stub_time_us = 0;        // estimated time of the current wake (us part)
+RTC_DATA_ATTR bool stub_time_is_current = false;// the stub estimated the time of this wake
+RTC_DATA_ATTR uint8_t stub_sample_cnt = 0;      // samples timed by the stub since the arm
+RTC_DATA_ATTR uint64_t stub_arm_time_us = 0;    // time of the arm (RTC)
+RTC_DATA_ATTR uint8_t stub_batch_size = 0;      // number of samples to boot for sending
+RTC_DATA_ATTR uint8_t stub_gpio_sda = 0;        // gpio number for I2C SDA line
+RTC_DATA_ATTR uint8_t stub_gpio_scl = 0;        // gpio number for I2C SCL line
+
+void wake_stub_arm(uint64_t now_us, uint8_t batch_size, uint8_t gpio_sda, uint8_t gpio_scl);
+void wake_stub_disarm();
+bool wake_stub_take_sample();
+void wake_stub_rebase_samples(uint64_t wake_time_us);
+bool temp_is_out_of_range(uint16_t value);
+
+
+// lets the stub take samples on the following timer wakes, must be called
+// right before deep sleep of the data cycle
+void wake_stub_arm(uint64_t now_us, uint8_t batch_size, uint8_t gpio_sda, uint8_t gpio_scl)
+{
+    stub_time_s = now_us / 1000000;
+    stub_time_us = now_us % 1000000;
+    stub_arm_time_us = now_us;
+    stub_sample_cnt = 0;
+    stub_time_is_current = false;
+    stub_batch_size = batch_size;
+    stub_gpio_sda = gpio_sda;
+    stub_gpio_scl = gpio_scl;
+    stub_conv_is_started = false;   // sensor may be reconfigured by the app
+    stub_sample_is_taken = false;
+    stub_is_armed = true;
+}
+
+
+// stops the stub from taking samples (e.g. there is nobody to send them to)
+void wake_stub_disarm()
+{
+    stub_is_armed = false;
+}
+
+
+// returns true (once) if the stub already took the sample of this wake
+bool wake_stub_take_sample()
+{
+    bool taken = stub_sample_is_taken;
+    stub_sample_is_taken = false;
+    return taken;
+}
+
+
+// moves the times of the samples the stub took since the arm from its
+// estimated clock onto the RTC one, wake_time_us is the RTC time of this
+// wakeup. it's done only if the stub ran on this wake, otherwise the time
+// of its last estimate is unknown and the samples keep their times
+void wake_stub_rebase_samples(uint64_t wake_time_us)
+{
+    if (!stub_time_is_current)
+        return;
+    stub_time_is_current = false;
+
+    uint64_t est_time_us = (uint64_t)stub_time_s * 1000000 + stub_time_us;
+    int64_t base_ms = stub_arm_time_us / 1000;
+    rescale_newest_sample_times(stub_sample_cnt, base_ms, (int64_t)(est_time_us / 1000) - base_ms,
+                                (int64_t)(wake_time_us / 1000) - base_ms);
+    stub_sample_cnt = 0;
+}
+
+
+// checks if the raw temperature value is out of the normal range
+bool RTC_IRAM_ATTR temp_is_out_of_range(uint16_t value)
+{
+    return (int16_t)value < TEMP_ALERT_LOW_RAW || (int16_t)value > TEMP_ALERT_HIGH_RAW;
+}
+
+
+// open-drain line emulation: low - drive output, high - release to pull-up
+static inline void RTC_IRAM_ATTR stub_line_set(uint8_t gpio_num, bool level)
+{
+    if (level)
+        REG_WRITE(GPIO_ENABLE_W1TC_REG, BIT(gpio_num));
+    else
+        REG_WRITE(GPIO_ENABLE_W1TS_REG, BIT(gpio_num));
+    esp_rom_delay_us(STUB_I2C_HALF_PERIOD_US);
+}
+
+
+static inline bool RTC_IRAM_ATTR stub_line_get(uint8_t gpio_num)
+{
+    return (REG_READ(GPIO_IN_REG) >> gpio_num) & 1;
+}
+
+
+// configures the pin as gpio with input and pull-up, output level is
+// always low, so enabling output pulls the line down
+static void RTC_IRAM_ATTR stub_i2c_pin_init(uint8_t gpio_num)
+{
+    PIN_FUNC_SELECT(STUB_IO_MUX_REG(gpio_num), PIN_FUNC_GPIO);
+    PIN_INPUT_ENABLE(STUB_IO_MUX_REG(gpio_num));
+    PIN_PULLUP_EN(STUB_IO_MUX_REG(gpio_num));
+    REG_WRITE(GPIO_FUNC0_OUT_SEL_CFG_REG + 4 * gpio_num, SIG_GPIO_OUT_IDX);
+    REG_WRITE(GPIO_OUT_W1TC_REG, BIT(gpio_num));
+    REG_WRITE(GPIO_ENABLE_W1TC_REG, BIT(gpio_num));
+}
+
+
+static void RTC_IRAM_ATTR stub_i2c_start()
+{
+    stub_line_set(stub_gpio_sda, 1);
+    stub_line_set(stub_gpio_scl, 1);
+    stub_line_set(stub_gpio_sda, 0);
+    stub_line_set(stub_gpio_scl, 0);
+}
+
+
+static void RTC_IRAM_ATTR stub_i2c_stop()
+{
+    stub_line_set(stub_gpio_sda, 0);
+    stub_line_set(stub_gpio_scl, 1);
+    stub_line_set(stub_gpio_sda, 1);
+}
+
+
+// writes a byte and returns true if it was acknowledged
+static bool RTC_IRAM_ATTR stub_i2c_write_byte(uint8_t byte)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        stub_line_set(stub_gpio_sda, (byte >> i) & 1);
+        stub_line_set(stub_gpio_scl, 1);
+        stub_line_set(stub_gpio_scl, 0);
+    }
+
+    stub_line_set(stub_gpio_sda, 1);    // release the line for ack
+    stub_line_set(stub_gpio_scl, 1);
+    bool ack = !stub_line_get(stub_gpio_sda);
+    stub_line_set(stub_gpio_scl, 0);
+    return ack;
+}
+
+
+static uint8_t RTC_IRAM_ATTR stub_i2c_read_byte(bool ack)
+{
+    uint8_t byte = 0;
+    stub_line_set(stub_gpio_sda, 1);    // release the line for slave
+    for (int i = 7; i >= 0; i--)
+    {
+        stub_line_set(stub_gpio_scl, 1);
+        byte |= stub_line_get(stub_gpio_sda) << i;
+        stub_line_set(stub_gpio_scl, 0);
+    }
+
+    stub_line_set(stub_gpio_sda, !ack);
+    stub_line_set(stub_gpio_scl, 1);
+    stub_line_set(stub_gpio_scl, 0);
+    return byte;
+}
+
+
+// writes MAX30205 configuration register (the same as esp_i2c_set_cnfg_reg)
+static bool RTC_IRAM_ATTR stub_max30205_set_cnfg_reg(uint8_t cnfg_reg)
+{
+    stub_i2c_start();
+    bool ok = stub_i2c_write_byte(MAX30205_I2C_ADDR) &&
+              stub_i2c_write_byte(MAX30205_CNFG_REG_PTR) &&
+              stub_i2c_write_byte(cnfg_reg);
+    stub_i2c_stop();
+    return ok;
+}
+
+
+// reads MAX30205 temperature register (the same as esp_i2c_read)
+static bool RTC_IRAM_ATTR stub_max30205_read(uint16_t* value)
+{
+    stub_i2c_start();
+    bool ok = stub_i2c_write_byte(MAX30205_I2C_ADDR) &&
+              stub_i2c_write_byte(MAX30205_TEMP_REG_PTR);
+    if (ok)
+    {
+        stub_i2c_start();   // repeated start
+        ok = stub_i2c_write_byte(MAX30205_I2C_ADDR | 1);
+    }
+    if (ok)
+    {
+        uint8_t temp_msb = stub_i2c_read_byte(true);
+        uint8_t temp_lsb = stub_i2c_read_byte(false);
+        *value = (temp_msb << 8) | temp_lsb;
+    }
+    stub_i2c_stop();
+    return ok;
+}
+
+
+// wake stub, called by ROM right after wakeup from deep sleep
+void RTC_IRAM_ATTR esp_wake_deep_sleep(void)
+{
+    esp_default_wake_deep_sleep();
+
+    // only timer wakes of the armed data cycle are handled here
+    if (!stub_is_armed || !(esp_wake_stub_get_wakeup_cause() & RTC_TIMER_TRIG_EN))
+        return;
+
+    // 64-bit division is in flash (libgcc), so the time is kept in two parts
+    uint32_t slept_ms = sched_get_interval_ms();
+    stub_time_us += (slept_ms % 1000) * 1000;
+    stub_time_s += slept_ms / 1000 + stub_time_us / 1000000;
+    stub_time_us %= 1000000;
+    stub_time_is_current = true;
+
+    stub_i2c_pin_init(stub_gpio_sda);
+    stub_i2c_pin_init(stub_gpio_scl);
+
+    // the first wake after the full boot has no conversion in progress
+    if (!stub_conv_is_started)
+    {
+        stub_max30205_set_cnfg_reg(MAX30205_CNFG_ONE_SHOT | MAX30205_CNFG_SHUTDOWN);
+        stub_conv_time_s = stub_time_s;
+        esp_rom_delay_us(MAX30205_CONV_TIME_US);
+    }
+
+    // read the result of the conversion and start the next one
+    uint16_t value;
+    if (!stub_max30205_read(&value))
+        return;     // let the app deal with the sensor
+    uint32_t value_time_s = stub_conv_time_s;
+
+    stub_conv_is_started = stub_max30205_set_cnfg_reg(MAX30205_CNFG_ONE_SHOT | MAX30205_CNFG_SHUTDOWN);
+    stub_conv_time_s = stub_time_s;
+
+    push_to_sample_buffer(SENSOR_ID_BODY_TEMP, value, value_time_s);
+    if (stub_sample_cnt < UINT8_MAX)
+        stub_sample_cnt++;
+    uint32_t sleep_time_ms = sched_update(value);
+    stub_sample_is_taken = true;
+
+    // boot to send the batch, to keep the heartbeat or
+    // if the temperature is out of range
+    if (sample_batch_is_ready(stub_batch_size) || sched_heartbeat_is_due() || temp_is_out_of_range(value))
+        return;
+
+    stub_sample_is_taken = false;
+    stub_time_is_current = false;   // the next wake may boot without the stub
+    telemetry_on_stub_wake();   // wakes with boot are counted by the app
+    esp_wake_stub_set_wakeup_time((uint64_t)sleep_time_ms * 1000);
+    esp_wake_stub_sleep(&esp_wake_deep_sleep);
+}
+
+
+#endif /* MAIN_WAKE_STUB_H_ */
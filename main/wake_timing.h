@@ -0,0 +1,93 @@
+/*
+ * wake_timing.h
+ *
+ *  2024
+ *  Author: nemiv
+ */
+
+#ifndef MAIN_WAKE_TIMING_H_
+#define MAIN_WAKE_TIMING_H_
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+// Every wake costs energy until the device is back in deep sleep, so the
+// time points of the data cycle are recorded and reported before sleep:
+// boot (app_main entry) -> sensor read -> ble sync -> adv start -> adv complete.
+// esp_timer starts counting at startup, so the boot time point also shows
+// how long it took the bootloader and startup code to reach app_main.
+
+#define WAKE_LATENCY_BUDGET_US  (100 * 1000)    // budget for wake to first adv (in us)
+
+
+// enumeration of the data cycle phases
+typedef enum {
+    WAKE_PHASE_BOOT = 0,
+    WAKE_PHASE_SENSOR_READ = 1,
+    WAKE_PHASE_BLE_SYNC = 2,
+    WAKE_PHASE_ADV_START = 3,
+    WAKE_PHASE_ADV_COMPLETE = 4,
+    WAKE_PHASE_CNT
+
+} wake_phase_t;
+
+const char* g_tag_wake = "WAKE";    // tag used in ESP_CHECK
+
+int64_t wake_phase_time[WAKE_PHASE_CNT] = {};   // time points of phases (in us since startup)
+
+void mark_wake_phase(wake_phase_t phase);
+int64_t get_wake_phase_time(wake_phase_t phase);
+void report_wake_timing();
+
+
+// records the time point of the phase
+void mark_wake_phase(wake_phase_t phase)
+{
+    if (phase < WAKE_PHASE_CNT)
+        wake_phase_time[phase] = esp_timer_get_time();
+}
+
+
+// returns the time point of the phase or 0 if it wasn't reached
+int64_t get_wake_phase_time(wake_phase_t phase)
+{
+    return phase < WAKE_PHASE_CNT ? wake_phase_time[phase] : 0;
+}
+
+
+// prints the duration of every reached phase and checks the latency budget
+void report_wake_timing()
+{
+    ESP_LOGI(g_tag_wake, "boot = %lld us", wake_phase_time[WAKE_PHASE_BOOT]);
+
+    if (wake_phase_time[WAKE_PHASE_SENSOR_READ])
+        ESP_LOGI(g_tag_wake, "boot -> sensor read = %lld us",
+                 wake_phase_time[WAKE_PHASE_SENSOR_READ] - wake_phase_time[WAKE_PHASE_BOOT]);
+
+    if (wake_phase_time[WAKE_PHASE_BLE_SYNC])
+        ESP_LOGI(g_tag_wake, "sensor read -> ble sync = %lld us",
+                 wake_phase_time[WAKE_PHASE_BLE_SYNC] - wake_phase_time[WAKE_PHASE_SENSOR_READ]);
+
+    if (wake_phase_time[WAKE_PHASE_ADV_START])
+    {
+        int64_t adv_latency = wake_phase_time[WAKE_PHASE_ADV_START];    // from startup
+        ESP_LOGI(g_tag_wake, "sensor read -> adv start = %lld us",
+                 wake_phase_time[WAKE_PHASE_ADV_START] - wake_phase_time[WAKE_PHASE_SENSOR_READ]);
+
+        if (adv_latency > WAKE_LATENCY_BUDGET_US)
+            ESP_LOGW(g_tag_wake, "wake -> adv start = %lld us exceeds the budget of %d us",
+                     adv_latency, WAKE_LATENCY_BUDGET_US);
+    }
+
+    if (wake_phase_time[WAKE_PHASE_ADV_COMPLETE])
+        ESP_LOGI(g_tag_wake, "adv start -> adv complete = %lld us",
+                 wake_phase_time[WAKE_PHASE_ADV_COMPLETE] - wake_phase_time[WAKE_PHASE_ADV_START]);
+
+    ESP_LOGI(g_tag_wake, "total awake = %lld us", esp_timer_get_time());
+}
+
+
+#endif /* MAIN_WAKE_TIMING_H_ */
@@ -10,17 +10,39 @@
 
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "nvs.h"
 #include "host/ble_hs.h"
 #include "esp_check_err.h"
 
-
-// struct that describes device in white list
-typedef struct
-{
-    ble_addr_t device_addr; // device mac addr
-    bool addr_is_empty;     // flag indicating whether the addr field is empty or not
-} device_data_t;
+// The white list keeps addrs of all registered gateways. Entries are kept
+// packed and sorted (by addr type, then by addr bytes), so lookups are
+// binary searches and there are no empty slots to skip. The same array is
+// programmed into the controller's filter accept list (see
+// load_white_list_to_controller), so the radio itself ignores scan and
+// connection requests from devices that are not registered, and one
+// undirected advertising reaches all registered gateways.
+//
+// RTC memory is lost on power loss (battery swap, brownout), so the list is
+// also persisted in NVS as one blob of packed addrs. Changes only mark the
+// list as dirty, all changes of a session are written at once before deep
+// sleep, and only if the stored blob differs. The RTC copy is rebuilt from
+// NVS once after power-on, so timer wakes never read NVS. Number of writes
+// is kept in NVS too, to check the flash wear.
+
+// default is used if the project is not configured (e.g. on the host)
+#ifndef CONFIG_TEMP_WHITE_LIST_SIZE
+#define CONFIG_TEMP_WHITE_LIST_SIZE 8
+#endif
+
+#define WHITE_LIST_SIZE CONFIG_TEMP_WHITE_LIST_SIZE // max number of registered gateways
+
+#define WL_NVS_NAMESPACE    "white_list"
+#define WL_NVS_KEY_ADDRS    "addrs"     // blob with packed sorted addrs
+#define WL_NVS_KEY_WRITES   "writes"    // number of writes of the blob
 
 
 esp_err_t init_white_list();
@@ -30,31 +52,40 @@ esp_err_t push_to_white_list(ble_addr_t addr);
 esp_err_t remove_from_white_list_by_addr(const ble_addr_t* addr);
 bool white_list_contains_addr(const ble_addr_t* addr);
 bool white_list_is_empty();
-esp_err_t get_addr_white_list(ble_addr_t **device_addr);
+esp_err_t get_white_list_addr(uint8_t idx, ble_addr_t* addr);
+esp_err_t load_white_list_to_controller();
+esp_err_t load_white_list_from_nvs();
+esp_err_t store_white_list_to_nvs();
+uint32_t get_white_list_write_cnt();
+int compare_addrs(const ble_addr_t* addr1, const ble_addr_t* addr2);
 bool addrs_are_equal(const ble_addr_t* addr1, const ble_addr_t* addr2);
 
 
+const char* g_tag_wl = "WL";        // tag used in logs
 bool wl_is_initialised = false;     // flag to indicate whether white list has been inited
-const uint8_t white_list_size = 1;  // size of the white list
-uint8_t white_list_len = 0;         // number of entries in the white list
-
 
 // white list, stored in RTC memory to persist across sleep cycles
-RTC_DATA_ATTR device_data_t white_list[] = {
-        {.device_addr = {},
-        .addr_is_empty = true
-        }
-};
+RTC_DATA_ATTR ble_addr_t white_list[WHITE_LIST_SIZE];   // sorted addrs
+RTC_DATA_ATTR uint8_t white_list_len = 0;               // number of entries in the white list
+RTC_DATA_ATTR bool white_list_is_loaded = false;        // flag that RTC copy is rebuilt from NVS (cleared on power loss)
+RTC_DATA_ATTR bool white_list_is_dirty = false;         // flag that RTC copy differs from NVS
+RTC_DATA_ATTR uint32_t white_list_write_cnt = 0;        // number of NVS writes (copy of the stored counter)
 
 
-// inits the white list
+// inits the white list, after power-on rebuilds it from NVS (so NVS must
+// be inited before)
 esp_err_t init_white_list()
 {
     if (wl_is_initialised)  // check if already initialised
         return ESP_FAIL;
 
-    white_list_len = get_white_list_len();  // count the non-empty entries (after sleep)
-    wl_is_initialised = true;               // mark as initialised
+    if (white_list_len > WHITE_LIST_SIZE)   // RTC memory is not valid (e.g. size was changed)
+        white_list_len = 0;
+
+    if (!white_list_is_loaded)
+        load_white_list_from_nvs();
+
+    wl_is_initialised = true;   // mark as initialised
     return ESP_OK;
 }
 
@@ -65,42 +96,62 @@ esp_err_t deinit_white_list()
     if (!wl_is_initialised) // check if white list was not initialised
         return ESP_FAIL;
 
-    white_list_len = 0;         // reset the list length
     wl_is_initialised = false;  // mark as not initialised
     return ESP_OK;
 }
 
 
-// calculates the number of non-empty entries in the white list
+// returns the number of entries in the white list
 uint8_t get_white_list_len()
 {
-    uint8_t cnt = 0;
-    for(uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty)
-            cnt++;
+    return white_list_len;
+}
+
 
-    return cnt;
+// finds the index of addr (if found is set) or the index to insert it at
+static uint8_t find_in_white_list(const ble_addr_t* addr, bool* found)
+{
+    uint8_t low = 0;
+    uint8_t high = white_list_len;
+    while (low < high)
+    {
+        uint8_t mid = low + (high - low) / 2;
+        int cmp = compare_addrs(&white_list[mid], addr);
+        if (cmp == 0)
+        {
+            *found = true;
+            return mid;
+        }
+        if (cmp < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    *found = false;
+    return low;
 }
 
-// adds a device to the white list by uuid and addr
+
+// adds a device to the white list by addr, keeping the list sorted
 esp_err_t push_to_white_list(ble_addr_t addr)
 {
     if (!wl_is_initialised) // check if already initialised
         return ESP_FAIL;
 
-    if (white_list_len == white_list_size)   // check if the list is full
-        return ESP_FAIL;
+    bool found;
+    uint8_t idx = find_in_white_list(&addr, &found);
+    if (found)  // already registered
+        return ESP_OK;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (white_list[i].addr_is_empty)
-        {
-            white_list[i].device_addr = addr;       // assign the addr
-            white_list[i].addr_is_empty = false;    // mark as not empty
-            white_list_len++;   // increment the list length
-            return ESP_OK;
-        }
+    if (white_list_len == WHITE_LIST_SIZE)  // check if the list is full
+        return ESP_FAIL;
 
-    return ESP_FAIL;    // no matching entry found
+    memmove(&white_list[idx + 1], &white_list[idx], (white_list_len - idx) * sizeof(ble_addr_t));
+    white_list[idx] = addr;
+    white_list_len++;   // increment the list length
+    white_list_is_dirty = true;
+    return ESP_OK;
 }
 
 
@@ -110,18 +161,15 @@ esp_err_t remove_from_white_list_by_addr(const ble_addr_t* addr)
     if (!wl_is_initialised)     // check if already initialised
         return ESP_FAIL;
 
-    if (white_list_len == 0)    // check if the list is empty
+    bool found;
+    uint8_t idx = find_in_white_list(addr, &found);
+    if (!found)                 // no matching entry found
         return ESP_FAIL;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty && addrs_are_equal(&white_list[i].device_addr, addr))
-        {
-            white_list[i].addr_is_empty = true; // mark as empty entity with corresp. addr
-            white_list_len--;   // decrement the list length
-            return ESP_OK;
-        }
-
-    return ESP_FAIL;
+    memmove(&white_list[idx], &white_list[idx + 1], (white_list_len - idx - 1) * sizeof(ble_addr_t));
+    white_list_len--;   // decrement the list length
+    white_list_is_dirty = true;
+    return ESP_OK;
 }
 
 
@@ -129,16 +177,11 @@ esp_err_t remove_from_white_list_by_addr(const ble_addr_t* addr)
 bool white_list_contains_addr(const ble_addr_t* addr)
 {
     if (!wl_is_initialised)     // check if already initialised
-        return ESP_FAIL;
-
-    if (white_list_len == 0)    // check if the list is empty
         return false;
 
-    for (uint8_t i = 0; i < white_list_size; i++)
-        if (!white_list[i].addr_is_empty && addrs_are_equal(&white_list[i].device_addr, addr))
-            return true;    // addr found
-
-    return false;    // addr not found
+    bool found;
+    find_in_white_list(addr, &found);
+    return found;
 }
 
 
@@ -149,28 +192,144 @@ bool white_list_is_empty()
 }
 
 
-// retrieves all addrs in the white list (not structures)
-esp_err_t get_white_list_addr(ble_addr_t *addr)
+// retrieves the addr of the entry with index idx
+esp_err_t get_white_list_addr(uint8_t idx, ble_addr_t* addr)
 {
     if (!wl_is_initialised)     // check if already initialised
         return ESP_FAIL;
 
-    if (white_list_len == 0)    // check if the list is empty
+    if (idx >= white_list_len)  // check if the entry exists
         return ESP_FAIL;
 
-    *addr = white_list[0].device_addr;
+    *addr = white_list[idx];
+    return ESP_OK;
+}
+
+
+// programs all addrs into the controller's filter accept list, so that
+// advertising with filter policy answers registered gateways only. must
+// be called after ble host is synced and while advertising is stopped
+esp_err_t load_white_list_to_controller()
+{
+    if (!wl_is_initialised || white_list_len == 0)
+        return ESP_FAIL;
 
+    int rc = ble_gap_wl_set(white_list, white_list_len);
+    return rc == 0 ? ESP_OK : ESP_FAIL;
+}
+
+
+// rebuilds the RTC copy of the list from NVS
+esp_err_t load_white_list_from_nvs()
+{
+    nvs_handle_t nvs_hndl;
+    esp_err_t err = nvs_open(WL_NVS_NAMESPACE, NVS_READONLY, &nvs_hndl);
+    if (err == ESP_ERR_NVS_NOT_FOUND)   // nothing was stored yet
+    {
+        white_list_is_loaded = true;
+        return ESP_OK;
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_wl, "NVS open failed! Error: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t blob_len = sizeof(white_list);
+    err = nvs_get_blob(nvs_hndl, WL_NVS_KEY_ADDRS, white_list, &blob_len);
+    if (err == ESP_OK && blob_len % sizeof(ble_addr_t) == 0)
+        white_list_len = blob_len / sizeof(ble_addr_t);
+    else
+    {
+        if (err != ESP_ERR_NVS_NOT_FOUND)
+            ESP_LOGE(g_tag_wl, "Reading white list failed! Error: %s", esp_err_to_name(err));
+        white_list_len = 0;
+    }
+
+    uint32_t write_cnt = 0;
+    nvs_get_u32(nvs_hndl, WL_NVS_KEY_WRITES, &write_cnt);
+    white_list_write_cnt = write_cnt;
+
+    nvs_close(nvs_hndl);
+    white_list_is_loaded = true;
+    white_list_is_dirty = false;
+    ESP_LOGI(g_tag_wl, "White list is loaded from NVS: len = %u, writes = %lu", white_list_len, white_list_write_cnt);
     return ESP_OK;
 }
 
 
+// writes the list to NVS if it was changed since the last write and
+// differs from the stored one (e.g. gateway was added and removed)
+esp_err_t store_white_list_to_nvs()
+{
+    if (!white_list_is_dirty)
+        return ESP_OK;
+
+    nvs_handle_t nvs_hndl;
+    esp_err_t err = nvs_open(WL_NVS_NAMESPACE, NVS_READWRITE, &nvs_hndl);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(g_tag_wl, "NVS open failed! Error: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // compare with the stored blob to skip the write if nothing changed
+    ble_addr_t stored[WHITE_LIST_SIZE];
+    size_t stored_len = sizeof(stored);
+    size_t blob_len = white_list_len * sizeof(ble_addr_t);
+    esp_err_t read_err = nvs_get_blob(nvs_hndl, WL_NVS_KEY_ADDRS, stored, &stored_len);
+    bool is_same = (read_err == ESP_OK && stored_len == blob_len && memcmp(stored, white_list, blob_len) == 0) ||
+                   (read_err == ESP_ERR_NVS_NOT_FOUND && blob_len == 0);
+
+    if (!is_same)
+    {
+        // empty list is stored as absent blob
+        if (blob_len == 0)
+            err = nvs_erase_key(nvs_hndl, WL_NVS_KEY_ADDRS);
+        else
+            err = nvs_set_blob(nvs_hndl, WL_NVS_KEY_ADDRS, white_list, blob_len);
+
+        if (err == ESP_OK)
+            err = nvs_set_u32(nvs_hndl, WL_NVS_KEY_WRITES, white_list_write_cnt + 1);
+        if (err == ESP_OK)
+            err = nvs_commit(nvs_hndl);
+
+        if (err == ESP_OK)
+        {
+            white_list_write_cnt++;
+            ESP_LOGI(g_tag_wl, "White list is stored to NVS: len = %u, writes = %lu", white_list_len, white_list_write_cnt);
+        }
+        else
+            ESP_LOGE(g_tag_wl, "Storing white list failed! Error: %s", esp_err_to_name(err));
+    }
+
+    nvs_close(nvs_hndl);
+    if (err == ESP_OK)
+        white_list_is_dirty = false;
+    return err;
+}
+
+
+// returns the number of NVS writes of the list (since flash erase)
+uint32_t get_white_list_write_cnt()
+{
+    return white_list_write_cnt;
+}
+
+
+// compares two mac addrs (by type, then by addr bytes)
+int compare_addrs(const ble_addr_t* addr1, const ble_addr_t* addr2)
+{
+    if (addr1->type != addr2->type)
+        return addr1->type < addr2->type ? -1 : 1;
+    return memcmp(addr1->val, addr2->val, 6);
+}
+
+
 // compares two mac addrs for equality
 bool addrs_are_equal(const ble_addr_t* addr1, const ble_addr_t* addr2)
 {
-    if (addr1->type == addr2->type)
-        if (memcmp(addr1->val, addr2->val, 6) == 0)
-            return true;
-    return false;
+    return compare_addrs(addr1, addr2) == 0;
 }
 
 